@@ -0,0 +1,234 @@
+/**
+ * @file    bench_ooopsi.cpp
+ *
+ * Microbenchmarks for the capture, symbolize, demangle and format paths.
+ * Run with "--benchmark_format=json" (or the "bench" target) to track the results.
+ */
+
+#include "internal.hpp"
+#include "ooopsi.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#ifdef OOOPSI_LINUX
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// keep the recursion (and with it the stack depth) intact
+#if defined(OOOPSI_MSVC)
+#define NO_INLINE __declspec(noinline)
+#else
+#define NO_INLINE __attribute__((noinline))
+#endif
+
+/// Calls 'func' with the given number of additional frames on the stack.
+template <class Func>
+NO_INLINE static void atDepth(size_t depth, Func& func)
+{
+    if (depth == 0)
+    {
+        func();
+    }
+    else
+    {
+        atDepth(depth - 1, func);
+    }
+    benchmark::ClobberMemory();
+}
+
+/// The log function for the print benchmarks.
+static void logNothing(const char* /*line*/) {}
+
+
+static void BM_CollectStackTrace(benchmark::State& state)
+{
+    const auto depth = static_cast<size_t>(state.range(0));
+    ooopsi::StackFrame frames[ooopsi::s_MAX_STACK_FRAMES];
+    size_t numFrames = 0;
+    auto collect = [&]() {
+        for (auto _ : state)
+        {
+            numFrames = ooopsi::collectStackTrace(frames, ooopsi::s_MAX_STACK_FRAMES);
+            benchmark::DoNotOptimize(numFrames);
+        }
+    };
+    atDepth(depth, collect);
+    state.counters["frames"] = static_cast<double>(numFrames);
+}
+BENCHMARK(BM_CollectStackTrace)->Arg(8)->Arg(32)->Arg(128);
+
+static void BM_SymbolizeBatch(benchmark::State& state)
+{
+    ooopsi::pointer_t addresses[ooopsi::s_MAX_STACK_FRAMES];
+    size_t numFrames = 0;
+    auto capture = [&]() {
+        numFrames = ooopsi::captureStackAddresses(addresses, ooopsi::s_MAX_STACK_FRAMES);
+    };
+    atDepth(32, capture);
+    // the same traces, as many times as a profile would have them
+    std::vector<ooopsi::pointer_t> batch;
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        batch.insert(batch.end(), addresses, addresses + numFrames);
+    }
+    std::vector<ooopsi::StackFrame> frames(batch.size());
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(ooopsi::symbolizeBatch(
+          batch.data(), batch.size(), frames.data(), static_cast<unsigned>(state.range(0))));
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(batch.size()));
+}
+BENCHMARK(BM_SymbolizeBatch)->ArgName("threads")->Arg(1)->Arg(4)->UseRealTime();
+
+static void BM_FormatStackTrace(benchmark::State& state)
+{
+    ooopsi::StackTrace<ooopsi::s_MAX_STACK_FRAMES> trace;
+    auto capture = [&]() { trace.capture(); };
+    atDepth(32, capture);
+    ooopsi::FormatSettings settings;
+    settings.maxSymbolizedFrames = static_cast<size_t>(state.range(0));
+    char buffer[64 * 1024];
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(
+          ooopsi::formatStackTrace(trace, buffer, sizeof(buffer), settings));
+    }
+}
+BENCHMARK(BM_FormatStackTrace)->ArgName("symbolized")->Arg(0)->Arg(4)->Arg(128);
+
+static void BM_PrintStackTrace(benchmark::State& state)
+{
+    ooopsi::LogSettings settings;
+    settings.logFunc = logNothing;
+    settings.demangleNames = state.range(0) != 0;
+    for (auto _ : state)
+    {
+        ooopsi::printStackTrace(settings);
+    }
+}
+BENCHMARK(BM_PrintStackTrace)->ArgName("demangle")->Arg(0)->Arg(1);
+
+/// short and long template symbols
+static const char* const s_SYMBOLS[] = {
+    // foo::bar(int)
+    "_ZN3foo3barEi",
+    // std::map<std::string, std::vector<int>>::operator[](std::string const&)
+    "_ZNSt3mapINSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEEESt6vectorIiSaIiEESt4lessIS5_E"
+    "SaISt4pairIKS5_S8_EEEixERSC_",
+};
+
+static void BM_Demangle(benchmark::State& state)
+{
+    const char* symbol = s_SYMBOLS[state.range(0)];
+    for (auto _ : state)
+    {
+        std::string name = ooopsi::demangle(symbol);
+        benchmark::DoNotOptimize(name);
+    }
+}
+BENCHMARK(BM_Demangle)->ArgName("long")->Arg(0)->Arg(1);
+
+static void BM_DemangleBuffer(benchmark::State& state)
+{
+    const char* symbol = s_SYMBOLS[state.range(0)];
+    char buffer[512];
+    for (auto _ : state)
+    {
+        size_t len = ooopsi::demangle(symbol, buffer, sizeof(buffer));
+        benchmark::DoNotOptimize(len);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_DemangleBuffer)->ArgName("long")->Arg(0)->Arg(1);
+
+static void BM_FormatReason(benchmark::State& state)
+{
+    char reason[256];
+    ooopsi::pointer_t address = &reason;
+    for (auto _ : state)
+    {
+        ooopsi::formatReason(reason, "SEGMENTATION FAULT", "address not mapped to object",
+                             &address);
+        benchmark::DoNotOptimize(reason);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_FormatReason);
+
+static void BM_Breadcrumb(benchmark::State& state)
+{
+    uint64_t value = 0;
+    for (auto _ : state)
+    {
+        ooopsi::breadcrumb("request started", ++value);
+    }
+}
+BENCHMARK(BM_Breadcrumb)->Threads(1)->Threads(4);
+
+static void BM_KickWatchdog(benchmark::State& state)
+{
+    ooopsi::watchThread(60 * 1000);
+    for (auto _ : state)
+    {
+        ooopsi::kickWatchdog();
+    }
+    ooopsi::unwatchThread();
+}
+BENCHMARK(BM_KickWatchdog)->Threads(1)->Threads(4);
+
+#ifdef OOOPSI_LINUX
+/// Runs the crasher (see test/crasher.cpp) until it exits: the time from starting the process to
+/// its exit, which includes printing the stack trace of the crash (to /dev/null).
+/// The path is taken from OOOPSI_CRASHER (default: "./crasher_ooopsi").
+static void BM_CrashToExit(benchmark::State& state)
+{
+    const char* crasher = getenv("OOOPSI_CRASHER"); // flawfinder: ignore
+    if (crasher == nullptr || crasher[0] == '\0')
+    {
+        crasher = "./crasher_ooopsi";
+    }
+    if (access(crasher, X_OK) != 0)
+    {
+        state.SkipWithError("crasher_ooopsi not found (set OOOPSI_CRASHER)");
+        return;
+    }
+
+    std::string action = state.range(0) == 0 ? "segfault" : "throw-exc";
+    char* const argv[] = { const_cast<char*>(crasher), &action[0], nullptr };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    for (auto _ : state)
+    {
+        pid_t pid = 0;
+        if (posix_spawn(&pid, crasher, &actions, nullptr, argv, environ) != 0)
+        {
+            state.SkipWithError("posix_spawn() failed");
+            break;
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 127)
+        {
+            state.SkipWithError("the crasher didn't exit via ooopsi");
+            break;
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+}
+BENCHMARK(BM_CrashToExit)->ArgName("throw")->Arg(0)->Arg(1)->UseRealTime()->Unit(
+  benchmark::kMillisecond);
+#endif // OOOPSI_LINUX
+
+BENCHMARK_MAIN();
@@ -8,8 +8,13 @@
 #ifndef OOOPSI_HPP_
 #define OOOPSI_HPP_
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <iterator>
 #include <string>
+#include <vector>
 
 #ifdef _MSC_VER
 #define OOOPSI_DLL_EXPORT __declspec(dllexport)
@@ -33,22 +38,82 @@ namespace ooopsi
 /// (see setAbortLogFunc() for details)
 typedef void (*LogFunc)(const char*);
 
+/// Block-wise variant of LogFunc: It's called with a whole block of text, which contains several
+/// lines (each one terminated by '\n') and isn't NUL-terminated. After the last block, it is called
+/// with (nullptr, 0). Same as for LogFunc, it needs to be 'noexcept'.
+typedef void (*LogBlockFunc)(const char* text, size_t length);
+
 /// Pointer alias. Avoid uint64_t/uintptr_t because they are a PITA when using printf.
 using pointer_t = const void*;
 
+/// Methods to walk the stack.
+enum class Unwinder
+{
+    /// the platform's default (libunwind on Linux/macOS, RtlCaptureStackBackTrace on Windows)
+    DEFAULT,
+    /// Follows the chain of frame pointers, which is much faster, but requires all code to be
+    /// compiled with '-fno-omit-frame-pointer' and skips the frame interrupted by a signal.
+    /// Only reads memory from the thread's stack (and the alternate signal stack). The stack range
+    /// is queried on the first walk per thread, which isn't signal-safe on Linux (except for the
+    /// thread that created the HandlerSetup).
+    /// Falls back to DEFAULT if not supported on the platform (e.g. Windows).
+    FRAME_POINTER,
+    /// Like DEFAULT, but signal stacks (see captureSignalStack()) are always walked from the
+    /// handler, up to the interrupted frame, also if libunwind could start at the signal context.
+    /// Only differs from DEFAULT on Linux.
+    FROM_HANDLER,
+};
+
+/// Formats of the output (see "src/structuredlog.hpp" for the fields).
+enum class LogFormat
+{
+    /// lines of text
+    TEXT,
+    /// a single line with a JSON object: the reason, the signal and the frames, with their
+    /// symbols, modules and source lines (without the other threads and the breadcrumbs)
+    JSON,
+    /// the same fields as a length-prefixed protobuf message, in a single block (requires
+    /// 'logFd' or 'logBlockFunc', JSON is used for a log function)
+    BINARY,
+};
+
 /// Parameters for printStackTrace().
 struct LogSettings
 {
     /// the log function to use (nullptr: use the current handler)
     LogFunc logFunc = nullptr;
-    /// demangle C++ function names? (recommended: don't in a Linux signal handler)
+    /// If set, the output is collected in a preallocated buffer and passed to this function in a
+    /// single call (as long as it fits), instead of calling 'logFunc' for every line.
+    LogBlockFunc logBlockFunc = nullptr;
+    /// If not negative (and 'logBlockFunc' isn't set), the output is collected the same way and
+    /// written to this (pre-opened) file descriptor with a single write(). This is signal-safe.
+    int logFd = -1;
+    /// demangle C++ function names?
     bool demangleNames = true;
+    /// append the module and the module-relative address to every frame (e.g. for addr2line)
+    bool printModules = true;
+    /// Build the source line index of a module if needed (see prepareSourceLines()). If not set,
+    /// the file and line are still appended for all modules whose index exists already.
+    bool printSourceLines = false;
+    /// the method to walk the stack
+    Unwinder unwinder = Unwinder::DEFAULT;
+    /// the format of the stack traces and crash reports
+    LogFormat format = LogFormat::TEXT;
 };
 
 /// Parameters for abort()
 struct AbortSettings : LogSettings
 {
     bool printStackTrace = true;
+    /// If not negative, only the reason is logged and a binary crash record (containing the raw
+    /// frame addresses, registers and loaded modules) is written to this file descriptor, which is
+    /// symbolized offline by the "ooopsi-symbolize" tool. Only supported on Linux (ignored on the
+    /// other platforms).
+    int crashRecordFd = -1;
+    /// Append a line with the time ooopsi took for the report (see getStats()), e.g. to tune the
+    /// settings. Alternatively, set the environment variable OOOPSI_PRINT_STATS to "1" (for the
+    /// reports of the signal and exception handlers).
+    bool printStats = false;
 };
 
 /// Prints a stack trace using the given log function.
@@ -57,8 +122,7 @@ struct AbortSettings : LogSettings
 /// The optional third argument is the address of the fault, used to highlight the according
 /// line in the backtrace (if found).
 ///
-/// Note: only throws if the log function does (and it shouldn't...) or memory allocation
-/// failed during demangling.
+/// Note: only throws if the log function does (and it shouldn't...).
 OOOPSI_EXPORT void printStackTrace(LogSettings settings = LogSettings(),
                                    const pointer_t* faultAddr = nullptr);
 
@@ -76,13 +140,506 @@ struct StackFrame
     size_t offset = 0;
 };
 
-/// Collects a stack trace into the given buffer.
+/// Collects a stack trace into the given buffer. Under memory pressure, the names that can't be
+/// allocated are left empty.
 /// Note: not safe to use in signal handlers due to the allocation of the function name.
 ///
 /// @param[out] buffer           buffer that will be filled with stack frames
 /// @param[in]  bufferSize       maximum number of frames to store in 'buffer'
+/// @param[in]  unwinder         the method to walk the stack
 /// @return number of actually stored frames in 'buffer'
-OOOPSI_EXPORT size_t collectStackTrace(StackFrame* buffer, size_t bufferSize) noexcept;
+OOOPSI_EXPORT size_t collectStackTrace(StackFrame* buffer, size_t bufferSize,
+                                       Unwinder unwinder = Unwinder::DEFAULT) noexcept;
+
+/// Captures the raw addresses of the current stack trace into the given buffer, without resolving
+/// any symbols. This is cheap, doesn't allocate and is safe to use in signal handlers.
+/// The addresses can be resolved later (or never) with symbolize().
+///
+/// @param[out] buffer           buffer that will be filled with frame addresses
+/// @param[in]  bufferSize       maximum number of addresses to store in 'buffer'
+/// @param[in]  unwinder         the method to walk the stack
+/// @return number of actually stored addresses in 'buffer'
+OOOPSI_EXPORT size_t captureStackAddresses(pointer_t* buffer, size_t bufferSize,
+                                           Unwinder unwinder = Unwinder::DEFAULT) noexcept;
+
+/// Captures the raw addresses of the stack interrupted by a signal (e.g. in an own SA_SIGINFO
+/// handler), starting with the exact address of the interrupted instruction, followed by the
+/// return addresses (the signal handler's frames are skipped). This is signal-safe and doesn't
+/// allocate; Unwinder::FRAME_POINTER is only used if the thread's stack range is known already
+/// (i.e. it did a frame pointer walk before).
+///
+/// On Linux (x86), libunwind starts at the interrupted frame if it has unw_init_local2(),
+/// otherwise the walk starts in the handler and skips up to the interrupted frame (if it isn't
+/// found, e.g. since libunwind can't step through the signal trampoline, the handler's frames are
+/// included). On Windows (x64
+/// only), the context of an SEH exception is unwound, and on the other platforms, the handler's
+/// frames are included.
+///
+/// @param[in]  context          the ucontext_t passed to the signal handler (Windows: the
+///                              EXCEPTION_POINTERS passed to the exception handler)
+/// @param[out] buffer           buffer that will be filled with frame addresses
+/// @param[in]  bufferSize       maximum number of addresses to store in 'buffer'
+/// @param[in]  unwinder         the method to walk the stack
+/// @return number of actually stored addresses in 'buffer'
+OOOPSI_EXPORT size_t captureSignalStack(const void* context, pointer_t* buffer, size_t bufferSize,
+                                        Unwinder unwinder = Unwinder::DEFAULT) noexcept;
+
+/// Resolves addresses captured by captureStackAddresses() into stack frames. This may be called at
+/// any later point and from any thread (as long as the according modules are still loaded).
+/// Note: not safe to use in signal handlers due to the allocation of the function name.
+///
+/// @param[in]  addresses        the addresses to resolve
+/// @param[in]  numAddresses     number of elements in 'addresses'
+/// @param[out] buffer           buffer for 'numAddresses' resolved stack frames
+/// @return number of frames whose function name could be resolved
+OOOPSI_EXPORT size_t symbolize(const pointer_t* addresses, size_t numAddresses,
+                               StackFrame* buffer) noexcept;
+
+/// Resolves a large number of addresses like symbolize(), e.g. the samples of a profile or the
+/// traces of many crash records. The addresses are sorted and deduplicated, so every one is only
+/// resolved once, and split into tasks of neighbouring addresses of the same module, which a pool
+/// of worker threads (including the calling one) resolves in parallel. This scales best with the
+/// symbol indexes (see prepareSymbolIndexes()). On Windows, a single worker is used, since DbgHelp
+/// can't be used concurrently. Under memory pressure, the names that can't be allocated are left
+/// empty (and fewer workers may be used).
+/// Note: not safe to use in signal handlers due to the allocations and threads.
+///
+/// @param[in]  addresses        the addresses to resolve (in any order, duplicates allowed)
+/// @param[in]  numAddresses     number of elements in 'addresses'
+/// @param[out] buffer           buffer for 'numAddresses' resolved stack frames
+/// @param[in]  numThreads       maximum number of workers (0: one per hardware thread)
+/// @return number of frames whose function name could be resolved
+OOOPSI_EXPORT size_t symbolizeBatch(const pointer_t* addresses, size_t numAddresses,
+                                    StackFrame* buffer, unsigned numThreads = 0) noexcept;
+
+/// Resolves a single code address into the given buffer, without allocating any memory (the
+/// result is taken from a process-wide cache if it has been resolved before). Not guaranteed to be
+/// signal-safe, since the platform's symbol lookup may take locks.
+///
+/// @param[in]  address          the address to resolve
+/// @param[out] buffer           receives the (de)mangled function name (truncated if necessary,
+///                              always NUL-terminated)
+/// @param[in]  bufferSize       size of 'buffer' in bytes
+/// @param[out] offset           offset of 'address' relative to the start of the function
+/// @param[in]  demangleName     demangle the name?
+/// @return length of the string in 'buffer' (0: not resolved)
+OOOPSI_EXPORT size_t resolveSymbol(pointer_t address, char* buffer, size_t bufferSize,
+                                   size_t& offset, bool demangleName = true) noexcept;
+
+/// Counters of the time ooopsi spends in the traces that are symbolized: collectStackTrace(),
+/// symbolize(), printStackTrace() and the crash reports (but not captureStackAddresses(), which is
+/// too cheap to measure). The counters are process-wide and incremented with relaxed atomics.
+struct Stats
+{
+    /// number of stack walks
+    uint64_t traces = 0;
+    /// number of frames unwound by them
+    uint64_t frames = 0;
+    /// number of symbol lookups that were answered by the symbol cache
+    uint64_t cacheHits = 0;
+    /// number of symbol lookups that needed the platform's lookup (and the demangler)
+    uint64_t cacheMisses = 0;
+    /// time spent walking the stacks (in nanoseconds)
+    uint64_t unwindNanoseconds = 0;
+    /// time spent in the platform's symbol lookups, including demangling (in nanoseconds)
+    uint64_t symbolizeNanoseconds = 0;
+    /// time spent demangling (in nanoseconds)
+    uint64_t demangleNanoseconds = 0;
+    /// time spent in the log functions or writing the output (in nanoseconds)
+    uint64_t logNanoseconds = 0;
+};
+
+/// Returns the current counters. This function is thread-safe and signal-safe.
+OOOPSI_EXPORT Stats getStats() noexcept;
+
+/// Sets all counters to 0 (e.g. before a benchmark). This function is thread-safe.
+OOOPSI_EXPORT void resetStats() noexcept;
+
+/// Identifies a stack trace: a hash over its frame addresses, which is the same for identical
+/// traces during the lifetime of the process (never 0).
+typedef uint64_t StackTraceId;
+
+/// Computes the ID of a stack trace.
+///
+/// @param[in]  addresses        the frame addresses (e.g. from captureStackAddresses())
+/// @param[in]  numAddresses     number of elements in 'addresses'
+/// @return the ID (never 0)
+OOOPSI_EXPORT StackTraceId hashStackTrace(const pointer_t* addresses,
+                                          size_t numAddresses) noexcept;
+
+/**
+ * A stack trace with a fixed capacity of N frames, which never allocates: the frame addresses,
+ * the function offsets and a pool for the function names are stored inline (in std::arrays).
+ * It is trivially copyable, so it can be embedded into error objects, copied with memcpy() or
+ * passed through lock-free queues.
+ *
+ * Capturing only stores the addresses (same as captureStackAddresses(), i.e. it's safe to use in
+ * signal handlers). The names are resolved lazily when a frame's name() is accessed for the first
+ * time (or by resolve()) and written into the pool, names that don't fit are truncated.
+ * Note: since resolving modifies the (mutable) pool, concurrent accesses to the same object
+ * require synchronization, unless resolve() has been called before.
+ *
+ * Traces are compared (and hashed) by their addresses only.
+ *
+ * @tparam N            maximum number of frames
+ * @tparam POOL_SIZE    size of the name pool in bytes
+ */
+template <size_t N, size_t POOL_SIZE = N * 64>
+class StackTrace
+{
+    static_assert(N > 0, "a stack trace needs at least one frame");
+    static_assert(POOL_SIZE < UINT32_MAX - 1, "the name pool is too large");
+
+    /// name offsets of frames that aren't resolved yet / couldn't be resolved
+    static constexpr uint32_t s_UNRESOLVED = UINT32_MAX;
+    static constexpr uint32_t s_UNKNOWN = UINT32_MAX - 1;
+
+public:
+    /// A view of a single frame (valid as long as the trace).
+    class Frame
+    {
+    public:
+        Frame(const StackTrace& trace, size_t index) noexcept : m_trace(&trace), m_index(index) {}
+
+        /// the frame's address
+        pointer_t address() const noexcept { return m_trace->m_addresses[m_index]; }
+
+        /// the demangled function name (resolved on the first call, nullptr: unknown)
+        const char* name() const noexcept { return m_trace->name(m_index); }
+
+        /// offset of address() relative to the start of the function (resolves the name)
+        size_t offset() const noexcept
+        {
+            m_trace->name(m_index);
+            return m_trace->m_offsets[m_index];
+        }
+
+    private:
+        const StackTrace* m_trace;
+        size_t m_index;
+    };
+
+    /// Iterates over the frames, innermost first (yields Frame values).
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Frame;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Frame*;
+        using reference = Frame;
+
+        const_iterator(const StackTrace& trace, size_t index) noexcept
+          : m_trace(&trace)
+          , m_index(index)
+        {
+        }
+
+        Frame operator*() const noexcept { return Frame(*m_trace, m_index); }
+
+        const_iterator& operator++() noexcept
+        {
+            ++m_index;
+            return *this;
+        }
+
+        const_iterator operator++(int) noexcept
+        {
+            const_iterator old = *this;
+            ++m_index;
+            return old;
+        }
+
+        bool operator==(const const_iterator& other) const noexcept
+        {
+            return m_trace == other.m_trace && m_index == other.m_index;
+        }
+
+        bool operator!=(const const_iterator& other) const noexcept { return !(*this == other); }
+
+    private:
+        const StackTrace* m_trace;
+        size_t m_index;
+    };
+
+    /// Creates an empty trace.
+    StackTrace() noexcept = default;
+
+    /// Replaces the trace by the current stack (safe to use in signal handlers).
+    ///
+    /// @param[in]  unwinder         the method to walk the stack
+    /// @return number of captured frames
+    size_t capture(Unwinder unwinder = Unwinder::DEFAULT) noexcept
+    {
+        m_size = captureStackAddresses(m_addresses.data(), N, unwinder);
+        reset();
+        return m_size;
+    }
+
+    /// Replaces the trace by the given addresses (truncated to N frames).
+    void assign(const pointer_t* addresses, size_t numAddresses) noexcept
+    {
+        m_size = numAddresses < N ? numAddresses : N;
+        for (size_t i = 0; i < m_size; ++i)
+        {
+            m_addresses[i] = addresses[i];
+        }
+        reset();
+    }
+
+    /// Resolves the names of all frames.
+    void resolve() const noexcept
+    {
+        for (size_t i = 0; i < m_size; ++i)
+        {
+            name(i);
+        }
+    }
+
+    /// the number of frames
+    size_t size() const noexcept { return m_size; }
+    bool empty() const noexcept { return m_size == 0; }
+    static constexpr size_t capacity() noexcept { return N; }
+
+    /// the frame addresses (size() elements)
+    const pointer_t* addresses() const noexcept { return m_addresses.data(); }
+
+    /// the trace's ID (see hashStackTrace())
+    StackTraceId id() const noexcept { return hashStackTrace(m_addresses.data(), m_size); }
+
+    Frame operator[](size_t index) const noexcept { return Frame(*this, index); }
+
+    const_iterator begin() const noexcept { return const_iterator(*this, 0); }
+    const_iterator end() const noexcept { return const_iterator(*this, m_size); }
+
+    bool operator==(const StackTrace& other) const noexcept
+    {
+        if (m_size != other.m_size)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < m_size; ++i)
+        {
+            if (m_addresses[i] != other.m_addresses[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool operator!=(const StackTrace& other) const noexcept { return !(*this == other); }
+
+private:
+    /// Marks all frames as unresolved and clears the pool.
+    void reset() noexcept
+    {
+        for (size_t i = 0; i < m_size; ++i)
+        {
+            m_names[i] = s_UNRESOLVED;
+            m_offsets[i] = 0;
+        }
+        m_poolUsed = 0;
+    }
+
+    /// Returns the name of a frame, resolves it on the first call.
+    const char* name(size_t index) const noexcept
+    {
+        if (m_names[index] == s_UNRESOLVED)
+        {
+            m_names[index] = s_UNKNOWN;
+            if (m_poolUsed + 1 < POOL_SIZE)
+            {
+                const size_t len = resolveSymbol(m_addresses[index], &m_pool[m_poolUsed],
+                                                 POOL_SIZE - m_poolUsed, m_offsets[index]);
+                if (len > 0)
+                {
+                    m_names[index] = static_cast<uint32_t>(m_poolUsed);
+                    m_poolUsed += len + 1;
+                }
+            }
+        }
+        return m_names[index] == s_UNKNOWN ? nullptr : &m_pool[m_names[index]];
+    }
+
+    std::array<pointer_t, N> m_addresses;
+    size_t m_size = 0;
+    /// offsets of the names in m_pool (or s_UNRESOLVED/s_UNKNOWN)
+    mutable std::array<uint32_t, N> m_names;
+    /// the function offsets
+    mutable std::array<size_t, N> m_offsets;
+    /// the NUL-terminated names
+    mutable std::array<char, POOL_SIZE> m_pool;
+    mutable size_t m_poolUsed = 0;
+};
+
+/// Settings of formatStackTrace() and formatStackFrame().
+struct FormatSettings
+{
+    /// Resolve the names of the innermost frames only, e.g. for cheap summaries: the others are
+    /// formatted with the address and module only (SIZE_MAX: resolve all).
+    size_t maxSymbolizedFrames = SIZE_MAX;
+    /// demangle C++ function names?
+    bool demangleNames = true;
+    /// append the module and the module-relative address to every frame (e.g. for addr2line)
+    bool printModules = true;
+    /// the frame with this address is highlighted as the fault (nullptr: none)
+    pointer_t faultAddress = nullptr;
+};
+
+/// Formats a single frame of a captured trace into the given buffer, the same way as
+/// printStackTrace() does (without a line break). The source file and line are appended if the
+/// module's line index exists (see prepareSourceLines()).
+/// This function doesn't allocate (the names are resolved like resolveSymbol() does), but isn't
+/// guaranteed to be signal-safe either.
+///
+/// @param[in]  index            the frame's number (0: innermost)
+/// @param[in]  address          the frame's address
+/// @param[out] buffer           receives the line (truncated if necessary, always NUL-terminated)
+/// @param[in]  bufferSize       size of 'buffer' in bytes
+/// @param[in]  settings         controls the symbolization and the format
+/// @return length of the line in 'buffer'
+OOOPSI_EXPORT size_t formatStackFrame(size_t index, pointer_t address, char* buffer,
+                                      size_t bufferSize,
+                                      const FormatSettings& settings = FormatSettings()) noexcept;
+
+/// Formats a captured trace (e.g. from captureStackAddresses()) into the given buffer, one line
+/// per frame (see formatStackFrame()), each terminated by '\n'. Frames that don't fit completely
+/// are left out. Doesn't allocate.
+///
+/// @param[in]  addresses        the frame addresses
+/// @param[in]  numAddresses     number of elements in 'addresses'
+/// @param[out] buffer           receives the text (always NUL-terminated)
+/// @param[in]  bufferSize       size of 'buffer' in bytes
+/// @param[in]  settings         controls the symbolization and the format
+/// @return length of the text in 'buffer'
+OOOPSI_EXPORT size_t formatStackTrace(const pointer_t* addresses, size_t numAddresses,
+                                      char* buffer, size_t bufferSize,
+                                      const FormatSettings& settings = FormatSettings()) noexcept;
+
+/// Formats a captured trace to an output iterator of char (e.g. into a log record), without any
+/// intermediate strings: every line (see formatStackFrame()) is formatted into a stack buffer
+/// and copied to 'out', followed by '\n'. Lines are truncated to 1023 characters.
+///
+/// @param[in]  addresses        the frame addresses
+/// @param[in]  numAddresses     number of elements in 'addresses'
+/// @param[in]  out              the destination
+/// @param[in]  settings         controls the symbolization and the format
+/// @return the iterator past the last written character
+template <class OutputIt>
+OutputIt formatStackTrace(const pointer_t* addresses, size_t numAddresses, OutputIt out,
+                          const FormatSettings& settings = FormatSettings())
+{
+    char line[1024];
+    for (size_t i = 0; i < numAddresses; ++i)
+    {
+        const size_t length = formatStackFrame(i, addresses[i], line, sizeof(line), settings);
+        for (size_t c = 0; c < length; ++c)
+        {
+            *out = line[c];
+            ++out;
+        }
+        *out = '\n';
+        ++out;
+    }
+    return out;
+}
+
+/// Formats a StackTrace into the given buffer (see above).
+template <size_t N, size_t POOL_SIZE>
+size_t formatStackTrace(const StackTrace<N, POOL_SIZE>& trace, char* buffer, size_t bufferSize,
+                        const FormatSettings& settings = FormatSettings()) noexcept
+{
+    return formatStackTrace(trace.addresses(), trace.size(), buffer, bufferSize, settings);
+}
+
+/// Formats a StackTrace to an output iterator (see above).
+template <size_t N, size_t POOL_SIZE, class OutputIt>
+OutputIt formatStackTrace(const StackTrace<N, POOL_SIZE>& trace, OutputIt out,
+                          const FormatSettings& settings = FormatSettings())
+{
+    return formatStackTrace(trace.addresses(), trace.size(), out, settings);
+}
+
+/// Counts an occurrence of the stack trace in a process-wide table of unique traces, which is
+/// much cheaper than symbolizing and logging it every time. The table has a fixed capacity: once
+/// it's full, new traces aren't counted anymore.
+/// This function is lock-free and doesn't allocate, so it's safe to use in signal handlers.
+///
+/// @param[in]  addresses        the frame addresses (e.g. from captureStackAddresses())
+/// @param[in]  numAddresses     number of elements in 'addresses'
+/// @param[out] count            if not nullptr, receives the number of occurrences so far
+///                              (1: first sight, 0: the table is full)
+/// @return the trace's ID
+OOOPSI_EXPORT StackTraceId recordStackTrace(const pointer_t* addresses, size_t numAddresses,
+                                            uint64_t* count = nullptr) noexcept;
+
+/// Captures the current stack trace and counts it (as above).
+///
+/// @param[in]  unwinder         the method to walk the stack
+/// @param[out] count            if not nullptr, receives the number of occurrences so far
+/// @return the trace's ID
+OOOPSI_EXPORT StackTraceId recordStackTrace(Unwinder unwinder = Unwinder::DEFAULT,
+                                            uint64_t* count = nullptr) noexcept;
+
+/// Returns the number of occurrences of a recorded stack trace (0: unknown).
+OOOPSI_EXPORT uint64_t getStackTraceCount(StackTraceId id) noexcept;
+
+/// A recorded stack trace and its number of occurrences.
+struct StackTraceCount
+{
+    StackTraceId id = 0;
+    uint64_t count = 0;
+    /// the symbolized frames
+    std::vector<StackFrame> frames;
+};
+
+/// Returns a recorded stack trace. It is symbolized on the first call, later calls use the cached
+/// names (e.g. call this on the first sight of a trace and log it).
+/// Note: not safe to use in signal handlers.
+///
+/// @param[in]  id          the trace's ID
+/// @param[out] result      the trace
+/// @return false if the trace isn't in the table
+OOOPSI_EXPORT bool getStackTrace(StackTraceId id, StackTraceCount& result);
+
+/// Returns the most frequent recorded stack traces (symbolized once, see getStackTrace()).
+///
+/// @param[in] maxTraces    maximum number of traces to return
+/// @return the traces, most frequent first
+OOOPSI_EXPORT std::vector<StackTraceCount> getTopStackTraces(size_t maxTraces);
+
+/// Prints the most frequent recorded stack traces with their counts, in the format of
+/// printStackTrace(). The names are always demangled (they are symbolized only once).
+/// Not safe to use in signal handlers.
+///
+/// @param[in] maxTraces    maximum number of traces to print
+/// @param[in] settings     controls log function etc.
+OOOPSI_EXPORT void printTopStackTraces(size_t maxTraces, LogSettings settings = LogSettings());
+
+/// Builds the source line index of all loaded modules: from then on, every frame of a stack trace
+/// is followed by its source file and line (as far as the modules have debug information), also in
+/// abort() and the signal handlers, where indexes can't be built anymore.
+/// On Linux, the index is built from the DWARF line tables of the module or of a separate debug
+/// file in /usr/lib/debug/.build-id, which may take a while for large modules. If the environment
+/// variable OOOPSI_LINE_CACHE is set to a directory, the indexes are persisted there and reused by
+/// the next processes. Setting OOOPSI_SOURCE_LINES to "1" calls this function in HandlerSetup.
+/// On Windows, the lines are taken from the PDB files on demand (this function does nothing).
+/// Not supported on macOS.
+///
+/// @return the number of modules with line information
+OOOPSI_EXPORT size_t prepareSourceLines() noexcept;
+
+/// Builds a sorted index of the function symbols (.symtab and .dynsym) of all loaded modules:
+/// from then on, frames are symbolized with a binary search in the index instead of libunwind's
+/// search through the symbol tables, in abort() and the signal handlers as well. The symbols of a
+/// separate debug file in /usr/lib/debug/.build-id are used if it has more of them (e.g. for a
+/// stripped module). Modules loaded later are indexed when they are first symbolized outside of
+/// a crash report. Setting OOOPSI_SYMBOL_INDEX to "1" calls this function in HandlerSetup.
+/// Linux only (does nothing on other platforms).
+///
+/// @return the number of modules with symbols
+OOOPSI_EXPORT size_t prepareSymbolIndexes() noexcept;
 
 /// Tries to demangle a C++ symbol (usually a function name).
 /// Note: not safe to use in signal handlers due to the allocation of the function name.
@@ -97,6 +654,17 @@ inline std::string demangle(const std::string& symbol)
     return demangle(symbol.c_str());
 }
 
+/// Tries to demangle a C++ symbol into the given buffer, without allocating any memory.
+/// On Linux and macOS, this is safe to use in signal handlers. Names using rarely seen parts of the
+/// mangling grammar (e.g. expressions in template arguments) are copied as they are.
+///
+/// @param[in]  symbol           the symbol to demangle
+/// @param[out] buffer           receives the demangled name or a copy of 'symbol' as fallback
+///                              (truncated if necessary, always NUL-terminated)
+/// @param[in]  bufferSize       size of 'buffer' in bytes
+/// @return length of the string in 'buffer'
+OOOPSI_EXPORT size_t demangle(const char* symbol, char* buffer, size_t bufferSize) noexcept;
+
 /// Aborts the current process' execution, similar to std::abort, but logs a stack trace and the
 /// given reason (if given).
 ///
@@ -122,6 +690,309 @@ OOOPSI_EXPORT void setAbortLogFunc(LogFunc func) noexcept;
 /// Returns the current log function pointer (also not thread-safe).
 OOOPSI_EXPORT LogFunc getAbortLogFunc() noexcept;
 
+/// Sets a (pre-opened) file descriptor to write the output of abort() to, instead of calling the
+/// current log function. The output is collected in a preallocated buffer and written by a single
+/// write() call, which is faster, doesn't interleave with other output and is signal-safe.
+/// This is used unless the LogSettings contain another log function or file descriptor.
+///
+/// Passing -1 restores using the log function. Same as setAbortLogFunc(), this isn't thread-safe.
+OOOPSI_EXPORT void setAbortLogFd(int fd) noexcept;
+
+/// Returns the current file descriptor for the output (-1: not set).
+OOOPSI_EXPORT int getAbortLogFd() noexcept;
+
+/// Sets the format of the crash reports of the signal and exception handlers (see LogFormat),
+/// e.g. for log collectors that index them without parsing. Alternatively, set the environment
+/// variable OOOPSI_LOG_FORMAT to "json" or "binary". Same as setAbortLogFunc(), this isn't
+/// thread-safe.
+OOOPSI_EXPORT void setCrashReportFormat(LogFormat format) noexcept;
+
+/// Returns the format of the crash reports of the handlers.
+OOOPSI_EXPORT LogFormat getCrashReportFormat() noexcept;
+
+/// Sets a (pre-opened) file descriptor to write binary crash records to (see
+/// AbortSettings::crashRecordFd), which is used unless the AbortSettings contain another one.
+/// Alternatively, set the environment variable OOOPSI_CRASH_RECORD to the path of a file that
+/// the records are appended to.
+///
+/// Passing -1 disables writing crash records. Same as setAbortLogFunc(), this isn't thread-safe.
+OOOPSI_EXPORT void setCrashRecordFd(int fd) noexcept;
+
+/// Returns the current file descriptor for crash records (-1: not set).
+OOOPSI_EXPORT int getCrashRecordFd() noexcept;
+
+/// Lets a forked child process report crashes (Linux only): abort() forks right away and the
+/// process ends (with the usual exit code) without waiting for the report. The child symbolizes
+/// and logs everything, as well as writing the crash record and the dump. The stacks of the other
+/// threads are not printed, they don't exist in the child. This minimizes the time until a crashed
+/// process can be restarted, independent of the depth of the trace and the size of the symbol
+/// tables. Alternatively, set the environment variable OOOPSI_FORKED_REPORTS to "1".
+/// Same as setAbortLogFunc(), this isn't thread-safe.
+OOOPSI_EXPORT void setForkedCrashReports(bool enabled) noexcept;
+
+/// Checks whether crashes are reported by a forked child process.
+OOOPSI_EXPORT bool getForkedCrashReports() noexcept;
+
+/// Parameters for setCrashDumpSettings().
+struct CrashDumpSettings
+{
+    /// the file to write the dump to (nullptr: disabled)
+    const char* path = nullptr;
+    /// maximum size of the dump in bytes (allocated in advance, Linux only)
+    size_t maxSize = 8 * 1024 * 1024;
+    /// maximum size of the faulting thread's stack in the dump (Linux only)
+    size_t maxStackBytes = 256 * 1024;
+    /// bytes around each register value that looks like a pointer (0: none, Linux only)
+    size_t regionBytes = 1024;
+    /// maximum time to spend on the memory contents (in milliseconds, Linux only)
+    unsigned timeoutMs = 1000;
+};
+
+/// Enables writing a crash dump if the program is terminated by a signal (or an SEH exception):
+/// On Linux, this contains a crash record (see setCrashRecordFd()), the faulting thread's stack,
+/// the memory around its registers and the regions added by addCrashDumpRegion() (see
+/// src/crashdump.hpp for the format). On Windows, a minidump is written by MiniDumpWriteDump().
+/// The file is created (and truncated) here, so nothing needs to be opened at crash time.
+/// Alternatively, set the environment variable OOOPSI_CRASH_DUMP to the path of the file.
+///
+/// Passing a path of nullptr disables the dumps. Same as setAbortLogFunc(), this isn't thread-safe.
+///
+/// @param[in] settings     the dump settings
+/// @return false if the file couldn't be created or allocated (or not supported, i.e. on macOS)
+OOOPSI_EXPORT bool setCrashDumpSettings(const CrashDumpSettings& settings) noexcept;
+
+/// Returns the current settings for crash dumps (path nullptr: disabled).
+OOOPSI_EXPORT CrashDumpSettings getCrashDumpSettings() noexcept;
+
+/// Adds a memory region to crash dumps (e.g. important data structures on the heap), up to 32.
+/// This function is thread-safe and doesn't allocate.
+///
+/// @return false if there are too many regions already
+OOOPSI_EXPORT bool addCrashDumpRegion(const void* start, size_t size) noexcept;
+
+/// Removes a region added by addCrashDumpRegion() (e.g. before the memory is released).
+OOOPSI_EXPORT void removeCrashDumpRegion(const void* start) noexcept;
+
+/// Parameters for setCrashJournalSettings().
+struct CrashJournalSettings
+{
+    /// the journal file (nullptr: disabled)
+    const char* path = nullptr;
+    /// number of crashes kept (the oldest ones are overwritten)
+    size_t numEntries = 256;
+};
+
+/// Enables a persistent journal of crashes (Linux and macOS): the file is mapped into the
+/// process, and every crash (or other termination by abort()) stores the reason, the time, the
+/// frame addresses and a stack ID into a fixed-size entry. This takes a few stores and no system
+/// call, and the entries survive the process. The entries of earlier processes are kept, and
+/// several processes may share the same file. Use readCrashJournal() or the "ooopsi-journal" tool
+/// to see how often the same crashes happened.
+/// Alternatively, set the environment variable OOOPSI_CRASH_JOURNAL to the path of the file.
+///
+/// Passing a path of nullptr disables the journal. Same as setAbortLogFunc(), this isn't
+/// thread-safe.
+///
+/// @param[in] settings     the journal settings
+/// @return false if the file couldn't be created or mapped (or not supported, i.e. on Windows)
+OOOPSI_EXPORT bool setCrashJournalSettings(const CrashJournalSettings& settings) noexcept;
+
+/// Returns the current settings for the crash journal (path nullptr: disabled).
+OOOPSI_EXPORT CrashJournalSettings getCrashJournalSettings() noexcept;
+
+/// The crashes in a journal with the same stack.
+struct CrashSummary
+{
+    /// hash of the module-relative frame addresses (the same for every run of the same binaries)
+    StackTraceId traceId = 0;
+    /// number of crashes
+    uint64_t count = 0;
+    /// times of the first and the last crash (microseconds since 1970)
+    uint64_t firstTime = 0;
+    uint64_t lastTime = 0;
+    /// the reason of the last crash
+    std::string reason;
+    /// the frames of the last crash ("<module>+0x<offset>", or the address if the module is
+    /// unknown)
+    std::vector<std::string> frames;
+};
+
+/// Reads a crash journal (see setCrashJournalSettings()), which may be in use. Incomplete entries
+/// are skipped.
+///
+/// @param[in] path     the journal file
+/// @return the crashes grouped by their stacks, the most frequent ones first (empty if the file
+///         couldn't be read)
+OOOPSI_EXPORT std::vector<CrashSummary> readCrashJournal(const char* path);
+
+/// Reserves the emergency memory for reporting crashes (replacing the current one): Since the heap
+/// can't be trusted after a fault, the longer messages and names of the crash report are formatted
+/// in this arena. HandlerSetup reserves 256KB (or the size in the environment variable
+/// OOOPSI_CRASH_ARENA_SIZE), the pages are touched right away. If the arena is too small (or 0,
+/// which releases it), the report uses smaller, fixed-size buffers.
+/// Same as setAbortLogFunc(), this isn't thread-safe.
+///
+/// @return false if the memory couldn't be reserved
+OOOPSI_EXPORT bool setCrashArenaSize(size_t size) noexcept;
+
+/// Returns the size of the crash arena in bytes (0: none).
+OOOPSI_EXPORT size_t getCrashArenaSize() noexcept;
+
+/// Sets the size of the alternate signal stacks, which are used to report stack overflows (and
+/// by the other signal handlers). The space needed by the kernel to deliver a signal is added.
+/// Only affects stacks that are installed afterwards, default: 32KB.
+OOOPSI_EXPORT void setAltStackSize(size_t size) noexcept;
+
+/// Returns the size of the alternate signal stacks.
+OOOPSI_EXPORT size_t getAltStackSize() noexcept;
+
+/// Installs an alternate signal stack for the current thread, unless it has one already.
+/// HandlerSetup does this for its own thread and for all threads created by pthread_create() from
+/// then on (Linux only), other threads need to call this (e.g. on macOS). The stack is released
+/// when the thread exits.
+/// Not needed on Windows (always returns false).
+///
+/// @return true if the thread has an alternate signal stack
+OOOPSI_EXPORT bool installAltStack() noexcept;
+
+/// Parameters for setThreadDumpSettings().
+struct ThreadDumpSettings
+{
+    /// print the stacks of all other threads after the one of the terminating thread?
+    bool enabled = true;
+    /// maximum time to wait for the other threads (in milliseconds), stuck ones are skipped
+    unsigned timeoutMs = 500;
+};
+
+/// Enables dumping the stacks of all threads when the program terminates.
+/// On Linux, every other thread is interrupted by a real-time signal (SIGRTMIN + 4) and writes
+/// its return addresses into a preallocated slot. On Windows (x64 only), the threads are suspended
+/// and walked one after the other. The stacks are symbolized by the terminating thread.
+/// Alternatively, set the environment variable OOOPSI_DUMP_THREADS to "1".
+///
+/// Disabled by default. Same as setAbortLogFunc(), this isn't thread-safe.
+OOOPSI_EXPORT void setThreadDumpSettings(const ThreadDumpSettings& settings) noexcept;
+
+/// Returns the current settings for thread dumps.
+OOOPSI_EXPORT ThreadDumpSettings getThreadDumpSettings() noexcept;
+
+/// Parameters for setThrowTraceSettings().
+struct ThrowTraceSettings
+{
+    /// the default of maxFrames
+    static constexpr size_t s_DEFAULT_MAX_FRAMES = 32;
+
+    /// Capture the stack of every n-th exception thrown per thread (0: disabled, 1: every one).
+    /// The capture happens at the throw site: it doesn't allocate or resolve any symbols.
+    unsigned sampleInterval = 1;
+    /// maximum number of frames per trace (limited to 64)
+    size_t maxFrames = s_DEFAULT_MAX_FRAMES;
+    /// the method to walk the stack
+    Unwinder unwinder = Unwinder::DEFAULT;
+};
+
+/// Enables capturing the stack trace of thrown exceptions: If an exception leads to
+/// std::terminate, its throw site is printed in addition to the trace at termination (as long as
+/// the throw was sampled). This hooks __cxa_throw on Linux (the library must precede libstdc++ in
+/// the symbol lookup order, e.g. by linking or LD_PRELOAD) and uses the vectored exception handler
+/// on Windows. Not supported on macOS.
+/// Alternatively, set the environment variable OOOPSI_THROW_TRACES to the sample interval.
+/// Disabled by default. This function is thread-safe.
+OOOPSI_EXPORT void setThrowTraceSettings(const ThrowTraceSettings& settings) noexcept;
+
+/// Returns the current settings for throw traces (sampleInterval 0: disabled).
+OOOPSI_EXPORT ThrowTraceSettings getThrowTraceSettings() noexcept;
+
+/// Leaves a breadcrumb: an application event (e.g. a state transition or a request ID), which is
+/// printed after the stack trace when the program terminates. Every thread keeps its latest 32
+/// breadcrumbs in a ring buffer of its own (up to 256 threads at a time): this is wait-free,
+/// doesn't allocate and only takes a few nanoseconds. This function is thread-safe.
+///
+/// @param[in] text     describes the event (copied, truncated to 47 characters)
+/// @param[in] value    an arbitrary value (e.g. an ID)
+OOOPSI_EXPORT void breadcrumb(const char* text, uint64_t value = 0) noexcept;
+
+/// Parameters for startWatchdog().
+struct WatchdogSettings
+{
+    /// how often the deadlines of the watched threads are checked (in milliseconds)
+    unsigned intervalMs = 100;
+    /// terminate the program (with abort()) after reporting a stuck thread?
+    bool abortOnHang = false;
+};
+
+/// Starts a watchdog (Linux and Windows x64): A background thread checks periodically whether the
+/// watched threads (see watchThread()) kicked it within their timeouts. The stack of a thread that
+/// didn't is captured (by a signal on Linux, or by suspending it on Windows) and logged with the
+/// current log function, once per stall.
+///
+/// @return false if it's running already (or not supported)
+OOOPSI_EXPORT bool startWatchdog(const WatchdogSettings& settings = WatchdogSettings()) noexcept;
+
+/// Stops the watchdog. The threads stay registered.
+OOOPSI_EXPORT void stopWatchdog() noexcept;
+
+/// Registers the current thread with the watchdog (up to 4096 threads at a time), or changes its
+/// timeout. The thread is unregistered when it exits.
+///
+/// @param[in] timeoutMs    the maximum time between two calls of kickWatchdog()
+/// @return false if there are too many watched threads (or the timeout is 0)
+OOOPSI_EXPORT bool watchThread(unsigned timeoutMs) noexcept;
+
+/// Unregisters the current thread from the watchdog (e.g. before waiting for a long time).
+OOOPSI_EXPORT void unwatchThread() noexcept;
+
+/// Tells the watchdog that the current thread makes progress: a single relaxed store into the
+/// thread's own slot (nothing if it isn't watched). This function is thread-safe and wait-free.
+OOOPSI_EXPORT void kickWatchdog() noexcept;
+
+/// Parameters for startProfiler().
+struct ProfilerSettings
+{
+    /// samples per second of CPU time (per thread)
+    unsigned frequency = 100;
+    /// maximum number of frames per sample
+    size_t maxFrames = 64;
+    /// size of each thread's sample buffer in bytes (samples are dropped if it's full)
+    size_t bufferSize = 256 * 1024;
+    /// The method to walk the stack. FRAME_POINTER is only used for threads that know their stack
+    /// range already (i.e. did a frame pointer walk before), the others use DEFAULT.
+    Unwinder unwinder = Unwinder::DEFAULT;
+};
+
+/// Output formats of getProfile().
+enum class ProfileFormat
+{
+    /// one line per unique stack, root first: "main;foo();bar() 42" (e.g. for flamegraph.pl)
+    FOLDED,
+    /// an uncompressed protocol buffer for "pprof" (including the mappings and function names)
+    PPROF,
+};
+
+/// Starts the sampling CPU profiler for all threads of the process. Any previous profile is
+/// discarded.
+///
+/// On Linux, every thread gets a timer for its CPU time that interrupts it with SIGPROF, and the
+/// signal handler records the stack into the thread's sample buffer (lock-free). A background
+/// thread collects the samples and picks up new threads.
+/// On Windows (x64 only), a timer queue thread suspends the threads that used CPU time in the
+/// meantime and walks their stacks.
+/// Not supported on macOS.
+///
+/// @param[in] settings     the profiler settings
+/// @return false if the profiler couldn't be started (already running, or not supported)
+OOOPSI_EXPORT bool startProfiler(const ProfilerSettings& settings = ProfilerSettings()) noexcept;
+
+/// Stops the profiler. The profile is kept until the profiler is started again.
+OOOPSI_EXPORT void stopProfiler() noexcept;
+
+/// Returns the profile collected so far (also while the profiler is running).
+/// Note: This symbolizes the addresses, which may take a while.
+///
+/// @param[in] format   the output format
+/// @return the formatted profile
+OOOPSI_EXPORT std::string getProfile(ProfileFormat format = ProfileFormat::FOLDED);
+
 /// RAII helper class to register all necessary handlers and hooks.
 /// You only need this class when building a static library - the shared lib does this
 /// automatically.
@@ -135,5 +1006,20 @@ public:
 
 } // namespace ooopsi
 
+namespace std
+{
+
+/// allows using stack traces as keys of unordered containers
+template <size_t N, size_t POOL_SIZE>
+struct hash<ooopsi::StackTrace<N, POOL_SIZE>>
+{
+    size_t operator()(const ooopsi::StackTrace<N, POOL_SIZE>& trace) const noexcept
+    {
+        return static_cast<size_t>(trace.id());
+    }
+};
+
+} // namespace std
+
 
 #endif /* OOOPSI_HPP_ */
@@ -0,0 +1,324 @@
+/**
+ * @file    altstack.cpp
+ * @brief   per-thread alternate signal stacks
+ *
+ * Signal handlers need an alternate stack to report stack overflows, and every thread needs its
+ * own one. The stacks are mapped on demand with a guard page below them (so an overflow of the
+ * alternate stack doesn't silently corrupt other memory), and only the touched pages use memory.
+ * When a thread exits, its stack is returned to a small pool for the next thread (or unmapped if
+ * the pool is full), so the memory stays proportional to the number of live threads.
+ *
+ * On Linux, threads get their stack at thread start by hooking pthread_create(). Threads that
+ * aren't created this way (or on macOS) can call installAltStack().
+ */
+
+#include "internal.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#if defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
+#include <cerrno>
+#include <csignal>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef OOOPSI_LINUX
+#include <sys/auxv.h>
+#endif
+
+namespace ooopsi
+{
+
+/// the size usable by signal handlers (the kernel's signal frame is added)
+static std::atomic<size_t> s_altStackSize{ s_ALT_STACK_SIZE };
+
+#if defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
+
+/// maximum number of unused stacks that are kept for new threads
+static constexpr size_t s_MAX_POOLED_ALT_STACKS = 64;
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+namespace
+{
+
+/// The header of an unused stack in the pool (stored in the stack itself).
+struct PooledAltStack
+{
+    PooledAltStack* next;
+    /// size of the whole mapping (including the guard page)
+    size_t mappingSize;
+};
+
+} // namespace
+
+/// guards the pool
+static std::mutex s_altStackMutex;
+/// the unused stacks (a linked list)
+static PooledAltStack* s_altStackPool = nullptr;
+static size_t s_numPooledAltStacks = 0;
+
+/// releases the stack of an exiting thread
+static pthread_key_t s_altStackKey;
+static pthread_once_t s_altStackKeyOnce = PTHREAD_ONCE_INIT;
+
+/// set by HandlerSetup: hook new threads
+static std::atomic<bool> s_altStacksForNewThreads{ false };
+
+
+/// the signal frame size if the system doesn't tell (the classic MINSIGSTKSZ, which is a runtime
+/// value itself with newer glibc versions)
+static constexpr size_t s_FALLBACK_SIGNAL_FRAME_SIZE = 2048;
+
+/// Returns the space needed by the kernel to deliver a signal (at runtime, since it depends on
+/// the CPU's register set, e.g. AVX-512).
+static size_t signalFrameSize() noexcept
+{
+    size_t size = s_FALLBACK_SIGNAL_FRAME_SIZE;
+#ifdef _SC_MINSIGSTKSZ
+    const long minimum = sysconf(_SC_MINSIGSTKSZ);
+    if (minimum > 0)
+    {
+        size = std::max(size, static_cast<size_t>(minimum));
+    }
+#endif
+#if defined(OOOPSI_LINUX) && defined(AT_MINSIGSTKSZ)
+    size = std::max(size, static_cast<size_t>(getauxval(AT_MINSIGSTKSZ)));
+#endif
+    return size;
+}
+
+static size_t pageSize() noexcept
+{
+    static const auto s_pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return s_pageSize;
+}
+
+/// Converts the header of a pooled stack (which is located above the guard page) to the mapping.
+static void* toMapping(PooledAltStack* stack) noexcept
+{
+    return reinterpret_cast<char*>(stack) - pageSize();
+}
+
+/// Returns the size of a stack's mapping (including the guard page) for the current settings.
+static size_t mappingSize() noexcept
+{
+    const size_t page = pageSize();
+    const size_t size = s_altStackSize.load(std::memory_order_relaxed) + signalFrameSize();
+    return (size + page - 1) / page * page + page;
+}
+
+/// Maps a new stack or takes one from the pool, returns the start of the mapping.
+static void* acquireAltStack(size_t size) noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(s_altStackMutex);
+        while (s_altStackPool != nullptr)
+        {
+            PooledAltStack* stack = s_altStackPool;
+            s_altStackPool = stack->next;
+            --s_numPooledAltStacks;
+            if (stack->mappingSize == size)
+            {
+                return toMapping(stack);
+            }
+            // the size was changed in the meantime
+            munmap(toMapping(stack), stack->mappingSize);
+        }
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    // the stack grows downwards: protect the lowest page
+    if (mprotect(mapping, pageSize(), PROT_NONE) != 0)
+    {
+        munmap(mapping, size);
+        return nullptr;
+    }
+    return mapping;
+}
+
+/// Returns a stack to the pool (or unmaps it if the pool is full).
+static void releaseAltStack(void* mapping, size_t size) noexcept
+{
+    // note: the header is stored above the guard page
+    auto* stack = reinterpret_cast<PooledAltStack*>(static_cast<char*>(mapping) + pageSize());
+    {
+        const std::lock_guard<std::mutex> lock(s_altStackMutex);
+        if (s_numPooledAltStacks < s_MAX_POOLED_ALT_STACKS)
+        {
+            stack->next = s_altStackPool;
+            stack->mappingSize = size;
+            s_altStackPool = stack;
+            ++s_numPooledAltStacks;
+            return;
+        }
+    }
+    munmap(mapping, size);
+}
+
+/// Called when a thread with an installed stack exits.
+static void onAltStackThreadExit(void* mapping)
+{
+    // stop using the stack before releasing it
+    stack_t current;
+    if (sigaltstack(nullptr, &current) != 0 || (current.ss_flags & SS_ONSTACK) != 0 ||
+        current.ss_sp != static_cast<char*>(mapping) + pageSize())
+    {
+        // still in use (unless a signal handler terminates the thread) or replaced by the
+        // application: leak it
+        return;
+    }
+    stack_t disable;
+    memset(&disable, 0, sizeof(disable));
+    disable.ss_flags = SS_DISABLE;
+    sigaltstack(&disable, nullptr);
+
+    const size_t size = current.ss_size + pageSize();
+    releaseAltStack(mapping, size);
+}
+
+static void createAltStackKey() noexcept
+{
+    pthread_key_create(&s_altStackKey, onAltStackThreadExit);
+}
+
+bool installAltStack() noexcept
+{
+    stack_t current;
+    if (sigaltstack(nullptr, &current) != 0)
+    {
+        return false;
+    }
+    if ((current.ss_flags & SS_DISABLE) == 0)
+    {
+        // the thread has one already (maybe installed by the application)
+        return true;
+    }
+
+    pthread_once(&s_altStackKeyOnce, createAltStackKey);
+
+    const size_t size = mappingSize();
+    void* mapping = acquireAltStack(size);
+    if (mapping == nullptr)
+    {
+        return false;
+    }
+
+    stack_t altStack;
+    memset(&altStack, 0, sizeof(altStack));
+    altStack.ss_sp = static_cast<char*>(mapping) + pageSize();
+    altStack.ss_size = size - pageSize();
+    if (sigaltstack(&altStack, nullptr) != 0)
+    {
+        releaseAltStack(mapping, size);
+        return false;
+    }
+    pthread_setspecific(s_altStackKey, mapping);
+    return true;
+}
+
+void enableAltStacksForNewThreads() noexcept
+{
+    s_altStacksForNewThreads.store(true, std::memory_order_relaxed);
+}
+
+#else // !OOOPSI_LINUX && !OOOPSI_MAC
+
+bool installAltStack() noexcept
+{
+    // not needed: stack overflows are reported by the vectored exception handler
+    return false;
+}
+
+void enableAltStacksForNewThreads() noexcept {}
+
+#endif // OOOPSI_LINUX || OOOPSI_MAC
+
+void setAltStackSize(size_t size) noexcept
+{
+    s_altStackSize.store(size, std::memory_order_relaxed);
+}
+
+size_t getAltStackSize() noexcept
+{
+    return s_altStackSize.load(std::memory_order_relaxed);
+}
+
+} // namespace ooopsi
+
+
+#ifdef OOOPSI_LINUX
+
+namespace
+{
+
+/// The parameters of pthread_create(), passed to the new thread.
+struct ThreadStart
+{
+    void* (*start)(void*);
+    void* arg;
+};
+
+} // namespace
+
+/// Entry point of a new thread: installs the alternate signal stack first.
+static void* startThreadWithAltStack(void* param)
+{
+    const ThreadStart start = *static_cast<ThreadStart*>(param);
+    delete static_cast<ThreadStart*>(param);
+
+    ooopsi::installAltStack();
+    // the stack range bounds the traces of crashes (querying it isn't signal-safe)
+    ooopsi::prepareFramePointerWalk();
+    return start.start(start.arg);
+}
+
+/*
+ * Give every new thread an alternate signal stack: this replaces the C library's function for the
+ * whole process and forwards the call (with a wrapped start routine).
+ */
+extern "C" OOOPSI_DLL_EXPORT int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                                                void* (*start)(void*), void* arg) noexcept
+{
+    using PthreadCreateFunc = int (*)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+    static const auto s_pthreadCreate =
+      reinterpret_cast<PthreadCreateFunc>(dlsym(RTLD_NEXT, "pthread_create"));
+    if (s_pthreadCreate == nullptr)
+    {
+        return EAGAIN;
+    }
+
+    ThreadStart* param = nullptr;
+    if (ooopsi::s_altStacksForNewThreads.load(std::memory_order_relaxed))
+    {
+        param = new (std::nothrow) ThreadStart{ start, arg };
+    }
+    if (param == nullptr)
+    {
+        return s_pthreadCreate(thread, attr, start, arg);
+    }
+
+    const int result = s_pthreadCreate(thread, attr, startThreadWithAltStack, param);
+    if (result != 0)
+    {
+        delete param;
+    }
+    return result;
+}
+
+#endif // OOOPSI_LINUX
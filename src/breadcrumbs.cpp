@@ -0,0 +1,234 @@
+/**
+ * @file    breadcrumbs.cpp
+ * @brief   per-thread ring buffers of application events, printed on termination
+ *
+ * Every thread that leaves a breadcrumb claims a ring from a preallocated table once (the only
+ * shared atomic operation), which it owns from then on: Writing a record only touches the
+ * thread's own cache lines and is wait-free. Each record fills a cache line and is protected by
+ * its sequence number (a seqlock), so the reporting thread can read the rings of running threads
+ * and skip records that are being overwritten. The ring of an exiting thread is kept (and
+ * printed) until another thread claims it.
+ */
+
+#include "ooopsi.hpp"
+#include "internal.hpp"
+
+#include <atomic>
+#include <cstring>
+
+#if defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
+#include <pthread.h>
+#endif
+
+namespace ooopsi
+{
+
+/// number of records per thread (the latest ones are kept)
+static constexpr size_t s_BREADCRUMBS_PER_THREAD = 32;
+/// maximum number of threads with breadcrumbs at the same time
+static constexpr size_t s_MAX_BREADCRUMB_THREADS = 256;
+/// maximum length of a breadcrumb's text (longer ones are truncated)
+static constexpr size_t s_BREADCRUMB_TEXT_SIZE = 47;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the breadcrumbs require lock-free 64 bit integers");
+
+namespace
+{
+
+/// A single record (one cache line).
+struct alignas(64) Breadcrumb
+{
+    /// the number of the record in its ring, counting from 1 (0: being written)
+    std::atomic<uint64_t> seq;
+    /// the value passed to breadcrumb()
+    uint64_t value;
+    /// the text (NUL-terminated)
+    char text[s_BREADCRUMB_TEXT_SIZE + 1];
+};
+
+static_assert(sizeof(Breadcrumb) == 64, "a record should fill a cache line");
+
+/// The ring of a thread.
+struct alignas(64) BreadcrumbRing
+{
+    /// the owning thread (0: free)
+    std::atomic<uint64_t> owner;
+    /// set when the owner exited
+    std::atomic<bool> exited;
+    /// number of records written so far (written by the owner only)
+    std::atomic<uint64_t> count;
+    /// the thread's name (if known when the ring was claimed)
+    char name[32];
+    Breadcrumb records[s_BREADCRUMBS_PER_THREAD];
+};
+
+/// Releases the ring of the current thread when it exits.
+class RingOwner
+{
+public:
+    RingOwner() noexcept = default;
+    ~RingOwner();
+
+    RingOwner(const RingOwner&) = delete;
+    RingOwner& operator=(const RingOwner&) = delete;
+
+    BreadcrumbRing* ring = nullptr;
+};
+
+} // namespace
+
+/// the rings of all threads
+static BreadcrumbRing s_breadcrumbRings[s_MAX_BREADCRUMB_THREADS];
+
+/// the current thread's ring (trivial, so accessing it doesn't need an initialization check)
+static thread_local BreadcrumbRing* t_breadcrumbRing = nullptr;
+/// releases it when the thread exits (only touched when the ring is claimed)
+static thread_local RingOwner t_breadcrumbRingOwner;
+
+
+RingOwner::~RingOwner()
+{
+    if (ring != nullptr)
+    {
+        // keep the records until the ring is claimed again
+        ring->exited.store(true, std::memory_order_relaxed);
+        ring->owner.store(0, std::memory_order_release);
+    }
+}
+
+/// Claims a ring for the current thread, nullptr if all rings are in use.
+static BreadcrumbRing* claimRing() noexcept
+{
+    const uint64_t self = currentThreadId();
+    // prefer unused rings, which keeps the breadcrumbs of exited threads a bit longer
+    for (const bool reuse : { false, true })
+    {
+        for (auto& ring : s_breadcrumbRings)
+        {
+            if (ring.exited.load(std::memory_order_relaxed) != reuse)
+            {
+                continue;
+            }
+            uint64_t expected = 0;
+            if (ring.owner.compare_exchange_strong(expected, self, std::memory_order_acq_rel))
+            {
+                ring.exited.store(false, std::memory_order_relaxed);
+                ring.count.store(0, std::memory_order_release);
+                ring.name[0] = '\0';
+#if defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
+                pthread_getname_np(pthread_self(), ring.name, sizeof(ring.name));
+#endif
+                return &ring;
+            }
+        }
+    }
+    return nullptr;
+}
+
+void breadcrumb(const char* text, uint64_t value) noexcept
+{
+    BreadcrumbRing* ring = t_breadcrumbRing;
+    if (ring == nullptr)
+    {
+        ring = claimRing();
+        if (ring == nullptr)
+        {
+            // too many threads
+            return;
+        }
+        t_breadcrumbRing = ring;
+        t_breadcrumbRingOwner.ring = ring;
+    }
+
+    // only this thread writes: no read-modify-write needed
+    const uint64_t seq = ring->count.load(std::memory_order_relaxed) + 1;
+    Breadcrumb& record = ring->records[seq % s_BREADCRUMBS_PER_THREAD];
+    record.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    record.value = value;
+    const size_t length = text != nullptr ? strnlen(text, s_BREADCRUMB_TEXT_SIZE) : 0;
+    if (length > 0)
+    {
+        memcpy(record.text, text, length);
+    }
+    record.text[length] = '\0';
+
+    record.seq.store(seq, std::memory_order_release);
+    ring->count.store(seq, std::memory_order_release);
+}
+
+/// Copies a record if it isn't being overwritten, returns false otherwise.
+static bool readRecord(const Breadcrumb& record, uint64_t seq, uint64_t& value,
+                       char (&text)[s_BREADCRUMB_TEXT_SIZE + 1]) noexcept
+{
+    if (record.seq.load(std::memory_order_acquire) != seq)
+    {
+        return false;
+    }
+    value = record.value;
+    memcpy(text, record.text, sizeof(text));
+    text[s_BREADCRUMB_TEXT_SIZE] = '\0';
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return record.seq.load(std::memory_order_relaxed) == seq;
+}
+
+void printBreadcrumbs(LogWriter& writer) noexcept
+{
+    bool first = true;
+    char line[128];
+    for (const auto& ring : s_breadcrumbRings)
+    {
+        const uint64_t count = ring.count.load(std::memory_order_acquire);
+        if (count == 0)
+        {
+            continue;
+        }
+        const uint64_t owner = ring.owner.load(std::memory_order_acquire);
+        if (owner == 0 && !ring.exited.load(std::memory_order_relaxed))
+        {
+            continue;
+        }
+
+        if (first)
+        {
+            writer.line("---------- BREADCRUMBS ----------");
+            first = false;
+        }
+        LineFormatter title(line);
+        if (owner != 0)
+        {
+            title.append("thread ").appendDecimal(owner);
+        }
+        else
+        {
+            title.append("exited thread");
+        }
+        if (ring.name[0] != '\0')
+        {
+            title.append(" (").append(ring.name).append(')');
+        }
+        writer.line(title.append(':').c_str());
+
+        // the oldest records first
+        const uint64_t start =
+          count > s_BREADCRUMBS_PER_THREAD ? count - s_BREADCRUMBS_PER_THREAD + 1 : 1;
+        for (uint64_t seq = start; seq <= count; ++seq)
+        {
+            uint64_t value = 0;
+            char text[s_BREADCRUMB_TEXT_SIZE + 1];
+            if (readRecord(ring.records[seq % s_BREADCRUMBS_PER_THREAD], seq, value, text))
+            {
+                LineFormatter entry(line);
+                entry.append("  #").appendDecimal(seq).padTo(9).append(text);
+                writer.line(entry.append(' ').appendDecimal(value).c_str());
+            }
+        }
+    }
+    if (!first)
+    {
+        writer.line("-------------------------------");
+    }
+}
+
+} // namespace ooopsi
@@ -0,0 +1,141 @@
+/**
+ * @file    crasharena.cpp
+ * @brief   emergency memory for reporting crashes
+ *
+ * The heap can't be trusted after a fault (it may be corrupted, or its lock held by the crashed
+ * thread), so the larger buffers of the crash path come from an arena that is reserved (and
+ * touched, so it's backed by real pages) by HandlerSetup. Allocations are lock-free bumps of an
+ * offset and never freed: the process ends after the report anyway. The buffers that are needed
+ * for every frame (symbol names, output lines) are allocated once and reused by the reporting
+ * thread, see getCrashScratch().
+ */
+
+#include "internal.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#ifdef OOOPSI_WINDOWS
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace ooopsi
+{
+
+/// the arena (nullptr: not reserved)
+static char* s_arena = nullptr;
+/// size of the arena in bytes
+static size_t s_arenaSize = 0;
+/// the allocated part of the arena
+static std::atomic<size_t> s_arenaUsed{ 0 };
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 || ATOMIC_LONG_LOCK_FREE == 2,
+              "the crash arena requires lock-free offsets");
+
+/// sizes of the scratch buffers
+static constexpr size_t s_SCRATCH_SIZES[] = {
+    // CrashScratch::SYMBOL
+    8 * 1024,
+    // CrashScratch::DEMANGLED
+    8 * 1024,
+    // CrashScratch::LINE
+    16 * 1024,
+};
+static_assert(sizeof(s_SCRATCH_SIZES) / sizeof(s_SCRATCH_SIZES[0]) ==
+                static_cast<size_t>(CrashScratch::COUNT),
+              "a size per scratch buffer");
+
+/// the scratch buffers (allocated by the reporting thread)
+static char* s_scratch[static_cast<size_t>(CrashScratch::COUNT)];
+
+
+static void releaseArena() noexcept
+{
+    if (s_arena != nullptr)
+    {
+#ifdef OOOPSI_WINDOWS
+        VirtualFree(s_arena, 0, MEM_RELEASE);
+#else
+        munmap(s_arena, s_arenaSize);
+#endif
+    }
+    s_arena = nullptr;
+    s_arenaSize = 0;
+    s_arenaUsed.store(0, std::memory_order_relaxed);
+    memset(s_scratch, 0, sizeof(s_scratch));
+}
+
+bool setCrashArenaSize(size_t size) noexcept
+{
+    releaseArena();
+    if (size == 0)
+    {
+        return true;
+    }
+
+#ifdef OOOPSI_WINDOWS
+    void* arena = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (arena == nullptr)
+    {
+        return false;
+    }
+#else
+    void* arena = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED)
+    {
+        return false;
+    }
+#endif
+    // touch every page: no page faults (or running out of memory) at crash time
+    memset(arena, 0, size);
+
+    s_arena = static_cast<char*>(arena);
+    s_arenaSize = size;
+    return true;
+}
+
+size_t getCrashArenaSize() noexcept
+{
+    return s_arenaSize;
+}
+
+void* crashAlloc(size_t size) noexcept
+{
+    // keep the alignment of malloc()
+    constexpr size_t alignment = alignof(std::max_align_t);
+    const size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+    if (s_arena == nullptr || size == 0 || rounded > s_arenaSize)
+    {
+        return nullptr;
+    }
+    size_t used = s_arenaUsed.load(std::memory_order_relaxed);
+    do
+    {
+        if (rounded > s_arenaSize - used)
+        {
+            // exhausted
+            return nullptr;
+        }
+    } while (!s_arenaUsed.compare_exchange_weak(used, used + rounded, std::memory_order_relaxed));
+    return s_arena + used;
+}
+
+char* getCrashScratch(CrashScratch which, size_t& size) noexcept
+{
+    if (!isReportingThread())
+    {
+        return nullptr;
+    }
+    const auto index = static_cast<size_t>(which);
+    if (s_scratch[index] == nullptr)
+    {
+        s_scratch[index] = static_cast<char*>(crashAlloc(s_SCRATCH_SIZES[index]));
+    }
+    size = s_SCRATCH_SIZES[index];
+    return s_scratch[index];
+}
+
+} // namespace ooopsi
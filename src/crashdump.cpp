@@ -0,0 +1,499 @@
+/**
+ * @file    crashdump.cpp
+ * @brief   writes crash dumps (see crashdump.hpp) to a preallocated file
+ *
+ * The file is opened (and its blocks are allocated) by setCrashDumpSettings(), so nothing needs
+ * to be created at crash time. The dump is streamed with pwrite() directly from the crashed
+ * process' memory: the kernel reports unreadable memory with EFAULT instead of raising another
+ * signal, so even stale register values can be followed safely. The size and the time spent are
+ * bounded by the settings, the memory that doesn't fit is omitted (and the header says so).
+ *
+ * On Windows, a native minidump is written with MiniDumpWriteDump() instead, which can be opened
+ * directly in WinDbg or Visual Studio.
+ */
+
+#include "crashdump.hpp"
+#include "crashrecord.hpp"
+#include "internal.hpp"
+
+#include <atomic>
+#include <cstring>
+
+#ifdef OOOPSI_LINUX
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+#ifdef OOOPSI_WINDOWS
+#ifdef OOOPSI_MSVC
+#pragma warning(push)
+#pragma warning(disable : 4091)
+#endif // OOOPSI_MSVC
+#include <dbghelp.h>
+#ifdef OOOPSI_MSVC
+#pragma warning(pop)
+#endif // OOOPSI_MSVC
+#endif
+
+namespace ooopsi
+{
+
+/// the current settings (path: points to s_dumpPath)
+static CrashDumpSettings s_dumpSettings;
+/// the path of the dump file
+static char s_dumpPath[1024];
+
+/// maximum number of regions added by addCrashDumpRegion()
+static constexpr size_t s_MAX_DUMP_REGIONS = 32;
+
+/// A memory region added by the application.
+struct DumpRegion
+{
+    std::atomic<const void*> start;
+    std::atomic<size_t> size;
+};
+
+static_assert(ATOMIC_POINTER_LOCK_FREE == 2, "the dump regions require lock-free pointers");
+
+/// the regions added by the application (start nullptr: free slot)
+static DumpRegion s_dumpRegions[s_MAX_DUMP_REGIONS];
+
+bool addCrashDumpRegion(const void* start, size_t size) noexcept
+{
+    if (start == nullptr || size == 0)
+    {
+        return false;
+    }
+    for (auto& region : s_dumpRegions)
+    {
+        const void* expected = nullptr;
+        // the size is cleared while the slot is free, so a crash sees an empty region meanwhile
+        if (region.start.compare_exchange_strong(expected, start, std::memory_order_acq_rel))
+        {
+            region.size.store(size, std::memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+void removeCrashDumpRegion(const void* start) noexcept
+{
+    for (auto& region : s_dumpRegions)
+    {
+        if (start != nullptr && region.start.load(std::memory_order_acquire) == start)
+        {
+            region.size.store(0, std::memory_order_release);
+            region.start.store(nullptr, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+CrashDumpSettings getCrashDumpSettings() noexcept
+{
+    return s_dumpSettings;
+}
+
+#ifdef OOOPSI_LINUX
+
+/// the dump file (-1: disabled)
+static int s_dumpFd = -1;
+/// the buffer for the crash record stream
+static char s_dumpRecord[s_CRASH_RECORD_SIZE];
+
+bool setCrashDumpSettings(const CrashDumpSettings& settings) noexcept
+{
+    if (s_dumpFd >= 0)
+    {
+        close(s_dumpFd);
+        s_dumpFd = -1;
+    }
+    s_dumpSettings = CrashDumpSettings();
+    s_dumpPath[0] = '\0';
+    if (settings.path == nullptr || settings.path[0] == '\0')
+    {
+        return true;
+    }
+    if (strlen(settings.path) >= sizeof(s_dumpPath))
+    {
+        return false;
+    }
+
+    const int fd = open(settings.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // allocate the blocks now: a full disk is noticed here, not at crash time
+    if (posix_fallocate(fd, 0, static_cast<off_t>(settings.maxSize)) != 0)
+    {
+        close(fd);
+        unlink(settings.path);
+        return false;
+    }
+
+    strcpy(s_dumpPath, settings.path); // flawfinder: ignore (checked above)
+    s_dumpSettings = settings;
+    s_dumpSettings.path = s_dumpPath;
+    s_dumpFd = fd;
+    return true;
+}
+
+namespace
+{
+
+/// Streams the parts of a dump to the file, within the configured limits.
+class DumpWriter
+{
+public:
+    DumpWriter(int fd, const CrashDumpSettings& settings) noexcept : m_fd(fd), m_settings(settings)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &m_deadline);
+        m_deadline.tv_sec += static_cast<time_t>(settings.timeoutMs / 1000);
+        m_deadline.tv_nsec += static_cast<long>(settings.timeoutMs % 1000) * 1000000L;
+        if (m_deadline.tv_nsec >= 1000000000L)
+        {
+            ++m_deadline.tv_sec;
+            m_deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    /// Adds a stream with the given payload.
+    void addStream(uint32_t type, const void* data, size_t size) noexcept
+    {
+        if (!fits(sizeof(CrashDumpStream) + size))
+        {
+            return;
+        }
+        CrashDumpStream stream;
+        memset(&stream, 0, sizeof(stream));
+        stream.type = type;
+        stream.size = size;
+        if (write(&stream, sizeof(stream), m_offset) == sizeof(stream) &&
+            write(data, size, m_offset + sizeof(stream)) == size)
+        {
+            m_offset += sizeof(stream) + size;
+            ++m_numStreams;
+        }
+    }
+
+    /// Adds a memory stream with (the readable start of) the given range.
+    void addMemory(uint32_t kind, uintptr_t start, size_t size) noexcept
+    {
+        constexpr size_t headerSize = sizeof(CrashDumpStream) + sizeof(CrashDumpMemory);
+        if (m_flags != 0)
+        {
+            return;
+        }
+        if (isTimedOut())
+        {
+            m_flags |= s_DUMP_TIMED_OUT;
+            return;
+        }
+        if (!fits(headerSize + 1))
+        {
+            m_flags |= s_DUMP_TRUNCATED;
+            return;
+        }
+        if (size > m_settings.maxSize - m_offset - headerSize)
+        {
+            size = m_settings.maxSize - m_offset - headerSize;
+            m_flags |= s_DUMP_TRUNCATED;
+        }
+
+        // the contents first: the headers get the number of bytes that could actually be read
+        const size_t length =
+          write(reinterpret_cast<const void*>(start), size, m_offset + headerSize);
+        if (length == 0)
+        {
+            return;
+        }
+        CrashDumpStream stream;
+        memset(&stream, 0, sizeof(stream));
+        stream.type = s_DUMP_STREAM_MEMORY;
+        stream.size = sizeof(CrashDumpMemory) + length;
+        CrashDumpMemory memory;
+        memset(&memory, 0, sizeof(memory));
+        memory.address = start;
+        memory.kind = kind;
+        if (write(&stream, sizeof(stream), m_offset) == sizeof(stream) &&
+            write(&memory, sizeof(memory), m_offset + sizeof(stream)) == sizeof(memory))
+        {
+            m_offset += headerSize + length;
+            ++m_numStreams;
+        }
+    }
+
+    /// Writes the header and releases the unused space, returns false on errors.
+    bool finish() noexcept
+    {
+        CrashDumpHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, s_CRASH_DUMP_MAGIC, sizeof(header.magic));
+        header.size = m_offset;
+        header.numStreams = m_numStreams;
+        header.flags = m_flags;
+        const bool ok = write(&header, sizeof(header), 0) == sizeof(header);
+        // ftruncate() is signal-safe, the file shrinks to the actual dump
+        return ftruncate(m_fd, static_cast<off_t>(m_offset)) == 0 && ok;
+    }
+
+private:
+    bool fits(size_t size) const noexcept
+    {
+        return m_offset <= m_settings.maxSize && size <= m_settings.maxSize - m_offset;
+    }
+
+    bool isTimedOut() const noexcept
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec > m_deadline.tv_sec ||
+               (now.tv_sec == m_deadline.tv_sec && now.tv_nsec >= m_deadline.tv_nsec);
+    }
+
+    /// Writes as much as possible (stops at the first unreadable byte), returns the length.
+    size_t write(const void* data, size_t size, size_t offset) noexcept
+    {
+        const auto* bytes = static_cast<const char*>(data);
+        size_t written = 0;
+        while (written < size)
+        {
+            const ssize_t result =
+              pwrite(m_fd, bytes + written, size - written, static_cast<off_t>(offset + written));
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result <= 0)
+            {
+                // EFAULT: the rest isn't mapped (or not readable)
+                break;
+            }
+            written += static_cast<size_t>(result);
+        }
+        return written;
+    }
+
+    int m_fd;
+    const CrashDumpSettings& m_settings;
+    timespec m_deadline;
+    /// the end of the dump in the file (the header is written last)
+    size_t m_offset = sizeof(CrashDumpHeader);
+    uint32_t m_numStreams = 0;
+    uint32_t m_flags = 0;
+};
+
+} // namespace
+
+/// Returns the stack pointer and the general purpose registers of a signal context.
+static size_t getRegisters(const ucontext_t& context, uintptr_t& stackPtr, uintptr_t* regs,
+                           size_t maxRegs) noexcept
+{
+    size_t numRegs = 0;
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__x86_64__)
+    stackPtr = static_cast<uintptr_t>(context.uc_mcontext.gregs[REG_RSP]);
+#else
+    stackPtr = static_cast<uintptr_t>(context.uc_mcontext.gregs[REG_ESP]);
+#endif
+    for (const greg_t reg : context.uc_mcontext.gregs)
+    {
+        if (numRegs < maxRegs)
+        {
+            regs[numRegs++] = static_cast<uintptr_t>(reg);
+        }
+    }
+#elif defined(__aarch64__)
+    stackPtr = static_cast<uintptr_t>(context.uc_mcontext.sp);
+    for (const auto reg : context.uc_mcontext.regs)
+    {
+        if (numRegs < maxRegs)
+        {
+            regs[numRegs++] = static_cast<uintptr_t>(reg);
+        }
+    }
+#else
+    stackPtr = 0;
+    static_cast<void>(context);
+    static_cast<void>(regs);
+    static_cast<void>(maxRegs);
+#endif
+    return numRegs;
+}
+
+const char* writeCrashDump(const char* reason, const pointer_t* faultAddr,
+                           const SignalDetails& signal) noexcept
+{
+    // only called by abort(), i.e. by a single thread
+    if (s_dumpFd < 0)
+    {
+        return nullptr;
+    }
+    DumpWriter writer(s_dumpFd, s_dumpSettings);
+
+    // the record first: it's small and the most important part
+    const size_t recordSize =
+      buildCrashRecord(s_dumpRecord, sizeof(s_dumpRecord), reason, faultAddr, &signal);
+    writer.addStream(s_DUMP_STREAM_RECORD, s_dumpRecord, recordSize);
+
+    const auto* context = static_cast<const ucontext_t*>(signal.context);
+    if (context != nullptr)
+    {
+        uintptr_t stackPtr = 0;
+        uintptr_t regs[64];
+        const size_t numRegs = getRegisters(*context, stackPtr, regs, 64);
+
+        // the stack from the red zone (x86_64 ABI) upwards
+        if (stackPtr != 0 && s_dumpSettings.maxStackBytes > 0)
+        {
+            constexpr uintptr_t redZone = 128;
+            const uintptr_t start = stackPtr > redZone ? stackPtr - redZone : stackPtr;
+            writer.addMemory(s_DUMP_MEMORY_STACK, start, s_dumpSettings.maxStackBytes);
+        }
+
+        // the memory around each register that looks like a pointer
+        const size_t halfRegion = s_dumpSettings.regionBytes / 2;
+        for (size_t i = 0; i < numRegs && halfRegion > 0; ++i)
+        {
+            // skip small integers (the first page is never mapped) and the stack itself
+            constexpr uintptr_t minAddress = 4096;
+            const bool onStack =
+              regs[i] >= stackPtr && regs[i] - stackPtr < s_dumpSettings.maxStackBytes;
+            if (regs[i] >= minAddress + halfRegion && !onStack)
+            {
+                writer.addMemory(s_DUMP_MEMORY_REGISTER, regs[i] - halfRegion,
+                                 s_dumpSettings.regionBytes);
+            }
+        }
+    }
+
+    for (const auto& region : s_dumpRegions)
+    {
+        const void* start = region.start.load(std::memory_order_acquire);
+        const size_t size = region.size.load(std::memory_order_acquire);
+        if (start != nullptr && size > 0)
+        {
+            writer.addMemory(s_DUMP_MEMORY_REGION, reinterpret_cast<uintptr_t>(start), size);
+        }
+    }
+
+    return writer.finish() ? s_dumpPath : nullptr;
+}
+
+#elif defined(OOOPSI_WINDOWS)
+
+/// the dump file (INVALID_HANDLE_VALUE: disabled)
+static HANDLE s_dumpFile = INVALID_HANDLE_VALUE;
+
+bool setCrashDumpSettings(const CrashDumpSettings& settings) noexcept
+{
+    if (s_dumpFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(s_dumpFile);
+        s_dumpFile = INVALID_HANDLE_VALUE;
+    }
+    s_dumpSettings = CrashDumpSettings();
+    s_dumpPath[0] = '\0';
+    if (settings.path == nullptr || settings.path[0] == '\0')
+    {
+        return true;
+    }
+    if (strlen(settings.path) >= sizeof(s_dumpPath))
+    {
+        return false;
+    }
+
+    // MiniDumpWriteDump() only needs the handle (it grows the file as needed)
+    const HANDLE file = CreateFileA(settings.path, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                                    CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    strcpy(s_dumpPath, settings.path); // flawfinder: ignore (checked above)
+    s_dumpSettings = settings;
+    s_dumpSettings.path = s_dumpPath;
+    s_dumpFile = file;
+    return true;
+}
+
+/// Adds the regions of addCrashDumpRegion() to a minidump ('param': the next slot to check).
+static BOOL CALLBACK addDumpRegions(PVOID param, const PMINIDUMP_CALLBACK_INPUT input,
+                                    PMINIDUMP_CALLBACK_OUTPUT output)
+{
+    if (input->CallbackType != MemoryCallback)
+    {
+        // the defaults for everything else
+        return TRUE;
+    }
+    auto& slot = *static_cast<size_t*>(param);
+    while (slot < s_MAX_DUMP_REGIONS)
+    {
+        const auto& region = s_dumpRegions[slot++];
+        const void* start = region.start.load(std::memory_order_acquire);
+        const size_t size = region.size.load(std::memory_order_acquire);
+        if (start != nullptr && size > 0)
+        {
+            output->MemoryBase = reinterpret_cast<ULONG64>(start);
+            output->MemorySize = static_cast<ULONG>(size);
+            return TRUE;
+        }
+    }
+    // no more regions
+    return FALSE;
+}
+
+const char* writeCrashDump(const char* /*reason*/, const pointer_t* /*faultAddr*/,
+                           const SignalDetails& signal) noexcept
+{
+    if (s_dumpFile == INVALID_HANDLE_VALUE)
+    {
+        return nullptr;
+    }
+
+    MINIDUMP_EXCEPTION_INFORMATION exception;
+    exception.ThreadId =
+      signal.threadId != 0 ? static_cast<DWORD>(signal.threadId) : GetCurrentThreadId();
+    exception.ExceptionPointers =
+      const_cast<EXCEPTION_POINTERS*>(static_cast<const EXCEPTION_POINTERS*>(signal.context));
+    exception.ClientPointers = FALSE;
+
+    size_t nextSlot = 0;
+    MINIDUMP_CALLBACK_INFORMATION callback;
+    callback.CallbackRoutine = addDumpRegions;
+    callback.CallbackParam = &nextSlot;
+
+    // the stacks, the memory referenced by them and the registered regions
+    const auto type =
+      static_cast<MINIDUMP_TYPE>(MiniDumpNormal | MiniDumpWithIndirectlyReferencedMemory);
+
+    const std::lock_guard<DbgHelpMutex> lock(s_dbgHelpMutex);
+    const BOOL ok = MiniDumpWriteDump(GetCurrentProcess(), GetCurrentProcessId(), s_dumpFile, type,
+                                      signal.context != nullptr ? &exception : nullptr, nullptr,
+                                      &callback);
+    FlushFileBuffers(s_dumpFile);
+    return ok ? s_dumpPath : nullptr;
+}
+
+#else // macOS
+
+bool setCrashDumpSettings(const CrashDumpSettings& /*settings*/) noexcept
+{
+    // not supported (yet)
+    return false;
+}
+
+const char* writeCrashDump(const char* /*reason*/, const pointer_t* /*faultAddr*/,
+                           const SignalDetails& /*signal*/) noexcept
+{
+    return nullptr;
+}
+
+#endif // OOOPSI_LINUX/WINDOWS
+
+} // namespace ooopsi
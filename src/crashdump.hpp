@@ -0,0 +1,81 @@
+/**
+ * @file    crashdump.hpp
+ * @brief   binary format of crash dumps (Linux)
+ *
+ * A crash dump extends a crash record (see crashrecord.hpp) by raw memory: the faulting thread's
+ * stack, the memory around the addresses held by its registers and the regions registered by the
+ * application. It's written to a preallocated file (see setCrashDumpSettings()). On Windows, a
+ * native minidump is written instead.
+ *
+ * Layout (all integers in the byte order of the crashed process, no padding between the parts):
+ *  - CrashDumpHeader
+ *  - streams (CrashDumpHeader::numStreams x (CrashDumpStream + payload)):
+ *     - s_DUMP_STREAM_RECORD: a complete crash record
+ *     - s_DUMP_STREAM_MEMORY: CrashDumpMemory + the memory contents
+ */
+
+#ifndef CRASHDUMP_HPP_
+#define CRASHDUMP_HPP_
+
+#include <cstdint>
+
+namespace ooopsi
+{
+
+/// identifies a crash dump (and its version)
+static constexpr char s_CRASH_DUMP_MAGIC[8] = { 'O', 'O', 'O', 'P', 'S', 'I', 'D', '1' };
+
+/// CrashDumpHeader::flags: the dump reached the maximum size, memory was omitted
+static constexpr uint32_t s_DUMP_TRUNCATED = 1;
+/// CrashDumpHeader::flags: writing took too long, memory was omitted
+static constexpr uint32_t s_DUMP_TIMED_OUT = 2;
+
+/// stream types
+static constexpr uint32_t s_DUMP_STREAM_RECORD = 1;
+static constexpr uint32_t s_DUMP_STREAM_MEMORY = 2;
+
+/// CrashDumpMemory::kind
+static constexpr uint32_t s_DUMP_MEMORY_STACK = 1;
+static constexpr uint32_t s_DUMP_MEMORY_REGISTER = 2;
+static constexpr uint32_t s_DUMP_MEMORY_REGION = 3;
+
+/// The start of a crash dump.
+struct CrashDumpHeader
+{
+    /// s_CRASH_DUMP_MAGIC
+    char magic[8];
+    /// total size of the dump in bytes, including this header
+    uint64_t size;
+    /// number of streams
+    uint32_t numStreams;
+    /// s_DUMP_TRUNCATED, s_DUMP_TIMED_OUT
+    uint32_t flags;
+};
+
+/// The start of a stream.
+struct CrashDumpStream
+{
+    /// s_DUMP_STREAM_*
+    uint32_t type;
+    uint32_t reserved;
+    /// size of the payload in bytes (excluding this header)
+    uint64_t size;
+};
+
+/// The start of a memory stream, followed by the contents.
+struct CrashDumpMemory
+{
+    /// the address of the first byte
+    uint64_t address;
+    /// s_DUMP_MEMORY_*
+    uint32_t kind;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(CrashDumpHeader) == 24, "unexpected padding");
+static_assert(sizeof(CrashDumpStream) == 16, "unexpected padding");
+static_assert(sizeof(CrashDumpMemory) == 16, "unexpected padding");
+
+} // namespace ooopsi
+
+#endif /* CRASHDUMP_HPP_ */
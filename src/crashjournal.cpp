@@ -0,0 +1,300 @@
+/**
+ * @file    crashjournal.cpp
+ * @brief   the persistent crash journal (see crashjournal.hpp) and its reader
+ *
+ * The journal file is mapped (shared) by setCrashJournalSettings(), so writing an entry at crash
+ * time is a number of plain stores into the page cache: they survive the process without msync()
+ * or any other system call. An entry is claimed by an atomic increment of the ring's counter
+ * (shared by all processes that map the file), and marked complete by storing its commit number
+ * last, so the reader skips entries that were torn by a second crash.
+ *
+ * The ID of an entry is computed from the module-relative frame addresses, which stay the same
+ * for every restart of the same binaries (in spite of address space layout randomization): this
+ * allows counting how often the same crash happened.
+ */
+
+#include "crashjournal.hpp"
+#include "internal.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+#ifndef OOOPSI_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace ooopsi
+{
+
+/// the current settings (path: points to s_journalPath)
+static CrashJournalSettings s_journalSettings;
+/// the path of the journal file
+static char s_journalPath[1024];
+
+CrashJournalSettings getCrashJournalSettings() noexcept
+{
+    return s_journalSettings;
+}
+
+#ifndef OOOPSI_WINDOWS
+
+/// the mapped journal (nullptr: disabled)
+static CrashJournalHeader* s_journal = nullptr;
+/// size of the mapping in bytes
+static size_t s_journalSize = 0;
+
+/// Returns the entries following the header.
+static CrashJournalEntry* journalEntries(CrashJournalHeader* header) noexcept
+{
+    return reinterpret_cast<CrashJournalEntry*>(header + 1);
+}
+
+bool setCrashJournalSettings(const CrashJournalSettings& settings) noexcept
+{
+    if (s_journal != nullptr)
+    {
+        munmap(s_journal, s_journalSize);
+        s_journal = nullptr;
+        s_journalSize = 0;
+    }
+    s_journalSettings = CrashJournalSettings();
+    s_journalPath[0] = '\0';
+    if (settings.path == nullptr || settings.path[0] == '\0')
+    {
+        return true;
+    }
+    if (strlen(settings.path) >= sizeof(s_journalPath) || settings.numEntries == 0 ||
+        settings.numEntries > UINT32_MAX)
+    {
+        return false;
+    }
+
+    // the entries of earlier processes are kept (unless the geometry changed)
+    const int fd = open(settings.path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    const size_t size =
+      sizeof(CrashJournalHeader) + settings.numEntries * sizeof(CrashJournalEntry);
+    // the constant part of the header: magic, entry size and number of entries
+    char start[16] = {};
+    uint32_t geometry[2] = { 0, 0 };
+    if (pread(fd, start, sizeof(start), 0) == static_cast<ssize_t>(sizeof(start)))
+    {
+        memcpy(geometry, start + 8, sizeof(geometry));
+    }
+    const bool valid = memcmp(start, s_CRASH_JOURNAL_MAGIC, sizeof(s_CRASH_JOURNAL_MAGIC)) == 0 &&
+                       geometry[0] == sizeof(CrashJournalEntry) &&
+                       geometry[1] == settings.numEntries;
+    if (!valid && ftruncate(fd, 0) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    bool allocated = ftruncate(fd, static_cast<off_t>(size)) == 0;
+#ifdef OOOPSI_LINUX
+    // allocate the blocks now: writing to a mapped hole of a full disk would raise SIGBUS
+    allocated = allocated && posix_fallocate(fd, 0, static_cast<off_t>(size)) == 0;
+#endif
+    void* mapping =
+      allocated ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    // the mapping stays valid without the file descriptor
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+
+    s_journal = static_cast<CrashJournalHeader*>(mapping);
+    s_journalSize = size;
+    if (!valid)
+    {
+        s_journal->entrySize = sizeof(CrashJournalEntry);
+        s_journal->numEntries = static_cast<uint32_t>(settings.numEntries);
+        s_journal->next.store(0, std::memory_order_relaxed);
+        // the magic last: a journal is only valid once it's initialized
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(s_journal->magic, s_CRASH_JOURNAL_MAGIC, sizeof(s_journal->magic));
+    }
+
+    strcpy(s_journalPath, settings.path); // flawfinder: ignore (checked above)
+    s_journalSettings = settings;
+    s_journalSettings.path = s_journalPath;
+    return true;
+}
+
+void writeCrashJournal(const char* reason, const SignalDetails* signal) noexcept
+{
+    CrashJournalHeader* journal = s_journal;
+    if (journal == nullptr)
+    {
+        return;
+    }
+
+    // claim an entry: it's incomplete until the commit number is stored
+    const uint64_t seq = journal->next.fetch_add(1, std::memory_order_acq_rel);
+    CrashJournalEntry& entry = journalEntries(journal)[seq % journal->numEntries];
+    entry.commit.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    entry.time = static_cast<uint64_t>(now.tv_sec) * 1000000U +
+                 static_cast<uint64_t>(now.tv_nsec) / 1000U;
+    entry.pid = static_cast<uint32_t>(getpid());
+    entry.signal = signal != nullptr ? signal->signal : 0;
+
+    const size_t length = reason != nullptr ? strnlen(reason, s_JOURNAL_REASON_SIZE) : 0;
+    if (length > 0)
+    {
+        memcpy(entry.reason, reason, length);
+    }
+    entry.reasonLength = static_cast<uint32_t>(length);
+
+    pointer_t frames[s_JOURNAL_FRAMES];
+    const size_t numFrames =
+      signal != nullptr && signal->context != nullptr
+        ? captureSignalStack(signal->context, frames, s_JOURNAL_FRAMES, Unwinder::DEFAULT)
+        : captureStackAddresses(frames, s_JOURNAL_FRAMES);
+
+    // the module-relative addresses are hashed (and their modules saved)
+    size_t numModules = 0;
+    for (size_t i = 0; i < numFrames; ++i)
+    {
+        const auto address = reinterpret_cast<uintptr_t>(frames[i]);
+        entry.frames[i] = address;
+
+        ModuleInfo module;
+        if (!findModule(frames[i], module))
+        {
+            continue;
+        }
+        frames[i] = reinterpret_cast<pointer_t>(address - module.base);
+        size_t m = 0;
+        while (m < numModules && entry.modules[m].start != module.start)
+        {
+            ++m;
+        }
+        if (m == numModules && numModules < s_JOURNAL_MODULES)
+        {
+            CrashJournalModule& saved = entry.modules[numModules++];
+            saved.base = module.base;
+            saved.start = module.start;
+            saved.end = module.end;
+            const char* name = moduleName(module);
+            const size_t nameLength = strnlen(name, sizeof(saved.name) - 1);
+            memcpy(saved.name, name, nameLength);
+            saved.name[nameLength] = '\0';
+        }
+    }
+    entry.numFrames = static_cast<uint32_t>(numFrames);
+    entry.numModules = static_cast<uint32_t>(numModules);
+    entry.traceId = hashStackTrace(frames, numFrames);
+
+    entry.commit.store(seq + 1, std::memory_order_release);
+}
+
+#else // OOOPSI_WINDOWS
+
+bool setCrashJournalSettings(const CrashJournalSettings& settings) noexcept
+{
+    s_journalSettings = CrashJournalSettings();
+    s_journalPath[0] = '\0';
+    // not supported
+    return settings.path == nullptr || settings.path[0] == '\0';
+}
+
+void writeCrashJournal(const char* /*reason*/, const SignalDetails* /*signal*/) noexcept {}
+
+#endif // OOOPSI_WINDOWS
+
+/// Formats a frame of an entry: module-relative if the module is known.
+static std::string formatJournalFrame(const CrashJournalEntry& entry, uint64_t address)
+{
+    char buffer[128];
+    const uint32_t numModules = std::min<uint32_t>(entry.numModules, s_JOURNAL_MODULES);
+    for (uint32_t m = 0; m < numModules; ++m)
+    {
+        const CrashJournalModule& module = entry.modules[m];
+        if (address >= module.start && address < module.end)
+        {
+            snprintf(buffer, sizeof(buffer), "%.*s+0x%" PRIx64,
+                     static_cast<int>(sizeof(module.name)), module.name, address - module.base);
+            return buffer;
+        }
+    }
+    snprintf(buffer, sizeof(buffer), "0x%" PRIx64, address);
+    return buffer;
+}
+
+std::vector<CrashSummary> readCrashJournal(const char* path)
+{
+    std::vector<CrashSummary> result;
+    FILE* file = path != nullptr ? fopen(path, "rb") : nullptr;
+    if (file == nullptr)
+    {
+        return result;
+    }
+
+    CrashJournalHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, s_CRASH_JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.entrySize != sizeof(CrashJournalEntry))
+    {
+        fclose(file);
+        return result;
+    }
+
+    std::map<StackTraceId, CrashSummary> summaries;
+    CrashJournalEntry entry;
+    for (uint32_t i = 0; i < header.numEntries && fread(&entry, sizeof(entry), 1, file) == 1; ++i)
+    {
+        if (entry.commit.load(std::memory_order_relaxed) == 0)
+        {
+            // never written (or torn)
+            continue;
+        }
+        CrashSummary& summary = summaries[entry.traceId];
+        summary.traceId = entry.traceId;
+        ++summary.count;
+        if (summary.count == 1 || entry.time < summary.firstTime)
+        {
+            summary.firstTime = entry.time;
+        }
+        if (entry.time >= summary.lastTime)
+        {
+            // the details of the latest crash
+            summary.lastTime = entry.time;
+            summary.reason.assign(entry.reason,
+                                  std::min<size_t>(entry.reasonLength, s_JOURNAL_REASON_SIZE));
+            summary.frames.clear();
+            const uint32_t numFrames = std::min<uint32_t>(entry.numFrames, s_JOURNAL_FRAMES);
+            for (uint32_t f = 0; f < numFrames; ++f)
+            {
+                summary.frames.push_back(formatJournalFrame(entry, entry.frames[f]));
+            }
+        }
+    }
+    fclose(file);
+
+    // the most frequent crashes first
+    for (auto& summary : summaries)
+    {
+        result.push_back(std::move(summary.second));
+    }
+    std::stable_sort(result.begin(), result.end(),
+                     [](const CrashSummary& lhs, const CrashSummary& rhs) {
+                         return lhs.count > rhs.count;
+                     });
+    return result;
+}
+
+} // namespace ooopsi
@@ -0,0 +1,99 @@
+/**
+ * @file    crashjournal.hpp
+ * @brief   binary format of the crash journal
+ *
+ * The journal is a file of fixed size (see setCrashJournalSettings()) that is mapped into every
+ * process using it, so an entry written at crash time survives the process without any system
+ * call. It's a ring: the latest entries are kept, the oldest ones are overwritten. Several
+ * processes may share a journal.
+ *
+ * Layout (all integers in the byte order of the writing processes):
+ *  - CrashJournalHeader
+ *  - CrashJournalHeader::numEntries x CrashJournalEntry
+ */
+
+#ifndef CRASHJOURNAL_HPP_
+#define CRASHJOURNAL_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace ooopsi
+{
+
+/// identifies a crash journal (and its version)
+static constexpr char s_CRASH_JOURNAL_MAGIC[8] = { 'O', 'O', 'O', 'P', 'S', 'I', 'J', '1' };
+
+/// maximum number of frames per entry
+static constexpr size_t s_JOURNAL_FRAMES = 128;
+/// maximum number of modules per entry (the ones the frames are located in)
+static constexpr size_t s_JOURNAL_MODULES = 8;
+/// maximum length of the reason text (longer ones are truncated)
+static constexpr size_t s_JOURNAL_REASON_SIZE = 464;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the crash journal requires lock-free 64 bit integers");
+
+/// The start of the file.
+struct CrashJournalHeader
+{
+    /// s_CRASH_JOURNAL_MAGIC
+    char magic[8];
+    /// sizeof(CrashJournalEntry)
+    uint32_t entrySize;
+    /// number of entries in the ring
+    uint32_t numEntries;
+    /// number of entries ever started (the next one goes to 'next % numEntries')
+    std::atomic<uint64_t> next;
+    uint64_t reserved[5];
+};
+
+/// A module that contains some of the frames of an entry.
+struct CrashJournalModule
+{
+    /// the load bias: the module-relative address of a frame is 'address - base'
+    uint64_t base;
+    /// start of the module's mapped memory
+    uint64_t start;
+    /// end of the module's mapped memory
+    uint64_t end;
+    /// the module's file name (NUL-terminated, may be truncated)
+    char name[40];
+};
+
+/// A crash.
+struct CrashJournalEntry
+{
+    /// the number of the entry ('next' when it was started) + 1, set when the entry is complete
+    /// (0: being written, or never written)
+    std::atomic<uint64_t> commit;
+    /// the time of the crash (microseconds since 1970)
+    uint64_t time;
+    /// hash of the module-relative frame addresses (stable across restarts)
+    uint64_t traceId;
+    /// the process ID
+    uint32_t pid;
+    /// the signal number (0: not crashed due to a signal)
+    int32_t signal;
+    /// number of frame addresses
+    uint32_t numFrames;
+    /// number of modules
+    uint32_t numModules;
+    /// length of the reason text
+    uint32_t reasonLength;
+    uint32_t reserved;
+    /// the reason (not NUL-terminated)
+    char reason[s_JOURNAL_REASON_SIZE];
+    /// the modules the frames are located in
+    CrashJournalModule modules[s_JOURNAL_MODULES];
+    /// the frame addresses (return addresses except for the faulting instruction)
+    uint64_t frames[s_JOURNAL_FRAMES];
+};
+
+static_assert(sizeof(CrashJournalHeader) == 64, "unexpected padding");
+static_assert(sizeof(CrashJournalModule) == 64, "unexpected padding");
+static_assert(sizeof(CrashJournalEntry) == 2048, "unexpected padding");
+
+} // namespace ooopsi
+
+#endif /* CRASHJOURNAL_HPP_ */
@@ -0,0 +1,255 @@
+/**
+ * @file    crashrecord.cpp
+ * @brief   writes binary crash records (see crashrecord.hpp)
+ *
+ * The record is assembled in a preallocated buffer and written with a single write() call. Only
+ * signal-safe functions are used, the modules are taken from the (lock-free) module map.
+ */
+
+#include "crashrecord.hpp"
+#include "internal.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+#ifdef OOOPSI_LINUX
+#include <elf.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+namespace ooopsi
+{
+
+/// the file descriptor for crash records (-1: disabled)
+static int s_crashRecordFd = -1;
+
+void setCrashRecordFd(int fd) noexcept
+{
+    s_crashRecordFd = fd >= 0 ? fd : -1;
+    // the records list the modules known at the time of the crash
+    refreshModuleMap();
+}
+
+int getCrashRecordFd() noexcept
+{
+    return s_crashRecordFd;
+}
+
+#ifdef OOOPSI_LINUX
+
+/// the buffer for assembling a record
+static char s_recordBuffer[s_CRASH_RECORD_SIZE];
+/// set while a thread uses s_recordBuffer
+static std::atomic_flag s_recordBufferInUse = ATOMIC_FLAG_INIT;
+
+namespace
+{
+
+/// Appends data to a record.
+class RecordBuilder
+{
+public:
+    RecordBuilder(char* buffer, size_t capacity) noexcept : m_buffer(buffer), m_capacity(capacity)
+    {
+    }
+
+    /// Returns false (and doesn't append anything) if the data doesn't fit.
+    bool append(const void* data, size_t length) noexcept
+    {
+        if (length > m_capacity - m_length)
+        {
+            return false;
+        }
+        memcpy(m_buffer + m_length, data, length);
+        m_length += length;
+        return true;
+    }
+
+    bool append(uint64_t value) noexcept { return append(&value, sizeof(value)); }
+
+    /// Checks whether 'length' more bytes fit.
+    bool fits(size_t length) const noexcept { return length <= m_capacity - m_length; }
+
+    /// the number of bytes that still fit
+    size_t remaining() const noexcept { return m_capacity - m_length; }
+
+    size_t length() const noexcept { return m_length; }
+
+private:
+    char* m_buffer;
+    size_t m_capacity;
+    size_t m_length = 0;
+};
+
+} // namespace
+
+/// Appends the modules of the module map to the record, returns their number.
+static uint32_t addModules(RecordBuilder& builder) noexcept
+{
+    uint32_t numModules = 0;
+    const size_t numSlots = numModuleSlots();
+    for (size_t i = 0; i < numSlots; ++i)
+    {
+        ModuleInfo info;
+        if (!getModule(i, info))
+        {
+            continue;
+        }
+
+        CrashRecordModule module;
+        memset(&module, 0, sizeof(module));
+        module.base = static_cast<uint64_t>(info.base);
+        module.start = static_cast<uint64_t>(info.start);
+        module.end = static_cast<uint64_t>(info.end);
+        module.buildIdLength = info.buildIdLength;
+        module.pathLength = static_cast<uint32_t>(strlen(info.path));
+        if (!builder.fits(sizeof(module) + module.buildIdLength + module.pathLength))
+        {
+            // stop here, the record is full
+            break;
+        }
+        builder.append(&module, sizeof(module));
+        builder.append(info.buildId, module.buildIdLength);
+        builder.append(info.path, module.pathLength);
+        ++numModules;
+    }
+    return numModules;
+}
+
+size_t buildCrashRecord(char* buffer, size_t capacity, const char* reason,
+                        const pointer_t* faultAddr, const SignalDetails* signal) noexcept
+{
+    CrashRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_CRASH_RECORD_MAGIC, sizeof(header.magic));
+#if defined(__x86_64__)
+    header.machine = EM_X86_64;
+#elif defined(__aarch64__)
+    header.machine = EM_AARCH64;
+#elif defined(__i386__)
+    header.machine = EM_386;
+#elif defined(__arm__)
+    header.machine = EM_ARM;
+#endif
+    header.pointerSize = sizeof(pointer_t);
+    header.pid = static_cast<uint32_t>(getpid());
+    header.tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    if (faultAddr != nullptr)
+    {
+        header.faultAddress = reinterpret_cast<uintptr_t>(*faultAddr);
+    }
+
+    if (capacity < sizeof(header))
+    {
+        return 0;
+    }
+    RecordBuilder builder(buffer, capacity);
+    builder.append(&header, sizeof(header));
+    // the counts in the header are set from what was actually appended (truncated if it's full)
+    if (reason != nullptr)
+    {
+        const size_t reasonLength = std::min(strlen(reason), builder.remaining());
+        builder.append(reason, reasonLength);
+        header.reasonLength = static_cast<uint32_t>(reasonLength);
+    }
+
+    // registers of the interrupted context
+    if (signal != nullptr)
+    {
+        header.signal = signal->signal;
+        header.signalCode = signal->code;
+        header.signalAddress = reinterpret_cast<uintptr_t>(signal->address);
+
+        const auto* context = static_cast<const ucontext_t*>(signal->context);
+        if (context != nullptr)
+        {
+            // all registers or none (the reader identifies them by their index)
+#if defined(__x86_64__) || defined(__i386__)
+            if (builder.fits(NGREG * sizeof(uint64_t)))
+            {
+                for (const greg_t reg : context->uc_mcontext.gregs)
+                {
+                    using ureg_t = std::make_unsigned<greg_t>::type;
+                    builder.append(static_cast<uint64_t>(static_cast<ureg_t>(reg)));
+                }
+                header.numRegisters = NGREG;
+            }
+#elif defined(__aarch64__)
+            // x0..x30, sp, pc, pstate
+            if (builder.fits(34 * sizeof(uint64_t)))
+            {
+                for (const auto reg : context->uc_mcontext.regs)
+                {
+                    builder.append(static_cast<uint64_t>(reg));
+                }
+                builder.append(static_cast<uint64_t>(context->uc_mcontext.sp));
+                builder.append(static_cast<uint64_t>(context->uc_mcontext.pc));
+                builder.append(static_cast<uint64_t>(context->uc_mcontext.pstate));
+                header.numRegisters = 34;
+            }
+#endif
+        }
+    }
+
+    pointer_t frames[s_MAX_STACK_FRAMES];
+    // start at the interrupted frame (if any)
+    const size_t numFrames =
+      signal != nullptr && signal->context != nullptr
+        ? captureSignalStack(signal->context, frames, s_MAX_STACK_FRAMES, Unwinder::DEFAULT)
+        : captureStackAddresses(frames, s_MAX_STACK_FRAMES);
+    for (size_t i = 0; i < numFrames; ++i)
+    {
+        if (!builder.append(static_cast<uint64_t>(reinterpret_cast<uintptr_t>(frames[i]))))
+        {
+            break;
+        }
+        ++header.numFrames;
+    }
+
+    header.numModules = addModules(builder);
+
+    // finally, the header is complete
+    header.size = static_cast<uint32_t>(builder.length());
+    memcpy(buffer, &header, sizeof(header));
+    return builder.length();
+}
+
+bool writeCrashRecord(int fd, const char* reason, const pointer_t* faultAddr,
+                      const SignalDetails* signal) noexcept
+{
+    // concurrent crashes: the first one wins, the others wait for the process to exit
+    while (s_recordBufferInUse.test_and_set(std::memory_order_acquire))
+    {
+        sleep(1);
+    }
+
+    const size_t length =
+      buildCrashRecord(s_recordBuffer, sizeof(s_recordBuffer), reason, faultAddr, signal);
+    writeAll(fd, s_recordBuffer, length);
+    s_recordBufferInUse.clear(std::memory_order_release);
+    return true;
+}
+
+#else // !OOOPSI_LINUX
+
+size_t buildCrashRecord(char* /*buffer*/, size_t /*capacity*/, const char* /*reason*/,
+                        const pointer_t* /*faultAddr*/, const SignalDetails* /*signal*/) noexcept
+{
+    // not supported (yet)
+    return 0;
+}
+
+bool writeCrashRecord(int /*fd*/, const char* /*reason*/, const pointer_t* /*faultAddr*/,
+                      const SignalDetails* /*signal*/) noexcept
+{
+    // not supported (yet)
+    return false;
+}
+
+#endif // OOOPSI_LINUX
+
+} // namespace ooopsi
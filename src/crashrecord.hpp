@@ -0,0 +1,86 @@
+/**
+ * @file    crashrecord.hpp
+ * @brief   binary format of crash records
+ *
+ * A crash record is written instead of a symbolized stack trace if enabled (see
+ * setCrashRecordFd()), and turned into the usual text by the offline "ooopsi-symbolize" tool.
+ * Several records may be appended to the same file.
+ *
+ * Layout (all integers in the byte order of the crashed process, no padding between the parts):
+ *  - CrashRecordHeader
+ *  - reason text (CrashRecordHeader::reasonLength bytes, not NUL-terminated)
+ *  - registers (CrashRecordHeader::numRegisters x uint64_t, in the order of the OS's ucontext_t)
+ *  - frame addresses (CrashRecordHeader::numFrames x uint64_t, return addresses except for the
+ *    faulting instruction)
+ *  - modules (CrashRecordHeader::numModules x (CrashRecordModule + build-id + path))
+ */
+
+#ifndef CRASHRECORD_HPP_
+#define CRASHRECORD_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ooopsi
+{
+
+/// maximum size of a record written by the library (limits the number of modules)
+static constexpr size_t s_CRASH_RECORD_SIZE = 64 * 1024;
+
+/// identifies a crash record (and its version)
+static constexpr char s_CRASH_RECORD_MAGIC[8] = { 'O', 'O', 'O', 'P', 'S', 'I', 'C', '1' };
+
+/// The fixed-size start of a crash record.
+struct CrashRecordHeader
+{
+    /// s_CRASH_RECORD_MAGIC
+    char magic[8];
+    /// total size of the record in bytes, including this header
+    uint32_t size;
+    /// ELF machine type of the crashed process (EM_X86_64, EM_AARCH64, ...)
+    uint16_t machine;
+    /// size of a pointer in the crashed process
+    uint16_t pointerSize;
+    /// the signal number (0: not crashed due to a signal)
+    int32_t signal;
+    /// the signal code ('si_code')
+    int32_t signalCode;
+    /// the address reported by the signal ('si_addr')
+    uint64_t signalAddress;
+    /// the address of the faulting instruction (0: unknown)
+    uint64_t faultAddress;
+    /// the process ID
+    uint32_t pid;
+    /// the ID of the crashed thread
+    uint32_t tid;
+    /// length of the reason text
+    uint32_t reasonLength;
+    /// number of saved registers
+    uint32_t numRegisters;
+    /// number of frame addresses
+    uint32_t numFrames;
+    /// number of loaded modules
+    uint32_t numModules;
+};
+
+/// A loaded module, followed by its build-id and path.
+struct CrashRecordModule
+{
+    /// the load bias (added to the module's virtual addresses)
+    uint64_t base;
+    /// start of the module's mapped segments
+    uint64_t start;
+    /// end of the module's mapped segments
+    uint64_t end;
+    /// length of the build-id (0: none)
+    uint32_t buildIdLength;
+    /// length of the module's path (not NUL-terminated)
+    uint32_t pathLength;
+};
+
+static_assert(sizeof(CrashRecordHeader) == 64, "unexpected padding");
+static_assert(sizeof(CrashRecordModule) == 32, "unexpected padding");
+
+} // namespace ooopsi
+
+#endif /* CRASHRECORD_HPP_ */
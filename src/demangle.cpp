@@ -16,6 +16,7 @@
 #include <cxxabi.h>
 #endif
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 
@@ -79,4 +80,65 @@ std::string demangle(const char* symbol)
     return result;
 }
 
+size_t demangle(const char* symbol, char* buffer, size_t bufferSize) noexcept
+{
+    if (buffer == nullptr || bufferSize == 0)
+    {
+        return 0;
+    }
+    buffer[0] = '\0';
+    if (symbol == nullptr)
+    {
+        return 0;
+    }
+
+    size_t length = 0;
+    if (demangleItanium(symbol, buffer, bufferSize, length))
+    {
+        return length;
+    }
+
+#ifdef OOOPSI_MSVC
+    {
+        constexpr DWORD flags = UNDNAME_NO_MS_KEYWORDS | UNDNAME_NO_ACCESS_SPECIFIERS;
+        const std::lock_guard<DbgHelpMutex> lock(s_dbgHelpMutex);
+        const DWORD maxLength = static_cast<DWORD>(std::min<size_t>(bufferSize - 1, MAXDWORD));
+        const DWORD len = UnDecorateSymbolName(symbol, buffer, maxLength, flags);
+        if (len > 0)
+        {
+            buffer[len] = '\0';
+            return len;
+        }
+    }
+#endif // OOOPSI_MSVC
+
+    // may not be C++, but plain C (or not supported) - use the original name
+    length = std::min(strlen(symbol), bufferSize - 1);
+    memcpy(buffer, symbol, length);
+    buffer[length] = '\0';
+    return length;
+}
+
+size_t demangleTypeName(const char* name, char* buffer, size_t bufferSize) noexcept
+{
+#ifndef OOOPSI_MSVC
+    // a class name is mangled like the name of an object: the prefix makes it a complete symbol
+    char symbol[1024];
+    if (name != nullptr && strlen(name) + 3 <= sizeof(symbol))
+    {
+        symbol[0] = '_';
+        symbol[1] = 'Z';
+        strcpy(symbol + 2, name); // flawfinder: ignore (checked above)
+        size_t length = 0;
+        if (buffer != nullptr && bufferSize > 0 &&
+            demangleItanium(symbol, buffer, bufferSize, length))
+        {
+            return length;
+        }
+    }
+#endif // OOOPSI_MSVC
+    // MSVC: the names are readable already
+    return demangle(name, buffer, bufferSize);
+}
+
 } // namespace ooopsi
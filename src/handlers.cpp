@@ -9,33 +9,33 @@
 #include "internal.hpp"
 
 #include <csignal>
+#include <cstdlib>
 #include <cstring>
 #include <system_error>
-#include <tuple> // for std::ignore
 #include <typeinfo>
 
 #ifdef OOOPSI_WINDOWS
 #include <windows.h>
 #endif
 #if defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
+#include <cxxabi.h>
+#include <fcntl.h>
 #include <sys/ucontext.h>
 #endif
 
 namespace ooopsi
 {
 
-/// Demangling is by default disabled in signal handlers: allow to overwrite this.
-static bool s_forceDemangling = false;
+/// print the time the reports took? (see AbortSettings::printStats)
+static bool s_printStats = false;
 
 /// Creates AbortSettings from the current context.
-inline AbortSettings makeSettings(bool inSignalHandler = false) noexcept
+/// Note: Demangling doesn't allocate, so it's enabled in signal handlers, too.
+inline AbortSettings makeSettings() noexcept
 {
     AbortSettings settings;
-#if defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
-    settings.demangleNames = !inSignalHandler || s_forceDemangling;
-#else
-    std::ignore = inSignalHandler;
-#endif
+    settings.format = getCrashReportFormat();
+    settings.printStats = s_printStats;
     return settings;
 }
 
@@ -47,6 +47,28 @@ static constexpr DWORD s_SEH_CPP_EXCEPTION = 0xE06D7363;
 /// The g++ runtime has a different code...
 static constexpr DWORD s_MINGW_CPP_EXCEPTION = 0x20474343;
 
+/// the stack of the thread that reports a stack overflow
+static constexpr SIZE_T s_OVERFLOW_REPORT_STACK_SIZE = 256 * 1024;
+/// the thread whose stack overflowed (set before the reporting thread is started)
+static DWORD s_overflowingThread = 0;
+
+/**
+ * Reports a stack overflow: runs on a new thread, since only a few pages are left on the
+ * overflowing one. The exception's context is unwound (up to the bounds of the BoundedTrace).
+ * @param[in] param     the EXCEPTION_POINTERS of the overflowing thread (which waits)
+ */
+static DWORD WINAPI reportStackOverflow(LPVOID param)
+{
+    const auto* excInfo = static_cast<const EXCEPTION_POINTERS*>(param);
+    SignalDetails signal;
+    signal.signal = static_cast<int>(excInfo->ExceptionRecord->ExceptionCode);
+    signal.context = excInfo;
+    signal.threadId = s_overflowingThread;
+    abort(REASON_PREFIX "SEGMENTATION FAULT (stack overflow)", makeSettings(),
+          reinterpret_cast<const pointer_t*>(&excInfo->ExceptionRecord->ExceptionAddress),
+          &signal);
+}
+
 /**
  * Handler for Windows SEH exceptions.
  * @param[in] excInfo      information about the current exception
@@ -84,6 +106,8 @@ static LONG WINAPI onWindowsException(EXCEPTION_POINTERS* excInfo)
         }
 #endif
 
+        // vectored handlers are called before unwinding: this is still the throw site
+        recordThrowSite(nullptr, nullptr);
         // let onTerminate() handle it
         return EXCEPTION_CONTINUE_SEARCH;
 
@@ -144,8 +168,8 @@ static LONG WINAPI onWindowsException(EXCEPTION_POINTERS* excInfo)
             // the second element contains the virtual address of the inaccessible data
             // the third element contains the underlying NTSTATUS code that caused the exception
             addr = reinterpret_cast<const pointer_t*>(&excRec.ExceptionInformation[1]);
-            uint64_t status = excRec.ExceptionInformation[2];
-            snprintf(detailBuf, sizeof(detailBuf), "NTSTATUS=%" PRIu64, status);
+            const uint64_t status = excRec.ExceptionInformation[2];
+            LineFormatter(detailBuf).append("NTSTATUS=").appendDecimal(status);
             details = detailBuf;
         }
         break;
@@ -174,15 +198,29 @@ static LONG WINAPI onWindowsException(EXCEPTION_POINTERS* excInfo)
         break;
     }
 
-    // only print a back trace if the stack didn't overflow... (we would only make it worse)
     if (excRec.ExceptionCode != EXCEPTION_STACK_OVERFLOW)
     {
         char reason[256];
         formatReason(reason, exceptionType, details, addr);
-        abort(reason, makeSettings(), reinterpret_cast<const pointer_t*>(&excRec.ExceptionAddress));
+        SignalDetails signal;
+        signal.signal = static_cast<int>(excRec.ExceptionCode);
+        signal.address = addr != nullptr ? *addr : nullptr;
+        signal.context = excInfo;
+        abort(reason, makeSettings(), reinterpret_cast<const pointer_t*>(&excRec.ExceptionAddress),
+              &signal);
     }
     else
     {
+        // the report would overflow the stack again: let another thread print it
+        s_overflowingThread = GetCurrentThreadId();
+        HANDLE reporter = CreateThread(nullptr, s_OVERFLOW_REPORT_STACK_SIZE, reportStackOverflow,
+                                       excInfo, STACK_SIZE_PARAM_IS_A_RESERVATION, nullptr);
+        if (reporter != nullptr)
+        {
+            // the reporter ends the process
+            WaitForSingleObject(reporter, INFINITE);
+        }
+        // no thread: at least print the reason (without a trace, we would only make it worse)
         AbortSettings settings;
         settings.printStackTrace = false;
         abort(REASON_PREFIX "SEGMENTATION FAULT (stack overflow)", settings);
@@ -208,7 +246,7 @@ static LONG WINAPI onWindowsException(EXCEPTION_POINTERS* excInfo)
         break;
     default:
         // should not happen, but let's handle it
-        snprintf(buf, sizeof(buf), "unexpected signal %d", sig);
+        LineFormatter(buf).append("unexpected signal ").appendDecimal(static_cast<unsigned>(sig));
         errorType = buf;
         break;
     }
@@ -228,9 +266,6 @@ static LONG WINAPI onWindowsException(EXCEPTION_POINTERS* excInfo)
 
 #else // !OOOPSI_WINDOWS
 
-/// for systems supporting it, statically reserve it as an actual stack
-static std::array<uint8_t, s_ALT_STACK_SIZE> s_ALT_STACK;
-
 /**
  * Signal handler implementation for Linux.
  * @param[in] sig       the signal number
@@ -277,29 +312,6 @@ static std::array<uint8_t, s_ALT_STACK_SIZE> s_ALT_STACK;
         {
         case SEGV_MAPERR:
             detail = "address not mapped to object";
-            // may be a stack overflow...
-            if (context != nullptr)
-            {
-                // Let's try to distinguish the usual "segmentation fault" from a
-                // "stack overflow": Check if the address causing the fault is "slightly"
-                // past the end of the stack.
-#ifdef OOOPSI_MAC
-#ifdef OOOPSI_MAC_ARM
-                auto stackPtr = static_cast<uintptr_t>(context->uc_mcontext->__ss.__pc);
-#else
-                auto stackPtr = static_cast<uintptr_t>(context->uc_mcontext->__ss.__rip);
-#endif
-
-#else
-                auto stackPtr = static_cast<uintptr_t>(context->uc_mcontext.gregs[REG_RSP]);
-#endif
-                auto stackAddr = reinterpret_cast<uintptr_t>(info->si_addr);
-                constexpr auto rangeLimit = 2048u;
-                if (stackPtr - stackAddr < rangeLimit)
-                {
-                    detail = "stack overflow";
-                }
-            }
             break;
         case SEGV_ACCERR:
             detail = "invalid permissions for mapped object";
@@ -317,6 +329,29 @@ static std::array<uint8_t, s_ALT_STACK_SIZE> s_ALT_STACK;
         default:
             break;
         }
+        // may be a stack overflow (hitting an unmapped page or a guard page of a thread)...
+        if (context != nullptr && (info->si_code == SEGV_MAPERR || info->si_code == SEGV_ACCERR))
+        {
+            // Let's try to distinguish the usual "segmentation fault" from a
+            // "stack overflow": Check if the address causing the fault is "slightly"
+            // past the end of the stack.
+#ifdef OOOPSI_MAC
+#ifdef OOOPSI_MAC_ARM
+            auto stackPtr = static_cast<uintptr_t>(context->uc_mcontext->__ss.__pc);
+#else
+            auto stackPtr = static_cast<uintptr_t>(context->uc_mcontext->__ss.__rip);
+#endif
+
+#else
+            auto stackPtr = static_cast<uintptr_t>(context->uc_mcontext.gregs[REG_RSP]);
+#endif
+            auto stackAddr = reinterpret_cast<uintptr_t>(info->si_addr);
+            constexpr auto rangeLimit = 2048u;
+            if (stackPtr - stackAddr < rangeLimit)
+            {
+                detail = "stack overflow";
+            }
+        }
         addr = reinterpret_cast<const pointer_t*>(&info->si_addr);
         break;
     }
@@ -421,7 +456,7 @@ static std::array<uint8_t, s_ALT_STACK_SIZE> s_ALT_STACK;
     default:
     {
         // should not happen, but let's handle it
-        snprintf(buf, sizeof(buf), "unexpected signal %d", sig);
+        LineFormatter(buf).append("unexpected signal ").appendDecimal(static_cast<unsigned>(sig));
         what = buf;
         break;
     }
@@ -429,8 +464,12 @@ static std::array<uint8_t, s_ALT_STACK_SIZE> s_ALT_STACK;
 
     char reason[256];
     formatReason(reason, what, detail, addr);
-    constexpr bool inSigHandler = true;
-    abort(reason, makeSettings(inSigHandler), faultAddr);
+    SignalDetails details;
+    details.signal = sig;
+    details.code = info->si_code;
+    details.address = info->si_addr;
+    details.context = ctx;
+    abort(reason, makeSettings(), faultAddr, &details);
 }
 #endif // OOOPSI_WINDOWS
 
@@ -445,7 +484,11 @@ static std::array<uint8_t, s_ALT_STACK_SIZE> s_ALT_STACK;
     if (currentException)
     {
         const char* const what = "std::terminate()";
-        char detail[256];
+        // messages may be long: the buffers are taken from the crash arena (not from the heap)
+        char detailFallback[256];
+        size_t detailSize = 0;
+        char* detailBuffer = allocCrashBuffer(4096, detailFallback, detailSize);
+        LineFormatter detail(detailBuffer, detailSize);
         // if there is a current exception, re-throw it to handle it's type properly
         try
         {
@@ -456,17 +499,26 @@ static std::array<uint8_t, s_ALT_STACK_SIZE> s_ALT_STACK;
         {
             // indicate the exception's type
             const std::error_code& err = exc.code();
-            snprintf(detail, sizeof(detail), "std::system_error: \"%s\" (%s:%d)",
-                     err.message().c_str(), err.category().name(), err.value());
+            detail.append("std::system_error: \"").append(err.message().c_str()).append("\" (");
+            detail.append(err.category().name()).append(':');
+            const int64_t value = err.value();
+            if (value < 0)
+            {
+                detail.append('-');
+            }
+            detail.appendDecimal(static_cast<uint64_t>(value < 0 ? -value : value)).append(')');
         }
         // catch-all for all standard exceptions
         catch (const std::exception& exc)
         {
             // demangle the exception class name
-            std::string className = demangle(typeid(exc).name());
+            char classFallback[128];
+            size_t classSize = 0;
+            char* className = allocCrashBuffer(1024, classFallback, classSize);
+            demangleTypeName(typeid(exc).name(), className, classSize);
 
             // format the exception's type and error message
-            snprintf(detail, sizeof(detail), "%s: \"%s\"", className.c_str(), exc.what());
+            detail.append(className).append(": \"").append(exc.what()).append('"');
         }
         // handle strings (should not be used, but who knows...)
         catch (const char* err)
@@ -477,17 +529,27 @@ static std::array<uint8_t, s_ALT_STACK_SIZE> s_ALT_STACK;
             }
 
             // indicate the exception's type
-            snprintf(detail, sizeof(detail), "exception (const char*): \"%s\"", err);
+            detail.append("exception (const char*): \"").append(err).append('"');
         }
         // anything else
         catch (...)
         {
-            strncpy(detail, "unknown exception", sizeof(detail));
+            detail.append("unknown exception");
         }
 
-        char reason[256];
-        formatReason(reason, what, detail, nullptr);
-        abort(reason);
+        char reasonFallback[256];
+        size_t reasonSize = 0;
+        char* reason = allocCrashBuffer(detailSize + 64, reasonFallback, reasonSize);
+        formatReason(reason, reasonSize, what, detail.c_str(), nullptr);
+
+        // print the throw site as well (if captured)
+        const std::type_info* type = nullptr;
+#if defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
+        type = abi::__cxa_current_exception_type();
+#endif
+        ThrowSite site;
+        const bool haveSite = getThrowSite(type, site);
+        abort(reason, makeSettings(), nullptr, nullptr, haveSite ? &site : nullptr);
     }
     else
     {
@@ -560,19 +622,109 @@ HandlerSetup::HandlerSetup() noexcept
     {
         return;
     }
-    // allow to enable demangling even when dumping from a signal handler
-    opt = getenv("OOOPSI_FORCE_DEMANGLE"); // flawfinder: ignore
+
+    if (s_handlersRegistered)
+    {
+        return;
+    }
+    s_handlersRegistered = true;
+
+#ifdef OOOPSI_LINUX
+    // allow to write crash records without changing the application
+    opt = getenv("OOOPSI_CRASH_RECORD"); // flawfinder: ignore
+    if (opt != nullptr && opt[0] != '\0' && getCrashRecordFd() < 0)
+    {
+        const int fd = open(opt, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0)
+        {
+            setCrashRecordFd(fd);
+        }
+    }
+#endif // OOOPSI_LINUX
+
+    // reserve the emergency memory for reporting crashes
+    opt = getenv("OOOPSI_CRASH_ARENA_SIZE"); // flawfinder: ignore
+    setCrashArenaSize(opt != nullptr && opt[0] != '\0'
+                        ? static_cast<size_t>(strtoul(opt, nullptr, 10))
+                        : s_DEFAULT_CRASH_ARENA_SIZE);
+
+    // allow to write crash dumps without changing the application
+    opt = getenv("OOOPSI_CRASH_DUMP"); // flawfinder: ignore
+    if (opt != nullptr && opt[0] != '\0' && getCrashDumpSettings().path == nullptr)
+    {
+        CrashDumpSettings settings;
+        settings.path = opt;
+        setCrashDumpSettings(settings);
+    }
+
+    // allow to keep a journal of crashes without changing the application
+    opt = getenv("OOOPSI_CRASH_JOURNAL"); // flawfinder: ignore
+    if (opt != nullptr && opt[0] != '\0' && getCrashJournalSettings().path == nullptr)
+    {
+        CrashJournalSettings settings;
+        settings.path = opt;
+        setCrashJournalSettings(settings);
+    }
+
+    // allow to capture throw sites without changing the application
+    opt = getenv("OOOPSI_THROW_TRACES"); // flawfinder: ignore
+    if (opt != nullptr && opt[0] != '\0')
+    {
+        ThrowTraceSettings settings;
+        settings.sampleInterval = static_cast<unsigned>(strtoul(opt, nullptr, 10));
+        setThrowTraceSettings(settings);
+    }
+
+    // allow to report crashes in a forked process without changing the application
+    opt = getenv("OOOPSI_FORKED_REPORTS"); // flawfinder: ignore
+    if (opt != nullptr && strcmp(opt, "1") == 0)
+    {
+        setForkedCrashReports(true);
+    }
+
+    // allow structured reports without changing the application
+    opt = getenv("OOOPSI_LOG_FORMAT"); // flawfinder: ignore
+    if (opt != nullptr && strcmp(opt, "json") == 0)
+    {
+        setCrashReportFormat(LogFormat::JSON);
+    }
+    else if (opt != nullptr && strcmp(opt, "binary") == 0)
+    {
+        setCrashReportFormat(LogFormat::BINARY);
+    }
+
+    // allow to measure the reports without changing the application
+    opt = getenv("OOOPSI_PRINT_STATS"); // flawfinder: ignore
     if (opt != nullptr && strcmp(opt, "1") == 0)
     {
-        s_forceDemangling = true;
+        s_printStats = true;
     }
 
+    // allow to dump all threads without changing the application
+    opt = getenv("OOOPSI_DUMP_THREADS"); // flawfinder: ignore
+    if (opt != nullptr && strcmp(opt, "1") == 0)
+    {
+        setThreadDumpSettings(ThreadDumpSettings());
+    }
 
-    if (s_handlersRegistered)
+    // allow signal-safe frame pointer walks on this thread
+    prepareFramePointerWalk();
+    // take the first snapshot of the loaded modules
+    refreshModuleMap();
+
+    // allow to print source lines (in crash reports, too) without changing the application
+    setLineIndexCacheDir(getenv("OOOPSI_LINE_CACHE")); // flawfinder: ignore
+    opt = getenv("OOOPSI_SOURCE_LINES");               // flawfinder: ignore
+    if (opt != nullptr && strcmp(opt, "1") == 0)
     {
-        return;
+        prepareSourceLines();
+    }
+    // same for the symbol index
+    opt = getenv("OOOPSI_SYMBOL_INDEX"); // flawfinder: ignore
+    if (opt != nullptr && strcmp(opt, "1") == 0)
+    {
+        prepareSymbolIndexes();
     }
-    s_handlersRegistered = true;
 
     {
         // catch std::terminate
@@ -599,18 +751,18 @@ HandlerSetup::HandlerSetup() noexcept
         abort(messageBuffer, makeSettings());
     };
 
-    // use an alternate stack in case we have a stack overflow!
+    // use an alternate stack in case we have a stack overflow - one per thread!
     {
-        stack_t altStack;
-        altStack.ss_flags = 0;
-        static_assert(s_ALT_STACK_SIZE >= MINSIGSTKSZ,
-                      "Not fulfilling the system's minimum requirement!");
-        altStack.ss_size = s_ALT_STACK.size();
-        altStack.ss_sp = s_ALT_STACK.data();
-        if (sigaltstack(&altStack, nullptr) != 0)
+        opt = getenv("OOOPSI_ALT_STACK_SIZE"); // flawfinder: ignore
+        if (opt != nullptr && opt[0] != '\0')
+        {
+            setAltStackSize(static_cast<size_t>(strtoul(opt, nullptr, 10)));
+        }
+        if (!installAltStack())
         {
-            err("sigaltstack", s_ALT_STACK_SIZE);
+            err("sigaltstack", static_cast<int>(getAltStackSize()));
         }
+        enableAltStacksForNewThreads();
     }
 
     // catch fatal signals
@@ -0,0 +1,138 @@
+/**
+ * @file    indexedsymbols.cpp
+ * @brief   symbol lookups through the symbol indexes of the modules (Linux only)
+ *
+ * The symbol index of a module (see symbolindex.hpp) is built by prepareSymbolIndexes(), or when
+ * it's needed for the first time afterwards (outside of crash reports): from the module's own file
+ * or from a separate debug file with a matching build-id in /usr/lib/debug, whichever has more
+ * symbols (a stripped module only has its exported functions). The finished index is kept in a
+ * read-only mapping for the rest of the process' lifetime, so lookups are lock-free binary
+ * searches, in the crash reports as well. Modules without an index are resolved by libunwind.
+ */
+
+#include "internal.hpp"
+#include "symbolindex.hpp"
+
+#include <atomic>
+
+namespace ooopsi
+{
+
+#ifdef OOOPSI_LINUX
+
+static_assert(ATOMIC_POINTER_LOCK_FREE == 2, "the symbol indexes require lock-free pointers");
+
+/// the symbol index per module slot (nullptr: not built yet)
+static std::atomic<const char*> s_symbolIndexes[s_MAX_MODULES];
+/// marks modules without symbols
+static const char s_NO_SYMBOL_INDEX = '\0';
+/// guards building the indexes
+static std::mutex s_symbolIndexMutex;
+/// build the indexes of new modules when needed? (set by prepareSymbolIndexes())
+static std::atomic<bool> s_symbolIndexesEnabled{ false };
+
+/// Creates the index for a module, returns &s_NO_SYMBOL_INDEX on failure.
+static const char* loadSymbolIndex(const ModuleInfo& module)
+{
+    std::vector<char> index;
+    if (module.path[0] == '\0' || !buildIndexFromFile(module.path, buildSymbolIndex, index))
+    {
+        index.clear();
+    }
+    const std::string debugPath = debugFilePath(module);
+    std::vector<char> debugIndex;
+    if (!debugPath.empty() && buildIndexFromFile(debugPath, buildSymbolIndex, debugIndex) &&
+        (index.empty() || numIndexedSymbols(debugIndex.data()) > numIndexedSymbols(index.data())))
+    {
+        index.swap(debugIndex);
+    }
+    if (index.empty())
+    {
+        return &s_NO_SYMBOL_INDEX;
+    }
+    const char* mapped = mapIndex(index);
+    return mapped != nullptr ? mapped : &s_NO_SYMBOL_INDEX;
+}
+
+/// Returns the index of a module slot (building it if requested), nullptr if not available.
+static const char* getSymbolIndex(size_t slot, const ModuleInfo& module, bool load) noexcept
+{
+    const char* index = s_symbolIndexes[slot].load(std::memory_order_acquire);
+    if (index == nullptr && load)
+    {
+        try
+        {
+            const std::lock_guard<std::mutex> lock(s_symbolIndexMutex);
+            index = s_symbolIndexes[slot].load(std::memory_order_acquire);
+            if (index == nullptr)
+            {
+                index = loadSymbolIndex(module);
+                s_symbolIndexes[slot].store(index, std::memory_order_release);
+            }
+        }
+        catch (...)
+        {
+            // out of memory: try again next time
+            return nullptr;
+        }
+    }
+    return index != &s_NO_SYMBOL_INDEX ? index : nullptr;
+}
+
+const char* lookupIndexedSymbol(pointer_t address, bool load, uint64_t& offset) noexcept
+{
+    ModuleInfo module;
+    size_t slot = 0;
+    if (!findModule(address, module, &slot))
+    {
+        return nullptr;
+    }
+    load = load && s_symbolIndexesEnabled.load(std::memory_order_relaxed);
+    const char* index = getSymbolIndex(slot, module, load);
+    if (index == nullptr)
+    {
+        return nullptr;
+    }
+    // look up the call instruction (a return address may be the end of a noreturn function)
+    const uint64_t relative = reinterpret_cast<uintptr_t>(address) - module.base;
+    uint64_t start = 0;
+    const char* name = lookupSymbol(index, relative > 0 ? relative - 1 : 0, start);
+    if (name != nullptr)
+    {
+        offset = relative - start;
+    }
+    return name;
+}
+
+size_t prepareSymbolIndexes() noexcept
+{
+    s_symbolIndexesEnabled.store(true, std::memory_order_relaxed);
+    refreshModuleMap();
+    size_t numIndexed = 0;
+    ModuleInfo module;
+    for (size_t i = 0; i < numModuleSlots(); ++i)
+    {
+        if (getModule(i, module) && getSymbolIndex(i, module, true) != nullptr)
+        {
+            ++numIndexed;
+        }
+    }
+    return numIndexed;
+}
+
+#else // !OOOPSI_LINUX
+
+const char* lookupIndexedSymbol(pointer_t /*address*/, bool /*load*/, uint64_t& /*offset*/) noexcept
+{
+    // DbgHelp (Windows) and libunwind (macOS) are used instead
+    return nullptr;
+}
+
+size_t prepareSymbolIndexes() noexcept
+{
+    return 0;
+}
+
+#endif // OOOPSI_LINUX
+
+} // namespace ooopsi
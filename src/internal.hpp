@@ -6,6 +6,7 @@
 #ifndef INTERNAL_HPP_
 #define INTERNAL_HPP_
 
+#include "lineindex.hpp"
 #include "ooopsi.hpp"
 
 #include <array>
@@ -13,7 +14,10 @@
 #include <cstdint>
 #include <cstring>
 #include <mutex>
+#include <string>
 #include <tuple> // for std::ignore
+#include <typeinfo>
+#include <vector>
 
 /*
  * OS detection
@@ -62,45 +66,754 @@
 namespace ooopsi
 {
 
-/// reserve 16KB alternate stack, allowing to put some text buffers on it
-#ifdef OOOPSI_MAC
+/// reserve 32KB alternate stacks by default, allowing to put some text buffers (and the
+/// demangler) on it
 static constexpr size_t s_ALT_STACK_SIZE = 32 * 1024;
-#else
-static constexpr size_t s_ALT_STACK_SIZE = 16 * 1024;
-#endif
+
+/// size of the crash arena reserved by HandlerSetup (see setCrashArenaSize())
+static constexpr size_t s_DEFAULT_CRASH_ARENA_SIZE = 256 * 1024;
 
 /// limits the length of the trace
 static constexpr size_t s_MAX_STACK_FRAMES = 128;
 
+/// maximum number of modules (loaded and unloaded ones) during the process' lifetime
+static constexpr size_t s_MAX_MODULES = 1024;
+
+
+/**
+ * Sends the lines of the output to the destination selected by the LogSettings: either line by
+ * line to a LogFunc, or collected in a preallocated buffer that is passed to a LogBlockFunc or
+ * written to a file descriptor at once.
+ * The buffer is shared by all threads: if it's in use (or full), the output is passed on in several
+ * blocks.
+ */
+class LogWriter
+{
+public:
+    explicit LogWriter(const LogSettings& settings) noexcept;
+    ~LogWriter();
+
+    LogWriter(const LogWriter&) = delete;
+    LogWriter& operator=(const LogWriter&) = delete;
+
+    /// Adds a line (without trailing '\n').
+    void line(const char* text) noexcept;
+
+    /// Adds raw data (e.g. binary), which isn't followed by a '\n'. Ignored if the destination is a
+    /// log function (see acceptsBlocks()).
+    void block(const char* data, size_t length) noexcept;
+
+    /// Can the destination take raw data? (a log function only takes NUL-terminated lines)
+    bool acceptsBlocks() const noexcept { return m_logFunc == nullptr; }
+
+    /// Ends the output: flushes the buffer or calls the log function with nullptr.
+    /// No more lines may be added afterwards.
+    void finish() noexcept;
+
+private:
+    /// Appends to the buffer (or passes on right away if there's none).
+    void append(const char* data, size_t length, bool newline) noexcept;
+
+    /// Passes a block of text to the destination.
+    void emit(const char* text, size_t length) noexcept;
+
+    LogFunc m_logFunc = nullptr;
+    LogBlockFunc m_logBlockFunc = nullptr;
+    int m_fd = -1;
+    /// the shared buffer (nullptr: not buffered or in use by another thread)
+    char* m_buffer = nullptr;
+    size_t m_length = 0;
+    bool m_finished = false;
+};
+
+/// Prints a stack trace using a LogWriter, the output isn't finished.
+/// The source lines are only loaded if 'loadLines' is set (see logFrame()).
+void printStackTrace(LogWriter& writer, const LogSettings& settings, const pointer_t* faultAddr,
+                     bool loadLines = false);
+
+/// Logs a line of a stack trace.
+///
+/// @param[in] writer       the destination
+/// @param[in] num          the frame's number
+/// @param[in] address      the frame's address
+/// @param[in] sym          the frame's symbol (nullptr: unknown)
+/// @param[in] offset       offset of 'address' relative to the symbol
+/// @param[in] faultAddr    address of the fault (highlighted if it's the frame's address)
+/// @param[in] printModule  append the module and the module-relative address?
+/// @param[in] loadLines    build the module's line index if needed? (not signal-safe, otherwise
+///                         the source line is only appended if the index exists already)
+void logFrame(LogWriter& writer, uint64_t num, pointer_t address, const char* sym, uint64_t offset,
+              const pointer_t* faultAddr, bool printModule, bool loadLines = false);
+
+/// Writes all data to the file descriptor, retrying on interruptions and partial writes.
+/// Errors are ignored.
+void writeAll(int fd, const char* data, size_t length) noexcept;
+
+/// Details about the signal that caused the program termination.
+struct SignalDetails
+{
+    /// the signal number
+    int signal = 0;
+    /// the signal code ('si_code')
+    int code = 0;
+    /// the address reported by the signal ('si_addr')
+    pointer_t address = nullptr;
+    /// the interrupted context (ucontext_t, EXCEPTION_POINTERS on Windows)
+    const void* context = nullptr;
+    /// the interrupted thread, if the report runs on another one (Windows only, 0: the current)
+    uint64_t threadId = 0;
+};
+
+/// Writes a binary crash record (see crashrecord.hpp) to the given file descriptor.
+/// This function is signal-safe (as far as possible).
+///
+/// @param[in] fd           the file descriptor to write to
+/// @param[in] reason       the reason for the program termination (may be nullptr)
+/// @param[in] faultAddr    address of the faulting instruction (may be nullptr)
+/// @param[in] signal       details about the signal (nullptr: not terminated due to a signal)
+/// @return false if crash records aren't supported on this platform
+bool writeCrashRecord(int fd, const char* reason, const pointer_t* faultAddr,
+                      const SignalDetails* signal) noexcept;
+
+/// Assembles a binary crash record (as written by writeCrashRecord()) in the given buffer.
+/// This function is signal-safe (as far as possible).
+///
+/// @param[out] buffer      receives the record (the modules that don't fit are omitted)
+/// @param[in]  capacity    size of 'buffer' in bytes
+/// @param[in]  reason      the reason for the program termination (may be nullptr)
+/// @param[in]  faultAddr   address of the faulting instruction (may be nullptr)
+/// @param[in]  signal      details about the signal (nullptr: not terminated due to a signal)
+/// @return the length of the record (0: not supported on this platform)
+size_t buildCrashRecord(char* buffer, size_t capacity, const char* reason,
+                        const pointer_t* faultAddr, const SignalDetails* signal) noexcept;
+
+/// Adds an entry to the crash journal mapped by setCrashJournalSettings() (if enabled).
+/// This function is signal-safe and doesn't make any system calls (except for the clock).
+///
+/// @param[in] reason       the reason for the program termination (may be nullptr)
+/// @param[in] signal       details about the signal (nullptr: not terminated due to a signal)
+void writeCrashJournal(const char* reason, const SignalDetails* signal) noexcept;
+
+/// Writes a crash dump to the file prepared by setCrashDumpSettings() (if enabled).
+/// This function is signal-safe (as far as possible).
+///
+/// @param[in] reason       the reason for the program termination (may be nullptr)
+/// @param[in] faultAddr    address of the faulting instruction (may be nullptr)
+/// @param[in] signal       details about the signal, including the interrupted context
+/// @return the path of the written dump (nullptr: disabled or failed)
+const char* writeCrashDump(const char* reason, const pointer_t* faultAddr,
+                           const SignalDetails& signal) noexcept;
+
+/// The stack trace captured when an exception was thrown.
+struct ThrowSite
+{
+    /// the frame addresses, starting with the throw site
+    const pointer_t* frames = nullptr;
+    /// number of elements in 'frames'
+    size_t numFrames = 0;
+};
 
 /// Extension of the public abort() function with an optional address that caused the fault.
 /// The address will be used to highlight the according backtrace line.
-[[noreturn]] void abort(const char* reason, AbortSettings settings, const pointer_t* faultAddr);
+/// The signal details are stored in crash records (if enabled), the throw site is printed before
+/// the backtrace.
+[[noreturn]] void abort(const char* reason, AbortSettings settings, const pointer_t* faultAddr,
+                        const SignalDetails* signal = nullptr,
+                        const ThrowSite* throwSite = nullptr);
+
+/// Lets only one thread report the termination of the program: The first caller returns true,
+/// all later callers are parked forever, since the process is about to exit. If the reporting
+/// thread itself crashes while reporting, it returns false.
+/// This function is signal-safe.
+bool enterCrashGate() noexcept;
+
+/// Makes the current thread the reporting one (see enterCrashGate()), in a process that was
+/// forked by the reporting thread. This function is signal-safe.
+void adoptCrashGate() noexcept;
+
+/// Returns an ID of the current thread (never 0), the kernel's thread ID on Linux.
+/// This function is signal-safe.
+uint64_t currentThreadId() noexcept;
+
+/// Checks whether the current thread is the one reporting the termination (see enterCrashGate()).
+/// This function is signal-safe.
+bool isReportingThread() noexcept;
+
+/// The counters of getStats().
+enum class Stat
+{
+    TRACES,
+    FRAMES,
+    CACHE_HITS,
+    CACHE_MISSES,
+    UNWIND_NANOSECONDS,
+    SYMBOLIZE_NANOSECONDS,
+    DEMANGLE_NANOSECONDS,
+    LOG_NANOSECONDS,
+    COUNT
+};
+
+/// Adds to a counter (relaxed). This function is lock-free and signal-safe.
+void addStat(Stat which, uint64_t value) noexcept;
+
+/// Counts a stack walk (see getStats()).
+inline void countTrace(uint64_t numFrames) noexcept
+{
+    addStat(Stat::TRACES, 1);
+    addStat(Stat::FRAMES, numFrames);
+}
+
+/// Returns the time for the counters in nanoseconds (of a monotonic clock).
+/// This function is signal-safe.
+uint64_t statNanoseconds() noexcept;
+
+/// Adds the lifetime of the object to a time counter.
+class StatTimer
+{
+public:
+    explicit StatTimer(Stat which) noexcept
+      : m_which(which)
+      , m_start(statNanoseconds())
+    {
+    }
+
+    ~StatTimer() { addStat(m_which, statNanoseconds() - m_start); }
+
+    StatTimer(const StatTimer&) = delete;
+    StatTimer& operator=(const StatTimer&) = delete;
+
+private:
+    const Stat m_which;
+    const uint64_t m_start;
+};
+
+/// Prints a line with the counters that changed since 'before' (see AbortSettings::printStats).
+/// This function is signal-safe.
+void printStats(LogWriter& writer, const Stats& before) noexcept;
+
+/// Allocates memory from the crash arena (see setCrashArenaSize()), which is never freed.
+/// This function is lock-free and signal-safe.
+///
+/// @return the memory (aligned like malloc()) or nullptr if the arena is exhausted or disabled
+void* crashAlloc(size_t size) noexcept;
+
+/// Takes a buffer from the crash arena, or uses the given array if the arena is exhausted.
+///
+/// @param[in]  size        the preferred size in bytes
+/// @param[in]  fallback    the array to use instead
+/// @param[out] actualSize  the size of the returned buffer
+template <size_t N>
+char* allocCrashBuffer(size_t size, char (&fallback)[N], size_t& actualSize) noexcept
+{
+    auto* buffer = static_cast<char*>(crashAlloc(size));
+    actualSize = buffer != nullptr ? size : N;
+    return buffer != nullptr ? buffer : fallback;
+}
+
+/// The reusable buffers of the crash arena.
+enum class CrashScratch
+{
+    /// a mangled symbol name
+    SYMBOL,
+    /// a demangled symbol name
+    DEMANGLED,
+    /// a line of output
+    LINE,
+    COUNT
+};
+
+/// Returns a reusable scratch buffer from the crash arena. Each buffer is allocated by the first
+/// call and exclusively used by the reporting thread, other threads get nullptr.
+/// This function is signal-safe.
+///
+/// @param[in]  which   the buffer
+/// @param[out] size    size of the buffer in bytes
+/// @return the buffer or nullptr (not the reporting thread, or the arena is exhausted)
+char* getCrashScratch(CrashScratch which, size_t& size) noexcept;
+
+/// Prints the breadcrumbs of all threads (see breadcrumb()), unless there are none.
+/// This function is signal-safe.
+void printBreadcrumbs(LogWriter& writer) noexcept;
+
+/// Prints the stacks of all threads except the current one (if enabled by
+/// setThreadDumpSettings()). This function is signal-safe (as far as possible).
+///
+/// @param[in] writer       the destination
+/// @param[in] settings     controls demangling etc.
+void dumpOtherThreads(LogWriter& writer, const LogSettings& settings) noexcept;
+
+/// Prints a titled list of frames using a LogWriter (the format of printStackTrace()).
+///
+/// @param[in] writer       the destination
+/// @param[in] settings     controls demangling etc.
+/// @param[in] title        the first line
+/// @param[in] addresses    the frame addresses
+/// @param[in] numAddresses number of elements in 'addresses'
+/// @param[in] faultAddr    address of the fault (may be nullptr)
+/// @param[in] truncated    indicate that more frames were omitted?
+/// @param[in] loadLines    build the line indexes if needed? (see logFrame())
+void printAddresses(LogWriter& writer, const LogSettings& settings, const char* title,
+                    const pointer_t* addresses, size_t numAddresses, const pointer_t* faultAddr,
+                    bool truncated, bool loadLines = false);
+
+/// Captures the stack of an exception that is being thrown on the current thread, if enabled and
+/// sampled (see setThrowTraceSettings()). Doesn't allocate.
+///
+/// @param[in] type     the exception's type (nullptr: unknown)
+/// @param[in] caller   the return address into the throwing function: frames up to it are skipped
+///                     (nullptr: keep all frames)
+void recordThrowSite(const std::type_info* type, pointer_t caller) noexcept;
+
+/// Returns the stack captured for the last exception thrown on the current thread.
+///
+/// @param[in]  type    the expected type of the exception (nullptr: don't check)
+/// @param[out] site    the stack trace
+/// @return false if the last exception wasn't captured (or has a different type)
+bool getThrowSite(const std::type_info* type, ThrowSite& site) noexcept;
+
+/// An entry of the process-wide symbol cache.
+struct CachedSymbol
+{
+    /// start address of the symbol
+    pointer_t start = nullptr;
+    /// mangled symbol name
+    const char* mangled = nullptr;
+    /// demangled symbol name
+    const char* demangled = nullptr;
+};
+
+/// Looks up a previously resolved address in the symbol cache.
+/// This function is lock-free and doesn't allocate, so it's safe to use in signal handlers.
+///
+/// @param[in]  address     the address as passed to cacheSymbol()
+/// @param[out] result      the cached symbol (the names are valid until the process ends)
+/// @return true if found
+bool lookupCachedSymbol(pointer_t address, CachedSymbol& result) noexcept;
+
+/// Adds a resolved address to the symbol cache. Silently ignored if the cache is full.
+///
+/// @param[in]  address     the resolved address
+/// @param[in]  start       start address of the symbol containing 'address'
+/// @param[in]  mangled     the mangled symbol name
+/// @param[in]  demangled   the demangled symbol name
+void cacheSymbol(pointer_t address, pointer_t start, const char* mangled,
+                 const char* demangled) noexcept;
+
+/// A loaded module (executable or shared library) in the process-wide module map.
+struct ModuleInfo
+{
+    /// the load bias (Linux) or base address (Windows): the module-relative address of a code
+    /// address (e.g. for addr2line) is 'address - base'
+    uintptr_t base = 0;
+    /// start of the module's mapped memory
+    uintptr_t start = 0;
+    /// end of the module's mapped memory
+    uintptr_t end = 0;
+    /// the module's path (valid until the process ends)
+    const char* path = "";
+    /// GNU build-id (Linux) or CodeView GUID + age (Windows)
+    const uint8_t* buildId = nullptr;
+    /// length of 'buildId' (0: none)
+    uint32_t buildIdLength = 0;
+};
+
+/// Updates the module map, which is cheap if no modules were loaded or unloaded in the meantime.
+/// Called by HandlerSetup and by the entry points that symbolize outside of crash reports (e.g.
+/// collectStackTrace()). Not signal-safe.
+void refreshModuleMap() noexcept;
+
+/// Returns the number of slots in the module map, including the ones of unloaded modules.
+/// This function is lock-free and doesn't allocate, so it's safe to use in signal handlers (same
+/// for getModule() and findModule()).
+size_t numModuleSlots() noexcept;
+
+/// Returns the module in the given slot.
+///
+/// @param[in]  index   the slot (< numModuleSlots())
+/// @param[out] info    the module
+/// @return false if the module has been unloaded
+bool getModule(size_t index, ModuleInfo& info) noexcept;
+
+/// Looks up the loaded module that contains the given address.
+///
+/// @param[in]  address     the address to look up
+/// @param[out] info        the module
+/// @param[out] index       if not nullptr, receives the module's slot
+/// @return true if found
+bool findModule(pointer_t address, ModuleInfo& info, size_t* index = nullptr) noexcept;
+
+/// Returns the file name of the module (without the directory).
+const char* moduleName(const ModuleInfo& info) noexcept;
+
+/// Looks up the source file and line of a code address. On Linux, the line index of the
+/// address' module is used (see prepareSourceLines()), on Windows the PDB (via DbgHelp).
+/// Without 'load', this function is lock-free and doesn't allocate on Linux, i.e. modules whose
+/// index hasn't been built yet are skipped.
+///
+/// @param[in]  address     the exact address of an instruction (i.e. not a return address)
+/// @param[in]  load        build the module's index if needed? (not signal-safe)
+/// @param[out] location    the location (the file name is valid until the index is released,
+///                         i.e. the end of the process on Linux, the next call on Windows)
+/// @return true if found
+bool lookupSourceLine(pointer_t address, bool load, SourceLocation& location) noexcept;
+
+/// Sets the directory to persist line indexes in (Linux only, nullptr: don't persist).
+/// Called by HandlerSetup.
+void setLineIndexCacheDir(const char* dir) noexcept;
+
+#ifdef OOOPSI_LINUX
+/// Builds an index from the contents of an ELF file (e.g. buildLineIndex()).
+typedef bool (*BuildIndexFunc)(const char* image, size_t size, std::vector<char>& index);
+
+/// Builds an index of an ELF file, which is mapped meanwhile.
+bool buildIndexFromFile(const std::string& path, BuildIndexFunc build, std::vector<char>& index);
+
+/// Returns the path of a module's separate debug file in /usr/lib/debug (like GDB looks for
+/// them), or an empty string if the module has no build-id.
+std::string debugFilePath(const ModuleInfo& module);
+
+/// Copies an index to a read-only anonymous mapping, returns nullptr on failure.
+const char* mapIndex(const std::vector<char>& index);
+#endif // OOOPSI_LINUX
+
+/// Looks up the function that contains a code address in the symbol index of its module (see
+/// prepareSymbolIndexes()). Without 'load', this function is lock-free and doesn't allocate, i.e.
+/// modules whose index hasn't been built yet are skipped.
+///
+/// @param[in]  address     the address to look up (a return address, except for the fault)
+/// @param[in]  load        build the module's index if needed? (not signal-safe)
+/// @param[out] offset      offset of 'address' relative to the start of the function
+/// @return the (mangled) name, valid until the process ends, or nullptr if not found
+const char* lookupIndexedSymbol(pointer_t address, bool load, uint64_t& offset) noexcept;
+
+/// Demangles a name according to the Itanium C++ ABI, without allocating any memory (i.e. it's safe
+/// to use in signal handlers). The output matches the one of abi::__cxa_demangle().
+/// Names that aren't mangled or use unsupported parts of the grammar are rejected.
+///
+/// @param[in]  symbol      the mangled name (starting with "_Z")
+/// @param[out] buffer      receives the demangled name (truncated if it doesn't fit)
+/// @param[in]  bufferSize  size of 'buffer' in bytes, including the NUL terminator
+/// @param[out] length      length of the demangled name in 'buffer'
+/// @return true if the name could be demangled (otherwise 'buffer' contains garbage)
+bool demangleItanium(const char* symbol, char* buffer, size_t bufferSize, size_t& length) noexcept;
+
+/// Demangles a type name as returned by std::type_info::name() (classes only on Linux and macOS)
+/// without allocating any memory. Names that can't be demangled are copied as they are.
+///
+/// @param[in]  name        the type name
+/// @param[out] buffer      receives the demangled name (truncated if it doesn't fit)
+/// @param[in]  bufferSize  size of 'buffer' in bytes, including the NUL terminator
+/// @return the length of the name in 'buffer'
+size_t demangleTypeName(const char* name, char* buffer, size_t bufferSize) noexcept;
+
+/// Installs an alternate signal stack for every thread that is created from now on (Linux only).
+/// Called by HandlerSetup.
+void enableAltStacksForNewThreads() noexcept;
+
+/// Queries the current thread's stack range for Unwinder::FRAME_POINTER, which isn't signal-safe
+/// on all platforms. Subsequent walks on this thread use the cached range.
+void prepareFramePointerWalk() noexcept;
+
+/// number of frames (or collapsed cycles) kept from the top of a BoundedTrace
+static constexpr size_t s_TRACE_HEAD_FRAMES = 64;
+/// number of frames kept from the bottom of a BoundedTrace
+static constexpr size_t s_TRACE_TAIL_FRAMES = 32;
+/// longest sequence of frames that is collapsed if it repeats (recursion)
+static constexpr size_t s_MAX_CYCLE_FRAMES = 8;
+/// a BoundedTrace stops the walk after this number of frames...
+static constexpr uint64_t s_MAX_TRACE_STEPS = 1024 * 1024;
+/// ... or after this time (in milliseconds)
+static constexpr unsigned s_MAX_TRACE_MILLISECONDS = 1000;
+
+/**
+ * Keeps the interesting parts of an arbitrarily deep stack in fixed buffers: the first frames,
+ * with repeated cycles of up to s_MAX_CYCLE_FRAMES frames (recursion) collapsed into a single
+ * entry while the frames are added, and the last frames (the thread's entry point). The frames in
+ * between are only counted. The walk is bounded by a maximum number of frames and a deadline.
+ * This class is signal-safe.
+ */
+class BoundedTrace
+{
+public:
+    /// An entry of the head: a frame, or a cycle of the frames right before it.
+    struct Entry
+    {
+        /// the frame's address (nullptr: a cycle)
+        pointer_t address;
+        /// the frame's number (cycle: the number of its first frame)
+        uint64_t num;
+        /// cycle: number of frames in the cycle
+        size_t cycleLength;
+        /// cycle: number of repetitions (including the first one, which is kept as frames)
+        uint64_t repeats;
+    };
+
+    BoundedTrace() noexcept;
+
+    /// Adds the next frame of the walk.
+    /// @return false if the walk should stop (too many frames or too long)
+    bool add(pointer_t address) noexcept;
+
+    /// Ends the walk: closes a pending cycle.
+    /// @param[in] truncated    the walk was stopped before the end of the stack?
+    void finish(bool truncated = false) noexcept;
+
+    /// the number of frames added
+    uint64_t numFrames() const noexcept { return m_numFrames; }
+    /// the head entries
+    const Entry* head() const noexcept { return m_head; }
+    size_t numHead() const noexcept { return m_numHead; }
+    /// the number of frames between the head and the tail that were dropped
+    uint64_t numSkipped() const noexcept
+    {
+        return m_numTail > s_TRACE_TAIL_FRAMES ? m_numTail - s_TRACE_TAIL_FRAMES : 0;
+    }
+    /// the number of the first frame that was dropped (if numSkipped() > 0)
+    uint64_t firstSkipped() const noexcept { return m_firstTailNum; }
+    /// the tail frames (oldest first), 'i' < numTail()
+    size_t numTail() const noexcept;
+    const Entry& tail(size_t i) const noexcept;
+    /// the walk was stopped before the end of the stack?
+    bool truncated() const noexcept { return m_truncated; }
+
+private:
+    /// Appends a frame to the head, or to the tail if the head is full.
+    void push(pointer_t address, uint64_t num) noexcept;
+    /// Checks whether the last frames of the head repeat the frames before them.
+    void detectCycle() noexcept;
+    /// Replaces the pending cycle by an entry (and its partial last repetition by frames).
+    void closeCycle() noexcept;
+
+    Entry m_head[s_TRACE_HEAD_FRAMES];
+    size_t m_numHead = 0;
+    /// the first head entry that may start a cycle (the ones before belong to a cycle)
+    size_t m_cycleCandidate = 0;
+    /// the pending cycle: its first frame in m_head, its length (0: none), etc.
+    size_t m_cycleStart = 0;
+    size_t m_cycleLength = 0;
+    size_t m_cyclePos = 0;
+    uint64_t m_cycleRepeats = 0;
+
+    /// the ring of the last frames
+    Entry m_tail[s_TRACE_TAIL_FRAMES];
+    uint64_t m_numTail = 0;
+    uint64_t m_firstTailNum = 0;
+
+    uint64_t m_numFrames = 0;
+    /// when the walk has to stop (in milliseconds of a steady clock)
+    uint64_t m_deadline;
+    bool m_truncated = false;
+};
+
+/// Captures the stack of the code interrupted by a signal, like captureSignalStack(), but without
+/// limiting it to s_MAX_STACK_FRAMES: deep stacks (e.g. stack overflows) are collapsed by the
+/// BoundedTrace. The walk also stops when it leaves the thread's stack (if known already).
+///
+/// @param[in]  context      the ucontext_t passed to the signal handler (Windows: the
+///                          EXCEPTION_POINTERS passed to the exception handler)
+/// @param[out] trace        receives the frames (finish() is called)
+/// @param[in]  unwinder     the method to walk the stack
+void captureSignalStack(const void* context, BoundedTrace& trace, Unwinder unwinder) noexcept;
+
+/// Prints a BoundedTrace using a LogWriter (in the format of printAddresses()).
+///
+/// @param[in] writer       the destination
+/// @param[in] settings     controls demangling etc.
+/// @param[in] title        the first line
+/// @param[in] trace        the frames
+/// @param[in] faultAddr    address of the fault (may be nullptr)
+void printBoundedTrace(LogWriter& writer, const LogSettings& settings, const char* title,
+                       const BoundedTrace& trace, const pointer_t* faultAddr) noexcept;
+
+/// The contents of a structured report (see writeStructuredReport()).
+struct StructuredReport
+{
+    /// the reason for the program termination (may be nullptr)
+    const char* reason = nullptr;
+    /// address of the faulting instruction (may be nullptr)
+    const pointer_t* faultAddr = nullptr;
+    /// details about the signal (nullptr: not terminated due to a signal)
+    const SignalDetails* signal = nullptr;
+    /// the path of the crash dump (may be nullptr)
+    const char* dumpPath = nullptr;
+    /// a crash record was written (instead of symbolizing the frames)?
+    bool recordWritten = false;
+    /// the frames of a signal's context (nullptr: see 'addresses')
+    const BoundedTrace* trace = nullptr;
+    /// the frames of the current stack
+    const pointer_t* addresses = nullptr;
+    size_t numAddresses = 0;
+    /// the current stack is (probably) truncated?
+    bool truncated = false;
+};
+
+/// Writes a report in the structured format of the settings (see structuredlog.hpp) using a
+/// LogWriter: a single line with a JSON object, or a single block with a protobuf message. It's
+/// composed in a single pass in a fixed buffer. This function is signal-safe (as far as possible).
+///
+/// @param[in] writer       the destination
+/// @param[in] settings     the format, demangling etc.
+/// @param[in] report       the contents
+/// @param[in] loadLines    build the line indexes if needed? (see logFrame())
+void writeStructuredReport(LogWriter& writer, const LogSettings& settings,
+                           const StructuredReport& report, bool loadLines = false) noexcept;
+
+/**
+ * Composes a NUL-terminated line in a fixed-size character array, replacing snprintf() and
+ * strncat() on the hot and signal paths: it keeps a write cursor (so nothing is ever rescanned),
+ * formats numbers by hand (no locale, no stdio) and silently truncates at the end of the array.
+ * This class is signal-safe.
+ */
+class LineFormatter
+{
+public:
+    template <size_t N>
+    explicit LineFormatter(char (&buffer)[N]) noexcept
+      : m_begin(buffer)
+      , m_cur(buffer)
+      , m_end(buffer + N - 1)
+    {
+        static_assert(N > 0, "the buffer needs space for the NUL terminator");
+        *m_cur = '\0';
+    }
+
+    /// Uses a buffer with a size that is known at runtime only (e.g. from the crash arena). An empty
+    /// buffer (size 0) is never written, the line stays "" then.
+    LineFormatter(char* buffer, size_t size) noexcept
+      : m_begin(size > 0 ? buffer : &m_empty)
+      , m_cur(m_begin)
+      , m_end(size > 0 ? buffer + size - 1 : &m_empty)
+    {
+        *m_cur = '\0';
+    }
+
+    LineFormatter(const LineFormatter&) = delete;
+    LineFormatter& operator=(const LineFormatter&) = delete;
+
+    /// Appends a string (nullptr is ignored).
+    LineFormatter& append(const char* text) noexcept
+    {
+        if (text != nullptr)
+        {
+            while (*text != '\0' && m_cur != m_end)
+            {
+                *m_cur++ = *text++;
+            }
+            *m_cur = '\0';
+        }
+        return *this;
+    }
+
+    /// Appends a single character.
+    LineFormatter& append(char c) noexcept
+    {
+        if (m_cur != m_end)
+        {
+            *m_cur++ = c;
+            *m_cur = '\0';
+        }
+        return *this;
+    }
+
+    /// Appends a number in decimal notation.
+    LineFormatter& appendDecimal(uint64_t value) noexcept
+    {
+        char digits[20];
+        size_t n = 0;
+        do
+        {
+            digits[n++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+        while (n > 0)
+        {
+            append(digits[--n]);
+        }
+        return *this;
+    }
+
+    /// Appends a number in lowercase hexadecimal notation (without "0x" and leading '0's).
+    LineFormatter& appendHex(uint64_t value) noexcept
+    {
+        int shift = 60;
+        while (shift > 0 && (value >> shift) == 0)
+        {
+            shift -= 4;
+        }
+        for (; shift >= 0; shift -= 4)
+        {
+            append("0123456789abcdef"[(value >> shift) & 0xF]);
+        }
+        return *this;
+    }
+
+    /// Appends an address as "0x" followed by the hexadecimal value.
+    LineFormatter& appendAddress(const void* address) noexcept
+    {
+        return append("0x").appendHex(reinterpret_cast<uintptr_t>(address));
+    }
+
+    /// Appends spaces until the line has the given length (i.e. left-aligns the last items).
+    LineFormatter& padTo(size_t length) noexcept
+    {
+        while (size() < length && m_cur != m_end)
+        {
+            append(' ');
+        }
+        return *this;
+    }
+
+    /// the line (always NUL-terminated)
+    const char* c_str() const noexcept { return m_begin; }
+
+    /// length of the line
+    size_t size() const noexcept { return static_cast<size_t>(m_cur - m_begin); }
+
+private:
+    char* m_begin;
+    char* m_cur;
+    /// the position of the last NUL terminator
+    char* m_end;
+    /// the line of an empty buffer
+    char m_empty = '\0';
+};
 
 /// define the error string prefix as a macro to allow composing compile-time messages
 #define REASON_PREFIX "!!! TERMINATING DUE TO "
 
 /// Formats a string containing the abort reason
-template <size_t N>
-void formatReason(char (&buffer)[N], const char* what, const char* detail = nullptr,
-                  const pointer_t* addr = nullptr)
+inline void formatReason(char* buffer, size_t size, const char* what, const char* detail = nullptr,
+                         const pointer_t* addr = nullptr) noexcept
 {
-    snprintf(buffer, N, REASON_PREFIX "%s", what);
+    LineFormatter line(buffer, size);
+    line.append(REASON_PREFIX).append(what);
     if (detail)
     {
-        size_t len = strlen(buffer);
-        snprintf(buffer + len, N - len, " (%s)", detail);
+        line.append(" (").append(detail).append(')');
     }
     if (addr)
     {
-        size_t len = strlen(buffer);
-        // avoid padding '0's here, format as non-pointer
-        uintptr_t myaddr = reinterpret_cast<uintptr_t>(*addr);
-        snprintf(buffer + len, N - len, " @ 0x%" PRIxPTR, myaddr);
+        // avoid padding '0's here
+        line.append(" @ ").appendAddress(*addr);
     }
 }
 
+/// Formats a string containing the abort reason (into an array)
+template <size_t N>
+void formatReason(char (&buffer)[N], const char* what, const char* detail = nullptr,
+                  const pointer_t* addr = nullptr) noexcept
+{
+    formatReason(buffer, N, what, detail, addr);
+}
+
 #ifdef OOOPSI_WINDOWS
+/// DLL load/unload notifications (not declared in the SDK headers, see
+/// https://docs.microsoft.com/en-us/windows/win32/devnotes/ldrregisterdllnotification)
+typedef VOID(CALLBACK* DllNotificationFunc)(ULONG reason, const void* data, PVOID context);
+typedef LONG(NTAPI* LdrRegisterDllNotificationFunc)(ULONG flags, DllNotificationFunc func,
+                                                     PVOID context, PVOID* cookie);
+typedef LONG(NTAPI* LdrUnregisterDllNotificationFunc)(PVOID cookie);
+
 #if defined(OOOPSI_MINGW) && !defined(_GLIBCXX_HAS_GTHREADS)
 // MinGW without thread support: create a small wrapper as a workaround
 class DbgHelpMutex
@@ -129,6 +842,27 @@ using DbgHelpMutex = std::recursive_mutex;
  */
 extern DbgHelpMutex s_dbgHelpMutex;
 
+/**
+ * Prepares the process-wide DbgHelp session: It's initialized once (without loading any symbols)
+ * and kept alive until the library is unloaded. Modules are registered lazily and refreshed after
+ * DLLs were loaded or unloaded, symbols are loaded on demand.
+ * Note: the caller must hold s_dbgHelpMutex.
+ *
+ * @return true if the DbgHelp functions (e.g. SymFromAddr) can be used
+ */
+bool prepareDbgHelp() noexcept;
+
+#if defined(_M_X64) || defined(__x86_64__)
+/// Suspends another thread and walks its stack (x64 only). Doesn't allocate, since the thread
+/// might hold the heap lock.
+///
+/// @param[in]  thread      the thread (needs THREAD_SUSPEND_RESUME and THREAD_GET_CONTEXT access)
+/// @param[out] frames      buffer that will be filled with frame addresses
+/// @param[in]  maxFrames   maximum number of addresses to store in 'frames'
+/// @return number of actually stored addresses in 'frames'
+size_t captureThreadStack(HANDLE thread, pointer_t* frames, size_t maxFrames) noexcept;
+#endif
+
 #endif
 
 } // namespace ooopsi
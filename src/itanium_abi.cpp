@@ -39,4 +39,25 @@ void __cxxabiv1::__cxa_deleted_virtual()
     ooopsi::abort(reason);
 }
 
+#ifdef OOOPSI_LINUX
+#include <dlfcn.h>
+
+/// This function is called by every throw expression: capture the throw site (if enabled) and
+/// forward to the C++ runtime's implementation.
+void __cxxabiv1::__cxa_throw(void* object, std::type_info* type, void (*destructor)(void*))
+{
+    ooopsi::recordThrowSite(type, __builtin_return_address(0));
+
+    using CxaThrowFunc = void (*)(void*, std::type_info*, void (*)(void*));
+    static const auto s_cxaThrow =
+      reinterpret_cast<CxaThrowFunc>(dlsym(RTLD_NEXT, "__cxa_throw"));
+    if (s_cxaThrow != nullptr)
+    {
+        s_cxaThrow(object, type, destructor);
+    }
+    // not reached unless the C++ runtime is linked statically
+    ooopsi::abort(REASON_PREFIX "std::terminate() (__cxa_throw not found)");
+}
+#endif // OOOPSI_LINUX
+
 #endif // OOOPSI_LINUX || OOOPSI_MAC
@@ -0,0 +1,2373 @@
+/**
+ * @file    itanium_demangle.cpp
+ * @brief   allocation-free demangler for names mangled according to the Itanium C++ ABI
+ *
+ * The mangled name is parsed into a tree of small nodes (following the grammar and the
+ * substitution rules of the ABI), which is printed into the caller's buffer afterwards. All storage
+ * is reserved up front on the stack and nothing is ever allocated, so it's safe to use in signal
+ * handlers. The output is the same as the one of abi::__cxa_demangle() from libstdc++.
+ *
+ * Only the parts of the grammar that show up in stack traces are supported: names containing
+ * expressions (e.g. decltype() or SFINAE return types), floating point literals and some other
+ * exotic constructs are rejected, the caller has to fall back to the mangled name in this case.
+ */
+
+#include "internal.hpp"
+
+#include <cstring>
+
+namespace ooopsi
+{
+
+/// maximum number of nodes per name
+static constexpr size_t s_DEMANGLE_MAX_NODES = 512;
+/// maximum number of substitution candidates per name
+static constexpr size_t s_DEMANGLE_MAX_SUBS = 128;
+/// maximum number of template arguments of the current template
+static constexpr size_t s_DEMANGLE_MAX_PARAMS = 64;
+/// maximum nesting level while parsing and printing (limits the stack usage)
+static constexpr unsigned s_DEMANGLE_MAX_DEPTH = 64;
+/// maximum number of nodes visited while printing (limits the run time for pathological input)
+static constexpr size_t s_DEMANGLE_MAX_STEPS = 64 * 1024;
+/// maximum value of any number in the mangled name (that we care about)
+static constexpr size_t s_DEMANGLE_MAX_NUMBER = 0xF000;
+
+namespace
+{
+
+/// node index, 0 is used as "none"
+using NodeId = uint16_t;
+
+/// node types (the meaning of the node's members is documented per kind)
+enum class Kind : uint8_t
+{
+    SOURCE,         ///< identifier from the mangled name: a=offset, b=length
+    TEXT,           ///< fixed text: a=Text
+    STD,            ///< standard substitution: a=index in s_stdSubstitutions, flags=1: expanded
+    OPERATOR,       ///< operator name: a=index in s_operators
+    CONVERSION,     ///< conversion operator: a=type
+    LITERAL_OP,     ///< literal operator: a=identifier
+    CTOR_DTOR,      ///< constructor or destructor: a=class name, flags=1: destructor
+    ABI_TAG,        ///< a=name, b=tag
+    LAMBDA,         ///< closure type: a=parameter list, b=number
+    UNNAMED,        ///< unnamed type: b=number
+    TEMPLATE_PARAM, ///< (auto) template parameter of a generic lambda: b=index, or a substituted
+                    ///< template parameter: flags=1, a=resolved type, b=index
+    NESTED,         ///< qualified name: a=scope, b=name
+    TEMPLATE,       ///< template-id: a=name, b=argument list
+    LIST,           ///< list element: a=value, b=next element
+    QUAL,           ///< cv-qualified type: a=type, flags=qualifiers
+    POINTER,        ///< a=pointee
+    LREF,           ///< lvalue reference: a=referenced type
+    RREF,           ///< rvalue reference: a=referenced type
+    POSTFIX,        ///< type with a suffix (_Complex etc.): a=type, b=Text
+    VECTOR,         ///< vendor vector type: a=element type, b=dimension
+    ARRAY,          ///< a=element type, b=dimension (or none)
+    MEMBER_PTR,     ///< pointer to member: a=class type, b=member type
+    FUNCTION,       ///< function type: a=return type (or none), b=parameter list, flags=qualifiers
+    ENCODING,       ///< function name + signature: a=name, b=FUNCTION
+    ARG_PACK,       ///< template argument pack: a=argument list
+    PARAM_PACK,     ///< template parameter (that refers to an argument pack): a=argument list
+    EXPANSION,      ///< pack expansion: a=pattern
+    LITERAL,        ///< literal template argument: a=type, b=value (or none), flags=1: negative
+    SPECIAL,        ///< special name (vtable etc.): a=Text, b=name
+    CTOR_VTABLE,    ///< construction vtable: a=base class, b=derived class
+    CLONE,          ///< function clone: a=encoding, b=suffix
+};
+
+/// qualifiers of QUAL and FUNCTION nodes
+enum Qualifier : uint8_t
+{
+    QUAL_CONST = 1,
+    QUAL_VOLATILE = 2,
+    QUAL_RESTRICT = 4,
+    QUAL_LVALUE_REF = 8,
+    QUAL_RVALUE_REF = 16,
+    QUAL_NOEXCEPT = 32,
+};
+
+/// A node of the parsed name.
+struct Node
+{
+    Kind kind;
+    uint8_t flags;
+    uint16_t a;
+    uint16_t b;
+};
+
+/// all fixed strings (for TEXT nodes)
+enum Text : uint16_t
+{
+    TEXT_STD,
+    TEXT_ANONYMOUS_NAMESPACE,
+    TEXT_STRING_LITERAL,
+    TEXT_VOID,
+    TEXT_WCHAR,
+    TEXT_BOOL,
+    TEXT_CHAR,
+    TEXT_SIGNED_CHAR,
+    TEXT_UNSIGNED_CHAR,
+    TEXT_SHORT,
+    TEXT_UNSIGNED_SHORT,
+    TEXT_INT,
+    TEXT_UNSIGNED_INT,
+    TEXT_LONG,
+    TEXT_UNSIGNED_LONG,
+    TEXT_LONG_LONG,
+    TEXT_UNSIGNED_LONG_LONG,
+    TEXT_INT128,
+    TEXT_UNSIGNED_INT128,
+    TEXT_FLOAT,
+    TEXT_DOUBLE,
+    TEXT_LONG_DOUBLE,
+    TEXT_FLOAT128,
+    TEXT_ELLIPSIS,
+    TEXT_DECIMAL32,
+    TEXT_DECIMAL64,
+    TEXT_DECIMAL128,
+    TEXT_HALF,
+    TEXT_CHAR8,
+    TEXT_CHAR16,
+    TEXT_CHAR32,
+    TEXT_AUTO,
+    TEXT_DECLTYPE_AUTO,
+    TEXT_NULLPTR,
+    TEXT_COMPLEX,
+    TEXT_IMAGINARY,
+    TEXT_VTABLE,
+    TEXT_VTT,
+    TEXT_TYPEINFO,
+    TEXT_TYPEINFO_NAME,
+    TEXT_NON_VIRTUAL_THUNK,
+    TEXT_VIRTUAL_THUNK,
+    TEXT_COVARIANT_THUNK,
+    TEXT_GUARD_VARIABLE,
+    TEXT_TLS_WRAPPER,
+    TEXT_TLS_INIT,
+    TEXT_TRANSACTION_CLONE,
+    TEXT_NON_TRANSACTION_CLONE,
+    TEXT_COUNT
+};
+
+static const char* const s_texts[] = {
+    "std",
+    "(anonymous namespace)",
+    "string literal",
+    "void",
+    "wchar_t",
+    "bool",
+    "char",
+    "signed char",
+    "unsigned char",
+    "short",
+    "unsigned short",
+    "int",
+    "unsigned int",
+    "long",
+    "unsigned long",
+    "long long",
+    "unsigned long long",
+    "__int128",
+    "unsigned __int128",
+    "float",
+    "double",
+    "long double",
+    "__float128",
+    "...",
+    "decimal32",
+    "decimal64",
+    "decimal128",
+    "half",
+    "char8_t",
+    "char16_t",
+    "char32_t",
+    "auto",
+    "decltype(auto)",
+    "decltype(nullptr)",
+    " _Complex",
+    " _Imaginary",
+    "vtable for ",
+    "VTT for ",
+    "typeinfo for ",
+    "typeinfo name for ",
+    "non-virtual thunk to ",
+    "virtual thunk to ",
+    "covariant return thunk to ",
+    "guard variable for ",
+    "TLS wrapper function for ",
+    "TLS init function for ",
+    "transaction clone for ",
+    "non-transaction clone for ",
+};
+static_assert(sizeof(s_texts) / sizeof(s_texts[0]) == TEXT_COUNT, "s_texts is incomplete");
+
+/// An operator name.
+struct OperatorInfo
+{
+    /// the mangled code
+    char code[3];
+    /// the printed name
+    const char* name;
+};
+
+static const OperatorInfo s_operators[] = {
+    { "nw", "new" },   { "na", "new[]" }, { "dl", "delete" }, { "da", "delete[]" },
+    { "aw", "co_await" }, { "ps", "+" },  { "ng", "-" },      { "ad", "&" },
+    { "de", "*" },     { "co", "~" },     { "pl", "+" },      { "mi", "-" },
+    { "ml", "*" },     { "dv", "/" },     { "rm", "%" },      { "an", "&" },
+    { "or", "|" },     { "eo", "^" },     { "aS", "=" },      { "pL", "+=" },
+    { "mI", "-=" },    { "mL", "*=" },    { "dV", "/=" },     { "rM", "%=" },
+    { "aN", "&=" },    { "oR", "|=" },    { "eO", "^=" },     { "ls", "<<" },
+    { "rs", ">>" },    { "lS", "<<=" },   { "rS", ">>=" },    { "eq", "==" },
+    { "ne", "!=" },    { "lt", "<" },     { "gt", ">" },      { "le", "<=" },
+    { "ge", ">=" },    { "ss", "<=>" },   { "nt", "!" },      { "aa", "&&" },
+    { "oo", "||" },    { "pp", "++" },    { "mm", "--" },     { "cm", "," },
+    { "pm", "->*" },   { "pt", "->" },    { "cl", "()" },     { "ix", "[]" },
+    { "qu", "?" },     { "st", "sizeof" }, { "sz", "sizeof" }, { "at", "alignof" },
+    { "az", "alignof" },
+};
+
+/// A standard substitution (Sa, Ss etc.).
+struct StdSubstitution
+{
+    /// the mangled code (following the 'S')
+    char code;
+    /// the printed name
+    const char* name;
+    /// the expanded name (used as the scope of constructors and destructors)
+    const char* expanded;
+    /// the name of constructors and destructors
+    const char* baseName;
+};
+
+static const StdSubstitution s_stdSubstitutions[] = {
+    { 'a', "std::allocator", "std::allocator", "allocator" },
+    { 'b', "std::basic_string", "std::basic_string", "basic_string" },
+    { 's', "std::string",
+      "std::basic_string<char, std::char_traits<char>, std::allocator<char> >", "basic_string" },
+    { 'i', "std::istream", "std::basic_istream<char, std::char_traits<char> >", "basic_istream" },
+    { 'o', "std::ostream", "std::basic_ostream<char, std::char_traits<char> >", "basic_ostream" },
+    { 'd', "std::iostream", "std::basic_iostream<char, std::char_traits<char> >",
+      "basic_iostream" },
+};
+
+static bool isDigit(char c) noexcept
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool isLower(char c) noexcept
+{
+    return c >= 'a' && c <= 'z';
+}
+
+static bool isUpper(char c) noexcept
+{
+    return c >= 'A' && c <= 'Z';
+}
+
+/// Maps the code of a single-letter builtin type to its name.
+static bool builtinType(char code, Text& text) noexcept
+{
+    switch (code)
+    {
+    case 'v': text = TEXT_VOID; return true;
+    case 'w': text = TEXT_WCHAR; return true;
+    case 'b': text = TEXT_BOOL; return true;
+    case 'c': text = TEXT_CHAR; return true;
+    case 'a': text = TEXT_SIGNED_CHAR; return true;
+    case 'h': text = TEXT_UNSIGNED_CHAR; return true;
+    case 's': text = TEXT_SHORT; return true;
+    case 't': text = TEXT_UNSIGNED_SHORT; return true;
+    case 'i': text = TEXT_INT; return true;
+    case 'j': text = TEXT_UNSIGNED_INT; return true;
+    case 'l': text = TEXT_LONG; return true;
+    case 'm': text = TEXT_UNSIGNED_LONG; return true;
+    case 'x': text = TEXT_LONG_LONG; return true;
+    case 'y': text = TEXT_UNSIGNED_LONG_LONG; return true;
+    case 'n': text = TEXT_INT128; return true;
+    case 'o': text = TEXT_UNSIGNED_INT128; return true;
+    case 'f': text = TEXT_FLOAT; return true;
+    case 'd': text = TEXT_DOUBLE; return true;
+    case 'e': text = TEXT_LONG_DOUBLE; return true;
+    case 'g': text = TEXT_FLOAT128; return true;
+    case 'z': text = TEXT_ELLIPSIS; return true;
+    default: return false;
+    }
+}
+
+/// Maps the code of a builtin type starting with 'D' to its name.
+static bool builtinTypeD(char code, Text& text) noexcept
+{
+    switch (code)
+    {
+    case 'f': text = TEXT_DECIMAL32; return true;
+    case 'd': text = TEXT_DECIMAL64; return true;
+    case 'e': text = TEXT_DECIMAL128; return true;
+    case 'h': text = TEXT_HALF; return true;
+    case 'u': text = TEXT_CHAR8; return true;
+    case 's': text = TEXT_CHAR16; return true;
+    case 'i': text = TEXT_CHAR32; return true;
+    case 'a': text = TEXT_AUTO; return true;
+    case 'c': text = TEXT_DECLTYPE_AUTO; return true;
+    case 'n': text = TEXT_NULLPTR; return true;
+    default: return false;
+    }
+}
+
+/// Properties of a name, collected while parsing an <encoding>.
+struct NameState
+{
+    /// the name ends with template arguments (i.e. the function's return type is mangled)
+    bool endsWithTemplateArgs = false;
+    /// the name is a constructor, destructor or conversion operator
+    bool ctorDtorConversion = false;
+    /// cv- and ref-qualifiers of a member function
+    uint8_t qualifiers = 0;
+};
+
+/// Increments a nesting counter for the lifetime of the object.
+class DepthGuard
+{
+public:
+    explicit DepthGuard(unsigned& depth) noexcept : m_depth(depth) { ++m_depth; }
+    ~DepthGuard() { --m_depth; }
+
+    DepthGuard(const DepthGuard&) = delete;
+    DepthGuard& operator=(const DepthGuard&) = delete;
+
+    /// nested too deep?
+    bool exceeded() const noexcept { return m_depth > s_DEMANGLE_MAX_DEPTH; }
+
+private:
+    unsigned& m_depth;
+};
+
+/// Parses a mangled name into a tree of nodes.
+class Demangler
+{
+public:
+    Demangler(const char* mangled, size_t length) noexcept : m_str(mangled), m_len(length) {}
+
+    Demangler(const Demangler&) = delete;
+    Demangler& operator=(const Demangler&) = delete;
+
+    /// Parses the complete name, returns the root node (or 0 if the name isn't supported).
+    NodeId parse() noexcept
+    {
+        if (m_len < 2 || m_str[0] != '_' || m_str[1] != 'Z')
+        {
+            return 0;
+        }
+        m_pos = 2;
+        NodeId root = parseEncoding();
+
+        // GCC appends suffixes for cloned functions, e.g. ".constprop.0" or ".cold"
+        while (root != 0 && look() == '.' &&
+               (isLower(look(1)) || isDigit(look(1)) || look(1) == '_'))
+        {
+            const size_t start = m_pos;
+            m_pos += 2;
+            while (isLower(look()) || isDigit(look()) || look() == '_')
+            {
+                ++m_pos;
+            }
+            while (look() == '.' && isDigit(look(1)))
+            {
+                m_pos += 2;
+                while (isDigit(look()))
+                {
+                    ++m_pos;
+                }
+            }
+            root = make(Kind::CLONE, root, makeSource(start, m_pos - start));
+        }
+
+        // everything must be consumed
+        return m_pos == m_len ? root : 0;
+    }
+
+    /// the node with the given index
+    const Node& node(NodeId id) const noexcept { return m_nodes[id]; }
+
+    /// the mangled name
+    const char* source() const noexcept { return m_str; }
+
+private:
+    /// Returns the character at the parse position plus 'ahead' (or '\0' at the end).
+    char look(size_t ahead = 0) const noexcept
+    {
+        return m_pos + ahead < m_len ? m_str[m_pos + ahead] : '\0';
+    }
+
+    /// Skips the given character if it's next.
+    bool consume(char c) noexcept
+    {
+        if (look() != c)
+        {
+            return false;
+        }
+        ++m_pos;
+        return true;
+    }
+
+    /// Skips the given two characters if they're next.
+    bool consume(char c1, char c2) noexcept
+    {
+        if (look() != c1 || look(1) != c2)
+        {
+            return false;
+        }
+        m_pos += 2;
+        return true;
+    }
+
+    /// Creates a new node, returns 0 if the pool is exhausted.
+    NodeId make(Kind kind, size_t a = 0, size_t b = 0, uint8_t flags = 0) noexcept
+    {
+        if (m_numNodes >= s_DEMANGLE_MAX_NODES)
+        {
+            return 0;
+        }
+        Node& n = m_nodes[m_numNodes];
+        n.kind = kind;
+        n.flags = flags;
+        n.a = static_cast<uint16_t>(a);
+        n.b = static_cast<uint16_t>(b);
+        return static_cast<NodeId>(m_numNodes++);
+    }
+
+    /// Creates a node for a part of the mangled name.
+    NodeId makeSource(size_t start, size_t length) noexcept
+    {
+        return make(Kind::SOURCE, start, length);
+    }
+
+    /// Appends 'value' to the list starting at 'head' ('tail' is its last element).
+    bool append(NodeId& head, NodeId& tail, NodeId value) noexcept
+    {
+        const NodeId element = value != 0 ? make(Kind::LIST, value) : 0;
+        if (element == 0)
+        {
+            return false;
+        }
+        if (tail != 0)
+        {
+            m_nodes[tail].b = element;
+        }
+        else
+        {
+            head = element;
+        }
+        tail = element;
+        return true;
+    }
+
+    /// Adds a substitution candidate.
+    bool addSubstitution(NodeId id) noexcept
+    {
+        if (id == 0 || m_numSubs >= s_DEMANGLE_MAX_SUBS)
+        {
+            return false;
+        }
+        m_subs[m_numSubs++] = id;
+        return true;
+    }
+
+    /// <number> ::= <decimal digits> (never negative here)
+    bool parseNumber(size_t& value) noexcept
+    {
+        if (!isDigit(look()))
+        {
+            return false;
+        }
+        value = 0;
+        while (isDigit(look()))
+        {
+            value = value * 10 + static_cast<size_t>(look() - '0');
+            if (value > s_DEMANGLE_MAX_NUMBER)
+            {
+                return false;
+            }
+            ++m_pos;
+        }
+        return true;
+    }
+
+    /// [n] <number> - the value doesn't matter, only needs to be skipped
+    bool skipNumber() noexcept
+    {
+        consume('n');
+        if (!isDigit(look()))
+        {
+            return false;
+        }
+        while (isDigit(look()))
+        {
+            ++m_pos;
+        }
+        return true;
+    }
+
+    /// <call-offset> ::= h <nv-offset> _ | v <v-offset> _
+    bool skipCallOffset() noexcept
+    {
+        if (consume('h'))
+        {
+            return skipNumber() && consume('_');
+        }
+        if (consume('v'))
+        {
+            return skipNumber() && consume('_') && skipNumber() && consume('_');
+        }
+        return false;
+    }
+
+    /// [<number>] _ (as used by lambdas and unnamed types): returns 1 for '_', n + 2 otherwise
+    bool parseCount(size_t& count) noexcept
+    {
+        count = 1;
+        if (isDigit(look()))
+        {
+            if (!parseNumber(count))
+            {
+                return false;
+            }
+            count += 2;
+        }
+        return consume('_');
+    }
+
+    /// <discriminator> ::= _ <digit> | __ <number> _   (ignored, but needs to be skipped)
+    bool skipDiscriminator() noexcept
+    {
+        if (!consume('_'))
+        {
+            return true;
+        }
+        const bool twoUnderscores = consume('_');
+        size_t value = 0;
+        if (isDigit(look()) && !parseNumber(value))
+        {
+            return false;
+        }
+        return !twoUnderscores || value < 10 || consume('_');
+    }
+
+    /// <CV-qualifiers> ::= [r] [V] [K]
+    uint8_t parseCvQualifiers() noexcept
+    {
+        uint8_t qualifiers = 0;
+        if (consume('r'))
+        {
+            qualifiers |= QUAL_RESTRICT;
+        }
+        if (consume('V'))
+        {
+            qualifiers |= QUAL_VOLATILE;
+        }
+        if (consume('K'))
+        {
+            qualifiers |= QUAL_CONST;
+        }
+        return qualifiers;
+    }
+
+    /// The characters that may follow an <encoding> (none of them can start a <type>).
+    bool isEndOfEncoding() const noexcept
+    {
+        return m_pos >= m_len || look() == 'E' || look() == '.' || look() == '_';
+    }
+
+    /// <source-name> ::= <positive length number> <identifier>
+    NodeId parseSourceName() noexcept
+    {
+        size_t length = 0;
+        if (!parseNumber(length) || length == 0 || length > m_len - m_pos)
+        {
+            return 0;
+        }
+        const size_t start = m_pos;
+        m_pos += length;
+
+        // GCC's names for anonymous namespaces: "_GLOBAL_" [._$] "N" ...
+        const char* name = m_str + start;
+        if (length >= 10 && memcmp(name, "_GLOBAL_", 8) == 0 &&
+            (name[8] == '.' || name[8] == '_' || name[8] == '$') && name[9] == 'N')
+        {
+            return make(Kind::TEXT, TEXT_ANONYMOUS_NAMESPACE);
+        }
+        return makeSource(start, length);
+    }
+
+    /// <substitution> ::= S_ | S <seq-id> _ | Sa | Sb | Ss | Si | So | Sd
+    /// Note: "St" isn't a substitution (and handled by the callers).
+    /// Substituted template parameters are resolved in the current scope, unless referenced by a
+    /// reference (like __cxa_demangle() does).
+    NodeId parseSubstitution(bool inPrefix, bool inReference = false) noexcept
+    {
+        if (!consume('S'))
+        {
+            return 0;
+        }
+        if (isLower(look()))
+        {
+            const char code = look();
+            ++m_pos;
+            for (size_t i = 0; i < sizeof(s_stdSubstitutions) / sizeof(s_stdSubstitutions[0]); ++i)
+            {
+                if (s_stdSubstitutions[i].code == code)
+                {
+                    // constructors and destructors are printed with the expanded name
+                    const bool expand = inPrefix && (look() == 'C' || look() == 'D');
+                    return make(Kind::STD, i, 0, expand ? 1 : 0);
+                }
+            }
+            return 0;
+        }
+
+        size_t index = 0;
+        if (!consume('_'))
+        {
+            // base 36 sequence ID
+            size_t seqId = 0;
+            while (isDigit(look()) || isUpper(look()))
+            {
+                const char c = look();
+                seqId = seqId * 36 + static_cast<size_t>(isDigit(c) ? c - '0' : c - 'A' + 10);
+                if (seqId > s_DEMANGLE_MAX_NUMBER)
+                {
+                    return 0;
+                }
+                ++m_pos;
+            }
+            if (!consume('_'))
+            {
+                return 0;
+            }
+            index = seqId + 1;
+        }
+        if (index >= m_numSubs)
+        {
+            return 0;
+        }
+
+        NodeId sub = m_subs[index];
+        // template parameters refer to the current template arguments (like a generic lambda's
+        // parameter from outside of the lambda)
+        const Node& n = m_nodes[sub];
+        if (n.kind == Kind::TEMPLATE_PARAM && n.flags != 0 && inReference)
+        {
+            sub = n.a;
+        }
+        else if (n.kind == Kind::TEMPLATE_PARAM && (m_lambdaDepth == 0 || n.flags != 0) &&
+                 n.b < m_numParams)
+        {
+            sub = m_params[m_paramsBegin + n.b];
+        }
+        return sub;
+    }
+
+    /// <template-param> ::= T_ | T <number> _
+    NodeId parseTemplateParam(size_t* paramIndex = nullptr) noexcept
+    {
+        if (!consume('T'))
+        {
+            return 0;
+        }
+        size_t index = 0;
+        if (!consume('_'))
+        {
+            if (!parseNumber(index) || !consume('_'))
+            {
+                return 0;
+            }
+            ++index;
+        }
+        if (paramIndex != nullptr)
+        {
+            *paramIndex = index;
+        }
+        if (m_lambdaDepth > 0)
+        {
+            // the parameter of a generic lambda ("auto")
+            return make(Kind::TEMPLATE_PARAM, 0, index);
+        }
+        return index < m_numParams ? m_params[m_paramsBegin + index] : 0;
+    }
+
+    /// <template-args> ::= I <template-arg>+ E
+    /// If 'isCurrent', the arguments become the ones referenced by <template-param>s.
+    bool parseTemplateArgs(bool isCurrent, NodeId& args) noexcept
+    {
+        DepthGuard guard(m_depth);
+        if (guard.exceeded() || !consume('I'))
+        {
+            return false;
+        }
+
+        // The new arguments are collected above the ones of enclosing templates that are still
+        // being parsed. While parsing an argument, there is no current template.
+        const size_t start = m_paramsTop;
+        size_t count = 0;
+
+        args = 0;
+        NodeId tail = 0;
+        while (!consume('E'))
+        {
+            if (isCurrent)
+            {
+                m_paramsTop = start + count;
+                m_paramsBegin = m_paramsTop;
+                m_numParams = 0;
+            }
+            const NodeId arg = parseTemplateArg();
+            if (!append(args, tail, arg))
+            {
+                return false;
+            }
+            if (isCurrent)
+            {
+                NodeId param = arg;
+                if (m_nodes[arg].kind == Kind::ARG_PACK)
+                {
+                    param = make(Kind::PARAM_PACK, m_nodes[arg].a);
+                }
+                if (param == 0 || start + count >= s_DEMANGLE_MAX_PARAMS)
+                {
+                    return false;
+                }
+                m_params[start + count++] = param;
+            }
+        }
+        if (isCurrent)
+        {
+            m_paramsTop = start;
+            m_paramsBegin = start;
+            m_numParams = count;
+        }
+        return true;
+    }
+
+    /// <template-arg> ::= <type> | <expr-primary> | J <template-arg>* E
+    NodeId parseTemplateArg() noexcept
+    {
+        switch (look())
+        {
+        case 'J':
+        {
+            ++m_pos;
+            NodeId head = 0;
+            NodeId tail = 0;
+            while (!consume('E'))
+            {
+                if (!append(head, tail, parseTemplateArg()))
+                {
+                    return 0;
+                }
+            }
+            return make(Kind::ARG_PACK, head);
+        }
+        case 'L':
+            if (look(1) == 'Z')
+            {
+                // LZ <encoding> E (GCC extension)
+                m_pos += 2;
+                const NodeId encoding = parseEncoding();
+                return consume('E') ? encoding : 0;
+            }
+            return parseExprPrimary();
+        case 'X':
+            // expressions aren't supported
+            return 0;
+        default:
+            return parseType();
+        }
+    }
+
+    /// <expr-primary> ::= L <type> [n] <value> E | L _Z <encoding> E
+    NodeId parseExprPrimary() noexcept
+    {
+        if (!consume('L'))
+        {
+            return 0;
+        }
+        if (consume('_', 'Z'))
+        {
+            const NodeId encoding = parseEncoding();
+            return consume('E') ? encoding : 0;
+        }
+
+        const NodeId type = parseType();
+        if (type == 0)
+        {
+            return 0;
+        }
+        const Node& t = m_nodes[type];
+        if (t.kind == Kind::TEXT &&
+            ((t.a >= TEXT_FLOAT && t.a <= TEXT_FLOAT128) || t.a == TEXT_HALF ||
+             (t.a >= TEXT_DECIMAL32 && t.a <= TEXT_DECIMAL128)))
+        {
+            // floating point literals aren't supported
+            return 0;
+        }
+
+        const uint8_t negative = consume('n') ? 1 : 0;
+        const size_t start = m_pos;
+        while (look() != 'E')
+        {
+            if (look() == '\0')
+            {
+                return 0;
+            }
+            ++m_pos;
+        }
+        const size_t length = m_pos - start;
+        ++m_pos;
+
+        NodeId value = 0;
+        if (length > 0)
+        {
+            value = makeSource(start, length);
+            if (value == 0)
+            {
+                return 0;
+            }
+        }
+        return make(Kind::LITERAL, type, value, negative);
+    }
+
+    /// <type> (see the ABI for the complete grammar)
+    NodeId parseType() noexcept
+    {
+        DepthGuard guard(m_depth);
+        if (guard.exceeded())
+        {
+            return 0;
+        }
+
+        NodeId result = 0;
+        Text text = TEXT_COUNT;
+        switch (look())
+        {
+        case 'r':
+        case 'V':
+        case 'K':
+        {
+            size_t after = m_pos;
+            while (after < m_len && (m_str[after] == 'r' || m_str[after] == 'V' ||
+                                     m_str[after] == 'K'))
+            {
+                ++after;
+            }
+            const char next = after + 1 < m_len ? m_str[after + 1] : '\0';
+            if (after < m_len &&
+                (m_str[after] == 'F' ||
+                 (m_str[after] == 'D' && (next == 'o' || next == 'O' || next == 'w' || next == 'x'))))
+            {
+                // qualified function type (of a member function)
+                result = parseFunctionType();
+                break;
+            }
+            const uint8_t qualifiers = parseCvQualifiers();
+            NodeId type = parseType();
+            if (type != 0 && m_nodes[type].kind == Kind::QUAL)
+            {
+                // e.g. a const template argument that is made const again
+                const Node& inner = m_nodes[type];
+                result = make(Kind::QUAL, inner.a, 0,
+                              static_cast<uint8_t>(qualifiers | inner.flags));
+                break;
+            }
+            result = type != 0 ? make(Kind::QUAL, type, 0, qualifiers) : 0;
+            break;
+        }
+        case 'F':
+            result = parseFunctionType();
+            break;
+        case 'D':
+            switch (look(1))
+            {
+            case 'o':
+            case 'O':
+            case 'w':
+            case 'x':
+                result = parseFunctionType();
+                break;
+            case 'p':
+            {
+                // pack expansion
+                m_pos += 2;
+                const NodeId pattern = parseType();
+                result = pattern != 0 ? make(Kind::EXPANSION, pattern) : 0;
+                break;
+            }
+            case 'v':
+            {
+                // vector type: only with a number as dimension
+                m_pos += 2;
+                const size_t start = m_pos;
+                size_t dim = 0;
+                if (!parseNumber(dim) || !consume('_'))
+                {
+                    return 0;
+                }
+                const NodeId dimension = makeSource(start, m_pos - 1 - start);
+                const NodeId type = parseType();
+                result = dimension != 0 && type != 0 ? make(Kind::VECTOR, type, dimension) : 0;
+                break;
+            }
+            default:
+                // builtin types aren't substitution candidates
+                if (!builtinTypeD(look(1), text))
+                {
+                    return 0;
+                }
+                m_pos += 2;
+                return make(Kind::TEXT, text);
+            }
+            break;
+        case 'A':
+            result = parseArrayType();
+            break;
+        case 'M':
+        {
+            ++m_pos;
+            const NodeId classType = parseType();
+            const NodeId memberType = classType != 0 ? parseType() : 0;
+            result = memberType != 0 ? make(Kind::MEMBER_PTR, classType, memberType) : 0;
+            break;
+        }
+        case 'T':
+        {
+            if (look(1) == 's' || look(1) == 'u' || look(1) == 'e')
+            {
+                // elaborated type specifier (struct/union/enum - not printed)
+                m_pos += 2;
+                result = parseName(nullptr);
+                break;
+            }
+            size_t index = 0;
+            result = parseTemplateParam(&index);
+            if (result != 0 && look() != 'I' && m_lambdaDepth == 0)
+            {
+                // __cxa_demangle() resolves substituted parameters where they're used
+                const NodeId param = make(Kind::TEMPLATE_PARAM, result, index, 1);
+                return param != 0 && addSubstitution(param) ? result : 0;
+            }
+            if (result != 0 && look() == 'I')
+            {
+                // <template-template-param> <template-args>
+                NodeId args = 0;
+                if (!addSubstitution(result) || !parseTemplateArgs(false, args))
+                {
+                    return 0;
+                }
+                result = make(Kind::TEMPLATE, result, args);
+            }
+            break;
+        }
+        case 'P':
+        case 'R':
+        case 'O':
+        {
+            const char c = look();
+            ++m_pos;
+            NodeId type = 0;
+            if (c != 'P' && look() == 'S' && look(1) != 't')
+            {
+                const size_t start = m_pos;
+                type = parseSubstitution(false, true);
+                if (type == 0 || look() == 'I')
+                {
+                    m_pos = start;
+                    type = 0;
+                }
+            }
+            if (type == 0)
+            {
+                type = parseType();
+            }
+            const Kind kind = c == 'P' ? Kind::POINTER : (c == 'R' ? Kind::LREF : Kind::RREF);
+            result = type != 0 ? make(kind, type) : 0;
+            break;
+        }
+        case 'C':
+        case 'G':
+        {
+            const Text suffix = look() == 'C' ? TEXT_COMPLEX : TEXT_IMAGINARY;
+            ++m_pos;
+            const NodeId type = parseType();
+            result = type != 0 ? make(Kind::POSTFIX, type, suffix) : 0;
+            break;
+        }
+        case 'u':
+            // vendor extended type
+            ++m_pos;
+            result = parseSourceName();
+            break;
+        case 'S':
+            if (look(1) != 't')
+            {
+                const NodeId sub = parseSubstitution(false);
+                if (sub == 0 || look() != 'I')
+                {
+                    // substitutions aren't added again
+                    return sub;
+                }
+                NodeId args = 0;
+                if (!parseTemplateArgs(false, args))
+                {
+                    return 0;
+                }
+                result = make(Kind::TEMPLATE, sub, args);
+                break;
+            }
+            result = parseName(nullptr);
+            break;
+        case 'N':
+        case 'Z':
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+            // <class-enum-type>
+            result = parseName(nullptr);
+            break;
+        default:
+            if (!builtinType(look(), text))
+            {
+                return 0;
+            }
+            ++m_pos;
+            return make(Kind::TEXT, text);
+        }
+
+        return addSubstitution(result) ? result : 0;
+    }
+
+    /// <function-type> ::= [<CV-qualifiers>] [Do] [Dx] F [Y] <bare-function-type> [<ref>] E
+    NodeId parseFunctionType() noexcept
+    {
+        uint8_t qualifiers = parseCvQualifiers();
+        if (consume('D', 'o'))
+        {
+            qualifiers |= QUAL_NOEXCEPT;
+        }
+        // neither dynamic exception specifications nor transaction_safe are supported
+        if (!consume('F'))
+        {
+            return 0;
+        }
+        consume('Y'); // extern "C"
+
+        const NodeId returnType = parseType();
+        if (returnType == 0)
+        {
+            return 0;
+        }
+
+        NodeId params = 0;
+        NodeId tail = 0;
+        for (;;)
+        {
+            if (consume('E'))
+            {
+                break;
+            }
+            if (consume('v'))
+            {
+                continue;
+            }
+            if (consume('R', 'E'))
+            {
+                qualifiers |= QUAL_LVALUE_REF;
+                break;
+            }
+            if (consume('O', 'E'))
+            {
+                qualifiers |= QUAL_RVALUE_REF;
+                break;
+            }
+            if (!append(params, tail, parseType()))
+            {
+                return 0;
+            }
+        }
+        return make(Kind::FUNCTION, returnType, params, qualifiers);
+    }
+
+    /// <array-type> ::= A [<dimension number>] _ <element type>
+    NodeId parseArrayType() noexcept
+    {
+        if (!consume('A'))
+        {
+            return 0;
+        }
+        NodeId dimension = 0;
+        if (isDigit(look()))
+        {
+            const size_t start = m_pos;
+            while (isDigit(look()))
+            {
+                ++m_pos;
+            }
+            dimension = makeSource(start, m_pos - start);
+            if (dimension == 0)
+            {
+                return 0;
+            }
+        }
+        // (expressions as dimensions aren't supported)
+        if (!consume('_'))
+        {
+            return 0;
+        }
+        const NodeId type = parseType();
+        return type != 0 ? make(Kind::ARRAY, type, dimension) : 0;
+    }
+
+    /// <abi-tags> ::= (B <source-name>)*
+    NodeId parseAbiTags(NodeId name) noexcept
+    {
+        while (name != 0 && consume('B'))
+        {
+            const NodeId tag = parseSourceName();
+            name = tag != 0 ? make(Kind::ABI_TAG, name, tag) : 0;
+        }
+        return name;
+    }
+
+    /// <operator-name> (including conversion and literal operators)
+    NodeId parseOperatorName(NameState* state) noexcept
+    {
+        if (consume('c', 'v'))
+        {
+            if (state != nullptr)
+            {
+                state->ctorDtorConversion = true;
+            }
+            const NodeId type = parseType();
+            return type != 0 ? make(Kind::CONVERSION, type) : 0;
+        }
+        if (consume('l', 'i'))
+        {
+            const NodeId name = parseSourceName();
+            return name != 0 ? make(Kind::LITERAL_OP, name) : 0;
+        }
+        for (size_t i = 0; i < sizeof(s_operators) / sizeof(s_operators[0]); ++i)
+        {
+            if (consume(s_operators[i].code[0], s_operators[i].code[1]))
+            {
+                return make(Kind::OPERATOR, i);
+            }
+        }
+        // (vendor extended operators aren't supported)
+        return 0;
+    }
+
+    /// <unnamed-type-name> ::= Ut [<number>] _ | Ul <lambda-sig> E [<number>] _
+    NodeId parseUnnamedTypeName() noexcept
+    {
+        size_t count = 0;
+        if (consume('U', 't'))
+        {
+            return parseCount(count) ? make(Kind::UNNAMED, 0, count) : 0;
+        }
+        if (!consume('U', 'l'))
+        {
+            return 0;
+        }
+
+        NodeId params = 0;
+        NodeId tail = 0;
+        ++m_lambdaDepth;
+        if (!consume('v', 'E'))
+        {
+            while (!consume('E'))
+            {
+                if (!append(params, tail, parseType()))
+                {
+                    --m_lambdaDepth;
+                    return 0;
+                }
+            }
+        }
+        --m_lambdaDepth;
+        return parseCount(count) ? make(Kind::LAMBDA, params, count) : 0;
+    }
+
+    /// <unqualified-name> ::= <operator-name> | <source-name> | <unnamed-type-name>
+    ///                        | L <source-name> [<discriminator>]   (all with optional ABI tags)
+    NodeId parseUnqualifiedName(NameState* state) noexcept
+    {
+        NodeId result = 0;
+        if (consume('L'))
+        {
+            // internal linkage
+            result = parseSourceName();
+            if (!skipDiscriminator())
+            {
+                return 0;
+            }
+        }
+        else if (isDigit(look()))
+        {
+            result = parseSourceName();
+        }
+        else if (look() == 'U')
+        {
+            result = parseUnnamedTypeName();
+        }
+        else if (isLower(look()))
+        {
+            result = parseOperatorName(state);
+        }
+        // (structured bindings aren't supported)
+        return parseAbiTags(result);
+    }
+
+    /// <ctor-dtor-name> ::= C1 | C2 | C3 | C4 | C5 | D0 | D1 | D2 | D4 | D5
+    NodeId parseCtorDtorName(NodeId scope, NameState* state) noexcept
+    {
+        if (state != nullptr)
+        {
+            state->ctorDtorConversion = true;
+        }
+        // (inheriting constructors aren't supported)
+        const char c = look();
+        const char variant = look(1);
+        if ((c == 'C' && variant >= '1' && variant <= '5') ||
+            (c == 'D' && variant >= '0' && variant <= '5' && variant != '3'))
+        {
+            m_pos += 2;
+            return make(Kind::CTOR_DTOR, scope, 0, c == 'D' ? 1 : 0);
+        }
+        return 0;
+    }
+
+    /// Appends a component to a qualified name.
+    bool addComponent(NodeId& name, NodeId component, NameState* state) noexcept
+    {
+        if (component == 0)
+        {
+            return false;
+        }
+        name = name != 0 ? make(Kind::NESTED, name, component) : component;
+        if (state != nullptr)
+        {
+            state->endsWithTemplateArgs = false;
+        }
+        return name != 0;
+    }
+
+    /// <nested-name> ::= N [<CV-qualifiers>] [<ref-qualifier>] <prefix> <unqualified-name> E
+    ///               ::= N [<CV-qualifiers>] [<ref-qualifier>] <template-prefix> <template-args> E
+    NodeId parseNestedName(NameState* state) noexcept
+    {
+        if (!consume('N'))
+        {
+            return 0;
+        }
+        uint8_t qualifiers = parseCvQualifiers();
+        if (consume('R'))
+        {
+            qualifiers |= QUAL_LVALUE_REF;
+        }
+        else if (consume('O'))
+        {
+            qualifiers |= QUAL_RVALUE_REF;
+        }
+        if (state != nullptr)
+        {
+            state->qualifiers = qualifiers;
+        }
+
+        // all prefixes are substitution candidates, but not the complete name
+        NodeId name = 0;
+        bool lastIsCandidate = false;
+        while (!consume('E'))
+        {
+            lastIsCandidate = true;
+            consume('L');
+
+            if (consume('M'))
+            {
+                // <data-member-prefix> (the scope of a lambda in an initializer)
+                if (name == 0)
+                {
+                    return 0;
+                }
+                lastIsCandidate = false;
+                continue;
+            }
+            if (look() == 'T')
+            {
+                if (!addComponent(name, parseTemplateParam(), state) || !addSubstitution(name))
+                {
+                    return 0;
+                }
+                continue;
+            }
+            if (look() == 'I')
+            {
+                NodeId args = 0;
+                if (name == 0 || !parseTemplateArgs(state != nullptr, args))
+                {
+                    return 0;
+                }
+                name = make(Kind::TEMPLATE, name, args);
+                if (state != nullptr)
+                {
+                    state->endsWithTemplateArgs = true;
+                }
+                if (!addSubstitution(name))
+                {
+                    return 0;
+                }
+                continue;
+            }
+            if (look() == 'S' && look(1) == 't')
+            {
+                m_pos += 2;
+                if (name != 0)
+                {
+                    return 0;
+                }
+                name = make(Kind::TEXT, TEXT_STD);
+                lastIsCandidate = false;
+                continue;
+            }
+            if (look() == 'S')
+            {
+                const NodeId sub = parseSubstitution(true);
+                const bool first = name == 0;
+                if (!addComponent(name, sub, state) || (!first && !addSubstitution(name)))
+                {
+                    return 0;
+                }
+                lastIsCandidate = !first;
+                continue;
+            }
+            if (look() == 'C' || (look() == 'D' && look(1) != 'C'))
+            {
+                if (name == 0 || !addComponent(name, parseCtorDtorName(name, state), state))
+                {
+                    return 0;
+                }
+                name = parseAbiTags(name);
+                if (!addSubstitution(name))
+                {
+                    return 0;
+                }
+                continue;
+            }
+            // (decltype() and other exotic prefixes aren't supported)
+            if (!addComponent(name, parseUnqualifiedName(state), state) ||
+                !addSubstitution(name))
+            {
+                return 0;
+            }
+        }
+
+        if (name == 0)
+        {
+            return 0;
+        }
+        if (lastIsCandidate)
+        {
+            --m_numSubs;
+        }
+        return name;
+    }
+
+    /// <local-name> ::= Z <encoding> E <entity name> [<discriminator>]
+    ///              ::= Z <encoding> E s [<discriminator>]
+    NodeId parseLocalName(NameState* state) noexcept
+    {
+        if (!consume('Z'))
+        {
+            return 0;
+        }
+        const NodeId encoding = parseEncoding();
+        if (encoding == 0 || !consume('E'))
+        {
+            return 0;
+        }
+        if (m_nodes[encoding].kind == Kind::ENCODING)
+        {
+            // the return type of the enclosing function isn't printed
+            m_nodes[m_nodes[encoding].b].a = 0;
+        }
+        if (consume('s'))
+        {
+            const NodeId literal = make(Kind::TEXT, TEXT_STRING_LITERAL);
+            return literal != 0 && skipDiscriminator() ? make(Kind::NESTED, encoding, literal) : 0;
+        }
+        // (default argument scopes aren't supported)
+        const NodeId entity = look() != 'd' ? parseName(state) : 0;
+        if (entity == 0)
+        {
+            return 0;
+        }
+        // lambdas and unnamed types have their own numbers
+        const Kind kind = m_nodes[entity].kind;
+        if (kind != Kind::LAMBDA && kind != Kind::UNNAMED && !skipDiscriminator())
+        {
+            return 0;
+        }
+        return make(Kind::NESTED, encoding, entity);
+    }
+
+    /// <name> ::= <nested-name> | <local-name> | <unscoped-name>
+    ///        ::= <unscoped-template-name> <template-args>
+    NodeId parseName(NameState* state) noexcept
+    {
+        DepthGuard guard(m_depth);
+        if (guard.exceeded())
+        {
+            return 0;
+        }
+        if (look() == 'N')
+        {
+            return parseNestedName(state);
+        }
+        if (look() == 'Z')
+        {
+            return parseLocalName(state);
+        }
+
+        NodeId name = 0;
+        const bool isSubstitution = look() == 'S' && look(1) != 't';
+        if (isSubstitution)
+        {
+            name = parseSubstitution(false);
+        }
+        else if (consume('S', 't'))
+        {
+            const NodeId scope = make(Kind::TEXT, TEXT_STD);
+            const NodeId unqualified = scope != 0 ? parseUnqualifiedName(state) : 0;
+            name = unqualified != 0 ? make(Kind::NESTED, scope, unqualified) : 0;
+        }
+        else
+        {
+            name = parseUnqualifiedName(state);
+        }
+        if (name == 0)
+        {
+            return 0;
+        }
+
+        if (look() == 'I')
+        {
+            // <unscoped-template-name> <template-args> (the template name is a candidate)
+            NodeId args = 0;
+            if ((!isSubstitution && !addSubstitution(name)) ||
+                !parseTemplateArgs(state != nullptr, args))
+            {
+                return 0;
+            }
+            if (state != nullptr)
+            {
+                state->endsWithTemplateArgs = true;
+            }
+            return make(Kind::TEMPLATE, name, args);
+        }
+        // a substitution must be followed by template arguments
+        return isSubstitution ? 0 : name;
+    }
+
+    /// <special-name> (vtables, thunks, guard variables etc.)
+    NodeId parseSpecialName() noexcept
+    {
+        Text text = TEXT_COUNT;
+        NodeId name = 0;
+        if (consume('T'))
+        {
+            const char c = look();
+            ++m_pos;
+            switch (c)
+            {
+            case 'V':
+            case 'T':
+            case 'I':
+            case 'S':
+                text = c == 'V' ? TEXT_VTABLE
+                                : (c == 'T' ? TEXT_VTT : (c == 'I' ? TEXT_TYPEINFO
+                                                                   : TEXT_TYPEINFO_NAME));
+                name = parseType();
+                break;
+            case 'h':
+                text = TEXT_NON_VIRTUAL_THUNK;
+                name = skipNumber() && consume('_') ? parseEncoding() : 0;
+                break;
+            case 'v':
+                text = TEXT_VIRTUAL_THUNK;
+                name = skipNumber() && consume('_') && skipNumber() && consume('_')
+                         ? parseEncoding()
+                         : 0;
+                break;
+            case 'c':
+                text = TEXT_COVARIANT_THUNK;
+                name = skipCallOffset() && skipCallOffset() ? parseEncoding() : 0;
+                break;
+            case 'C':
+            {
+                // construction vtable: <derived type> <offset number> _ <base type>
+                const NodeId derived = parseType();
+                const NodeId base =
+                  derived != 0 && skipNumber() && consume('_') ? parseType() : 0;
+                return base != 0 ? make(Kind::CTOR_VTABLE, base, derived) : 0;
+            }
+            case 'W':
+            case 'H':
+                text = c == 'W' ? TEXT_TLS_WRAPPER : TEXT_TLS_INIT;
+                name = parseName(nullptr);
+                break;
+            default:
+                return 0;
+            }
+        }
+        else if (consume('G', 'V'))
+        {
+            text = TEXT_GUARD_VARIABLE;
+            name = parseName(nullptr);
+        }
+        else if (consume('G', 'T'))
+        {
+            if (consume('t'))
+            {
+                text = TEXT_TRANSACTION_CLONE;
+            }
+            else if (consume('n'))
+            {
+                text = TEXT_NON_TRANSACTION_CLONE;
+            }
+            name = text != TEXT_COUNT ? parseEncoding() : 0;
+        }
+        // (reference temporaries and other special names aren't supported)
+        return name != 0 ? make(Kind::SPECIAL, text, name) : 0;
+    }
+
+    /// <encoding> ::= <function name> <bare-function-type> | <data name> | <special-name>
+    NodeId parseEncoding() noexcept
+    {
+        DepthGuard guard(m_depth);
+        if (guard.exceeded())
+        {
+            return 0;
+        }
+        if (look() == 'G' || look() == 'T')
+        {
+            return parseSpecialName();
+        }
+
+        NameState state;
+        const NodeId name = parseName(&state);
+        if (name == 0 || isEndOfEncoding())
+        {
+            return name;
+        }
+
+        // only function templates have a return type (except constructors etc.)
+        NodeId returnType = 0;
+        if (state.endsWithTemplateArgs && !state.ctorDtorConversion)
+        {
+            returnType = parseType();
+            if (returnType == 0)
+            {
+                return 0;
+            }
+        }
+
+        NodeId params = 0;
+        NodeId tail = 0;
+        if (!consume('v'))
+        {
+            do
+            {
+                if (!append(params, tail, parseType()))
+                {
+                    return 0;
+                }
+            } while (!isEndOfEncoding());
+        }
+        const NodeId signature = make(Kind::FUNCTION, returnType, params, state.qualifiers);
+        return signature != 0 ? make(Kind::ENCODING, name, signature) : 0;
+    }
+
+    /// the mangled name (not necessarily NUL-terminated)
+    const char* const m_str;
+    /// length of the mangled name
+    const size_t m_len;
+    /// current parse position
+    size_t m_pos = 0;
+    /// current nesting level
+    unsigned m_depth = 0;
+    /// > 0 while parsing the signature of a lambda
+    unsigned m_lambdaDepth = 0;
+
+    /// all nodes (index 0 is unused)
+    Node m_nodes[s_DEMANGLE_MAX_NODES];
+    size_t m_numNodes = 1;
+    /// substitution candidates
+    NodeId m_subs[s_DEMANGLE_MAX_SUBS];
+    size_t m_numSubs = 0;
+    /// the arguments of the current template (referenced by <template-param>) are
+    /// m_params[m_paramsBegin, m_paramsBegin + m_numParams), the ones of enclosing templates that
+    /// are still being parsed are below m_paramsTop
+    NodeId m_params[s_DEMANGLE_MAX_PARAMS];
+    size_t m_paramsBegin = 0;
+    size_t m_numParams = 0;
+    size_t m_paramsTop = 0;
+};
+
+/// Prints a parsed name into a buffer (truncating it if necessary).
+class Printer
+{
+public:
+    Printer(const Demangler& demangler, char* buffer, size_t bufferSize) noexcept
+      : m_demangler(demangler), m_buffer(buffer), m_capacity(bufferSize - 1)
+    {
+    }
+
+    Printer(const Printer&) = delete;
+    Printer& operator=(const Printer&) = delete;
+
+    /// Prints the name, returns false if it can't be printed.
+    bool print(NodeId root) noexcept
+    {
+        printNode(root);
+        m_buffer[length()] = '\0';
+        return !m_failed;
+    }
+
+    /// number of printed characters (excluding truncated ones)
+    size_t length() const noexcept { return m_len < m_capacity ? m_len : m_capacity; }
+
+private:
+    /// Counts the nesting level and the number of visited nodes for the lifetime of the object.
+    class Visit
+    {
+    public:
+        explicit Visit(Printer& printer) noexcept : m_printer(printer)
+        {
+            ++m_printer.m_depth;
+            if (m_printer.m_depth > s_DEMANGLE_MAX_DEPTH ||
+                ++m_printer.m_steps > s_DEMANGLE_MAX_STEPS)
+            {
+                m_printer.m_failed = true;
+            }
+        }
+        ~Visit() { --m_printer.m_depth; }
+
+        Visit(const Visit&) = delete;
+        Visit& operator=(const Visit&) = delete;
+
+        /// continue printing? (not if failed or the buffer is full)
+        bool ok() const noexcept { return !m_printer.m_failed && m_printer.m_len <= m_printer.m_capacity; }
+
+    private:
+        Printer& m_printer;
+    };
+
+    /// A position in the output (to remove text again).
+    struct Position
+    {
+        size_t len;
+        char last;
+    };
+
+    const Node& node(NodeId id) const noexcept { return m_demangler.node(id); }
+
+    Position position() const noexcept { return Position{ m_len, m_last }; }
+
+    void restore(const Position& pos) noexcept
+    {
+        m_len = pos.len;
+        m_last = pos.last;
+    }
+
+    void put(char c) noexcept
+    {
+        if (m_len < m_capacity)
+        {
+            m_buffer[m_len] = c;
+        }
+        ++m_len;
+        m_last = c;
+    }
+
+    void put(const char* str, size_t len) noexcept
+    {
+        for (size_t i = 0; i < len; ++i)
+        {
+            put(str[i]);
+        }
+    }
+
+    void put(const char* str) noexcept { put(str, strlen(str)); }
+
+    void putNumber(size_t value) noexcept
+    {
+        char digits[24];
+        size_t n = 0;
+        do
+        {
+            digits[n++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value > 0);
+        while (n > 0)
+        {
+            put(digits[--n]);
+        }
+    }
+
+    /// Returns the list element at 'index' (or 0).
+    NodeId listElement(NodeId list, size_t index) const noexcept
+    {
+        for (; list != 0; list = node(list).b, --index)
+        {
+            if (index == 0)
+            {
+                return node(list).a;
+            }
+        }
+        return 0;
+    }
+
+    size_t listSize(NodeId list) const noexcept
+    {
+        size_t size = 0;
+        for (; list != 0; list = node(list).b)
+        {
+            ++size;
+        }
+        return size;
+    }
+
+    /// Resolves a parameter pack to its element for the current pack expansion (0 if none).
+    NodeId resolve(NodeId id) noexcept
+    {
+        if (node(id).kind != Kind::PARAM_PACK)
+        {
+            return id;
+        }
+        const NodeId element = listElement(node(id).a, m_packIndex);
+        if (element == 0)
+        {
+            m_failed = true;
+        }
+        return element;
+    }
+
+    /// Has the type a component that's printed on the right side (i.e. after the name)?
+    bool hasRhs(NodeId id) noexcept
+    {
+        Visit visit(*this);
+        if (!visit.ok() || (id = resolve(id)) == 0)
+        {
+            return false;
+        }
+        const Node& n = node(id);
+        switch (n.kind)
+        {
+        case Kind::ARRAY:
+        case Kind::FUNCTION:
+        case Kind::ENCODING:
+            return true;
+        case Kind::POINTER:
+        case Kind::LREF:
+        case Kind::RREF:
+        case Kind::QUAL:
+            return hasRhs(n.a);
+        case Kind::MEMBER_PTR:
+            return hasRhs(n.b);
+        default:
+            return false;
+        }
+    }
+
+    /// Is the type an array?
+    bool hasArray(NodeId id) noexcept
+    {
+        while (id != 0 && (id = resolve(id)) != 0 && node(id).kind == Kind::QUAL)
+        {
+            id = node(id).a;
+        }
+        return id != 0 && node(id).kind == Kind::ARRAY;
+    }
+
+    /// Is the type a function?
+    bool hasFunction(NodeId id) noexcept
+    {
+        while (id != 0 && (id = resolve(id)) != 0 && node(id).kind == Kind::QUAL)
+        {
+            id = node(id).a;
+        }
+        return id != 0 && (node(id).kind == Kind::FUNCTION || node(id).kind == Kind::ENCODING);
+    }
+
+    /// Collapses references to references ("T&" with T=int&& is "int&"), returns the referenced
+    /// type and sets 'lvalue' accordingly.
+    NodeId collapseReference(NodeId id, bool& lvalue) noexcept
+    {
+        lvalue = node(id).kind == Kind::LREF;
+        NodeId referenced = node(id).a;
+        for (unsigned i = 0; i < s_DEMANGLE_MAX_DEPTH; ++i)
+        {
+            const NodeId inner = resolve(referenced);
+            if (inner == 0 || (node(inner).kind != Kind::LREF && node(inner).kind != Kind::RREF))
+            {
+                return inner;
+            }
+            lvalue = lvalue || node(inner).kind == Kind::LREF;
+            referenced = node(inner).a;
+        }
+        m_failed = true;
+        return 0;
+    }
+
+    /// Searches for the parameter pack that is expanded by a pack expansion.
+    NodeId findPack(NodeId id) noexcept
+    {
+        Visit visit(*this);
+        if (!visit.ok() || id == 0)
+        {
+            return 0;
+        }
+        const Node& n = node(id);
+        switch (n.kind)
+        {
+        case Kind::PARAM_PACK:
+            return id;
+        case Kind::CONVERSION:
+        case Kind::LITERAL_OP:
+        case Kind::QUAL:
+        case Kind::POINTER:
+        case Kind::LREF:
+        case Kind::RREF:
+        case Kind::POSTFIX:
+        case Kind::ARG_PACK:
+            return findPack(n.a);
+        case Kind::SPECIAL:
+            return findPack(n.b);
+        case Kind::ABI_TAG:
+        case Kind::NESTED:
+        case Kind::TEMPLATE:
+        case Kind::LIST:
+        case Kind::VECTOR:
+        case Kind::ARRAY:
+        case Kind::MEMBER_PTR:
+        case Kind::FUNCTION:
+        case Kind::ENCODING:
+        case Kind::LITERAL:
+        case Kind::CTOR_VTABLE:
+        case Kind::CLONE:
+        {
+            const NodeId pack = findPack(n.a);
+            return pack != 0 ? pack : findPack(n.b);
+        }
+        default:
+            // including nested pack expansions
+            return 0;
+        }
+    }
+
+    /// Prints a comma separated list. Trailing elements that print nothing (i.e. empty argument
+    /// packs) are removed including their comma.
+    void printList(NodeId list) noexcept
+    {
+        Position trailing{ 0, '\0' };
+        bool hasTrailing = false;
+        for (bool first = true; list != 0; list = node(list).b, first = false)
+        {
+            const Position before = position();
+            if (!first)
+            {
+                put(", ");
+            }
+            const size_t len = m_len;
+            printNode(node(list).a);
+            if (m_len == len && !first)
+            {
+                if (!hasTrailing)
+                {
+                    trailing = before;
+                    hasTrailing = true;
+                }
+            }
+            else if (m_len != len)
+            {
+                hasTrailing = false;
+            }
+        }
+        if (hasTrailing)
+        {
+            // Note: __cxa_demangle() doesn't reset the last character, e.g. "A<B<int>>"
+            m_len = trailing.len;
+        }
+    }
+
+    /// Prints the qualifiers of a type or function.
+    void printQualifiers(uint8_t qualifiers) noexcept
+    {
+        if ((qualifiers & QUAL_CONST) != 0)
+        {
+            put(" const");
+        }
+        if ((qualifiers & QUAL_VOLATILE) != 0)
+        {
+            put(" volatile");
+        }
+        if ((qualifiers & QUAL_RESTRICT) != 0)
+        {
+            put(" restrict");
+        }
+        if ((qualifiers & QUAL_LVALUE_REF) != 0)
+        {
+            put(" &");
+        }
+        if ((qualifiers & QUAL_RVALUE_REF) != 0)
+        {
+            put(" &&");
+        }
+        if ((qualifiers & QUAL_NOEXCEPT) != 0)
+        {
+            put(" noexcept");
+        }
+    }
+
+    /// Opens the parentheses around a pointer or reference to an array or function (if needed).
+    void openDeclarator(NodeId type) noexcept
+    {
+        if (hasArray(type))
+        {
+            put(" (");
+        }
+        else if (hasFunction(type))
+        {
+            if (m_last != '(' && m_last != '*' && m_last != ' ')
+            {
+                put(' ');
+            }
+            put('(');
+        }
+    }
+
+    /// Prints the name of a constructor or destructor (i.e. the last component of its class).
+    void printBaseName(NodeId id) noexcept
+    {
+        for (unsigned i = 0; i < s_DEMANGLE_MAX_DEPTH; ++i)
+        {
+            const Node& n = node(id);
+            switch (n.kind)
+            {
+            case Kind::NESTED:
+                // unnamed types are named after the enclosing class
+                id = node(n.b).kind == Kind::UNNAMED ? n.a : n.b;
+                break;
+            case Kind::TEMPLATE:
+            case Kind::ABI_TAG:
+                id = n.a;
+                break;
+            case Kind::STD:
+                put(s_stdSubstitutions[n.a].baseName);
+                return;
+            default:
+                printNode(id);
+                return;
+            }
+        }
+        m_failed = true;
+    }
+
+    void printLiteral(const Node& n) noexcept
+    {
+        const Node& type = node(n.a);
+        const bool negative = n.flags != 0;
+        if (n.b == 0)
+        {
+            // e.g. nullptr
+            printNode(n.a);
+            return;
+        }
+        if (type.kind == Kind::TEXT && type.a >= TEXT_INT && type.a <= TEXT_UNSIGNED_LONG_LONG)
+        {
+            static const char* const s_suffixes[] = { "", "u", "l", "ul", "ll", "ull" };
+            if (negative)
+            {
+                put('-');
+            }
+            printNode(n.b);
+            put(s_suffixes[type.a - TEXT_INT]);
+            return;
+        }
+        if (type.kind == Kind::TEXT && type.a == TEXT_BOOL && !negative && node(n.b).b == 1)
+        {
+            const char value = m_demangler.source()[node(n.b).a];
+            if (value == '0' || value == '1')
+            {
+                put(value == '1' ? "true" : "false");
+                return;
+            }
+        }
+        put('(');
+        printNode(n.a);
+        put(')');
+        if (negative)
+        {
+            put('-');
+        }
+        printNode(n.b);
+    }
+
+    void printExpansion(const Node& n) noexcept
+    {
+        const NodeId pack = findPack(n.a);
+        if (pack == 0)
+        {
+            printNode(n.a);
+            put("...");
+            return;
+        }
+        const size_t size = listSize(node(pack).a);
+        const size_t savedIndex = m_packIndex;
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (i > 0)
+            {
+                put(", ");
+            }
+            m_packIndex = i;
+            printNode(n.a);
+        }
+        m_packIndex = savedIndex;
+    }
+
+    void printNode(NodeId id) noexcept
+    {
+        printLeft(id);
+        printRight(id);
+    }
+
+    /// Prints everything that goes before the name of a declaration (or the complete name).
+    void printLeft(NodeId id) noexcept
+    {
+        Visit visit(*this);
+        if (!visit.ok() || (id = resolve(id)) == 0)
+        {
+            return;
+        }
+        const Node& n = node(id);
+        switch (n.kind)
+        {
+        case Kind::SOURCE:
+            put(m_demangler.source() + n.a, n.b);
+            break;
+        case Kind::TEXT:
+            put(s_texts[n.a]);
+            break;
+        case Kind::STD:
+            put(n.flags != 0 ? s_stdSubstitutions[n.a].expanded : s_stdSubstitutions[n.a].name);
+            break;
+        case Kind::OPERATOR:
+        {
+            const char* name = s_operators[n.a].name;
+            put("operator");
+            if (isLower(name[0]))
+            {
+                put(' ');
+            }
+            put(name);
+            break;
+        }
+        case Kind::CONVERSION:
+            put("operator ");
+            printNode(n.a);
+            break;
+        case Kind::LITERAL_OP:
+            put("operator\"\" ");
+            printNode(n.a);
+            break;
+        case Kind::CTOR_DTOR:
+            if (n.flags != 0)
+            {
+                put('~');
+            }
+            printBaseName(n.a);
+            break;
+        case Kind::ABI_TAG:
+            printNode(n.a);
+            put("[abi:");
+            printNode(n.b);
+            put(']');
+            break;
+        case Kind::LAMBDA:
+            put("{lambda(");
+            printList(n.a);
+            put(")#");
+            putNumber(n.b);
+            put('}');
+            break;
+        case Kind::UNNAMED:
+            put("{unnamed type#");
+            putNumber(n.b);
+            put('}');
+            break;
+        case Kind::TEMPLATE_PARAM:
+            put("auto:");
+            putNumber(n.b + 1U);
+            break;
+        case Kind::NESTED:
+            printNode(n.a);
+            put("::");
+            printNode(n.b);
+            break;
+        case Kind::TEMPLATE:
+            printNode(n.a);
+            if (m_last == '<')
+            {
+                put(' ');
+            }
+            put('<');
+            printList(n.b);
+            if (m_last == '>')
+            {
+                put(' ');
+            }
+            put('>');
+            break;
+        case Kind::LIST:
+        case Kind::ARG_PACK:
+            printList(n.kind == Kind::LIST ? id : n.a);
+            break;
+        case Kind::QUAL:
+            printLeft(n.a);
+            printQualifiers(n.flags);
+            break;
+        case Kind::POINTER:
+            printLeft(n.a);
+            openDeclarator(n.a);
+            put('*');
+            break;
+        case Kind::LREF:
+        case Kind::RREF:
+        {
+            bool lvalue = true;
+            const NodeId referenced = collapseReference(id, lvalue);
+            printLeft(referenced);
+            openDeclarator(referenced);
+            put(lvalue ? "&" : "&&");
+            break;
+        }
+        case Kind::POSTFIX:
+            printNode(n.a);
+            put(s_texts[n.b]);
+            break;
+        case Kind::VECTOR:
+            printNode(n.a);
+            put(" __vector(");
+            printNode(n.b);
+            put(')');
+            break;
+        case Kind::ARRAY:
+            printLeft(n.a);
+            break;
+        case Kind::MEMBER_PTR:
+            printLeft(n.b);
+            if (hasArray(n.b) || hasFunction(n.b))
+            {
+                if (m_last != ' ')
+                {
+                    put(' ');
+                }
+                put('(');
+            }
+            else
+            {
+                put(' ');
+            }
+            printNode(n.a);
+            put("::*");
+            break;
+        case Kind::FUNCTION:
+            // the function's return type
+            printLeft(n.a);
+            if (!hasRhs(n.a))
+            {
+                put(' ');
+            }
+            break;
+        case Kind::ENCODING:
+        {
+            const NodeId returnType = node(n.b).a;
+            if (returnType != 0)
+            {
+                printLeft(returnType);
+                if (!hasRhs(returnType))
+                {
+                    put(' ');
+                }
+            }
+            printNode(n.a);
+            break;
+        }
+        case Kind::PARAM_PACK:
+            // already resolved
+            break;
+        case Kind::EXPANSION:
+            printExpansion(n);
+            break;
+        case Kind::LITERAL:
+            printLiteral(n);
+            break;
+        case Kind::SPECIAL:
+            put(s_texts[n.a]);
+            printNode(n.b);
+            break;
+        case Kind::CTOR_VTABLE:
+            put("construction vtable for ");
+            printNode(n.a);
+            put("-in-");
+            printNode(n.b);
+            break;
+        case Kind::CLONE:
+            printNode(n.a);
+            put(" [clone ");
+            printNode(n.b);
+            put(']');
+            break;
+        }
+    }
+
+    /// Prints everything that goes after the name of a declaration.
+    void printRight(NodeId id) noexcept
+    {
+        Visit visit(*this);
+        if (!visit.ok() || (id = resolve(id)) == 0)
+        {
+            return;
+        }
+        const Node& n = node(id);
+        switch (n.kind)
+        {
+        case Kind::QUAL:
+            printRight(n.a);
+            break;
+        case Kind::POINTER:
+            if (hasArray(n.a) || hasFunction(n.a))
+            {
+                put(')');
+            }
+            printRight(n.a);
+            break;
+        case Kind::LREF:
+        case Kind::RREF:
+        {
+            bool lvalue = true;
+            const NodeId referenced = collapseReference(id, lvalue);
+            if (hasArray(referenced) || hasFunction(referenced))
+            {
+                put(')');
+            }
+            printRight(referenced);
+            break;
+        }
+        case Kind::ARRAY:
+            if (m_last != ']')
+            {
+                put(' ');
+            }
+            put('[');
+            if (n.b != 0)
+            {
+                printNode(n.b);
+            }
+            put(']');
+            printRight(n.a);
+            break;
+        case Kind::MEMBER_PTR:
+            if (hasArray(n.b) || hasFunction(n.b))
+            {
+                put(')');
+            }
+            printRight(n.b);
+            break;
+        case Kind::FUNCTION:
+        case Kind::ENCODING:
+        {
+            // parameters, qualifiers and then the rest of the return type
+            const Node& signature = n.kind == Kind::FUNCTION ? n : node(n.b);
+            put('(');
+            printList(signature.b);
+            put(')');
+            printQualifiers(signature.flags);
+            if (signature.a != 0)
+            {
+                printRight(signature.a);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    const Demangler& m_demangler;
+    /// the output buffer
+    char* const m_buffer;
+    /// maximum number of characters in m_buffer (excluding the NUL terminator)
+    const size_t m_capacity;
+    /// number of printed characters (including truncated ones)
+    size_t m_len = 0;
+    /// the last printed character
+    char m_last = '\0';
+    /// current nesting level
+    unsigned m_depth = 0;
+    /// number of visited nodes
+    size_t m_steps = 0;
+    /// index of the current element of a pack expansion
+    size_t m_packIndex = 0;
+    /// set if the name can't be printed
+    bool m_failed = false;
+};
+
+} // namespace
+
+
+bool demangleItanium(const char* symbol, char* buffer, size_t bufferSize, size_t& length) noexcept
+{
+    length = 0;
+    if (symbol == nullptr || buffer == nullptr || bufferSize == 0)
+    {
+        return false;
+    }
+    const size_t symbolLength = strlen(symbol);
+    if (symbolLength > s_DEMANGLE_MAX_NUMBER)
+    {
+        return false;
+    }
+
+    Demangler demangler(symbol, symbolLength);
+    const NodeId root = demangler.parse();
+    if (root == 0)
+    {
+        return false;
+    }
+    Printer printer(demangler, buffer, bufferSize);
+    if (!printer.print(root))
+    {
+        return false;
+    }
+    length = printer.length();
+    return true;
+}
+
+} // namespace ooopsi
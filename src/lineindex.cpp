@@ -0,0 +1,750 @@
+/**
+ * @file    lineindex.cpp
+ * @brief   building and searching line indexes (see lineindex.hpp)
+ *
+ * The line programs in .debug_line (DWARF versions 2 to 5) are executed once, the resulting rows
+ * are reduced to the ones that change the file or line and sorted by address. File names are
+ * stored once per index.
+ */
+
+#include "lineindex.hpp"
+#include "internal.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#ifdef OOOPSI_LINUX
+#include <elf.h>
+#endif
+
+namespace ooopsi
+{
+
+#ifdef OOOPSI_LINUX
+
+namespace
+{
+
+/// The sections needed to build the index.
+struct DebugSections
+{
+    const uint8_t* line = nullptr;
+    size_t lineSize = 0;
+    /// string sections referenced by DWARF 5 line tables (may be missing)
+    const uint8_t* lineStr = nullptr;
+    size_t lineStrSize = 0;
+    const uint8_t* str = nullptr;
+    size_t strSize = 0;
+};
+
+/// Reads DWARF data, any read beyond the end fails the reader (and returns 0).
+class DwarfReader
+{
+public:
+    DwarfReader(const uint8_t* data, size_t size) noexcept : m_pos(data), m_end(data + size) {}
+
+    bool ok() const noexcept { return m_ok; }
+    bool atEnd() const noexcept { return m_pos >= m_end; }
+    const uint8_t* pos() const noexcept { return m_pos; }
+    size_t remaining() const noexcept { return static_cast<size_t>(m_end - m_pos); }
+
+    /// Reads a little endian integer of the given size (1..8 bytes).
+    uint64_t fixed(size_t size) noexcept
+    {
+        if (!require(size))
+        {
+            return 0;
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; ++i)
+        {
+            value |= static_cast<uint64_t>(m_pos[i]) << (8 * i);
+        }
+        m_pos += size;
+        return value;
+    }
+
+    uint64_t uleb() noexcept
+    {
+        uint64_t value = 0;
+        unsigned shift = 0;
+        while (require(1))
+        {
+            const uint8_t byte = *m_pos++;
+            if (shift < 64)
+            {
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            }
+            shift += 7;
+            if ((byte & 0x80) == 0)
+            {
+                break;
+            }
+        }
+        return value;
+    }
+
+    int64_t sleb() noexcept
+    {
+        uint64_t value = 0;
+        unsigned shift = 0;
+        uint8_t byte = 0;
+        while (require(1))
+        {
+            byte = *m_pos++;
+            if (shift < 64)
+            {
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            }
+            shift += 7;
+            if ((byte & 0x80) == 0)
+            {
+                break;
+            }
+        }
+        if (shift < 64 && (byte & 0x40) != 0)
+        {
+            value |= ~UINT64_C(0) << shift;
+        }
+        return static_cast<int64_t>(value);
+    }
+
+    /// Reads a NUL-terminated string.
+    const char* cstr() noexcept
+    {
+        const auto* nul = static_cast<const uint8_t*>(memchr(m_pos, 0, remaining()));
+        if (nul == nullptr)
+        {
+            m_ok = false;
+            m_pos = m_end;
+            return "";
+        }
+        const auto* str = reinterpret_cast<const char*>(m_pos);
+        m_pos = nul + 1;
+        return str;
+    }
+
+    void skip(uint64_t size) noexcept
+    {
+        if (require(size))
+        {
+            m_pos += size;
+        }
+    }
+
+private:
+    bool require(uint64_t size) noexcept
+    {
+        if (!m_ok || size > remaining())
+        {
+            m_ok = false;
+            m_pos = m_end;
+            return false;
+        }
+        return true;
+    }
+
+    const uint8_t* m_pos;
+    const uint8_t* m_end;
+    bool m_ok = true;
+};
+
+/// DWARF constants (see the DWARF 5 standard, section 7.22)
+enum : uint8_t
+{
+    DW_LNS_copy = 1,
+    DW_LNS_advance_pc = 2,
+    DW_LNS_advance_line = 3,
+    DW_LNS_set_file = 4,
+    DW_LNS_const_add_pc = 8,
+    DW_LNS_fixed_advance_pc = 9,
+
+    DW_LNE_end_sequence = 1,
+    DW_LNE_set_address = 2,
+
+    DW_LNCT_path = 1,
+    DW_LNCT_directory_index = 2,
+
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_string = 0x08,
+    DW_FORM_block = 0x09,
+    DW_FORM_data1 = 0x0b,
+    DW_FORM_sdata = 0x0d,
+    DW_FORM_strp = 0x0e,
+    DW_FORM_udata = 0x0f,
+    DW_FORM_data16 = 0x1e,
+    DW_FORM_line_strp = 0x1f,
+};
+
+/// A row while building the index (with the unit's file index instead of a string offset).
+struct PendingRow
+{
+    uint64_t address;
+    uint32_t file;
+    uint32_t line;
+    bool endSequence;
+};
+
+/// Collects the rows and file names of all units.
+class LineIndexBuilder
+{
+public:
+    explicit LineIndexBuilder(const DebugSections& sections) : m_sections(sections) {}
+
+    /// Parses all units of .debug_line, returns false if nothing was found.
+    bool parse()
+    {
+        DwarfReader reader(m_sections.line, m_sections.lineSize);
+        while (!reader.atEnd() && reader.ok())
+        {
+            uint64_t length = reader.fixed(4);
+            bool is64 = false;
+            if (length == 0xffffffff)
+            {
+                length = reader.fixed(8);
+                is64 = true;
+            }
+            if (!reader.ok() || length > reader.remaining())
+            {
+                break;
+            }
+            DwarfReader unit(reader.pos(), static_cast<size_t>(length));
+            // a broken unit only loses its own rows
+            parseUnit(unit, is64);
+            reader.skip(length);
+        }
+        return !m_rows.empty();
+    }
+
+    /// Sorts the rows and writes the index.
+    void write(std::vector<char>& index)
+    {
+        // at equal addresses, a new sequence wins over the end of the previous one
+        std::stable_sort(m_rows.begin(), m_rows.end(),
+                         [](const LineIndexRow& lhs, const LineIndexRow& rhs) {
+                             return lhs.address < rhs.address ||
+                                    (lhs.address == rhs.address && lhs.file == s_NO_LINE &&
+                                     rhs.file != s_NO_LINE);
+                         });
+
+        LineIndexHeader header;
+        memcpy(header.magic, s_LINE_INDEX_MAGIC, sizeof(header.magic));
+        header.numRows = m_rows.size();
+        header.stringsSize = m_strings.size();
+
+        index.resize(sizeof(header) + m_rows.size() * sizeof(LineIndexRow) + m_strings.size());
+        char* pos = index.data();
+        memcpy(pos, &header, sizeof(header));
+        pos += sizeof(header);
+        memcpy(pos, m_rows.data(), m_rows.size() * sizeof(LineIndexRow));
+        pos += m_rows.size() * sizeof(LineIndexRow);
+        memcpy(pos, m_strings.data(), m_strings.size());
+    }
+
+private:
+    /// Reads a string attribute of a DWARF 5 directory or file entry.
+    const char* readString(DwarfReader& unit, uint64_t form, bool is64)
+    {
+        const size_t offsetSize = is64 ? 8 : 4;
+        switch (form)
+        {
+        case DW_FORM_string:
+            return unit.cstr();
+        case DW_FORM_line_strp:
+            return sectionString(m_sections.lineStr, m_sections.lineStrSize,
+                                 unit.fixed(offsetSize));
+        case DW_FORM_strp:
+            return sectionString(m_sections.str, m_sections.strSize, unit.fixed(offsetSize));
+        default:
+            return nullptr;
+        }
+    }
+
+    /// Reads an integer attribute (or skips an unused one), returns false for unsupported forms.
+    static bool readValue(DwarfReader& unit, uint64_t form, uint64_t& value)
+    {
+        switch (form)
+        {
+        case DW_FORM_data1:
+            value = unit.fixed(1);
+            return true;
+        case DW_FORM_data2:
+            value = unit.fixed(2);
+            return true;
+        case DW_FORM_data4:
+            value = unit.fixed(4);
+            return true;
+        case DW_FORM_data8:
+            value = unit.fixed(8);
+            return true;
+        case DW_FORM_data16:
+            unit.skip(16);
+            return true;
+        case DW_FORM_udata:
+            value = unit.uleb();
+            return true;
+        case DW_FORM_sdata:
+            value = static_cast<uint64_t>(unit.sleb());
+            return true;
+        case DW_FORM_block:
+            unit.skip(unit.uleb());
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static const char* sectionString(const uint8_t* section, size_t size, uint64_t offset)
+    {
+        if (section == nullptr || offset >= size ||
+            memchr(section + offset, 0, static_cast<size_t>(size - offset)) == nullptr)
+        {
+            return nullptr;
+        }
+        return reinterpret_cast<const char*>(section + offset);
+    }
+
+    /// Reads the DWARF 5 directory or file name table, returns false if unsupported.
+    bool readEntries(DwarfReader& unit, bool is64, std::vector<const char*>& paths,
+                     std::vector<uint64_t>& dirs)
+    {
+        const uint64_t numFormats = unit.fixed(1);
+        std::vector<std::pair<uint64_t, uint64_t>> formats;
+        for (uint64_t i = 0; i < numFormats && unit.ok(); ++i)
+        {
+            const uint64_t type = unit.uleb();
+            formats.emplace_back(type, unit.uleb());
+        }
+        const uint64_t count = unit.uleb();
+        for (uint64_t i = 0; i < count && unit.ok(); ++i)
+        {
+            const char* path = nullptr;
+            uint64_t dir = 0;
+            for (const auto& format : formats)
+            {
+                if (format.first == DW_LNCT_path)
+                {
+                    path = readString(unit, format.second, is64);
+                    if (path == nullptr)
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    uint64_t value = 0;
+                    if (!readValue(unit, format.second, value))
+                    {
+                        return false;
+                    }
+                    if (format.first == DW_LNCT_directory_index)
+                    {
+                        dir = value;
+                    }
+                }
+            }
+            paths.push_back(path != nullptr ? path : "");
+            dirs.push_back(dir);
+        }
+        return unit.ok();
+    }
+
+    /// Returns the offset of a file name in m_strings (added if new).
+    uint32_t addString(const std::string& name)
+    {
+        auto it = m_stringOffsets.find(name);
+        if (it == m_stringOffsets.end())
+        {
+            const auto offset = static_cast<uint32_t>(m_strings.size());
+            m_strings.append(name.c_str(), name.size() + 1);
+            it = m_stringOffsets.emplace(name, offset).first;
+        }
+        return it->second;
+    }
+
+    void parseUnit(DwarfReader& unit, bool is64)
+    {
+        const auto version = static_cast<unsigned>(unit.fixed(2));
+        if (version < 2 || version > 5)
+        {
+            return;
+        }
+        size_t addressSize = sizeof(void*);
+        if (version >= 5)
+        {
+            addressSize = static_cast<size_t>(unit.fixed(1));
+            unit.fixed(1); // segment selector size
+        }
+        const uint64_t headerLength = unit.fixed(is64 ? 8 : 4);
+        if (!unit.ok() || headerLength > unit.remaining())
+        {
+            return;
+        }
+        const uint8_t* program = unit.pos() + headerLength;
+
+        const uint64_t minInstLength = unit.fixed(1);
+        if (version >= 4)
+        {
+            unit.fixed(1); // maximum operations per instruction (VLIW only)
+        }
+        unit.fixed(1); // default_is_stmt (all rows are used)
+        const auto lineBase = static_cast<int8_t>(unit.fixed(1));
+        const uint64_t lineRange = unit.fixed(1);
+        const auto opcodeBase = static_cast<uint8_t>(unit.fixed(1));
+        std::vector<uint8_t> opcodeLengths;
+        for (unsigned i = 1; i < opcodeBase; ++i)
+        {
+            opcodeLengths.push_back(static_cast<uint8_t>(unit.fixed(1)));
+        }
+        if (!unit.ok() || lineRange == 0)
+        {
+            return;
+        }
+
+        // the unit's file names, as indexed by the line program
+        std::vector<std::string> files;
+        if (version >= 5)
+        {
+            std::vector<const char*> dirPaths, filePaths;
+            std::vector<uint64_t> unused, fileDirs;
+            if (!readEntries(unit, is64, dirPaths, unused) ||
+                !readEntries(unit, is64, filePaths, fileDirs))
+            {
+                return;
+            }
+            for (size_t i = 0; i < filePaths.size(); ++i)
+            {
+                const char* dir = fileDirs[i] < dirPaths.size() ? dirPaths[fileDirs[i]] : "";
+                files.push_back(joinPath(dir, filePaths[i]));
+            }
+        }
+        else
+        {
+            // directory 0 is the compilation directory (not listed), file 0 is invalid
+            std::vector<const char*> dirs(1, "");
+            for (const char* dir = unit.cstr(); unit.ok() && *dir != '\0'; dir = unit.cstr())
+            {
+                dirs.push_back(dir);
+            }
+            files.emplace_back();
+            for (const char* file = unit.cstr(); unit.ok() && *file != '\0'; file = unit.cstr())
+            {
+                const uint64_t dir = unit.uleb();
+                unit.uleb(); // modification time
+                unit.uleb(); // file size
+                files.push_back(joinPath(dir < dirs.size() ? dirs[dir] : "", file));
+            }
+            if (!unit.ok())
+            {
+                return;
+            }
+        }
+
+        if (program > unit.pos() + unit.remaining())
+        {
+            return;
+        }
+        unit.skip(static_cast<uint64_t>(program - unit.pos()));
+        runProgram(unit, addressSize, minInstLength, lineBase, lineRange, opcodeBase,
+                   opcodeLengths, files);
+    }
+
+    static std::string joinPath(const char* dir, const char* file)
+    {
+        if (file[0] == '/' || dir[0] == '\0')
+        {
+            return file;
+        }
+        std::string path = dir;
+        if (path.back() != '/')
+        {
+            path += '/';
+        }
+        return path + file;
+    }
+
+    void runProgram(DwarfReader& unit, size_t addressSize, uint64_t minInstLength, int8_t lineBase,
+                    uint64_t lineRange, uint8_t opcodeBase, const std::vector<uint8_t>& lengths,
+                    const std::vector<std::string>& files)
+    {
+        // the file index of the unit -> the offset in m_strings
+        std::map<uint64_t, uint32_t> fileOffsets;
+        auto fileOffset = [&](uint64_t file) -> uint32_t {
+            auto it = fileOffsets.find(file);
+            if (it == fileOffsets.end())
+            {
+                const std::string name = file < files.size() ? files[file] : std::string("??");
+                it = fileOffsets.emplace(file, addString(name)).first;
+            }
+            return it->second;
+        };
+
+        std::vector<PendingRow> sequence;
+        uint64_t address = 0;
+        uint64_t file = 1;
+        int64_t line = 1;
+
+        auto emitRow = [&](bool endSequence) {
+            const auto row = PendingRow{ address, static_cast<uint32_t>(file),
+                                         static_cast<uint32_t>(line), endSequence };
+            // only keep the rows that change the location
+            if (endSequence || sequence.empty() || sequence.back().file != row.file ||
+                sequence.back().line != row.line)
+            {
+                sequence.push_back(row);
+            }
+        };
+        auto endSequence = [&]() {
+            line = 0;
+            emitRow(true);
+            // code removed by the linker keeps address 0 (or a tombstone) at the start
+            const uint64_t start = sequence.front().address;
+            if (start != 0 && start != UINT64_MAX && start != UINT32_MAX)
+            {
+                for (const PendingRow& row : sequence)
+                {
+                    const uint32_t offset = row.endSequence ? s_NO_LINE : fileOffset(row.file);
+                    m_rows.push_back(LineIndexRow{ row.address, offset, row.line });
+                }
+            }
+            sequence.clear();
+            address = 0;
+            file = 1;
+            line = 1;
+        };
+
+        while (!unit.atEnd() && unit.ok())
+        {
+            const auto opcode = static_cast<uint8_t>(unit.fixed(1));
+            if (opcode >= opcodeBase)
+            {
+                // special opcode: advance both, then add a row
+                const uint64_t adjusted = opcode - opcodeBase;
+                address += minInstLength * (adjusted / lineRange);
+                line += lineBase + static_cast<int64_t>(adjusted % lineRange);
+                emitRow(false);
+            }
+            else if (opcode == 0)
+            {
+                // extended opcode
+                const uint64_t length = unit.uleb();
+                if (length == 0 || length > unit.remaining())
+                {
+                    break;
+                }
+                const uint8_t* next = unit.pos() + length;
+                const auto sub = static_cast<uint8_t>(unit.fixed(1));
+                if (sub == DW_LNE_end_sequence)
+                {
+                    endSequence();
+                }
+                else if (sub == DW_LNE_set_address)
+                {
+                    address = unit.fixed(std::min<size_t>(static_cast<size_t>(length - 1),
+                                                          std::max<size_t>(addressSize, 1)));
+                }
+                unit.skip(static_cast<uint64_t>(next - unit.pos()));
+            }
+            else
+            {
+                switch (opcode)
+                {
+                case DW_LNS_copy:
+                    emitRow(false);
+                    break;
+                case DW_LNS_advance_pc:
+                    address += minInstLength * unit.uleb();
+                    break;
+                case DW_LNS_advance_line:
+                    line += unit.sleb();
+                    break;
+                case DW_LNS_set_file:
+                    file = unit.uleb();
+                    break;
+                case DW_LNS_const_add_pc:
+                    address += minInstLength * ((255U - opcodeBase) / lineRange);
+                    break;
+                case DW_LNS_fixed_advance_pc:
+                    address += unit.fixed(2);
+                    break;
+                default:
+                    // skip the (ULEB128) operands of all other standard opcodes
+                    for (unsigned i = 0; i < lengths[opcode - 1U]; ++i)
+                    {
+                        unit.uleb();
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    const DebugSections& m_sections;
+    std::vector<LineIndexRow> m_rows;
+    std::string m_strings;
+    std::unordered_map<std::string, uint32_t> m_stringOffsets;
+};
+
+/// Finds the debug sections of an ELF file.
+template <class Ehdr, class Shdr>
+static bool findDebugSections(const char* image, size_t size, DebugSections& sections)
+{
+    Ehdr ehdr;
+    if (size < sizeof(ehdr))
+    {
+        return false;
+    }
+    memcpy(&ehdr, image, sizeof(ehdr));
+    if (ehdr.e_shentsize != sizeof(Shdr) || ehdr.e_shoff > size ||
+        ehdr.e_shnum > (size - ehdr.e_shoff) / sizeof(Shdr) || ehdr.e_shstrndx >= ehdr.e_shnum)
+    {
+        return false;
+    }
+
+    auto section = [&](size_t i) {
+        Shdr shdr;
+        memcpy(&shdr, image + ehdr.e_shoff + i * sizeof(Shdr), sizeof(shdr));
+        return shdr;
+    };
+    const Shdr names = section(ehdr.e_shstrndx);
+    if (names.sh_offset > size || names.sh_size > size - names.sh_offset)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < ehdr.e_shnum; ++i)
+    {
+        const Shdr shdr = section(i);
+        if (shdr.sh_type == SHT_NOBITS || shdr.sh_name >= names.sh_size ||
+            shdr.sh_offset > size || shdr.sh_size > size - shdr.sh_offset)
+        {
+            continue;
+        }
+        const char* name = image + names.sh_offset + shdr.sh_name;
+        if (strnlen(name, names.sh_size - shdr.sh_name) == names.sh_size - shdr.sh_name)
+        {
+            continue;
+        }
+        const auto* data = reinterpret_cast<const uint8_t*>(image + shdr.sh_offset);
+        const auto dataSize = static_cast<size_t>(shdr.sh_size);
+        // compressed sections would need zlib
+        const bool compressed = (shdr.sh_flags & SHF_COMPRESSED) != 0;
+        if (strcmp(name, ".debug_line") == 0 && !compressed)
+        {
+            sections.line = data;
+            sections.lineSize = dataSize;
+        }
+        else if (strcmp(name, ".debug_line_str") == 0 && !compressed)
+        {
+            sections.lineStr = data;
+            sections.lineStrSize = dataSize;
+        }
+        else if (strcmp(name, ".debug_str") == 0 && !compressed)
+        {
+            sections.str = data;
+            sections.strSize = dataSize;
+        }
+    }
+    return sections.line != nullptr;
+}
+
+} // namespace
+
+bool buildLineIndex(const char* image, size_t size, std::vector<char>& index)
+{
+    if (size < EI_NIDENT || memcmp(image, ELFMAG, SELFMAG) != 0 ||
+        image[EI_DATA] != ELFDATA2LSB)
+    {
+        return false;
+    }
+    DebugSections sections;
+    const bool found = image[EI_CLASS] == ELFCLASS64
+                         ? findDebugSections<Elf64_Ehdr, Elf64_Shdr>(image, size, sections)
+                         : findDebugSections<Elf32_Ehdr, Elf32_Shdr>(image, size, sections);
+    if (!found)
+    {
+        return false;
+    }
+
+    LineIndexBuilder builder(sections);
+    if (!builder.parse())
+    {
+        return false;
+    }
+    builder.write(index);
+    return true;
+}
+
+#else // !OOOPSI_LINUX
+
+bool buildLineIndex(const char* /*image*/, size_t /*size*/, std::vector<char>& /*index*/)
+{
+    // only ELF files are supported
+    return false;
+}
+
+#endif // OOOPSI_LINUX
+
+bool isValidLineIndex(const char* index, size_t size) noexcept
+{
+    LineIndexHeader header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, index, sizeof(header));
+    const uint64_t payload = size - sizeof(header);
+    return memcmp(header.magic, s_LINE_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+           header.numRows <= payload / sizeof(LineIndexRow) &&
+           header.stringsSize == payload - header.numRows * sizeof(LineIndexRow) &&
+           (header.stringsSize == 0 || index[size - 1] == '\0');
+}
+
+bool lookupLine(const char* index, uint64_t address, SourceLocation& location) noexcept
+{
+    LineIndexHeader header;
+    memcpy(&header, index, sizeof(header));
+    const char* rows = index + sizeof(header);
+    const char* strings = rows + header.numRows * sizeof(LineIndexRow);
+
+    auto rowAt = [&](uint64_t i) {
+        LineIndexRow row;
+        memcpy(&row, rows + i * sizeof(LineIndexRow), sizeof(row));
+        return row;
+    };
+
+    // find the last row at or before the address
+    uint64_t low = 0;
+    uint64_t high = header.numRows;
+    while (low < high)
+    {
+        const uint64_t mid = low + (high - low) / 2;
+        if (rowAt(mid).address <= address)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low == 0)
+    {
+        return false;
+    }
+    const LineIndexRow row = rowAt(low - 1);
+    if (row.file == s_NO_LINE || row.file >= header.stringsSize)
+    {
+        return false;
+    }
+    location.file = strings + row.file;
+    location.line = row.line;
+    return true;
+}
+
+} // namespace ooopsi
@@ -0,0 +1,86 @@
+/**
+ * @file    lineindex.hpp
+ * @brief   compact address-to-line index of a module, built from the DWARF line tables
+ *
+ * The index is built once per module (parsing the line programs of all compilation units takes a
+ * while) and looked up with a binary search afterwards. It's a single position-independent block
+ * of memory, so it can be kept in a read-only mapping or persisted in a file and mapped again.
+ * Used by the library (see prepareSourceLines()) and by the offline "ooopsi-symbolize" tool.
+ *
+ * Layout (all integers in the byte order of the host, no padding between the parts):
+ *  - LineIndexHeader
+ *  - rows (LineIndexHeader::numRows x LineIndexRow, sorted by address)
+ *  - file names (LineIndexHeader::stringsSize bytes of NUL-terminated strings)
+ */
+
+#ifndef LINEINDEX_HPP_
+#define LINEINDEX_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ooopsi
+{
+
+/// identifies a line index (and its version)
+static constexpr char s_LINE_INDEX_MAGIC[8] = { 'O', 'O', 'O', 'P', 'S', 'I', 'L', '1' };
+
+/// The fixed-size start of a line index.
+struct LineIndexHeader
+{
+    /// s_LINE_INDEX_MAGIC
+    char magic[8];
+    /// number of rows
+    uint64_t numRows;
+    /// size of the file names in bytes
+    uint64_t stringsSize;
+};
+
+/// A row of the index: the code from 'address' up to the next row's address belongs to the line.
+struct LineIndexRow
+{
+    /// the module-relative (i.e. link-time) address
+    uint64_t address;
+    /// offset of the file name (s_NO_LINE: the end of a sequence, i.e. no code)
+    uint32_t file;
+    /// the line number (1-based)
+    uint32_t line;
+};
+
+/// LineIndexRow::file of rows without line information
+static constexpr uint32_t s_NO_LINE = UINT32_MAX;
+
+/// A location in the source code.
+struct SourceLocation
+{
+    /// the file name (including the directory, if known)
+    const char* file = nullptr;
+    /// the line number
+    uint32_t line = 0;
+};
+
+/// Builds the line index of an ELF file. Compressed debug sections aren't supported.
+///
+/// @param[in]  image   the contents of the ELF file
+/// @param[in]  size    size of 'image' in bytes
+/// @param[out] index   receives the index
+/// @return false if the file has no (usable) line tables
+bool buildLineIndex(const char* image, size_t size, std::vector<char>& index);
+
+/// Checks the header and the size of a line index (e.g. after loading it from a file).
+bool isValidLineIndex(const char* index, size_t size) noexcept;
+
+/// Looks up the source line of an address in a (valid) index.
+/// This function doesn't allocate and is safe to use in signal handlers.
+///
+/// @param[in]  index       the index
+/// @param[in]  address     the module-relative address
+/// @param[out] location    the location (the file name points into the index)
+/// @return true if found
+bool lookupLine(const char* index, uint64_t address, SourceLocation& location) noexcept;
+
+} // namespace ooopsi
+
+
+#endif /* LINEINDEX_HPP_ */
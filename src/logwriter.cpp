@@ -0,0 +1,190 @@
+/**
+ * @file    logwriter.cpp
+ * @brief   line-wise or buffered output of log messages and stack traces
+ */
+
+#include "internal.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#ifdef OOOPSI_WINDOWS
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace ooopsi
+{
+
+/// size of the shared output buffer (enough for a full trace with long names)
+static constexpr size_t s_LOG_BUFFER_SIZE = 64 * 1024;
+
+/// the shared output buffer
+static char s_logBuffer[s_LOG_BUFFER_SIZE];
+/// set while a LogWriter uses s_logBuffer
+static std::atomic_flag s_logBufferInUse = ATOMIC_FLAG_INIT;
+
+
+void writeAll(int fd, const char* data, size_t length) noexcept
+{
+    while (length > 0)
+    {
+#ifdef OOOPSI_WINDOWS
+        const unsigned int chunk = static_cast<unsigned int>(std::min<size_t>(length, INT_MAX));
+        const int written = _write(fd, data, chunk);
+#else
+        const ssize_t written = write(fd, data, length);
+#endif
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            // nothing we can do about it...
+            return;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+}
+
+
+LogWriter::LogWriter(const LogSettings& settings) noexcept
+{
+    // explicit settings take precedence over the global ones
+    if (settings.logBlockFunc != nullptr)
+    {
+        m_logBlockFunc = settings.logBlockFunc;
+    }
+    else if (settings.logFd >= 0)
+    {
+        m_fd = settings.logFd;
+    }
+    else if (settings.logFunc != nullptr)
+    {
+        m_logFunc = settings.logFunc;
+    }
+    else if (getAbortLogFd() >= 0)
+    {
+        m_fd = getAbortLogFd();
+    }
+    else
+    {
+        m_logFunc = getAbortLogFunc();
+    }
+
+    if (m_logFunc == nullptr && !s_logBufferInUse.test_and_set(std::memory_order_acquire))
+    {
+        m_buffer = s_logBuffer;
+    }
+}
+
+LogWriter::~LogWriter()
+{
+    finish();
+}
+
+void LogWriter::line(const char* text) noexcept
+{
+    if (m_finished)
+    {
+        return;
+    }
+    if (m_logFunc != nullptr)
+    {
+        const StatTimer timer(Stat::LOG_NANOSECONDS);
+        m_logFunc(text);
+        return;
+    }
+    append(text, strlen(text), true);
+}
+
+void LogWriter::block(const char* data, size_t length) noexcept
+{
+    if (m_finished || m_logFunc != nullptr)
+    {
+        return;
+    }
+    append(data, length, false);
+}
+
+void LogWriter::append(const char* data, size_t length, bool newline) noexcept
+{
+    const size_t total = length + (newline ? 1 : 0);
+    if (m_buffer == nullptr)
+    {
+        // no buffer available: pass on every line
+        emit(data, length);
+        emit("\n", newline ? 1 : 0);
+        return;
+    }
+    if (m_length + total > s_LOG_BUFFER_SIZE)
+    {
+        emit(m_buffer, m_length);
+        m_length = 0;
+        if (total > s_LOG_BUFFER_SIZE)
+        {
+            emit(data, length);
+            emit("\n", newline ? 1 : 0);
+            return;
+        }
+    }
+    memcpy(m_buffer + m_length, data, length);
+    if (newline)
+    {
+        m_buffer[m_length + length] = '\n';
+    }
+    m_length += total;
+}
+
+void LogWriter::finish() noexcept
+{
+    if (m_finished)
+    {
+        return;
+    }
+    m_finished = true;
+
+    if (m_logFunc != nullptr)
+    {
+        // allow logging to stop
+        const StatTimer timer(Stat::LOG_NANOSECONDS);
+        m_logFunc(nullptr);
+        return;
+    }
+    if (m_buffer != nullptr)
+    {
+        emit(m_buffer, m_length);
+        m_buffer = nullptr;
+        s_logBufferInUse.clear(std::memory_order_release);
+    }
+    if (m_logBlockFunc != nullptr)
+    {
+        const StatTimer timer(Stat::LOG_NANOSECONDS);
+        m_logBlockFunc(nullptr, 0);
+    }
+}
+
+void LogWriter::emit(const char* text, size_t length) noexcept
+{
+    if (length == 0)
+    {
+        return;
+    }
+    const StatTimer timer(Stat::LOG_NANOSECONDS);
+    if (m_logBlockFunc != nullptr)
+    {
+        m_logBlockFunc(text, length);
+    }
+    else
+    {
+        writeAll(m_fd, text, length);
+    }
+}
+
+} // namespace ooopsi
@@ -0,0 +1,549 @@
+/**
+ * @file    modulemap.cpp
+ * @brief   process-wide snapshot of the loaded modules
+ *
+ * The map is a statically allocated array of module slots plus a string pool for the paths. Slots
+ * are appended when a module is loaded and only flagged as unloaded later, but never reused, so
+ * readers can access them without any locks (e.g. from signal handlers). Writers are serialized by
+ * a mutex, which readers never touch.
+ *
+ * The map is filled by HandlerSetup. On Linux, it's refreshed by the functions that symbolize
+ * outside of crash reports (e.g. collectStackTrace()), by setCrashRecordFd() and by the profiler's
+ * and the watchdog's background threads; a refresh is cheap unless the loader's counters of added
+ * and removed modules changed. (Overriding dlopen() instead would break the caller-dependent lookup
+ * of RUNPATH, $ORIGIN and the linker namespace of every dlopen() in the process.) On Windows, the
+ * map is kept up to date by the loader's DLL notifications. Not supported on macOS (yet).
+ */
+
+#include "internal.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef OOOPSI_LINUX
+#include <elf.h>
+#include <link.h>
+#include <unistd.h>
+#endif
+#ifdef OOOPSI_WINDOWS
+#include <tlhelp32.h>
+#include <winternl.h>
+#endif
+
+namespace ooopsi
+{
+
+static_assert(ATOMIC_BOOL_LOCK_FREE == 2, "the module map requires lock-free booleans");
+static_assert(ATOMIC_POINTER_LOCK_FREE == 2, "the module map requires lock-free counters");
+
+/// number of bytes available for all module paths
+static constexpr size_t s_MODULE_PATH_POOL_SIZE = 256 * 1024;
+/// maximum length of a build-id (GNU build-ids are usually 20 bytes, CodeView IDs are 20 bytes)
+static constexpr size_t s_MAX_BUILD_ID = 32;
+
+namespace
+{
+
+/// A module slot, written once (except for 'loaded').
+struct ModuleSlot
+{
+    /// false once the module has been unloaded
+    std::atomic<bool> loaded;
+    uintptr_t base;
+    uintptr_t start;
+    uintptr_t end;
+    /// offset of the path in s_pathPool
+    uint32_t path;
+    uint32_t buildIdLength;
+    uint8_t buildId[s_MAX_BUILD_ID];
+    /// found by the current refresh? (only used by writers)
+    bool seen;
+};
+
+/// A module found while enumerating the loaded modules.
+struct ModuleCandidate
+{
+    uintptr_t base = 0;
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    std::string path;
+    uint32_t buildIdLength = 0;
+    uint8_t buildId[s_MAX_BUILD_ID];
+};
+
+#ifdef OOOPSI_WINDOWS
+using ModuleMapMutex = DbgHelpMutex;
+#else
+using ModuleMapMutex = std::mutex;
+#endif
+
+} // namespace
+
+/// the modules (zero-initialized, i.e. all slots are unused)
+static ModuleSlot s_modules[s_MAX_MODULES];
+/// number of published slots
+static std::atomic<size_t> s_numModules{ 0 };
+/// storage for all paths
+static char s_pathPool[s_MODULE_PATH_POOL_SIZE];
+/// number of used bytes in s_pathPool (guarded by s_moduleMapMutex)
+static size_t s_pathPoolUsed = 0;
+/// serializes all modifications
+static ModuleMapMutex s_moduleMapMutex;
+
+
+/// Appends a new slot for the candidate, unless the map is full.
+/// Note: the caller must hold s_moduleMapMutex.
+static void appendModule(const ModuleCandidate& module) noexcept
+{
+    const size_t index = s_numModules.load(std::memory_order_relaxed);
+    const size_t pathLen = module.path.size() + 1;
+    if (index >= s_MAX_MODULES || s_pathPoolUsed + pathLen > sizeof(s_pathPool))
+    {
+        // full: the crash output won't contain module infos for this one
+        return;
+    }
+    memcpy(s_pathPool + s_pathPoolUsed, module.path.c_str(), pathLen);
+
+    ModuleSlot& slot = s_modules[index];
+    slot.base = module.base;
+    slot.start = module.start;
+    slot.end = module.end;
+    slot.path = static_cast<uint32_t>(s_pathPoolUsed);
+    slot.buildIdLength = module.buildIdLength;
+    memcpy(slot.buildId, module.buildId, module.buildIdLength);
+    slot.seen = true;
+    slot.loaded.store(true, std::memory_order_relaxed);
+    s_pathPoolUsed += pathLen;
+
+    // publish the slot
+    s_numModules.store(index + 1, std::memory_order_release);
+}
+
+/// Merges the currently loaded modules into the map: new ones are appended, and if requested,
+/// the ones that aren't loaded anymore are flagged.
+/// Note: the caller must hold s_moduleMapMutex.
+static void mergeModules(const std::vector<ModuleCandidate>& modules, bool removeMissing) noexcept
+{
+    const size_t numSlots = s_numModules.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < numSlots; ++i)
+    {
+        s_modules[i].seen = false;
+    }
+
+    for (const auto& module : modules)
+    {
+        bool found = false;
+        for (size_t i = 0; i < numSlots && !found; ++i)
+        {
+            ModuleSlot& slot = s_modules[i];
+            if (slot.loaded.load(std::memory_order_relaxed) && slot.base == module.base &&
+                slot.start == module.start && slot.end == module.end &&
+                module.path == s_pathPool + slot.path)
+            {
+                slot.seen = true;
+                found = true;
+            }
+        }
+        if (!found)
+        {
+            appendModule(module);
+        }
+    }
+
+    if (removeMissing)
+    {
+        for (size_t i = 0; i < numSlots; ++i)
+        {
+            if (!s_modules[i].seen)
+            {
+                s_modules[i].loaded.store(false, std::memory_order_release);
+            }
+        }
+    }
+}
+
+
+#ifdef OOOPSI_LINUX
+
+/// number of modules added and removed by the dynamic linker, as of the last merge
+/// (guarded by s_moduleMapMutex)
+static unsigned long long s_mergedLoaderChanges = 0;
+static bool s_moduleMapInitialized = false;
+
+/// Returns the number of modules added and removed by the dynamic linker so far.
+static unsigned long long loaderChanges() noexcept
+{
+    unsigned long long changes = 0;
+    dl_iterate_phdr(
+      [](dl_phdr_info* info, size_t size, void* data) {
+          // these fields were added later, and we can stop after the first module
+          if (size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+          {
+              *static_cast<unsigned long long*>(data) = info->dlpi_adds + info->dlpi_subs;
+          }
+          return 1;
+      },
+      &changes);
+    return changes;
+}
+
+/// Looks for the GNU build-id note in the module's segments.
+static void findBuildId(const dl_phdr_info& info, ModuleCandidate& module) noexcept
+{
+    for (ElfW(Half) i = 0; i < info.dlpi_phnum; ++i)
+    {
+        const ElfW(Phdr)& phdr = info.dlpi_phdr[i];
+        if (phdr.p_type != PT_NOTE)
+        {
+            continue;
+        }
+        auto pos = static_cast<uintptr_t>(info.dlpi_addr + phdr.p_vaddr);
+        const uintptr_t end = pos + phdr.p_memsz;
+        while (pos + sizeof(ElfW(Nhdr)) <= end)
+        {
+            const auto* note = reinterpret_cast<const ElfW(Nhdr)*>(pos);
+            // name and descriptor are 4-byte aligned
+            const uintptr_t name = pos + sizeof(ElfW(Nhdr));
+            const uintptr_t desc = name + ((note->n_namesz + 3U) & ~3U);
+            const uintptr_t next = desc + ((note->n_descsz + 3U) & ~3U);
+            if (next > end)
+            {
+                break;
+            }
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+                memcmp(reinterpret_cast<const char*>(name), "GNU", 4) == 0 &&
+                note->n_descsz <= s_MAX_BUILD_ID)
+            {
+                module.buildIdLength = static_cast<uint32_t>(note->n_descsz);
+                memcpy(module.buildId, reinterpret_cast<const void*>(desc), note->n_descsz);
+                return;
+            }
+            pos = next;
+        }
+    }
+}
+
+/// Callback for dl_iterate_phdr(): adds a module to the list of candidates.
+static int collectModule(dl_phdr_info* info, size_t /*size*/, void* data)
+{
+    auto& modules = *static_cast<std::vector<ModuleCandidate>*>(data);
+
+    ModuleCandidate module;
+    module.base = static_cast<uintptr_t>(info->dlpi_addr);
+    module.start = UINTPTR_MAX;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i)
+    {
+        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type == PT_LOAD)
+        {
+            const uintptr_t start = module.base + phdr.p_vaddr;
+            module.start = std::min(module.start, start);
+            module.end = std::max(module.end, start + phdr.p_memsz);
+        }
+    }
+    if (module.end == 0)
+    {
+        // nothing mapped (e.g. the vDSO on some systems)
+        return 0;
+    }
+
+    if (info->dlpi_name != nullptr && info->dlpi_name[0] != '\0')
+    {
+        module.path = info->dlpi_name;
+    }
+    else
+    {
+        // the main executable has no name
+        char exePath[4096];
+        const ssize_t len = readlink("/proc/self/exe", exePath, sizeof(exePath));
+        if (len > 0)
+        {
+            module.path.assign(exePath, static_cast<size_t>(len));
+        }
+    }
+    findBuildId(*info, module);
+
+    modules.push_back(module);
+    return 0;
+}
+
+void refreshModuleMap() noexcept
+{
+    try
+    {
+        const unsigned long long changes = loaderChanges();
+        {
+            const std::lock_guard<ModuleMapMutex> lock(s_moduleMapMutex);
+            if (s_moduleMapInitialized && changes == s_mergedLoaderChanges)
+            {
+                return;
+            }
+        }
+
+        // enumerate without holding the lock, module constructors might call dlopen(), too
+        std::vector<ModuleCandidate> modules;
+        modules.reserve(64);
+        dl_iterate_phdr(collectModule, &modules);
+
+        const std::lock_guard<ModuleMapMutex> lock(s_moduleMapMutex);
+        // the counter only increases: skip this list if a newer one was merged in the meantime
+        if (!s_moduleMapInitialized || changes > s_mergedLoaderChanges)
+        {
+            mergeModules(modules, true);
+            s_mergedLoaderChanges = changes;
+            s_moduleMapInitialized = true;
+        }
+    }
+    catch (...)
+    {
+        // out of memory: keep the old snapshot
+    }
+}
+
+#elif defined(OOOPSI_WINDOWS)
+
+/// The data passed to DLL notifications (LDR_DLL_LOADED_NOTIFICATION_DATA and
+/// LDR_DLL_UNLOADED_NOTIFICATION_DATA have the same layout).
+struct DllNotificationData
+{
+    ULONG flags;
+    const UNICODE_STRING* fullDllName;
+    const UNICODE_STRING* baseDllName;
+    PVOID dllBase;
+    ULONG sizeOfImage;
+};
+
+/// reasons for DLL notifications
+static constexpr ULONG s_DLL_NOTIFICATION_LOADED = 1;
+static constexpr ULONG s_DLL_NOTIFICATION_UNLOADED = 2;
+
+/// the notification registration (nullptr: no notifications, refresh on every call)
+static PVOID s_moduleNotificationCookie = nullptr;
+static bool s_moduleMapInitialized = false;
+
+/// Reads the CodeView GUID and age (that identify the PDB file) from a loaded module.
+static void findBuildId(uintptr_t base, ModuleCandidate& module) noexcept
+{
+    const auto* dosHeader = reinterpret_cast<const IMAGE_DOS_HEADER*>(base);
+    if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+    {
+        return;
+    }
+    const auto* ntHeaders = reinterpret_cast<const IMAGE_NT_HEADERS*>(
+      base + static_cast<uintptr_t>(dosHeader->e_lfanew));
+    if (ntHeaders->Signature != IMAGE_NT_SIGNATURE ||
+        ntHeaders->OptionalHeader.NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_DEBUG)
+    {
+        return;
+    }
+    const IMAGE_DATA_DIRECTORY& debugDir =
+      ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+    const auto* entries = reinterpret_cast<const IMAGE_DEBUG_DIRECTORY*>(
+      base + static_cast<uintptr_t>(debugDir.VirtualAddress));
+    const size_t numEntries = debugDir.Size / sizeof(IMAGE_DEBUG_DIRECTORY);
+    for (size_t i = 0; debugDir.VirtualAddress != 0 && i < numEntries; ++i)
+    {
+        // "RSDS", GUID (16 bytes), age (4 bytes), PDB path
+        const IMAGE_DEBUG_DIRECTORY& entry = entries[i];
+        if (entry.Type == IMAGE_DEBUG_TYPE_CODEVIEW && entry.AddressOfRawData != 0 &&
+            entry.SizeOfData >= 24)
+        {
+            const auto* data =
+              reinterpret_cast<const char*>(base + static_cast<uintptr_t>(entry.AddressOfRawData));
+            if (memcmp(data, "RSDS", 4) == 0)
+            {
+                module.buildIdLength = 20;
+                memcpy(module.buildId, data + 4, module.buildIdLength);
+                return;
+            }
+        }
+    }
+}
+
+/// Converts a (not necessarily NUL-terminated) wide string to UTF-8.
+static std::string toUtf8(const wchar_t* str, int length)
+{
+    std::string result;
+    const int size = WideCharToMultiByte(CP_UTF8, 0, str, length, nullptr, 0, nullptr, nullptr);
+    if (size > 0)
+    {
+        result.resize(static_cast<size_t>(size));
+        WideCharToMultiByte(CP_UTF8, 0, str, length, &result[0], size, nullptr, nullptr);
+    }
+    return result;
+}
+
+/// Creates a candidate for a loaded module.
+static ModuleCandidate makeCandidate(const void* base, size_t size, std::string path)
+{
+    ModuleCandidate module;
+    module.base = reinterpret_cast<uintptr_t>(base);
+    module.start = module.base;
+    module.end = module.base + size;
+    module.path = std::move(path);
+    findBuildId(module.base, module);
+    return module;
+}
+
+/// Called by the loader (while holding the loader lock!) when a DLL is loaded or unloaded.
+/// Note: this never waits for the loader lock while holding s_moduleMapMutex, so it's safe to
+/// lock it here.
+static VOID CALLBACK onModuleNotification(ULONG reason, const void* data, PVOID /*ctx*/)
+{
+    const auto& details = *static_cast<const DllNotificationData*>(data);
+    const auto base = reinterpret_cast<uintptr_t>(details.dllBase);
+    try
+    {
+        if (reason == s_DLL_NOTIFICATION_LOADED)
+        {
+            std::vector<ModuleCandidate> modules;
+            modules.push_back(makeCandidate(
+              details.dllBase, details.sizeOfImage,
+              toUtf8(details.fullDllName->Buffer,
+                     static_cast<int>(details.fullDllName->Length / sizeof(wchar_t)))));
+
+            const std::lock_guard<ModuleMapMutex> lock(s_moduleMapMutex);
+            mergeModules(modules, false);
+        }
+        else if (reason == s_DLL_NOTIFICATION_UNLOADED)
+        {
+            const std::lock_guard<ModuleMapMutex> lock(s_moduleMapMutex);
+            const size_t numSlots = s_numModules.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < numSlots; ++i)
+            {
+                if (s_modules[i].base == base)
+                {
+                    s_modules[i].loaded.store(false, std::memory_order_release);
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        // out of memory: the module won't be listed
+    }
+}
+
+void refreshModuleMap() noexcept
+{
+    try
+    {
+        {
+            const std::lock_guard<ModuleMapMutex> lock(s_moduleMapMutex);
+            if (s_moduleMapInitialized && s_moduleNotificationCookie != nullptr)
+            {
+                // kept up to date by the notifications
+                return;
+            }
+            if (!s_moduleMapInitialized)
+            {
+                s_moduleMapInitialized = true;
+                auto registerFunc = reinterpret_cast<LdrRegisterDllNotificationFunc>(
+                  GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "LdrRegisterDllNotification"));
+                if (registerFunc == nullptr ||
+                    registerFunc(0, onModuleNotification, nullptr, &s_moduleNotificationCookie) !=
+                      0)
+                {
+                    s_moduleNotificationCookie = nullptr;
+                }
+            }
+        }
+
+        // enumerate without holding the lock (the snapshot takes the loader lock)
+        std::vector<ModuleCandidate> modules;
+        HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, GetCurrentProcessId());
+        if (snapshot == INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+        MODULEENTRY32W entry;
+        entry.dwSize = sizeof(entry);
+        for (BOOL ok = Module32FirstW(snapshot, &entry); ok; ok = Module32NextW(snapshot, &entry))
+        {
+            const auto pathLength = static_cast<int>(wcslen(entry.szExePath));
+            modules.push_back(makeCandidate(entry.modBaseAddr, entry.modBaseSize,
+                                            toUtf8(entry.szExePath, pathLength)));
+        }
+        CloseHandle(snapshot);
+
+        const std::lock_guard<ModuleMapMutex> lock(s_moduleMapMutex);
+        // with notifications, unloaded modules are flagged by the callback
+        mergeModules(modules, s_moduleNotificationCookie == nullptr);
+    }
+    catch (...)
+    {
+        // out of memory: keep the old snapshot
+    }
+}
+
+#else // macOS
+
+void refreshModuleMap() noexcept
+{
+    // not supported (yet)
+}
+
+#endif // OOOPSI_LINUX/WINDOWS
+
+
+size_t numModuleSlots() noexcept
+{
+    return s_numModules.load(std::memory_order_acquire);
+}
+
+bool getModule(size_t index, ModuleInfo& info) noexcept
+{
+    if (index >= numModuleSlots())
+    {
+        return false;
+    }
+    const ModuleSlot& slot = s_modules[index];
+    if (!slot.loaded.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    info.base = slot.base;
+    info.start = slot.start;
+    info.end = slot.end;
+    info.path = s_pathPool + slot.path;
+    info.buildId = slot.buildId;
+    info.buildIdLength = slot.buildIdLength;
+    return true;
+}
+
+bool findModule(pointer_t address, ModuleInfo& info, size_t* index) noexcept
+{
+    const auto addr = reinterpret_cast<uintptr_t>(address);
+    // newest first: a module loaded at the same address replaces an older one
+    for (size_t i = numModuleSlots(); i > 0; --i)
+    {
+        const ModuleSlot& slot = s_modules[i - 1];
+        if (addr >= slot.start && addr < slot.end && getModule(i - 1, info))
+        {
+            if (index != nullptr)
+            {
+                *index = i - 1;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* moduleName(const ModuleInfo& info) noexcept
+{
+    const char* name = info.path;
+    for (const char* pos = info.path; *pos != '\0'; ++pos)
+    {
+        if (*pos == '/' || *pos == '\\')
+        {
+            name = pos + 1;
+        }
+    }
+    return name;
+}
+
+} // namespace ooopsi
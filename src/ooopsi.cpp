@@ -4,10 +4,17 @@
  */
 
 #include "ooopsi.hpp"
+#include "internal.hpp"
 
 #include <cstdio>
 #include <cstdlib>
 
+#ifdef OOOPSI_LINUX
+#include <csignal>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace ooopsi
 {
 
@@ -31,6 +38,8 @@ static void logToStderr(const char* message) noexcept
 
 /// the log function to use
 static LogFunc s_logFunc = logToStderr;
+/// the file descriptor to use instead (if set)
+static int s_logFd = -1;
 
 void setAbortLogFunc(LogFunc func) noexcept
 {
@@ -49,27 +58,203 @@ LogFunc getAbortLogFunc() noexcept
     return s_logFunc;
 }
 
-[[noreturn]] void abort(const char* reason, AbortSettings settings, const pointer_t* faultAddr) {
-    if (settings.logFunc == nullptr)
+void setAbortLogFd(int fd) noexcept
+{
+    s_logFd = fd >= 0 ? fd : -1;
+}
+
+int getAbortLogFd() noexcept
+{
+    return s_logFd;
+}
+
+/// the format of the handlers' reports
+static LogFormat s_reportFormat = LogFormat::TEXT;
+
+void setCrashReportFormat(LogFormat format) noexcept
+{
+    s_reportFormat = format;
+}
+
+LogFormat getCrashReportFormat() noexcept
+{
+    return s_reportFormat;
+}
+
+/// report crashes in a forked child process?
+static bool s_forkedReports = false;
+
+void setForkedCrashReports(bool enabled) noexcept
+{
+    s_forkedReports = enabled;
+}
+
+bool getForkedCrashReports() noexcept
+{
+    return s_forkedReports;
+}
+
+/// Forks the process for reporting (if enabled): the parent exits right away.
+/// @return true in the child, false if this process has to report itself
+static bool forkReporter() noexcept
+{
+#ifdef OOOPSI_LINUX
+    if (!s_forkedReports)
     {
-        settings.logFunc = getAbortLogFunc();
+        return false;
     }
-
-    if (reason != nullptr)
+    // the raw system call: fork() runs the pthread_atfork() handlers (e.g. of malloc), which may
+    // wait for locks held by the crashed thread
+    const long pid = syscall(SYS_clone, SIGCHLD, 0, 0, 0, 0);
+    if (pid < 0)
+    {
+        return false;
+    }
+    if (pid > 0)
     {
-        settings.logFunc(reason);
+        std::_Exit(OOOPSI_EXIT_CODE);
     }
+    // the child has a copy of the memory (and the stacks), but only this thread
+    adoptCrashGate();
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// Writes the report of abort() in a structured format.
+static void reportStructured(LogWriter& writer, const AbortSettings& settings, const char* reason,
+                             const pointer_t* faultAddr, const SignalDetails* signal,
+                             const char* dumpPath) noexcept
+{
+    StructuredReport report;
+    report.reason = reason;
+    report.faultAddr = faultAddr;
+    report.signal = signal;
+    report.dumpPath = dumpPath;
+
+    const int recordFd = settings.crashRecordFd >= 0 ? settings.crashRecordFd : getCrashRecordFd();
+    report.recordWritten = recordFd >= 0 && writeCrashRecord(recordFd, reason, faultAddr, signal);
 
-    if (settings.printStackTrace)
+    BoundedTrace trace;
+    pointer_t addresses[s_MAX_STACK_FRAMES];
+    if (report.recordWritten || !settings.printStackTrace)
     {
-        printStackTrace(settings, faultAddr); // NOLINT (slicing is fine here)
+        // no frames
+    }
+    else if (signal != nullptr && signal->context != nullptr)
+    {
+        captureSignalStack(signal->context, trace, settings.unwinder);
+        report.trace = &trace;
     }
     else
     {
-        // allow logging to stop
-        settings.logFunc(nullptr);
+        report.addresses = addresses;
+        report.numAddresses =
+          captureStackAddresses(addresses, s_MAX_STACK_FRAMES, settings.unwinder);
+        report.truncated = report.numAddresses == s_MAX_STACK_FRAMES;
+    }
+    writeStructuredReport(writer, settings, report);
+}
+
+[[noreturn]] void abort(const char* reason, AbortSettings settings, const pointer_t* faultAddr,
+                        const SignalDetails* signal, const ThrowSite* throwSite) {
+    // only one thread reports, the others are parked until the process exits
+    if (!enterCrashGate())
+    {
+        // an error while reporting: the output so far is probably incomplete
+        LogWriter writer(settings);
+        if (reason != nullptr)
+        {
+            writer.line(reason);
+        }
+        writer.line("(while reporting a previous error)");
+        writer.finish();
+        std::_Exit(OOOPSI_EXIT_CODE);
     }
 
+    // the time until the process ends shouldn't depend on the report
+    const bool forked = forkReporter();
+    // the counters before the report (see printStats)
+    const Stats before = getStats();
+
+    // the reason and the trace end up in the same block of output (if buffered)
+    LogWriter writer(settings);
+    const bool structured = settings.format != LogFormat::TEXT;
+
+    if (reason != nullptr && !structured)
+    {
+        writer.line(reason);
+    }
+
+    // a few stores into the persistent journal, before anything that takes longer (or fails)
+    writeCrashJournal(reason, signal);
+
+    // the dump has the memory contents, in addition to the trace (or the record) below
+    const char* dumpPath = signal != nullptr ? writeCrashDump(reason, faultAddr, *signal) : nullptr;
+
+    if (structured)
+    {
+        // the same contents as fields of a single object (see structuredlog.hpp)
+        reportStructured(writer, settings, reason, faultAddr, signal, dumpPath);
+        writer.finish();
+        std::_Exit(OOOPSI_EXIT_CODE);
+    }
+
+    if (dumpPath != nullptr)
+    {
+        char buffer[1056];
+        writer.line(LineFormatter(buffer)
+                      .append("(crash dump written to ")
+                      .append(dumpPath)
+                      .append(')')
+                      .c_str());
+    }
+
+    // skip the symbolization if a crash record can be written instead
+    const int recordFd = settings.crashRecordFd >= 0 ? settings.crashRecordFd : getCrashRecordFd();
+    if (recordFd >= 0 && writeCrashRecord(recordFd, reason, faultAddr, signal))
+    {
+        writer.line("(crash record written)");
+    }
+    else if (settings.printStackTrace)
+    {
+        if (throwSite != nullptr)
+        {
+            printAddresses(writer, settings, "---------- THROWN AT ----------", throwSite->frames,
+                           throwSite->numFrames, nullptr, false);
+        }
+        if (signal != nullptr && signal->context != nullptr)
+        {
+            // start at the interrupted frame: the handler's frames would only take up space
+            // (and collapse recursion, a stack overflow would fill the trace otherwise)
+            BoundedTrace trace;
+            captureSignalStack(signal->context, trace, settings.unwinder);
+            printBoundedTrace(writer, settings, "---------- BACKTRACE ----------", trace,
+                              faultAddr);
+        }
+        else
+        {
+            printStackTrace(writer, settings, faultAddr); // NOLINT (slicing is fine here)
+        }
+        if (!forked)
+        {
+            dumpOtherThreads(writer, settings);
+        }
+    }
+
+    // what the application did before (in any case, it's cheap)
+    printBreadcrumbs(writer);
+
+    if (settings.printStats)
+    {
+        // (the output that is still buffered isn't included)
+        printStats(writer, before);
+    }
+
+    // allow logging to stop
+    writer.finish();
+
     // the application will now end
     std::_Exit(OOOPSI_EXIT_CODE);
 }
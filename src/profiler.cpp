@@ -0,0 +1,991 @@
+/**
+ * @file    profiler.cpp
+ * @brief   sampling CPU profiler
+ *
+ * Every profiled thread owns a slot with a ring buffer of samples (number of frames, followed by
+ * the frame addresses). The ring has a single producer, which is the thread's SIGPROF handler on
+ * Linux or the timer callback on Windows, and a single consumer (serialized by s_profileMutex),
+ * which aggregates the samples into a map of unique stacks. So the producer never takes a lock.
+ */
+
+#include "internal.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef OOOPSI_LINUX
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <ctime>
+#include <thread>
+
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// not defined by older C libraries
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif // OOOPSI_LINUX
+
+#ifdef OOOPSI_WINDOWS
+#include <tlhelp32.h>
+#endif
+
+// supported platforms
+#if defined(OOOPSI_LINUX) || (defined(OOOPSI_WINDOWS) && defined(_M_X64)) ||                      \
+  (defined(OOOPSI_WINDOWS) && defined(__x86_64__))
+#define OOOPSI_PROFILER
+#endif
+
+namespace ooopsi
+{
+
+#ifdef OOOPSI_PROFILER
+
+/// maximum number of threads that are profiled at the same time
+static constexpr size_t s_MAX_PROFILED_THREADS = 256;
+
+#ifdef OOOPSI_WINDOWS
+using ProfileMutex = DbgHelpMutex;
+using ThreadId = DWORD;
+#else
+using ProfileMutex = std::mutex;
+using ThreadId = pid_t;
+#endif
+
+namespace
+{
+
+/// A profiled thread and its samples.
+struct ProfileSlot
+{
+    /// positions (in words) in 'data': written by the producer resp. by the consumer
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    /// the ring buffer (nullptr: not allocated yet)
+    uint64_t* data;
+    /// capacity of 'data' in words (a power of 2)
+    size_t capacity;
+    /// samples that didn't fit
+    std::atomic<uint64_t> dropped;
+
+    /// the remaining members are only used by the profiler's own thread
+
+    /// profiling this thread?
+    bool used;
+    /// still running? (updated when scanning the threads)
+    bool seen;
+    ThreadId tid;
+#ifdef OOOPSI_WINDOWS
+    HANDLE thread;
+    /// CPU time at the last sample
+    ULONGLONG cpuTime;
+#else
+    timer_t timer;
+#endif
+
+    /// Adds a sample, or counts it as dropped if it doesn't fit.
+    void push(const pointer_t* frames, size_t numFrames) noexcept
+    {
+        const uint64_t pos = head.load(std::memory_order_relaxed);
+        if (capacity - (pos - tail.load(std::memory_order_acquire)) < numFrames + 1)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        const size_t mask = capacity - 1;
+        data[pos & mask] = numFrames;
+        for (size_t i = 0; i < numFrames; ++i)
+        {
+            data[(pos + 1 + i) & mask] = reinterpret_cast<uintptr_t>(frames[i]);
+        }
+        head.store(pos + 1 + numFrames, std::memory_order_release);
+    }
+};
+
+/// A unique stack, leaf frame first.
+using ProfileStack = std::vector<pointer_t>;
+
+} // namespace
+
+/// the profiled threads
+static ProfileSlot s_profileSlots[s_MAX_PROFILED_THREADS];
+/// the settings of the current run
+static ProfilerSettings s_profilerSettings;
+/// set while the profiler is running
+static std::atomic<bool> s_profilerRunning{ false };
+/// guards the members below and the consumer side of the slots
+static ProfileMutex s_profileMutex;
+/// the collected samples per unique stack
+static std::map<ProfileStack, uint64_t> s_profile;
+/// total number of dropped samples of the threads that exited
+static uint64_t s_profileDropped = 0;
+/// start of the current profile
+static std::chrono::system_clock::time_point s_profileStart;
+/// duration of the current profile (if stopped)
+static std::chrono::steady_clock::time_point s_profileSteadyStart;
+static std::chrono::steady_clock::duration s_profileDuration{};
+
+/// Moves the samples of a slot into s_profile.
+/// Note: the caller must hold s_profileMutex.
+static void drainSlot(ProfileSlot& slot)
+{
+    if (slot.data == nullptr)
+    {
+        return;
+    }
+    const size_t mask = slot.capacity - 1;
+    const uint64_t end = slot.head.load(std::memory_order_acquire);
+    uint64_t pos = slot.tail.load(std::memory_order_relaxed);
+    ProfileStack stack;
+    while (pos < end)
+    {
+        const auto numFrames = static_cast<size_t>(slot.data[pos & mask]);
+        stack.resize(numFrames);
+        for (size_t i = 0; i < numFrames; ++i)
+        {
+            stack[i] = reinterpret_cast<pointer_t>(
+              static_cast<uintptr_t>(slot.data[(pos + 1 + i) & mask]));
+        }
+        ++s_profile[stack];
+        pos += 1 + numFrames;
+    }
+    slot.tail.store(pos, std::memory_order_release);
+}
+
+/// Drains all slots.
+/// Note: the caller must hold s_profileMutex.
+static void drainAllSlots()
+{
+    for (auto& slot : s_profileSlots)
+    {
+        if (slot.used)
+        {
+            drainSlot(slot);
+        }
+    }
+}
+
+/// Prepares a free slot for the given thread, returns nullptr if there's none.
+/// Note: the caller must hold s_profileMutex.
+static ProfileSlot* allocateSlot(ThreadId tid) noexcept
+{
+    for (auto& slot : s_profileSlots)
+    {
+        if (slot.used)
+        {
+            continue;
+        }
+        if (slot.data == nullptr)
+        {
+            // round up to a power of 2 (at least enough for 2 full samples)
+            size_t words = std::max(s_profilerSettings.bufferSize / sizeof(uint64_t),
+                                    2 * (s_profilerSettings.maxFrames + 1));
+            size_t capacity = 1;
+            while (capacity * 2 <= words)
+            {
+                capacity *= 2;
+            }
+            if (capacity < words)
+            {
+                capacity *= 2;
+            }
+            slot.data = new (std::nothrow) uint64_t[capacity];
+            if (slot.data == nullptr)
+            {
+                return nullptr;
+            }
+            slot.capacity = capacity;
+        }
+        slot.head.store(0, std::memory_order_relaxed);
+        slot.tail.store(0, std::memory_order_relaxed);
+        slot.used = true;
+        slot.seen = true;
+        slot.tid = tid;
+        return &slot;
+    }
+    return nullptr;
+}
+
+/// Releases the slot of a thread that exited (the buffer is kept for the next thread).
+/// Note: the caller must hold s_profileMutex.
+static void releaseSlot(ProfileSlot& slot)
+{
+    drainSlot(slot);
+    s_profileDropped += slot.dropped.exchange(0, std::memory_order_relaxed);
+    slot.used = false;
+}
+
+/// Frees all buffers (when no producer is running anymore).
+/// Note: the caller must hold s_profileMutex.
+static void freeAllSlots()
+{
+    for (auto& slot : s_profileSlots)
+    {
+        delete[] slot.data;
+        slot.data = nullptr;
+        slot.capacity = 0;
+    }
+}
+
+/// Clears the profile at the start of a new run.
+/// Note: the caller must hold s_profileMutex.
+static void resetProfile(const ProfilerSettings& settings)
+{
+    s_profilerSettings = settings;
+    s_profilerSettings.frequency = std::max(1U, std::min(settings.frequency, 10000U));
+    s_profilerSettings.maxFrames = std::max<size_t>(1, std::min(settings.maxFrames,
+                                                                s_MAX_STACK_FRAMES));
+    s_profile.clear();
+    s_profileDropped = 0;
+    s_profileStart = std::chrono::system_clock::now();
+    s_profileSteadyStart = std::chrono::steady_clock::now();
+    s_profileDuration = std::chrono::steady_clock::duration{};
+}
+
+#endif // OOOPSI_PROFILER
+
+
+#ifdef OOOPSI_LINUX
+
+/// interval of collecting samples and looking for new threads
+static constexpr auto s_PROFILER_POLL_INTERVAL = std::chrono::milliseconds(100);
+
+/// number of signal handlers currently running (to know when the buffers can be freed)
+static std::atomic<int> s_activeProfileHandlers{ 0 };
+/// the background thread
+static std::thread s_profilerThread;
+/// wakes up the background thread when stopping
+static std::condition_variable s_profilerWakeup;
+static std::mutex s_profilerWakeupMutex;
+/// the SIGPROF handler is installed once and stays
+static bool s_profileHandlerInstalled = false;
+
+/// Records a sample of the interrupted thread.
+static void onProfileSignal(int /*sig*/, siginfo_t* info, void* context)
+{
+    const int savedErrno = errno;
+    s_activeProfileHandlers.fetch_add(1);
+    if (s_profilerRunning.load() && info->si_code == SI_TIMER)
+    {
+        // the timer tells us the slot
+        const int index = info->si_value.sival_int;
+        if (index >= 0 && static_cast<size_t>(index) < s_MAX_PROFILED_THREADS)
+        {
+            ProfileSlot& slot = s_profileSlots[index];
+            if (slot.data != nullptr)
+            {
+                pointer_t frames[s_MAX_STACK_FRAMES];
+                const size_t numFrames = captureSignalStack(
+                  context, frames, s_profilerSettings.maxFrames, s_profilerSettings.unwinder);
+                slot.push(frames, numFrames);
+            }
+        }
+    }
+    s_activeProfileHandlers.fetch_sub(1);
+    errno = savedErrno;
+}
+
+/// Returns the ID of the clock that measures the CPU time of the given thread.
+/// (the same as pthread_getcpuclockid(), but for any thread ID)
+static clockid_t threadCpuClock(pid_t tid) noexcept
+{
+    // see MAKE_THREAD_CPUCLOCK in the kernel: per-thread (4) scheduler clock (2)
+    const auto id = (~static_cast<unsigned int>(tid) << 3) | 6U;
+    return static_cast<clockid_t>(id);
+}
+
+/// Starts the CPU time timer of a thread.
+/// Note: the caller must hold s_profileMutex.
+static bool startThreadTimer(ProfileSlot& slot) noexcept
+{
+    struct sigevent event; // NOLINT (initialization below)
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = slot.tid;
+    event.sigev_value.sival_int = static_cast<int>(&slot - s_profileSlots);
+    if (timer_create(threadCpuClock(slot.tid), &event, &slot.timer) != 0)
+    {
+        return false;
+    }
+
+    const long interval = 1000000000L / static_cast<long>(s_profilerSettings.frequency);
+    struct itimerspec spec; // NOLINT (initialization below)
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = interval;
+    spec.it_value = spec.it_interval;
+    if (timer_settime(slot.timer, 0, &spec, nullptr) != 0)
+    {
+        timer_delete(slot.timer);
+        return false;
+    }
+    return true;
+}
+
+/// Adds new threads and removes the ones that exited.
+/// Note: the caller must hold s_profileMutex.
+static void scanThreads(pid_t self)
+{
+    for (auto& slot : s_profileSlots)
+    {
+        slot.seen = false;
+    }
+
+    DIR* dir = opendir("/proc/self/task");
+    if (dir == nullptr)
+    {
+        return;
+    }
+    while (const dirent* entry = readdir(dir))
+    {
+        const auto tid = static_cast<pid_t>(atoi(entry->d_name));
+        if (tid <= 0 || tid == self)
+        {
+            continue;
+        }
+        auto slot = std::find_if(std::begin(s_profileSlots), std::end(s_profileSlots),
+                                 [&](const ProfileSlot& s) { return s.used && s.tid == tid; });
+        if (slot != std::end(s_profileSlots))
+        {
+            slot->seen = true;
+        }
+        else if (ProfileSlot* newSlot = allocateSlot(tid))
+        {
+            if (!startThreadTimer(*newSlot))
+            {
+                // e.g. the thread exited in the meantime
+                newSlot->used = false;
+            }
+        }
+    }
+    closedir(dir);
+
+    for (auto& slot : s_profileSlots)
+    {
+        if (slot.used && !slot.seen)
+        {
+            timer_delete(slot.timer);
+            releaseSlot(slot);
+        }
+    }
+}
+
+/// The profiler's background thread: collects the samples and keeps the list of threads.
+static void profilerThread()
+{
+    const auto self = static_cast<pid_t>(syscall(SYS_gettid));
+    std::unique_lock<std::mutex> lock(s_profilerWakeupMutex);
+    while (s_profilerRunning)
+    {
+        {
+            const std::lock_guard<ProfileMutex> profileLock(s_profileMutex);
+            scanThreads(self);
+            drainAllSlots();
+        }
+        // the samples of new modules are symbolized later (and crash reports find them, too)
+        refreshModuleMap();
+        s_profilerWakeup.wait_for(lock, s_PROFILER_POLL_INTERVAL);
+    }
+}
+
+bool startProfiler(const ProfilerSettings& settings) noexcept
+{
+    const std::lock_guard<ProfileMutex> lock(s_profileMutex);
+    if (s_profilerRunning || s_profilerThread.joinable())
+    {
+        return false;
+    }
+    if (!s_profileHandlerInstalled)
+    {
+        struct sigaction act; // NOLINT (initialization below)
+        memset(&act, 0, sizeof(act));
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_ONSTACK | SA_SIGINFO | SA_RESTART; // NOLINT (sorry, that's C ...)
+        act.sa_sigaction = onProfileSignal;
+        if (sigaction(SIGPROF, &act, nullptr) != 0)
+        {
+            return false;
+        }
+        s_profileHandlerInstalled = true;
+    }
+
+    resetProfile(settings);
+    s_profilerRunning = true;
+    try
+    {
+        s_profilerThread = std::thread(profilerThread);
+    }
+    catch (...)
+    {
+        s_profilerRunning = false;
+        return false;
+    }
+    return true;
+}
+
+void stopProfiler() noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(s_profilerWakeupMutex);
+        if (!s_profilerRunning)
+        {
+            return;
+        }
+        s_profilerRunning = false;
+    }
+    s_profilerWakeup.notify_all();
+    if (s_profilerThread.joinable())
+    {
+        s_profilerThread.join();
+    }
+
+    const std::lock_guard<ProfileMutex> lock(s_profileMutex);
+    for (auto& slot : s_profileSlots)
+    {
+        if (slot.used)
+        {
+            timer_delete(slot.timer);
+        }
+    }
+    // wait until no handler uses the buffers anymore (new ones return immediately)
+    while (s_activeProfileHandlers.load() > 0)
+    {
+        std::this_thread::yield();
+    }
+    for (auto& slot : s_profileSlots)
+    {
+        if (slot.used)
+        {
+            releaseSlot(slot);
+        }
+    }
+    freeAllSlots();
+    s_profileDuration = std::chrono::steady_clock::now() - s_profileSteadyStart;
+}
+
+#elif defined(OOOPSI_PROFILER) // Windows x64
+
+/// the timer that takes the samples (nullptr: not running)
+static HANDLE s_profileTimer = nullptr;
+/// number of timer ticks so far (the timer callbacks don't overlap)
+static unsigned s_profileTicks = 0;
+/// set while a timer callback is running
+static std::atomic_flag s_profileTickActive = ATOMIC_FLAG_INIT;
+
+/// Returns the CPU time of the thread (in 100ns units).
+static ULONGLONG threadCpuTime(HANDLE thread) noexcept
+{
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(thread, &creation, &exit, &kernel, &user))
+    {
+        return 0;
+    }
+    return ((static_cast<ULONGLONG>(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime) +
+           ((static_cast<ULONGLONG>(user.dwHighDateTime) << 32) | user.dwLowDateTime);
+}
+
+/// Adds new threads and removes the ones that exited.
+/// Note: the caller must hold s_profileMutex.
+static void scanThreads()
+{
+    for (auto& slot : s_profileSlots)
+    {
+        slot.seen = false;
+    }
+
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    const DWORD pid = GetCurrentProcessId();
+    const DWORD self = GetCurrentThreadId();
+    THREADENTRY32 entry;
+    entry.dwSize = sizeof(entry);
+    for (BOOL ok = Thread32First(snapshot, &entry); ok; ok = Thread32Next(snapshot, &entry))
+    {
+        if (entry.th32OwnerProcessID != pid || entry.th32ThreadID == self)
+        {
+            continue;
+        }
+        const DWORD tid = entry.th32ThreadID;
+        auto slot = std::find_if(std::begin(s_profileSlots), std::end(s_profileSlots),
+                                 [&](const ProfileSlot& s) { return s.used && s.tid == tid; });
+        if (slot != std::end(s_profileSlots))
+        {
+            slot->seen = true;
+            continue;
+        }
+        HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT |
+                                     THREAD_QUERY_INFORMATION,
+                                   FALSE, tid);
+        if (thread == nullptr)
+        {
+            continue;
+        }
+        ProfileSlot* newSlot = allocateSlot(tid);
+        if (newSlot == nullptr)
+        {
+            CloseHandle(thread);
+            continue;
+        }
+        newSlot->thread = thread;
+        newSlot->cpuTime = threadCpuTime(thread);
+    }
+    CloseHandle(snapshot);
+
+    for (auto& slot : s_profileSlots)
+    {
+        if (slot.used && !slot.seen)
+        {
+            CloseHandle(slot.thread);
+            releaseSlot(slot);
+        }
+    }
+}
+
+/// Called by the timer queue: samples all threads that used CPU time since the last tick.
+static VOID CALLBACK onProfileTimer(PVOID /*param*/, BOOLEAN /*fired*/)
+{
+    if (s_profileTickActive.test_and_set(std::memory_order_acquire))
+    {
+        // the previous tick is still running
+        return;
+    }
+    // look for new threads and collect the samples every second
+    if (s_profileTicks++ % s_profilerSettings.frequency == 0)
+    {
+        const std::lock_guard<ProfileMutex> lock(s_profileMutex);
+        scanThreads();
+        drainAllSlots();
+    }
+
+    pointer_t frames[s_MAX_STACK_FRAMES];
+    for (auto& slot : s_profileSlots)
+    {
+        // note: 'used' only changes while scanning, i.e. on this thread
+        if (!slot.used)
+        {
+            continue;
+        }
+        const ULONGLONG cpuTime = threadCpuTime(slot.thread);
+        if (cpuTime == slot.cpuTime)
+        {
+            // idle
+            continue;
+        }
+        slot.cpuTime = cpuTime;
+        const size_t numFrames =
+          captureThreadStack(slot.thread, frames, s_profilerSettings.maxFrames);
+        if (numFrames > 0)
+        {
+            slot.push(frames, numFrames);
+        }
+    }
+    s_profileTickActive.clear(std::memory_order_release);
+}
+
+bool startProfiler(const ProfilerSettings& settings) noexcept
+{
+    const std::lock_guard<ProfileMutex> lock(s_profileMutex);
+    if (s_profilerRunning)
+    {
+        return false;
+    }
+    resetProfile(settings);
+    s_profileTicks = 0;
+    s_profilerRunning = true;
+
+    const DWORD interval = std::max(1U, 1000U / s_profilerSettings.frequency);
+    if (!CreateTimerQueueTimer(&s_profileTimer, nullptr, onProfileTimer, nullptr, interval,
+                               interval, WT_EXECUTEINTIMERTHREAD))
+    {
+        s_profileTimer = nullptr;
+        s_profilerRunning = false;
+        return false;
+    }
+    return true;
+}
+
+void stopProfiler() noexcept
+{
+    HANDLE timer = nullptr;
+    {
+        const std::lock_guard<ProfileMutex> lock(s_profileMutex);
+        if (!s_profilerRunning)
+        {
+            return;
+        }
+        s_profilerRunning = false;
+        timer = s_profileTimer;
+        s_profileTimer = nullptr;
+    }
+    // waits for a running callback (which might need the lock)
+    DeleteTimerQueueTimer(nullptr, timer, INVALID_HANDLE_VALUE);
+
+    const std::lock_guard<ProfileMutex> lock(s_profileMutex);
+    for (auto& slot : s_profileSlots)
+    {
+        if (slot.used)
+        {
+            CloseHandle(slot.thread);
+            releaseSlot(slot);
+        }
+    }
+    freeAllSlots();
+    s_profileDuration = std::chrono::steady_clock::now() - s_profileSteadyStart;
+}
+
+#else // unsupported platform
+
+bool startProfiler(const ProfilerSettings& /*settings*/) noexcept
+{
+    return false;
+}
+
+void stopProfiler() noexcept {}
+
+std::string getProfile(ProfileFormat /*format*/)
+{
+    return std::string();
+}
+
+#endif // OOOPSI_LINUX/PROFILER
+
+
+#ifdef OOOPSI_PROFILER
+
+namespace
+{
+
+/// A symbolized code address.
+struct ProfileSymbol
+{
+    std::string name;
+    ModuleInfo module;
+    bool hasModule = false;
+};
+
+/// Minimal protocol buffer encoder (only what's needed for pprof's profile.proto).
+class ProtoWriter
+{
+public:
+    void varint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            m_data += static_cast<char>((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        m_data += static_cast<char>(value);
+    }
+
+    /// varint field
+    void field(unsigned number, uint64_t value)
+    {
+        varint(number << 3);
+        varint(value);
+    }
+
+    /// length-delimited field (string, bytes, sub-message or packed numbers)
+    void field(unsigned number, const std::string& data)
+    {
+        varint((number << 3) | 2);
+        varint(data.size());
+        m_data += data;
+    }
+
+    void field(unsigned number, const ProtoWriter& message) { field(number, message.m_data); }
+
+    /// packed repeated field
+    void packed(unsigned number, const std::vector<uint64_t>& values)
+    {
+        ProtoWriter packed;
+        for (const uint64_t value : values)
+        {
+            packed.varint(value);
+        }
+        field(number, packed);
+    }
+
+    const std::string& data() const noexcept { return m_data; }
+
+private:
+    std::string m_data;
+};
+
+/// The strings of a pprof profile (index 0 is the empty string).
+class StringTable
+{
+public:
+    StringTable() { index(""); }
+
+    uint64_t index(const std::string& str)
+    {
+        auto it = m_indices.find(str);
+        if (it == m_indices.end())
+        {
+            it = m_indices.emplace(str, m_strings.size()).first;
+            m_strings.push_back(str);
+        }
+        return it->second;
+    }
+
+    const std::vector<std::string>& strings() const noexcept { return m_strings; }
+
+private:
+    std::map<std::string, uint64_t> m_indices;
+    std::vector<std::string> m_strings;
+};
+
+} // namespace
+
+/// Returns the address to symbolize: return addresses point after the call instruction, but the
+/// leaf frame is the exact address (and the resolver treats all addresses as return addresses).
+static pointer_t lookupAddress(pointer_t address, bool leaf) noexcept
+{
+#ifdef OOOPSI_WINDOWS
+    std::ignore = leaf;
+    return address;
+#else
+    return leaf ? static_cast<const char*>(address) + 1 : address;
+#endif
+}
+
+/// Symbolizes all addresses of the profile, the key of the map is lookupAddress().
+static std::map<pointer_t, ProfileSymbol>
+symbolizeProfile(const std::map<ProfileStack, uint64_t>& profile)
+{
+    std::set<pointer_t> addresses;
+    for (const auto& entry : profile)
+    {
+        for (size_t i = 0; i < entry.first.size(); ++i)
+        {
+            addresses.insert(lookupAddress(entry.first[i], i == 0));
+        }
+    }
+
+    const std::vector<pointer_t> list(addresses.begin(), addresses.end());
+    std::vector<StackFrame> frames(list.size());
+    symbolizeBatch(list.data(), list.size(), frames.data());
+
+    std::map<pointer_t, ProfileSymbol> symbols;
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        ProfileSymbol& symbol = symbols[list[i]];
+        symbol.name = std::move(frames[i].function);
+        symbol.hasModule = findModule(list[i], symbol.module);
+    }
+    return symbols;
+}
+
+/// Returns the name of a frame for the folded format.
+static std::string frameName(pointer_t address, const ProfileSymbol& symbol)
+{
+    if (!symbol.name.empty())
+    {
+        return symbol.name;
+    }
+    char buffer[512];
+    if (symbol.hasModule)
+    {
+        snprintf(buffer, sizeof(buffer), "%s+0x%" PRIxPTR, moduleName(symbol.module),
+                 reinterpret_cast<uintptr_t>(address) - symbol.module.base);
+    }
+    else
+    {
+        snprintf(buffer, sizeof(buffer), "0x%" PRIxPTR, reinterpret_cast<uintptr_t>(address));
+    }
+    return buffer;
+}
+
+static std::string formatFolded(const std::map<ProfileStack, uint64_t>& profile)
+{
+    const auto symbols = symbolizeProfile(profile);
+    // different addresses in the same functions result in the same line
+    std::map<std::string, uint64_t> lines;
+    for (const auto& entry : profile)
+    {
+        const ProfileStack& stack = entry.first;
+        std::string line;
+        // root first
+        for (size_t i = stack.size(); i > 0; --i)
+        {
+            const pointer_t address = lookupAddress(stack[i - 1], i == 1);
+            line += frameName(stack[i - 1], symbols.at(address));
+            if (i > 1)
+            {
+                line += ';';
+            }
+        }
+        lines[line] += entry.second;
+    }
+
+    std::string output;
+    for (const auto& line : lines)
+    {
+        output += line.first;
+        output += ' ';
+        output += std::to_string(line.second);
+        output += '\n';
+    }
+    return output;
+}
+
+/// Formats a profile according to https://github.com/google/pprof/blob/master/proto/profile.proto
+static std::string formatPprof(const std::map<ProfileStack, uint64_t>& profile, uint64_t dropped)
+{
+    const auto symbols = symbolizeProfile(profile);
+    const auto period = static_cast<uint64_t>(1000000000 / s_profilerSettings.frequency);
+    StringTable strings;
+    ProtoWriter result;
+
+    // sample types: number of samples and CPU time
+    ProtoWriter sampleCount;
+    sampleCount.field(1, strings.index("samples"));
+    sampleCount.field(2, strings.index("count"));
+    result.field(1, sampleCount);
+    ProtoWriter cpuTime;
+    cpuTime.field(1, strings.index("cpu"));
+    cpuTime.field(2, strings.index("nanoseconds"));
+    result.field(1, cpuTime);
+
+    // mappings: the loaded modules (IDs start at 1)
+    std::map<uintptr_t, uint64_t> mappingIds;
+    for (size_t i = 0; i < numModuleSlots(); ++i)
+    {
+        ModuleInfo module;
+        if (!getModule(i, module) || mappingIds.count(module.start) != 0)
+        {
+            continue;
+        }
+        const uint64_t id = mappingIds.size() + 1;
+        mappingIds[module.start] = id;
+
+        std::string buildId;
+        char hex[3];
+        for (uint32_t b = 0; b < module.buildIdLength; ++b)
+        {
+            snprintf(hex, sizeof(hex), "%02x", module.buildId[b]);
+            buildId += hex;
+        }
+        ProtoWriter mapping;
+        mapping.field(1, id);
+        mapping.field(2, module.start);
+        mapping.field(3, module.end);
+        mapping.field(4, module.start - module.base);
+        mapping.field(5, strings.index(module.path));
+        mapping.field(6, strings.index(buildId));
+        mapping.field(7, 1);
+        result.field(3, mapping);
+    }
+
+    // locations and functions: one per unique address resp. name
+    std::map<pointer_t, uint64_t> locationIds;
+    std::map<std::string, uint64_t> functionIds;
+    auto location = [&](pointer_t address, bool leaf) {
+        auto it = locationIds.find(address);
+        if (it != locationIds.end())
+        {
+            return it->second;
+        }
+        const uint64_t id = locationIds.size() + 1;
+        locationIds[address] = id;
+
+        const ProfileSymbol& symbol = symbols.at(lookupAddress(address, leaf));
+        ProtoWriter loc;
+        loc.field(1, id);
+        if (symbol.hasModule)
+        {
+            loc.field(2, mappingIds[symbol.module.start]);
+        }
+        loc.field(3, reinterpret_cast<uintptr_t>(address));
+        if (!symbol.name.empty())
+        {
+            auto fn = functionIds.find(symbol.name);
+            if (fn == functionIds.end())
+            {
+                fn = functionIds.emplace(symbol.name, functionIds.size() + 1).first;
+                ProtoWriter function;
+                function.field(1, fn->second);
+                function.field(2, strings.index(symbol.name));
+                function.field(3, strings.index(symbol.name));
+                result.field(5, function);
+            }
+            ProtoWriter line;
+            line.field(1, fn->second);
+            loc.field(4, line);
+        }
+        result.field(4, loc);
+        return id;
+    };
+
+    for (const auto& entry : profile)
+    {
+        std::vector<uint64_t> ids;
+        for (size_t i = 0; i < entry.first.size(); ++i)
+        {
+            ids.push_back(location(entry.first[i], i == 0));
+        }
+        ProtoWriter sample;
+        sample.packed(1, ids);
+        sample.packed(2, { entry.second, entry.second * period });
+        result.field(2, sample);
+    }
+
+    const auto startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      s_profileStart.time_since_epoch());
+    result.field(9, static_cast<uint64_t>(startNs.count()));
+    auto duration = s_profileDuration;
+    if (s_profilerRunning)
+    {
+        duration = std::chrono::steady_clock::now() - s_profileSteadyStart;
+    }
+    result.field(
+      10, static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+    result.field(11, cpuTime);
+    result.field(12, period);
+    result.field(13, strings.index("dropped samples: " + std::to_string(dropped)));
+    for (const auto& str : strings.strings())
+    {
+        result.field(6, str);
+    }
+    return result.data();
+}
+
+std::string getProfile(ProfileFormat format)
+{
+    std::map<ProfileStack, uint64_t> profile;
+    uint64_t dropped = 0;
+    {
+        const std::lock_guard<ProfileMutex> lock(s_profileMutex);
+        drainAllSlots();
+        profile = s_profile;
+        dropped = s_profileDropped;
+        for (const auto& slot : s_profileSlots)
+        {
+            dropped += slot.dropped.load(std::memory_order_relaxed);
+        }
+    }
+
+    if (format == ProfileFormat::PPROF)
+    {
+        return formatPprof(profile, dropped);
+    }
+    return formatFolded(profile);
+}
+
+#endif // OOOPSI_PROFILER
+
+} // namespace ooopsi
@@ -0,0 +1,316 @@
+/**
+ * @file    sourcelines.cpp
+ * @brief   source file and line lookups for stack traces
+ *
+ * On Linux, the line index of a module (see lineindex.hpp) is built when it's needed for the first
+ * time: from the module's own file or from a separate debug file with a matching build-id in
+ * /usr/lib/debug. The finished index is kept in a read-only mapping for the rest of the process'
+ * lifetime, so lookups are lock-free binary searches. If a cache directory is set (environment
+ * variable OOOPSI_LINE_CACHE), the index is persisted as "<build-id>.lines" and mapped directly
+ * next time, which avoids parsing the DWARF data again.
+ *
+ * On Windows, the lines are taken from the PDB files via DbgHelp, which indexes them on its own.
+ */
+
+#include "internal.hpp"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#ifdef OOOPSI_LINUX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef OOOPSI_WINDOWS
+#ifdef OOOPSI_MSVC
+#pragma warning(push)
+#pragma warning(disable : 4091)
+#endif // OOOPSI_MSVC
+#include <dbghelp.h>
+#ifdef OOOPSI_MSVC
+#pragma warning(pop)
+#endif // OOOPSI_MSVC
+#endif
+
+namespace ooopsi
+{
+
+#ifdef OOOPSI_LINUX
+
+static_assert(ATOMIC_POINTER_LOCK_FREE == 2, "the line indexes require lock-free pointers");
+
+/// the line index per module slot (nullptr: not built yet)
+static std::atomic<const char*> s_lineIndexes[s_MAX_MODULES];
+/// marks modules without line information
+static const char s_NO_LINE_INDEX = '\0';
+/// guards building the indexes
+static std::mutex s_lineIndexMutex;
+/// the directory to persist the indexes in (empty: don't persist)
+static char s_lineCacheDir[1024];
+
+
+void setLineIndexCacheDir(const char* dir) noexcept
+{
+    s_lineCacheDir[0] = '\0';
+    if (dir != nullptr && strlen(dir) < sizeof(s_lineCacheDir))
+    {
+        strcpy(s_lineCacheDir, dir); // flawfinder: ignore (checked above)
+    }
+}
+
+bool buildIndexFromFile(const std::string& path, BuildIndexFunc build, std::vector<char>& index)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        const auto size = static_cast<size_t>(st.st_size);
+        void* image = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image != MAP_FAILED)
+        {
+            ok = build(static_cast<const char*>(image), size, index);
+            munmap(image, size);
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+/// Maps a persisted index, returns nullptr if missing or invalid.
+static const char* mapIndexFile(const std::string& path)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    const char* index = nullptr;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        const auto size = static_cast<size_t>(st.st_size);
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            index = static_cast<const char*>(mapping);
+            if (!isValidLineIndex(index, size))
+            {
+                munmap(mapping, size);
+                index = nullptr;
+            }
+        }
+    }
+    close(fd);
+    return index;
+}
+
+/// Persists an index (written to a temporary file first, so readers never see a partial one).
+static void writeIndexFile(const std::string& path, const std::vector<char>& index)
+{
+    const std::string tmpPath = path + "." + std::to_string(getpid());
+    const int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+    writeAll(fd, index.data(), index.size());
+    const bool ok = close(fd) == 0;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmpPath.c_str());
+    }
+}
+
+const char* mapIndex(const std::vector<char>& index)
+{
+    void* mapping =
+      mmap(nullptr, index.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    memcpy(mapping, index.data(), index.size());
+    mprotect(mapping, index.size(), PROT_READ);
+    return static_cast<const char*>(mapping);
+}
+
+static std::string toHex(const uint8_t* data, size_t length)
+{
+    static const char s_digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hex += s_digits[data[i] >> 4];
+        hex += s_digits[data[i] & 0xf];
+    }
+    return hex;
+}
+
+std::string debugFilePath(const ModuleInfo& module)
+{
+    const std::string buildId = toHex(module.buildId, module.buildIdLength);
+    if (buildId.size() <= 2)
+    {
+        return std::string();
+    }
+    return "/usr/lib/debug/.build-id/" + buildId.substr(0, 2) + "/" + buildId.substr(2) + ".debug";
+}
+
+/// Creates (or maps a persisted) index for a module, returns &s_NO_LINE_INDEX on failure.
+static const char* loadIndex(const ModuleInfo& module)
+{
+    const std::string buildId = toHex(module.buildId, module.buildIdLength);
+    std::string cachePath;
+    if (s_lineCacheDir[0] != '\0' && !buildId.empty())
+    {
+        cachePath = std::string(s_lineCacheDir) + "/" + buildId + ".lines";
+        const char* index = mapIndexFile(cachePath);
+        if (index != nullptr)
+        {
+            return index;
+        }
+    }
+
+    std::vector<char> index;
+    bool ok = module.path[0] != '\0' && buildIndexFromFile(module.path, buildLineIndex, index);
+    const std::string debugPath = debugFilePath(module);
+    if (!ok && !debugPath.empty())
+    {
+        // the debug info may have been stripped into a separate file
+        ok = buildIndexFromFile(debugPath, buildLineIndex, index);
+    }
+    if (!ok)
+    {
+        return &s_NO_LINE_INDEX;
+    }
+
+    if (!cachePath.empty())
+    {
+        writeIndexFile(cachePath, index);
+        const char* persisted = mapIndexFile(cachePath);
+        if (persisted != nullptr)
+        {
+            return persisted;
+        }
+    }
+    const char* mapped = mapIndex(index);
+    return mapped != nullptr ? mapped : &s_NO_LINE_INDEX;
+}
+
+/// Returns the index of a module slot (building it if requested), nullptr if not available.
+static const char* getIndex(size_t slot, const ModuleInfo& module, bool load) noexcept
+{
+    const char* index = s_lineIndexes[slot].load(std::memory_order_acquire);
+    if (index == nullptr && load)
+    {
+        try
+        {
+            const std::lock_guard<std::mutex> lock(s_lineIndexMutex);
+            index = s_lineIndexes[slot].load(std::memory_order_acquire);
+            if (index == nullptr)
+            {
+                index = loadIndex(module);
+                s_lineIndexes[slot].store(index, std::memory_order_release);
+            }
+        }
+        catch (...)
+        {
+            // out of memory: try again next time
+            return nullptr;
+        }
+    }
+    return index != &s_NO_LINE_INDEX ? index : nullptr;
+}
+
+bool lookupSourceLine(pointer_t address, bool load, SourceLocation& location) noexcept
+{
+    ModuleInfo module;
+    size_t slot = 0;
+    if (!findModule(address, module, &slot))
+    {
+        return false;
+    }
+    const char* index = getIndex(slot, module, load);
+    return index != nullptr &&
+           lookupLine(index, reinterpret_cast<uintptr_t>(address) - module.base, location);
+}
+
+size_t prepareSourceLines() noexcept
+{
+    refreshModuleMap();
+    size_t numIndexed = 0;
+    ModuleInfo module;
+    for (size_t i = 0; i < numModuleSlots(); ++i)
+    {
+        if (getModule(i, module) && getIndex(i, module, true) != nullptr)
+        {
+            ++numIndexed;
+        }
+    }
+    return numIndexed;
+}
+
+#elif defined(OOOPSI_WINDOWS)
+
+void setLineIndexCacheDir(const char* /*dir*/) noexcept
+{
+    // DbgHelp has its own symbol cache
+}
+
+bool lookupSourceLine(pointer_t address, bool /*load*/, SourceLocation& location) noexcept
+{
+    static thread_local char t_file[MAX_PATH];
+
+    const std::lock_guard<DbgHelpMutex> lock(s_dbgHelpMutex);
+    if (!prepareDbgHelp())
+    {
+        return false;
+    }
+    IMAGEHLP_LINE64 line;
+    memset(&line, 0, sizeof(line));
+    line.SizeOfStruct = sizeof(line);
+    DWORD displacement = 0;
+    if (!SymGetLineFromAddr64(GetCurrentProcess(), reinterpret_cast<DWORD64>(address),
+                              &displacement, &line) ||
+        line.FileName == nullptr)
+    {
+        return false;
+    }
+    LineFormatter(t_file).append(line.FileName);
+    location.file = t_file;
+    location.line = static_cast<uint32_t>(line.LineNumber);
+    return true;
+}
+
+size_t prepareSourceLines() noexcept
+{
+    // DbgHelp loads the lines on demand
+    return 0;
+}
+
+#else // macOS
+
+void setLineIndexCacheDir(const char* /*dir*/) noexcept {}
+
+bool lookupSourceLine(pointer_t /*address*/, bool /*load*/, SourceLocation& /*location*/) noexcept
+{
+    // not supported (yet)
+    return false;
+}
+
+size_t prepareSourceLines() noexcept
+{
+    return 0;
+}
+
+#endif // OOOPSI_LINUX/WINDOWS
+
+} // namespace ooopsi
@@ -8,6 +8,7 @@
 #include "ooopsi.hpp"
 // private library header
 #include "internal.hpp"
+#include "structuredlog.hpp"
 
 #ifdef OOOPSI_WINDOWS
 #ifdef OOOPSI_MSVC
@@ -21,15 +22,30 @@
 #else
 #define UNW_LOCAL_ONLY
 #include <libunwind.h>
+#include <pthread.h>
+#include <signal.h>
+#include <ucontext.h>
+#endif
+
+// frame pointer walks are supported for platforms with a common frame record layout
+#if (defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)) &&                                              \
+  (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+#define OOOPSI_FRAME_POINTERS
 #endif
 
 #ifdef OOOPSI_MSVC
 #define OOOPSI_FORCE_INLINE __forceinline
 #else
-#define OOOPSI_FORCE_INLINE
+#define OOOPSI_FORCE_INLINE inline __attribute__((always_inline))
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <system_error>
+#include <thread>
 #include <tuple> // for std::ignore
+#include <vector>
 
 #include <cstdint>
 #include <cstdio>
@@ -40,189 +56,1444 @@ namespace ooopsi
 #ifdef OOOPSI_WINDOWS
 // access to the debug help API must be serialized
 DbgHelpMutex s_dbgHelpMutex;
-#endif
 
 /**
- * Implementation of the stack collection: the handler is called for every frame.
- * Note: this function is force-inlined to avoid having it show up in the call stack.
+ * The process-wide DbgHelp session: initialized once, refreshed whenever modules were loaded or
+ * unloaded in the meantime. All members are guarded by s_dbgHelpMutex, except for the
+ * 'modulesChanged' flag, which is set from the loader's notification callback.
  */
-template <class Func>
-OOOPSI_FORCE_INLINE size_t collectStackTrace(Func&& handler,
-                                             const size_t maxStackFrames = s_MAX_STACK_FRAMES)
+static struct DbgHelpSession
 {
-    size_t numberOfFrames = 0;
+    bool initialized = false;
+    bool ok = false;
+    std::atomic<bool> modulesChanged{ false };
+    PVOID notificationCookie = nullptr;
 
-// OS-specific back trace
-#ifdef OOOPSI_WINDOWS
+    ~DbgHelpSession()
     {
         const std::lock_guard<DbgHelpMutex> lock(s_dbgHelpMutex);
+        // this library may get unloaded before the process exits: don't leave a dangling callback
+        if (notificationCookie != nullptr)
+        {
+            auto unregisterFunc = reinterpret_cast<LdrUnregisterDllNotificationFunc>(
+              GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "LdrUnregisterDllNotification"));
+            if (unregisterFunc != nullptr)
+            {
+                unregisterFunc(notificationCookie);
+            }
+        }
+        if (ok)
+        {
+            SymCleanup(GetCurrentProcess());
+        }
+    }
+} s_dbgHelpSession;
+
+/// Called by the loader (while holding the loader lock!) when a DLL is loaded or unloaded.
+static VOID CALLBACK onDllNotification(ULONG /*reason*/, const void* /*data*/, PVOID /*ctx*/)
+{
+    s_dbgHelpSession.modulesChanged.store(true, std::memory_order_relaxed);
+}
+
+bool prepareDbgHelp() noexcept
+{
+    HANDLE thisProc = GetCurrentProcess();
+    if (!s_dbgHelpSession.initialized)
+    {
+        s_dbgHelpSession.initialized = true;
+
         // note: we're undecorating the name ourselves - gives much more infos!
         SymSetOptions(/*SYMOPT_UNDNAME |*/ SYMOPT_DEFERRED_LOADS);
+        // don't invade the process here, the modules are registered below (without symbols)
+        s_dbgHelpSession.ok = SymInitialize(thisProc, NULL, FALSE) != FALSE;
+        if (!s_dbgHelpSession.ok)
+        {
+            return false;
+        }
 
-        HANDLE thisProc = GetCurrentProcess();
+        auto registerFunc = reinterpret_cast<LdrRegisterDllNotificationFunc>(
+          GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "LdrRegisterDllNotification"));
+        if (registerFunc == nullptr ||
+            registerFunc(0, onDllNotification, nullptr, &s_dbgHelpSession.notificationCookie) != 0)
+        {
+            // no notifications: refresh on every call
+            s_dbgHelpSession.notificationCookie = nullptr;
+        }
+        s_dbgHelpSession.modulesChanged = true;
+    }
 
-        const BOOL symInitOk = SymInitialize(thisProc, NULL, TRUE);
-        void* stackFrames[s_MAX_STACK_FRAMES];
-        auto numFrames = std::min(s_MAX_STACK_FRAMES, maxStackFrames);
-        numberOfFrames =
-          RtlCaptureStackBackTrace(0, static_cast<DWORD>(numFrames), stackFrames, NULL);
+    if (s_dbgHelpSession.ok && (s_dbgHelpSession.notificationCookie == nullptr ||
+                                s_dbgHelpSession.modulesChanged.exchange(false)))
+    {
+        // enumerates the loaded modules, their symbols are loaded on demand (deferred)
+        SymRefreshModuleList(thisProc);
+    }
+    return s_dbgHelpSession.ok;
+}
+#endif
 
-        char symBuffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME * sizeof(TCHAR)];
-        PSYMBOL_INFO pSymbol = reinterpret_cast<PSYMBOL_INFO>(symBuffer);
+#ifdef OOOPSI_FRAME_POINTERS
 
-        for (size_t i = 0; i < numberOfFrames; ++i)
-        {
-            const DWORD64 address = reinterpret_cast<DWORD64>(stackFrames[i]);
+/// A range of stack memory.
+struct StackRange
+{
+    uintptr_t low = 0;
+    uintptr_t high = 0;
+
+    /// Checks whether a frame record (saved frame pointer + return address) is located at 'addr'.
+    bool containsFrame(uintptr_t addr) const noexcept
+    {
+        return addr >= low && addr < high && high - addr >= 2 * sizeof(uintptr_t) &&
+               (addr & (sizeof(uintptr_t) - 1)) == 0;
+    }
+};
 
-            DWORD64 dwDisplacement = 0;
-            const char* symName = nullptr;
+/// the current thread's stack (queried once per thread, high == 1 if unknown)
+static thread_local StackRange t_threadStack;
 
-            if (symInitOk)
+/// Returns the current thread's stack range.
+static const StackRange& threadStack() noexcept
+{
+    StackRange& range = t_threadStack;
+    if (range.high == 0)
+    {
+#ifdef OOOPSI_MAC
+        const pthread_t self = pthread_self();
+        range.high = reinterpret_cast<uintptr_t>(pthread_get_stackaddr_np(self));
+        range.low = range.high - pthread_get_stacksize_np(self);
+#else
+        // note: this reads /proc/self/maps for the main thread (not signal-safe)
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0)
+        {
+            void* addr = nullptr;
+            size_t size = 0;
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0)
             {
-                memset(symBuffer, 0, sizeof(symBuffer));
-                pSymbol->SizeOfStruct = sizeof(SYMBOL_INFO);
-                pSymbol->MaxNameLen = MAX_SYM_NAME;
-
-                if (SymFromAddr(thisProc, address, &dwDisplacement, pSymbol))
-                {
-                    symName = pSymbol->Name;
-                }
+                range.low = reinterpret_cast<uintptr_t>(addr);
+                range.high = range.low + size;
             }
+            pthread_attr_destroy(&attr);
+        }
+#endif
+        if (range.high == 0)
+        {
+            // don't try again
+            range.high = 1;
+        }
+    }
+    return range;
+}
+
+/**
+ * Walks the chain of frame pointers. Every frame pointer is validated before it's dereferenced:
+ * it must point to the thread's stack (or the alternate signal stack that is currently in use)
+ * and lead upwards the stack.
+ */
+class FramePointerWalker
+{
+public:
+    /// @param[in] framePointer     the frame to start at (its return address is the first one)
+    explicit FramePointerWalker(const void* framePointer) noexcept
+      : FramePointerWalker(framePointer, threadStack())
+    {
+    }
+
+    /// @param[in] framePointer     the frame to start at (its return address is the first one)
+    /// @param[in] stack            the current thread's stack
+    FramePointerWalker(const void* framePointer, const StackRange& stack) noexcept
+      : m_threadStack(stack)
+    {
+        const auto fp = reinterpret_cast<uintptr_t>(framePointer);
+        stack_t altStack;
+        if (sigaltstack(nullptr, &altStack) == 0 && (altStack.ss_flags & SS_ONSTACK) != 0)
+        {
+            m_altStack.low = reinterpret_cast<uintptr_t>(altStack.ss_sp);
+            m_altStack.high = m_altStack.low + altStack.ss_size;
+            m_onAltStack = m_altStack.containsFrame(fp);
+        }
+        if (m_onAltStack || m_threadStack.containsFrame(fp))
+        {
+            m_fp = fp;
+        }
+    }
+
+    /// Returns false if the start frame isn't located on a known stack.
+    bool valid() const noexcept { return m_fp != 0; }
 
-            handler(i, stackFrames[i], symName, dwDisplacement);
+    /// Moves to the next frame.
+    ///
+    /// @param[out] pc      the return address of the current frame
+    /// @return false at the end of the chain
+    bool step(pointer_t& pc) noexcept
+    {
+        if (m_fp == 0)
+        {
+            return false;
         }
+        const auto* frame = reinterpret_cast<const uintptr_t*>(m_fp);
+        const uintptr_t next = frame[0];
+        pc = reinterpret_cast<pointer_t>(frame[1]);
 
-        SymCleanup(thisProc);
+        const uintptr_t current = m_fp;
+        m_fp = 0;
+        if (m_onAltStack)
+        {
+            if (next > current && m_altStack.containsFrame(next))
+            {
+                m_fp = next;
+            }
+            else if (m_threadStack.containsFrame(next))
+            {
+                // the signal handler's caller
+                m_fp = next;
+                m_onAltStack = false;
+            }
+        }
+        else if (next > current && m_threadStack.containsFrame(next))
+        {
+            m_fp = next;
+        }
+        return pc != nullptr;
+    }
+
+private:
+    const StackRange& m_threadStack;
+    StackRange m_altStack;
+    bool m_onAltStack = false;
+    /// the current frame pointer (0: end of the chain)
+    uintptr_t m_fp = 0;
+};
+
+#endif // OOOPSI_FRAME_POINTERS
+
+void prepareFramePointerWalk() noexcept
+{
+#ifdef OOOPSI_FRAME_POINTERS
+    std::ignore = threadStack();
+#endif
+}
+
+/**
+ * Implementation of the stack walk: the handler is called for every frame's address, no symbols
+ * are resolved here.
+ * Note: this function is force-inlined to avoid having it show up in the call stack.
+ */
+template <class Func>
+OOOPSI_FORCE_INLINE size_t walkStack(Func&& handler,
+                                     const size_t maxStackFrames = s_MAX_STACK_FRAMES,
+                                     Unwinder unwinder = Unwinder::DEFAULT) noexcept
+{
+    size_t numberOfFrames = 0;
+
+// OS-specific back trace
+#ifdef OOOPSI_WINDOWS
+
+    // frame pointers aren't used on all Windows platforms
+    std::ignore = unwinder;
+
+    void* stackFrames[s_MAX_STACK_FRAMES];
+    auto numFrames = std::min(s_MAX_STACK_FRAMES, maxStackFrames);
+    numberOfFrames = RtlCaptureStackBackTrace(0, static_cast<DWORD>(numFrames), stackFrames, NULL);
+
+    for (size_t i = 0; i < numberOfFrames; ++i)
+    {
+        handler(i, stackFrames[i]);
     }
 
 #elif defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
 
+#ifdef OOOPSI_FRAME_POINTERS
+    if (unwinder == Unwinder::FRAME_POINTER)
+    {
+        FramePointerWalker walker(__builtin_frame_address(0));
+        if (walker.valid())
+        {
+            pointer_t pc = nullptr;
+            while (numberOfFrames < maxStackFrames && walker.step(pc))
+            {
+                handler(numberOfFrames, pc);
+                numberOfFrames++;
+            }
+            return numberOfFrames;
+        }
+        // else: unknown stack, use libunwind
+    }
+#else
+    std::ignore = unwinder;
+#endif // OOOPSI_FRAME_POINTERS
+
     unw_cursor_t cursor;
     unw_context_t context;
 
     unw_getcontext(&context);
     unw_init_local(&cursor, &context);
 
-    while (unw_step(&cursor) > 0)
+    while (numberOfFrames < maxStackFrames && unw_step(&cursor) > 0)
     {
-        unw_word_t offset, pc;
+        unw_word_t pc;
         unw_get_reg(&cursor, UNW_REG_IP, &pc);
         if (pc == 0)
         {
             break;
         }
 
-        if (numberOfFrames >= maxStackFrames)
+        handler(numberOfFrames, reinterpret_cast<pointer_t>(pc));
+        numberOfFrames++;
+    }
+
+#else
+
+#error "Unsupported platform!"
+
+#endif // OOOPSI_WINDOWS/LINUX/MACOS
+
+    return numberOfFrames;
+}
+
+
+/**
+ * Resolves code addresses to (optionally demangled) symbol names, consulting the process-wide
+ * symbol cache first.
+ * On Windows, the DbgHelp API is locked on the first cache miss, for the lifetime of this object,
+ * so resolve as many addresses as possible with a single instance.
+ */
+class SymbolResolver
+{
+public:
+    /**
+     * @param[in] demangleNames     demangle the symbol names?
+     *                              (if not, the cache is only read but not updated)
+     */
+    explicit SymbolResolver(bool demangleNames) noexcept : m_demangle(demangleNames)
+    {
+        // while reporting a crash, long names fit into the (larger) buffers of the crash arena
+        m_demangled = getCrashScratch(CrashScratch::DEMANGLED, m_demangledSize);
+        if (m_demangled == nullptr)
         {
-            break;
+            m_demangled = m_demangledBuffer;
+            m_demangledSize = sizeof(m_demangledBuffer);
+        }
+#ifndef OOOPSI_WINDOWS
+        m_symName = getCrashScratch(CrashScratch::SYMBOL, m_symNameSize);
+        if (m_symName == nullptr)
+        {
+            m_symName = m_symBuffer;
+            m_symNameSize = sizeof(m_symBuffer);
         }
+#endif
+    }
+
+    ~SymbolResolver() = default;
+
+    SymbolResolver(const SymbolResolver&) = delete;
+    SymbolResolver& operator=(const SymbolResolver&) = delete;
 
-        char symBuffer[1024];
-        const char* symName = nullptr;
-        if (unw_get_proc_name(&cursor, symBuffer, sizeof(symBuffer), &offset) == 0)
+    /**
+     * Looks up the symbol that contains the given address.
+     *
+     * @param[in]  address      the address to resolve
+     * @param[out] offset       offset of 'address' relative to the start of the symbol
+     * @return the symbol name (valid until the next call) or nullptr if not found
+     */
+    const char* resolve(pointer_t address, uint64_t& offset) noexcept
+    {
+        offset = 0;
+
+        CachedSymbol cached;
+        if (lookupCachedSymbol(address, cached))
         {
-            symName = symBuffer;
+            addStat(Stat::CACHE_HITS, 1);
+            offset =
+              reinterpret_cast<uintptr_t>(address) - reinterpret_cast<uintptr_t>(cached.start);
+            return m_demangle ? cached.demangled : cached.mangled;
         }
 
-        handler(numberOfFrames, reinterpret_cast<pointer_t>(pc), symName, offset);
-        numberOfFrames++;
+        addStat(Stat::CACHE_MISSES, 1);
+        const StatTimer timer(Stat::SYMBOLIZE_NANOSECONDS);
+        const char* symbol = resolveUncached(address, offset);
+        if (symbol == nullptr || !m_demangle)
+        {
+            return symbol;
+        }
+
+        {
+            const StatTimer demangleTimer(Stat::DEMANGLE_NANOSECONDS);
+            demangle(symbol, m_demangled, m_demangledSize);
+        }
+        const auto start =
+          reinterpret_cast<pointer_t>(reinterpret_cast<uintptr_t>(address) - offset);
+        cacheSymbol(address, start, symbol, m_demangled);
+        return m_demangled;
     }
 
+private:
+    /// Resolves the address using the OS-specific method, returns the mangled name.
+    const char* resolveUncached(pointer_t address, uint64_t& offset) noexcept
+    {
+#ifdef OOOPSI_WINDOWS
+        if (!m_lock.owns_lock())
+        {
+            m_lock.lock();
+            m_symInitOk = prepareDbgHelp();
+        }
+        if (!m_symInitOk)
+        {
+            return nullptr;
+        }
+
+        memset(m_symBuffer, 0, sizeof(m_symBuffer));
+        PSYMBOL_INFO pSymbol = reinterpret_cast<PSYMBOL_INFO>(m_symBuffer);
+        pSymbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+        pSymbol->MaxNameLen = MAX_SYM_NAME;
+
+        DWORD64 dwDisplacement = 0;
+        if (SymFromAddr(GetCurrentProcess(), reinterpret_cast<DWORD64>(address), &dwDisplacement,
+                        pSymbol))
+        {
+            offset = dwDisplacement;
+            return pSymbol->Name;
+        }
 #else
+        // the symbol index is a lot faster, if it has been built (see prepareSymbolIndexes())
+        const char* indexed = lookupIndexedSymbol(address, !isReportingThread(), offset);
+        if (indexed != nullptr)
+        {
+            return indexed;
+        }
 
-#error "Unsupported platform!"
+        if (!m_cursorOk)
+        {
+            // Any local cursor will do: the instruction pointer is overwritten for every lookup.
+            // Note: The cursor treats the IP as a return address and looks up the previous
+            // instruction, which is exactly what we want for addresses collected by walkStack().
+            unw_getcontext(&m_context);
+            m_cursorOk = unw_init_local(&m_cursor, &m_context) == 0;
+        }
 
-#endif // OOOPSI_WINDOWS/LINUX/MACOS
+        unw_word_t off = 0;
+        if (m_cursorOk &&
+            unw_set_reg(&m_cursor, UNW_REG_IP, reinterpret_cast<unw_word_t>(address)) == 0 &&
+            unw_get_proc_name(&m_cursor, m_symName, m_symNameSize, &off) == 0)
+        {
+            offset = off;
+            return m_symName;
+        }
+#endif
+        return nullptr;
+    }
 
-    return numberOfFrames;
-}
+    /// demangle the names?
+    const bool m_demangle;
+    /// storage for the last demangled name (m_demangledBuffer or from the crash arena)
+    char* m_demangled;
+    size_t m_demangledSize;
+    char m_demangledBuffer[1024];
+
+#ifdef OOOPSI_WINDOWS
+    // access to the debug help API must be serialized
+    std::unique_lock<DbgHelpMutex> m_lock{ s_dbgHelpMutex, std::defer_lock };
+    bool m_symInitOk = false;
+    char m_symBuffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME * sizeof(TCHAR)];
+#else
+    bool m_cursorOk = false;
+    unw_cursor_t m_cursor;
+    unw_context_t m_context;
+    /// storage for the last symbol name (m_symBuffer or from the crash arena)
+    char* m_symName;
+    size_t m_symNameSize;
+    char m_symBuffer[1024];
+#endif
+};
 
 
-static void logFrame(const LogSettings settings, uint64_t num, pointer_t address, const char* sym,
-                     uint64_t offset, const pointer_t* faultAddr)
+/// Formats a line of a stack trace (see logFrame()).
+static void formatFrame(LineFormatter& line, uint64_t num, pointer_t address, const char* sym,
+                        uint64_t offset, bool isFault, bool printModule, bool loadLines) noexcept
 {
+    line.append(isFault ? "=>" : "  ");
+    line.append('#').appendDecimal(num).padTo(5).append("  ").appendAddress(address);
+
+    if (sym != nullptr)
+    {
+        // append the (demangled) name + offset (the name may get truncated)
+        line.append(" in ").append(sym).append("+0x").appendHex(offset);
+    }
+    // else: no symbol name, keep the address
+
+    ModuleInfo module;
+    if (printModule && findModule(address, module))
+    {
+        // the module-relative address allows symbolizing offline (e.g. with addr2line)
+        const uint64_t moduleOffset = reinterpret_cast<uintptr_t>(address) - module.base;
+        line.append(sym != nullptr ? " (" : " in ").append(moduleName(module));
+        line.append("+0x").appendHex(moduleOffset);
+        if (sym != nullptr)
+        {
+            line.append(')');
+        }
+    }
+
+    // look up the call instruction instead of the return address (except for the faulting one)
+    const auto lineAddress = reinterpret_cast<pointer_t>(reinterpret_cast<uintptr_t>(address) -
+                                                         (isFault ? 0 : 1));
+    SourceLocation location;
+    if (lookupSourceLine(lineAddress, loadLines, location))
+    {
+        line.append(" at ").append(location.file).append(':').appendDecimal(location.line);
+    }
+}
+
+void logFrame(LogWriter& writer, uint64_t num, pointer_t address, const char* sym, uint64_t offset,
+              const pointer_t* faultAddr, bool printModule, bool loadLines)
+{
+    // while reporting a crash, long lines fit into the (larger) buffer of the crash arena
     char messageBuffer[1024];
-    const char* prefix = "  ";
-    if (faultAddr != nullptr && *faultAddr == address)
+    size_t lineSize = 0;
+    char* lineBuffer = getCrashScratch(CrashScratch::LINE, lineSize);
+    if (lineBuffer == nullptr)
     {
-        prefix = "=>";
+        lineBuffer = messageBuffer;
+        lineSize = sizeof(messageBuffer);
     }
-    snprintf(messageBuffer, sizeof(messageBuffer), "%s#%-2" PRIu64 "  %p", prefix, num, address);
+    LineFormatter line(lineBuffer, lineSize);
+    formatFrame(line, num, address, sym, offset, faultAddr != nullptr && *faultAddr == address,
+                printModule, loadLines);
+    writer.line(line.c_str());
+}
 
-    if (sym != nullptr)
+
+void printStackTrace(LogSettings settings, const pointer_t* faultAddr)
+{
+    if (!isReportingThread())
+    {
+        // (not in the crash reports, the module map can't be updated safely there)
+        refreshModuleMap();
+    }
+    LogWriter writer(settings);
+    if (settings.format != LogFormat::TEXT)
+    {
+        pointer_t addresses[s_MAX_STACK_FRAMES];
+        StructuredReport report;
+        report.faultAddr = faultAddr;
+        report.addresses = addresses;
+        {
+            const StatTimer timer(Stat::UNWIND_NANOSECONDS);
+            report.numAddresses = walkStack(
+              [&](size_t num, pointer_t address) { addresses[num] = address; }, s_MAX_STACK_FRAMES,
+              settings.unwinder);
+        }
+        countTrace(report.numAddresses);
+        report.truncated = report.numAddresses == s_MAX_STACK_FRAMES;
+        writeStructuredReport(writer, settings, report, settings.printSourceLines);
+        writer.finish();
+        return;
+    }
+    printStackTrace(writer, settings, faultAddr, settings.printSourceLines);
+    // END
+    writer.finish();
+}
+
+void printStackTrace(LogWriter& writer, const LogSettings& settings, const pointer_t* faultAddr,
+                     bool loadLines)
+{
+    pointer_t addresses[s_MAX_STACK_FRAMES];
+    size_t n = 0;
+    {
+        const StatTimer timer(Stat::UNWIND_NANOSECONDS);
+        n = walkStack([&](size_t num, pointer_t address) { addresses[num] = address; },
+                      s_MAX_STACK_FRAMES, settings.unwinder);
+    }
+    countTrace(n);
+
+    // the trace is (probably) truncated if the buffer is full
+    printAddresses(writer, settings, "---------- BACKTRACE ----------", addresses, n, faultAddr,
+                   n == s_MAX_STACK_FRAMES, loadLines);
+}
+
+void printAddresses(LogWriter& writer, const LogSettings& settings, const char* title,
+                    const pointer_t* addresses, size_t numAddresses, const pointer_t* faultAddr,
+                    bool truncated, bool loadLines)
+{
+    writer.line(title);
+
+    SymbolResolver resolver(settings.demangleNames);
+    for (size_t i = 0; i < numAddresses; ++i)
+    {
+        uint64_t offset = 0;
+        const char* symbol = resolver.resolve(addresses[i], offset);
+        logFrame(writer, i, addresses[i], symbol, offset, faultAddr, settings.printModules,
+                 loadLines);
+    }
+
+    if (truncated)
+    {
+        char messageBuffer[64];
+        LineFormatter line(messageBuffer);
+        line.append("  #").appendDecimal(numAddresses).padTo(5).append(" ... (truncating)");
+        writer.line(line.c_str());
+    }
+
+    writer.line("-------------------------------");
+}
+
+/// Returns the time of a steady clock in milliseconds.
+static uint64_t steadyMilliseconds() noexcept
+{
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+BoundedTrace::BoundedTrace() noexcept
+  : m_deadline(steadyMilliseconds() + s_MAX_TRACE_MILLISECONDS)
+{
+}
+
+bool BoundedTrace::add(pointer_t address) noexcept
+{
+    const uint64_t num = m_numFrames++;
+    if (m_cycleLength > 0)
+    {
+        if (m_head[m_cycleStart + m_cyclePos].address == address)
+        {
+            // the pending cycle continues
+            if (++m_cyclePos == m_cycleLength)
+            {
+                m_cyclePos = 0;
+                ++m_cycleRepeats;
+            }
+        }
+        else
+        {
+            closeCycle();
+            push(address, num);
+            detectCycle();
+        }
+    }
+    else
+    {
+        push(address, num);
+        detectCycle();
+    }
+
+    // reading the clock is cheap, but not as cheap as a step
+    if (m_numFrames >= s_MAX_TRACE_STEPS ||
+        ((m_numFrames & 0xff) == 0 && steadyMilliseconds() >= m_deadline))
+    {
+        return false;
+    }
+    return true;
+}
+
+void BoundedTrace::finish(bool truncated) noexcept
+{
+    if (m_cycleLength > 0)
+    {
+        closeCycle();
+    }
+    m_truncated = truncated;
+}
+
+size_t BoundedTrace::numTail() const noexcept
+{
+    return m_numTail < s_TRACE_TAIL_FRAMES ? static_cast<size_t>(m_numTail) : s_TRACE_TAIL_FRAMES;
+}
+
+const BoundedTrace::Entry& BoundedTrace::tail(size_t i) const noexcept
+{
+    const uint64_t oldest = m_numTail - numTail();
+    return m_tail[(oldest + i) % s_TRACE_TAIL_FRAMES];
+}
+
+void BoundedTrace::push(pointer_t address, uint64_t num) noexcept
+{
+    if (m_numHead < s_TRACE_HEAD_FRAMES)
+    {
+        m_head[m_numHead++] = Entry{ address, num, 0, 0 };
+        return;
+    }
+    if (m_numTail == 0)
+    {
+        m_firstTailNum = num;
+    }
+    m_tail[m_numTail++ % s_TRACE_TAIL_FRAMES] = Entry{ address, num, 0, 0 };
+}
+
+void BoundedTrace::detectCycle() noexcept
+{
+    // only frames in the head are collapsed (once it's full, they are added to the tail)
+    if (m_numTail > 0)
+    {
+        return;
+    }
+    const size_t available = m_numHead - m_cycleCandidate;
+    for (size_t length = 1; length <= s_MAX_CYCLE_FRAMES && 2 * length <= available; ++length)
+    {
+        size_t i = 0;
+        while (i < length &&
+               m_head[m_numHead - 1 - i].address == m_head[m_numHead - 1 - i - length].address)
+        {
+            ++i;
+        }
+        if (i == length)
+        {
+            // the second repetition is dropped, the first one stays
+            m_numHead -= length;
+            m_cycleStart = m_numHead - length;
+            m_cycleLength = length;
+            m_cyclePos = 0;
+            m_cycleRepeats = 2;
+            return;
+        }
+    }
+}
+
+void BoundedTrace::closeCycle() noexcept
+{
+    // the entry replaces the (dropped) second repetition, so the head has room for it
+    const uint64_t first = m_head[m_cycleStart].num;
+    m_head[m_numHead++] = Entry{ nullptr, first, m_cycleLength, m_cycleRepeats };
+    m_cycleCandidate = m_numHead;
+
+    // the frames of the incomplete last repetition
+    const uint64_t numRepeated = m_cycleLength * m_cycleRepeats;
+    for (size_t i = 0; i < m_cyclePos; ++i)
+    {
+        push(m_head[m_cycleStart + i].address, first + numRepeated + i);
+    }
+    m_cycleLength = 0;
+}
+
+void printBoundedTrace(LogWriter& writer, const LogSettings& settings, const char* title,
+                       const BoundedTrace& trace, const pointer_t* faultAddr) noexcept
+{
+    writer.line(title);
+
+    char messageBuffer[128];
+    SymbolResolver resolver(settings.demangleNames);
+    const auto printFrame = [&](const BoundedTrace::Entry& entry) {
+        uint64_t offset = 0;
+        const char* symbol = resolver.resolve(entry.address, offset);
+        logFrame(writer, entry.num, entry.address, symbol, offset, faultAddr,
+                 settings.printModules, false);
+    };
+
+    for (size_t i = 0; i < trace.numHead(); ++i)
+    {
+        const BoundedTrace::Entry& entry = trace.head()[i];
+        if (entry.address != nullptr)
+        {
+            printFrame(entry);
+            continue;
+        }
+        // the frames of the cycle were printed above
+        LineFormatter line(messageBuffer);
+        line.append("  #").appendDecimal(entry.num).append("-#");
+        line.appendDecimal(entry.num + entry.cycleLength * entry.repeats - 1);
+        line.append(" [cycle of ").appendDecimal(entry.cycleLength);
+        line.append(entry.cycleLength == 1 ? " frame x " : " frames x ");
+        writer.line(line.appendDecimal(entry.repeats).append(']').c_str());
+    }
+
+    if (trace.numSkipped() > 0)
+    {
+        LineFormatter line(messageBuffer);
+        line.append("  #").appendDecimal(trace.firstSkipped()).append("-#");
+        line.appendDecimal(trace.firstSkipped() + trace.numSkipped() - 1);
+        line.append(" ... (").appendDecimal(trace.numSkipped()).append(" skipped)");
+        writer.line(line.c_str());
+    }
+    for (size_t i = 0; i < trace.numTail(); ++i)
+    {
+        printFrame(trace.tail(i));
+    }
+
+    if (trace.truncated())
+    {
+        LineFormatter line(messageBuffer);
+        line.append("  #").appendDecimal(trace.numFrames()).padTo(5).append(" ... (truncating)");
+        writer.line(line.c_str());
+    }
+
+    writer.line("-------------------------------");
+}
+
+/// size of the buffer for structured reports (enough for a full trace with long names)
+static constexpr size_t s_REPORT_BUFFER_SIZE = 64 * 1024;
+/// the buffer for structured reports
+static char s_reportBuffer[s_REPORT_BUFFER_SIZE];
+/// set while s_reportBuffer is used
+static std::atomic_flag s_reportBufferInUse = ATOMIC_FLAG_INIT;
+
+/// Encodes a frame completely, or not at all.
+/// @return false if it didn't fit
+template <typename Encoder>
+static bool encodeFrame(Encoder& out, SymbolResolver& resolver, const LogSettings& settings,
+                        const BoundedTrace::Entry& entry, const pointer_t* faultAddr,
+                        bool loadLines) noexcept
+{
+    const auto mark = out.mark();
+    out.beginFrame();
+    out.number(FrameField::NUM, "num", entry.num);
+    if (entry.address != nullptr)
+    {
+        const auto address = reinterpret_cast<uintptr_t>(entry.address);
+        out.address(FrameField::ADDRESS, "address", address);
+
+        uint64_t offset = 0;
+        const char* symbol = resolver.resolve(entry.address, offset);
+        out.text(FrameField::SYMBOL, "symbol", symbol);
+        if (symbol != nullptr)
+        {
+            out.address(FrameField::OFFSET, "offset", offset);
+        }
+
+        ModuleInfo module;
+        if (settings.printModules && findModule(entry.address, module))
+        {
+            out.text(FrameField::MODULE, "module", moduleName(module));
+            out.address(FrameField::MODULE_OFFSET, "moduleOffset", address - module.base);
+        }
+
+        // the call instruction instead of the return address (except for the faulting one)
+        const bool isFault = faultAddr != nullptr && *faultAddr == entry.address;
+        SourceLocation location;
+        if (lookupSourceLine(reinterpret_cast<pointer_t>(address - (isFault ? 0 : 1)), loadLines,
+                             location))
+        {
+            out.text(FrameField::FILE, "file", location.file);
+            out.number(FrameField::LINE, "line", location.line);
+        }
+    }
+    else if (entry.cycleLength > 0)
+    {
+        out.number(FrameField::CYCLE, "cycle", entry.cycleLength);
+        out.number(FrameField::REPEATS, "repeats", entry.repeats);
+    }
+    else
+    {
+        // the frames between the head and the tail ('repeats': their number)
+        out.number(FrameField::SKIPPED, "skipped", entry.repeats);
+    }
+    out.endFrame();
+
+    if (out.overflowed())
+    {
+        out.rollback(mark);
+        return false;
+    }
+    return true;
+}
+
+/// Encodes a report (see writeStructuredReport()).
+template <typename Encoder>
+static void encodeReport(Encoder& out, const LogSettings& settings, const StructuredReport& report,
+                         bool loadLines) noexcept
+{
+    out.begin();
+    out.text(ReportField::REASON, "reason", report.reason);
+    if (report.signal != nullptr)
+    {
+        out.integer(ReportField::SIGNAL, "signal", report.signal->signal);
+        out.integer(ReportField::CODE, "code", report.signal->code);
+        if (report.signal->address != nullptr)
+        {
+            out.address(ReportField::ADDRESS, "address",
+                        reinterpret_cast<uintptr_t>(report.signal->address));
+        }
+    }
+    if (report.faultAddr != nullptr)
+    {
+        out.address(ReportField::FAULT, "fault", reinterpret_cast<uintptr_t>(*report.faultAddr));
+    }
+    const uint64_t threadId = report.signal != nullptr && report.signal->threadId != 0
+                                ? report.signal->threadId
+                                : currentThreadId();
+    out.number(ReportField::THREAD, "thread", threadId);
+    out.text(ReportField::DUMP, "dump", report.dumpPath);
+    if (report.recordWritten)
+    {
+        out.flag(ReportField::RECORD, "record");
+    }
+    // e.g. a long reason
+    bool truncated = out.overflowed();
+
+    if (report.trace != nullptr || report.addresses != nullptr)
     {
-        // append the demangled name + offset
-        strncat(messageBuffer, " in ", sizeof(messageBuffer) - strlen(messageBuffer) - 1);
-        size_t bufLen = strlen(messageBuffer);
-        if (bufLen < sizeof(messageBuffer))
+        out.beginFrames();
+        SymbolResolver resolver(settings.demangleNames);
+        const pointer_t* faultAddr = report.faultAddr;
+        bool complete = true;
+        if (report.trace != nullptr)
         {
-            if (settings.demangleNames)
+            // the same entries as printBoundedTrace()
+            const BoundedTrace& trace = *report.trace;
+            for (size_t i = 0; complete && i < trace.numHead(); ++i)
+            {
+                complete = encodeFrame(out, resolver, settings, trace.head()[i], faultAddr, false);
+            }
+            if (complete && trace.numSkipped() > 0)
             {
-                std::string demangled = demangle(sym);
-                strncat(messageBuffer, demangled.c_str(), sizeof(messageBuffer) - bufLen - 1);
+                const BoundedTrace::Entry skipped{ nullptr, trace.firstSkipped(), 0,
+                                                   trace.numSkipped() };
+                complete = encodeFrame(out, resolver, settings, skipped, faultAddr, false);
             }
-            else
+            for (size_t i = 0; complete && i < trace.numTail(); ++i)
+            {
+                complete = encodeFrame(out, resolver, settings, trace.tail(i), faultAddr, false);
+            }
+            truncated = truncated || trace.truncated();
+        }
+        else
+        {
+            for (size_t i = 0; complete && i < report.numAddresses; ++i)
             {
-                // copy the plain name (may get truncated)
-#ifdef OOOPSI_GCC
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpragmas"
-#pragma GCC diagnostic ignored "-Wstringop-truncation"
+                const BoundedTrace::Entry entry{ report.addresses[i], i, 0, 0 };
+                complete = encodeFrame(out, resolver, settings, entry, faultAddr, loadLines);
+            }
+            truncated = truncated || report.truncated;
+        }
+        out.endFrames();
+        truncated = truncated || !complete;
+    }
+
+    out.useReserve();
+    if (truncated)
+    {
+        out.flag(ReportField::TRUNCATED, "truncated");
+    }
+    out.end();
+}
+
+void writeStructuredReport(LogWriter& writer, const LogSettings& settings,
+                           const StructuredReport& report, bool loadLines) noexcept
+{
+    // another thread's report: a smaller buffer on the stack (holds the first frames)
+    char stackBuffer[4096];
+    const bool shared = !s_reportBufferInUse.test_and_set(std::memory_order_acquire);
+    char* buffer = shared ? s_reportBuffer : stackBuffer;
+    const size_t size = shared ? sizeof(s_reportBuffer) : sizeof(stackBuffer);
+
+    if (settings.format == LogFormat::BINARY && writer.acceptsBlocks())
+    {
+        ProtoEncoder out(buffer, size);
+        encodeReport(out, settings, report, loadLines);
+        writer.block(out.data(), out.size());
+    }
+    else
+    {
+        JsonEncoder out(buffer, size);
+        encodeReport(out, settings, report, loadLines);
+        writer.line(out.data());
+    }
+
+    if (shared)
+    {
+        s_reportBufferInUse.clear(std::memory_order_release);
+    }
+}
+
+/// Fills in a resolved frame, returns false if the name is unknown or doesn't fit into memory
+/// (then it's left empty).
+static bool assignFrame(StackFrame& frame, pointer_t address, const char* symbol,
+                        uint64_t offset) noexcept
+{
+    frame.address = address;
+    frame.offset = static_cast<size_t>(offset);
+    try
+    {
+        frame.function = symbol != nullptr ? symbol : "";
+    }
+    catch (...)
+    {
+        // out of memory
+        frame.function.clear();
+        return false;
+    }
+    return symbol != nullptr;
+}
+
+size_t collectStackTrace(StackFrame* buffer, size_t bufferSize, Unwinder unwinder) noexcept
+{
+    // (cheap if no modules were loaded or unloaded in the meantime)
+    refreshModuleMap();
+    size_t n = 0;
+    {
+        const StatTimer timer(Stat::UNWIND_NANOSECONDS);
+        n = walkStack([&](size_t num, pointer_t address) { buffer[num].address = address; },
+                      bufferSize, unwinder);
+    }
+    countTrace(n);
+
+    SymbolResolver resolver(true);
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t offset = 0;
+        const char* symbol = resolver.resolve(buffer[i].address, offset);
+        assignFrame(buffer[i], buffer[i].address, symbol, offset);
+    }
+    return n;
+}
+
+size_t captureStackAddresses(pointer_t* buffer, size_t bufferSize, Unwinder unwinder) noexcept
+{
+    return walkStack([&](size_t num, pointer_t address) { buffer[num] = address; }, bufferSize,
+                     unwinder);
+}
+
+#if defined(OOOPSI_WINDOWS) && (defined(_M_X64) || defined(__x86_64__))
+/// Walks the stack starting at the given context (x64 only, using the unwind tables of the
+/// modules): the handler is called with every frame's address and returns false to stop the walk.
+/// Doesn't allocate.
+template <class Func>
+static void unwindContext(CONTEXT& context, Func&& handler) noexcept
+{
+    while (context.Rip != 0 && handler(reinterpret_cast<pointer_t>(context.Rip)))
+    {
+        DWORD64 imageBase = 0;
+        PRUNTIME_FUNCTION function = RtlLookupFunctionEntry(context.Rip, &imageBase, nullptr);
+        if (function == nullptr)
+        {
+            // a leaf function: the return address is on top of the stack
+            context.Rip = *reinterpret_cast<const DWORD64*>(context.Rsp);
+            context.Rsp += sizeof(DWORD64);
+        }
+        else
+        {
+            PVOID handlerData = nullptr;
+            DWORD64 establisherFrame = 0;
+            RtlVirtualUnwind(UNW_FLAG_NHANDLER, imageBase, context.Rip, function, &context,
+                             &handlerData, &establisherFrame, nullptr);
+        }
+    }
+}
 #endif
-                strncat(messageBuffer, sym, sizeof(messageBuffer) - bufLen - 1);
-#ifdef OOOPSI_GCC
-#pragma GCC diagnostic pop
+
+#if defined(OOOPSI_LINUX) && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+/// Bounds a libunwind walk to the thread's stack: once the walk is on the stack (if its range is
+/// known), it stops when a frame is located outside of it (a corrupted or garbage frame).
+class StackBound
+{
+public:
+    /// Checks the frame the cursor points to, returns false if the walk should stop.
+    bool check(unw_cursor_t& cursor) noexcept
+    {
+        const StackRange& stack = t_threadStack;
+        if (stack.high <= 1)
+        {
+            return true;
+        }
+        unw_word_t sp = 0;
+        unw_get_reg(&cursor, UNW_REG_SP, &sp);
+        const bool inside = sp >= stack.low && sp < stack.high;
+        if (m_onStack && !inside)
+        {
+            return false;
+        }
+        m_onStack = m_onStack || inside;
+        return true;
+    }
+
+private:
+    bool m_onStack = false;
+};
+#endif
+
+/**
+ * Implementation of captureSignalStack(): the handler is called with every frame's address
+ * (starting with the interrupted instruction) and returns false to stop the walk.
+ * Note: this function is force-inlined to avoid having it show up in the call stack.
+ */
+template <class Func>
+OOOPSI_FORCE_INLINE void walkSignalStack(const void* context, Func&& handler,
+                                         Unwinder unwinder) noexcept
+{
+#if defined(OOOPSI_LINUX) && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+    // the interrupted frame (its frame pointer may not be set up yet, e.g. in a prologue)
+    const auto& mcontext = static_cast<const ucontext_t*>(context)->uc_mcontext;
+#if defined(__x86_64__)
+    const auto pc = static_cast<uintptr_t>(mcontext.gregs[REG_RIP]);
+    const auto fp = static_cast<uintptr_t>(mcontext.gregs[REG_RBP]);
+#elif defined(__i386__)
+    const auto pc = static_cast<uintptr_t>(mcontext.gregs[REG_EIP]);
+    const auto fp = static_cast<uintptr_t>(mcontext.gregs[REG_EBP]);
+#else
+    const auto pc = static_cast<uintptr_t>(mcontext.pc);
+    const auto fp = static_cast<uintptr_t>(mcontext.regs[29]);
 #endif
+    if (!handler(reinterpret_cast<pointer_t>(pc)))
+    {
+        return;
+    }
+
+    // only use frame pointers if the stack range is known already (querying it isn't signal-safe)
+    if (unwinder == Unwinder::FRAME_POINTER && t_threadStack.high > 1)
+    {
+        FramePointerWalker walker(reinterpret_cast<const void*>(fp), t_threadStack);
+        if (walker.valid())
+        {
+            pointer_t address = nullptr;
+            while (walker.step(address) && handler(address))
+            {
             }
-            bufLen = strlen(messageBuffer);
+            return;
         }
-        if (bufLen < sizeof(messageBuffer))
+    }
+
+    unw_cursor_t cursor;
+    StackBound bound;
+#if defined(OOOPSI_HAVE_UNW_INIT_LOCAL2) && (defined(__x86_64__) || defined(__i386__))
+    // Start at the interrupted frame (unw_context_t is a ucontext_t here): this doesn't step
+    // through the handler's frames and the signal trampoline, and the flag makes libunwind look up
+    // the interrupted instruction itself (instead of the one before a return address).
+    auto* ucontext = const_cast<unw_context_t*>(static_cast<const unw_context_t*>(context));
+    if (unwinder != Unwinder::FROM_HANDLER &&
+        unw_init_local2(&cursor, ucontext, UNW_INIT_SIGNAL_FRAME) == 0)
+    {
+        bound.check(cursor);
+        while (unw_step(&cursor) > 0 && bound.check(cursor))
         {
-            snprintf(messageBuffer + bufLen, sizeof(messageBuffer) - bufLen, "+0x%" PRIx64, offset);
+            unw_word_t ip = 0;
+            unw_get_reg(&cursor, UNW_REG_IP, &ip);
+            if (ip == 0 || !handler(reinterpret_cast<pointer_t>(ip)))
+            {
+                break;
+            }
         }
+        return;
+    }
+#endif
+
+    // libunwind steps through the signal frame: skip everything up to the interrupted frame
+    unw_context_t local;
+    unw_getcontext(&local);
+    unw_init_local(&cursor, &local);
+    bool interrupted = false;
+    while (unw_step(&cursor) > 0)
+    {
+        unw_word_t ip = 0;
+        unw_get_reg(&cursor, UNW_REG_IP, &ip);
+        if (ip == 0)
+        {
+            break;
+        }
+        if (!interrupted)
+        {
+            interrupted = ip == pc;
+            bound.check(cursor);
+            continue;
+        }
+        if (!bound.check(cursor) || !handler(reinterpret_cast<pointer_t>(ip)))
+        {
+            break;
+        }
+    }
+    if (interrupted)
+    {
+        return;
     }
-    // else: no symbol name, keep the address
 
-    settings.logFunc(messageBuffer);
+    // the interrupted frame wasn't found (e.g. libunwind couldn't step through the trampoline, or
+    // reports its address differently): better include the handler's frames than lose the trace
+    unw_init_local(&cursor, &local);
+    bound = StackBound();
+    while (unw_step(&cursor) > 0 && bound.check(cursor))
+    {
+        unw_word_t ip = 0;
+        unw_get_reg(&cursor, UNW_REG_IP, &ip);
+        if (ip == 0 || !handler(reinterpret_cast<pointer_t>(ip)))
+        {
+            break;
+        }
+    }
+#elif defined(OOOPSI_WINDOWS) && (defined(_M_X64) || defined(__x86_64__))
+    // the context of the exception (a copy, since unwinding modifies it)
+    const auto* exception = static_cast<const EXCEPTION_POINTERS*>(context);
+    if (exception != nullptr && exception->ContextRecord != nullptr)
+    {
+        CONTEXT copy = *exception->ContextRecord;
+        unwindContext(copy, handler);
+        return;
+    }
+    bool stopped = false;
+    walkStack([&](size_t, pointer_t address) { stopped = stopped || !handler(address); },
+              s_MAX_STACK_FRAMES, unwinder);
+#else
+    // not supported: include the signal handler's frames
+    std::ignore = context;
+    bool stopped = false;
+    walkStack([&](size_t, pointer_t address) { stopped = stopped || !handler(address); },
+              s_MAX_STACK_FRAMES, unwinder);
+#endif
 }
 
+size_t captureSignalStack(const void* context, pointer_t* buffer, size_t bufferSize,
+                          Unwinder unwinder) noexcept
+{
+    size_t numberOfFrames = 0;
+    if (bufferSize > 0)
+    {
+        walkSignalStack(
+          context,
+          [&](pointer_t address) {
+              buffer[numberOfFrames++] = address;
+              return numberOfFrames < bufferSize;
+          },
+          unwinder);
+    }
+    return numberOfFrames;
+}
 
-void printStackTrace(LogSettings settings, const pointer_t* faultAddr)
+void captureSignalStack(const void* context, BoundedTrace& trace, Unwinder unwinder) noexcept
 {
-    if (settings.logFunc == nullptr)
     {
-        settings.logFunc = getAbortLogFunc();
+        const StatTimer timer(Stat::UNWIND_NANOSECONDS);
+        bool stopped = false;
+        walkSignalStack(
+          context,
+          [&](pointer_t address) {
+              stopped = !trace.add(address);
+              return !stopped;
+          },
+          unwinder);
+        trace.finish(stopped);
     }
+    countTrace(trace.numFrames());
+}
 
-    settings.logFunc("---------- BACKTRACE ----------");
+#if defined(OOOPSI_WINDOWS) && (defined(_M_X64) || defined(__x86_64__))
+size_t captureThreadStack(HANDLE thread, pointer_t* frames, size_t maxFrames) noexcept
+{
+    if (maxFrames == 0 || SuspendThread(thread) == static_cast<DWORD>(-1))
+    {
+        return 0;
+    }
+    size_t numFrames = 0;
+    CONTEXT context;
+    memset(&context, 0, sizeof(context));
+    context.ContextFlags = CONTEXT_FULL;
+    if (GetThreadContext(thread, &context))
+    {
+        // note: nothing may allocate here, the thread might hold the heap lock
+        unwindContext(context, [&](pointer_t address) {
+            frames[numFrames++] = address;
+            return numFrames < maxFrames;
+        });
+    }
+    ResumeThread(thread);
+    return numFrames;
+}
+#endif
 
-    size_t n =
-      collectStackTrace([&](uint64_t num, pointer_t address, const char* symbol, uint64_t offset) {
-          logFrame(settings, num, address, symbol, offset, faultAddr);
-      });
-    if (n == s_MAX_STACK_FRAMES)
+size_t symbolize(const pointer_t* addresses, size_t numAddresses, StackFrame* buffer) noexcept
+{
+    refreshModuleMap();
+    size_t numResolved = 0;
+
+    SymbolResolver resolver(true);
+    for (size_t i = 0; i < numAddresses; ++i)
     {
-        // the trace is (probably) truncated
-        char messageBuffer[512];
-        uint64_t num = n;
-        snprintf(messageBuffer, sizeof(messageBuffer), "  #%-2" PRIu64 " ... (truncating)", num);
-        settings.logFunc(messageBuffer);
+        uint64_t offset = 0;
+        const char* symbol = resolver.resolve(addresses[i], offset);
+        if (assignFrame(buffer[i], addresses[i], symbol, offset))
+        {
+            ++numResolved;
+        }
     }
+    return numResolved;
+}
 
-    settings.logFunc("-------------------------------");
-    // END
-    settings.logFunc(nullptr);
+/// number of addresses per task of symbolizeBatch() (at most, tasks don't span modules)
+static constexpr size_t s_BATCH_TASK_SIZE = 256;
+
+/// Splits sorted addresses into tasks of symbolizeBatch(): returns the index of the first
+/// address of every task, plus the end.
+static std::vector<size_t> splitBatch(const std::vector<pointer_t>& addresses)
+{
+    std::vector<size_t> tasks;
+    ModuleInfo module;
+    bool inModule = false;
+    for (size_t i = 0; i < addresses.size(); ++i)
+    {
+        const auto address = reinterpret_cast<uintptr_t>(addresses[i]);
+        const bool sameModule = inModule && address >= module.start && address < module.end;
+        if (!sameModule)
+        {
+            inModule = findModule(addresses[i], module);
+        }
+        if (!sameModule || i - tasks.back() == s_BATCH_TASK_SIZE)
+        {
+            tasks.push_back(i);
+        }
+    }
+    tasks.push_back(addresses.size());
+    return tasks;
 }
 
-size_t collectStackTrace(StackFrame* buffer, size_t bufferSize) noexcept
+size_t symbolizeBatch(const pointer_t* addresses, size_t numAddresses, StackFrame* buffer,
+                      unsigned numThreads) noexcept
 {
-    return collectStackTrace(
-      [&](uint64_t num, pointer_t address, const char* symbol, uint64_t offset) {
-          buffer[num].address = address;
-          buffer[num].function = demangle(symbol);
-          buffer[num].offset = offset;
-      },
-      bufferSize);
+    refreshModuleMap();
+    std::vector<pointer_t> unique;
+    std::vector<StackFrame> resolved;
+    std::vector<size_t> tasks;
+    try
+    {
+        // every address is resolved once, and neighbours (i.e. the same module) together
+        unique.assign(addresses, addresses + numAddresses);
+        std::sort(unique.begin(), unique.end());
+        unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+        resolved.resize(unique.size());
+        tasks = splitBatch(unique);
+    }
+    catch (...)
+    {
+        // out of memory: one after another
+        return symbolize(addresses, numAddresses, buffer);
+    }
+
+    std::atomic<size_t> nextTask{ 0 };
+    auto worker = [&]() noexcept {
+        SymbolResolver resolver(true);
+        for (size_t task = nextTask++; task + 1 < tasks.size(); task = nextTask++)
+        {
+            for (size_t i = tasks[task]; i < tasks[task + 1]; ++i)
+            {
+                uint64_t offset = 0;
+                const char* symbol = resolver.resolve(unique[i], offset);
+                assignFrame(resolved[i], unique[i], symbol, offset);
+            }
+        }
+    };
+
+#ifdef OOOPSI_WINDOWS
+    // DbgHelp is single-threaded anyway (see s_dbgHelpMutex)
+    numThreads = 1;
+#else
+    if (numThreads == 0)
+    {
+        numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+#endif
+    numThreads = static_cast<unsigned>(std::min<size_t>(numThreads, tasks.size() - 1));
+
+    // this thread is one of the workers
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < numThreads; ++i)
+    {
+        try
+        {
+            threads.emplace_back(worker);
+        }
+        catch (...)
+        {
+            // (out of threads or memory) the others do the rest
+            break;
+        }
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    size_t numResolved = 0;
+    for (size_t i = 0; i < numAddresses; ++i)
+    {
+        const size_t index = static_cast<size_t>(
+          std::lower_bound(unique.begin(), unique.end(), addresses[i]) - unique.begin());
+        const StackFrame& frame = resolved[index];
+        if (assignFrame(buffer[i], frame.address,
+                        frame.function.empty() ? nullptr : frame.function.c_str(), frame.offset))
+        {
+            ++numResolved;
+        }
+    }
+    return numResolved;
+}
+
+/// Formats a frame of formatStackTrace() with the given resolver, returns the line's length.
+static size_t formatFrame(SymbolResolver& resolver, size_t index, pointer_t address, char* buffer,
+                          size_t bufferSize, const FormatSettings& settings) noexcept
+{
+    uint64_t offset = 0;
+    const char* symbol =
+      index < settings.maxSymbolizedFrames ? resolver.resolve(address, offset) : nullptr;
+    LineFormatter line(buffer, bufferSize);
+    formatFrame(line, index, address, symbol, offset,
+                settings.faultAddress != nullptr && settings.faultAddress == address,
+                settings.printModules, false);
+    return line.size();
+}
+
+size_t formatStackFrame(size_t index, pointer_t address, char* buffer, size_t bufferSize,
+                        const FormatSettings& settings) noexcept
+{
+    if (bufferSize == 0)
+    {
+        return 0;
+    }
+    SymbolResolver resolver(settings.demangleNames);
+    return formatFrame(resolver, index, address, buffer, bufferSize, settings);
+}
+
+size_t formatStackTrace(const pointer_t* addresses, size_t numAddresses, char* buffer,
+                        size_t bufferSize, const FormatSettings& settings) noexcept
+{
+    if (bufferSize == 0)
+    {
+        return 0;
+    }
+    buffer[0] = '\0';
+
+    SymbolResolver resolver(settings.demangleNames);
+    size_t length = 0;
+    for (size_t i = 0; i < numAddresses; ++i)
+    {
+        // the line is formatted in place, and dropped if it (or its '\n') doesn't fit anymore
+        const size_t available = bufferSize - length;
+        const size_t lineLength =
+          formatFrame(resolver, i, addresses[i], buffer + length, available, settings);
+        if (lineLength + 2 > available)
+        {
+            buffer[length] = '\0';
+            break;
+        }
+        length += lineLength;
+        buffer[length++] = '\n';
+        buffer[length] = '\0';
+    }
+    return length;
+}
+
+size_t resolveSymbol(pointer_t address, char* buffer, size_t bufferSize, size_t& offset,
+                     bool demangleName) noexcept
+{
+    offset = 0;
+    if (bufferSize == 0)
+    {
+        return 0;
+    }
+    buffer[0] = '\0';
+
+    SymbolResolver resolver(demangleName);
+    uint64_t symbolOffset = 0;
+    const char* symbol = resolver.resolve(address, symbolOffset);
+    if (symbol == nullptr || symbol[0] == '\0')
+    {
+        return 0;
+    }
+    offset = static_cast<size_t>(symbolOffset);
+
+    size_t len = 0;
+    while (symbol[len] != '\0' && len + 1 < bufferSize)
+    {
+        buffer[len] = symbol[len];
+        ++len;
+    }
+    buffer[len] = '\0';
+    return len;
 }
 
 } // namespace ooopsi
@@ -0,0 +1,101 @@
+/**
+ * @file    stats.cpp
+ * @brief   counters of the time spent in unwinding, symbolization and logging (see getStats())
+ *
+ * The counters are relaxed atomics, incremented once per trace, per cache miss or per log call
+ * (the cache hits aren't timed, reading the clock would take longer than the lookup).
+ */
+
+#include "internal.hpp"
+
+#include <atomic>
+#include <chrono>
+
+namespace ooopsi
+{
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the counters require lock-free 64 bit integers");
+
+/// the counters, indexed by Stat
+static std::atomic<uint64_t> s_stats[static_cast<size_t>(Stat::COUNT)];
+
+void addStat(Stat which, uint64_t value) noexcept
+{
+    s_stats[static_cast<size_t>(which)].fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t statNanoseconds() noexcept
+{
+    // (the vDSO on Linux, QueryPerformanceCounter() on Windows)
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+}
+
+/// Returns a counter.
+static uint64_t readStat(Stat which) noexcept
+{
+    return s_stats[static_cast<size_t>(which)].load(std::memory_order_relaxed);
+}
+
+Stats getStats() noexcept
+{
+    Stats stats;
+    stats.traces = readStat(Stat::TRACES);
+    stats.frames = readStat(Stat::FRAMES);
+    stats.cacheHits = readStat(Stat::CACHE_HITS);
+    stats.cacheMisses = readStat(Stat::CACHE_MISSES);
+    stats.unwindNanoseconds = readStat(Stat::UNWIND_NANOSECONDS);
+    stats.symbolizeNanoseconds = readStat(Stat::SYMBOLIZE_NANOSECONDS);
+    stats.demangleNanoseconds = readStat(Stat::DEMANGLE_NANOSECONDS);
+    stats.logNanoseconds = readStat(Stat::LOG_NANOSECONDS);
+    return stats;
+}
+
+void resetStats() noexcept
+{
+    for (auto& stat : s_stats)
+    {
+        stat.store(0, std::memory_order_relaxed);
+    }
+}
+
+/// Appends a duration with 2 or 3 significant digits (e.g. "40us", "2.1ms").
+static void appendDuration(LineFormatter& line, uint64_t nanoseconds) noexcept
+{
+    static const char* const s_UNITS[] = { "ns", "us", "ms", "s" };
+    size_t unit = 0;
+    uint64_t scale = 1;
+    while (unit + 1 < sizeof(s_UNITS) / sizeof(s_UNITS[0]) && nanoseconds >= scale * 1000)
+    {
+        scale *= 1000;
+        ++unit;
+    }
+    line.appendDecimal(nanoseconds / scale);
+    if (unit > 0 && nanoseconds < scale * 10)
+    {
+        // one decimal below 10
+        line.append('.').appendDecimal(nanoseconds % scale * 10 / scale);
+    }
+    line.append(s_UNITS[unit]);
+}
+
+void printStats(LogWriter& writer, const Stats& before) noexcept
+{
+    const Stats after = getStats();
+    char buffer[192];
+    LineFormatter line(buffer);
+    line.append("(ooopsi: unwind ");
+    appendDuration(line, after.unwindNanoseconds - before.unwindNanoseconds);
+    line.append(", symbolize ");
+    appendDuration(line, after.symbolizeNanoseconds - before.symbolizeNanoseconds);
+    line.append(", demangle ");
+    appendDuration(line, after.demangleNanoseconds - before.demangleNanoseconds);
+    line.append(", log ");
+    appendDuration(line, after.logNanoseconds - before.logNanoseconds);
+    line.append("; ").appendDecimal(after.frames - before.frames).append(" frames, ");
+    line.appendDecimal(after.cacheHits - before.cacheHits).append(" cache hits, ");
+    line.appendDecimal(after.cacheMisses - before.cacheMisses).append(" misses)");
+    writer.line(line.c_str());
+}
+
+} // namespace ooopsi
@@ -0,0 +1,537 @@
+/**
+ * @file    structuredlog.hpp
+ * @brief   fields of the structured crash reports (see LogSettings::format)
+ *
+ * A structured report has the same content as the text output (the reason, the signal and the
+ * frames, with their symbols, modules and source lines), in fields that log collectors can index
+ * without parsing. It's written as a whole, in a single call of the log destination:
+ *  - LogFormat::JSON: a single line with a JSON object, using the names below. Addresses and
+ *    offsets are strings ("0x..."), because JSON numbers can't hold all 64 bit values.
+ *  - LogFormat::BINARY: a protobuf message (proto3 wire format), prefixed with its length as a
+ *    varint (like protobuf's writeDelimitedTo()). The schema:
+ *
+ *        message Frame {
+ *          uint64 num = 1;
+ *          uint64 address = 2;
+ *          string symbol = 3;
+ *          uint64 offset = 4;
+ *          string module = 5;
+ *          uint64 module_offset = 6;
+ *          string file = 7;
+ *          uint64 line = 8;
+ *          uint64 cycle = 9;       // a cycle of the frames before it (no address)
+ *          uint64 repeats = 10;
+ *          uint64 skipped = 11;    // frames that were dropped (no address)
+ *        }
+ *        message Report {
+ *          string reason = 1;
+ *          int64 signal = 2;
+ *          int64 code = 3;
+ *          uint64 address = 4;
+ *          uint64 fault = 5;
+ *          uint64 thread = 6;
+ *          repeated Frame frames = 7;
+ *          bool truncated = 8;
+ *          string dump = 9;
+ *          bool record = 10;
+ *        }
+ *
+ *    The lengths of the frames (and the report) are written as 4 byte varints, with redundant
+ *    continuation bits if they're smaller, so the message is written in a single pass. Protobuf
+ *    parsers accept this.
+ *
+ * The fields that are unknown are omitted. The frames that don't fit into the output buffer are
+ * omitted as well (and 'truncated' is set).
+ *
+ * The encoders below write into a fixed buffer, without any allocation (i.e. they're
+ * signal-safe). A frame is written completely or not at all: if it doesn't fit, it's rolled back.
+ */
+
+#ifndef STRUCTUREDLOG_HPP_
+#define STRUCTUREDLOG_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace ooopsi
+{
+
+/// The fields of a report: the protobuf field numbers.
+enum class ReportField : uint32_t
+{
+    /// the reason for the program termination ("reason")
+    REASON = 1,
+    /// the signal number ("signal")
+    SIGNAL = 2,
+    /// the signal code ("code")
+    CODE = 3,
+    /// the address reported by the signal ("address")
+    ADDRESS = 4,
+    /// the address of the faulting instruction ("fault")
+    FAULT = 5,
+    /// the ID of the crashed thread ("thread")
+    THREAD = 6,
+    /// the frames ("frames", an array)
+    FRAMES = 7,
+    /// the stack or the report was truncated ("truncated")
+    TRUNCATED = 8,
+    /// the path of the crash dump ("dump")
+    DUMP = 9,
+    /// a crash record was written instead of the frames ("record")
+    RECORD = 10
+};
+
+/// The fields of a frame: the protobuf field numbers.
+enum class FrameField : uint32_t
+{
+    /// the frame's number ("num")
+    NUM = 1,
+    /// the frame's address ("address")
+    ADDRESS = 2,
+    /// the (demangled) symbol name ("symbol")
+    SYMBOL = 3,
+    /// offset of the address relative to the symbol ("offset")
+    OFFSET = 4,
+    /// the module's file name ("module")
+    MODULE = 5,
+    /// the module-relative address, e.g. for addr2line ("moduleOffset")
+    MODULE_OFFSET = 6,
+    /// the source file ("file")
+    FILE = 7,
+    /// the source line ("line")
+    LINE = 8,
+    /// the number of frames of a cycle ("cycle")
+    CYCLE = 9,
+    /// the number of repetitions of a cycle ("repeats")
+    REPEATS = 10,
+    /// the number of frames that were dropped ("skipped")
+    SKIPPED = 11
+};
+
+/// protobuf wire type of integers
+static constexpr uint32_t s_WIRE_VARINT = 0;
+/// protobuf wire type of strings and messages
+static constexpr uint32_t s_WIRE_LENGTH = 2;
+
+/// size of the (redundantly encoded) length of a message
+static constexpr size_t s_MESSAGE_LENGTH_SIZE = 4;
+
+/// Stores the output of an encoder in a fixed buffer.
+class ReportBuffer
+{
+public:
+    /// A position to roll back to.
+    struct Mark
+    {
+        size_t size;
+        bool separate;
+        bool overflowed;
+    };
+
+    /// Uses the given buffer: 'reserve' bytes at its end are kept for the last fields (see
+    /// useReserve()), 'closing' bytes of them for closing the report.
+    ReportBuffer(char* buffer, size_t size, size_t reserve, size_t closing) noexcept
+      : m_begin(buffer)
+      , m_cur(buffer)
+      , m_limit(buffer + (size > reserve ? size - reserve : 0))
+      , m_closing(buffer + (size > closing ? size - closing : 0))
+      , m_end(buffer + size)
+    {
+    }
+
+    ReportBuffer(const ReportBuffer&) = delete;
+    ReportBuffer& operator=(const ReportBuffer&) = delete;
+
+    /// the output
+    const char* data() const noexcept { return m_begin; }
+    size_t size() const noexcept { return static_cast<size_t>(m_cur - m_begin); }
+
+    /// Didn't something fit since the last mark()?
+    bool overflowed() const noexcept { return m_overflowed; }
+
+    /// Returns the current position.
+    Mark mark() noexcept
+    {
+        m_overflowed = false;
+        return Mark{ size(), m_separate, false };
+    }
+
+    /// Allows the last fields to use the reserve (after the frames).
+    void useReserve() noexcept { m_limit = m_closing; }
+
+    /// Discards everything after the mark.
+    void rollback(const Mark& mark) noexcept
+    {
+        m_cur = m_begin + mark.size;
+        m_separate = mark.separate;
+        m_overflowed = false;
+    }
+
+protected:
+    /// the remaining space (except for the reserve)
+    size_t room() const noexcept
+    {
+        return m_cur < m_limit ? static_cast<size_t>(m_limit - m_cur) : 0;
+    }
+
+    /// Starts a field, see endField().
+    Mark beginField() noexcept
+    {
+        const Mark start{ size(), m_separate, m_overflowed };
+        m_overflowed = false;
+        return start;
+    }
+
+    /// Ends a field: removes it if it didn't fit completely (the overflow is kept).
+    void endField(const Mark& start) noexcept
+    {
+        if (m_overflowed)
+        {
+            m_cur = m_begin + start.size;
+            m_separate = start.separate;
+        }
+        m_overflowed = m_overflowed || start.overflowed;
+    }
+
+    /// Appends the data if it fits completely.
+    void put(const void* data, size_t length) noexcept
+    {
+        if (length > room())
+        {
+            m_overflowed = true;
+            return;
+        }
+        memcpy(m_cur, data, length);
+        m_cur += length;
+    }
+
+    void put(char c) noexcept { put(&c, 1); }
+
+    /// Appends a character that closes the report (may use the reserve).
+    void close(char c) noexcept
+    {
+        if (m_cur != m_end)
+        {
+            *m_cur++ = c;
+        }
+    }
+
+    char* m_begin;
+    char* m_cur;
+    /// the end of the space for the fields
+    char* m_limit;
+    /// the end of the space for the last fields
+    char* m_closing;
+    char* m_end;
+    bool m_overflowed = false;
+    /// JSON: a comma is needed before the next value
+    bool m_separate = false;
+};
+
+/// Writes a report as a JSON object (NUL-terminated).
+class JsonEncoder : public ReportBuffer
+{
+public:
+    /// the reserve for the last fields (i.e. "truncated")
+    static constexpr size_t s_RESERVE = 32;
+    /// the reserve for closing a string, the frames, the report and the NUL terminator
+    static constexpr size_t s_CLOSING = 4;
+
+    JsonEncoder(char* buffer, size_t size) noexcept
+      : ReportBuffer(buffer, size, s_RESERVE, s_CLOSING)
+    {
+    }
+
+    void begin() noexcept { put('{'); }
+    void end() noexcept
+    {
+        close('}');
+        close('\0');
+        --m_cur;
+    }
+
+    void beginFrames() noexcept
+    {
+        const Mark start = beginField();
+        key("frames");
+        put('[');
+        m_framesOpen = !m_overflowed;
+        endField(start);
+        m_separate = m_separate && !m_framesOpen;
+    }
+    void endFrames() noexcept
+    {
+        if (m_framesOpen)
+        {
+            close(']');
+            m_separate = true;
+        }
+        m_framesOpen = false;
+    }
+
+    void beginFrame() noexcept
+    {
+        separate();
+        put('{');
+        m_separate = false;
+    }
+    void endFrame() noexcept
+    {
+        put('}');
+        m_separate = true;
+    }
+
+    /// Adds a string, which is truncated if it doesn't fit (nullptr: omitted).
+    template <typename Field>
+    void text(Field, const char* name, const char* value) noexcept
+    {
+        if (value == nullptr)
+        {
+            return;
+        }
+        const Mark start = beginField();
+        key(name);
+        put('"');
+        if (m_overflowed)
+        {
+            endField(start);
+            return;
+        }
+        for (; *value != '\0' && !m_overflowed; ++value)
+        {
+            const auto c = static_cast<unsigned char>(*value);
+            if (c == '"' || c == '\\')
+            {
+                const char escaped[2] = { '\\', static_cast<char>(c) };
+                put(escaped, sizeof(escaped));
+            }
+            else if (c < 0x20)
+            {
+                const char escaped[6] = { '\\', 'u', '0', '0', "0123456789abcdef"[c >> 4],
+                                          "0123456789abcdef"[c & 0xF] };
+                put(escaped, sizeof(escaped));
+            }
+            else
+            {
+                put(static_cast<char>(c));
+            }
+        }
+        // a truncated string is still closed
+        close('"');
+        m_overflowed = m_overflowed || start.overflowed;
+    }
+
+    template <typename Field>
+    void number(Field, const char* name, uint64_t value) noexcept
+    {
+        const Mark start = beginField();
+        key(name);
+        decimal(value);
+        endField(start);
+    }
+
+    template <typename Field>
+    void integer(Field, const char* name, int64_t value) noexcept
+    {
+        const Mark start = beginField();
+        key(name);
+        if (value < 0)
+        {
+            put('-');
+        }
+        decimal(value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value));
+        endField(start);
+    }
+
+    /// Adds an address (or an offset) as a string with the hexadecimal value.
+    template <typename Field>
+    void address(Field, const char* name, uint64_t value) noexcept
+    {
+        char digits[19] = { '"', '0', 'x' };
+        size_t n = 3;
+        int shift = 60;
+        while (shift > 0 && (value >> shift) == 0)
+        {
+            shift -= 4;
+        }
+        for (; shift >= 0; shift -= 4)
+        {
+            digits[n++] = "0123456789abcdef"[(value >> shift) & 0xF];
+        }
+        digits[n++] = '"';
+        const Mark start = beginField();
+        key(name);
+        put(digits, n);
+        endField(start);
+    }
+
+    template <typename Field>
+    void flag(Field, const char* name) noexcept
+    {
+        const Mark start = beginField();
+        key(name);
+        put("true", 4);
+        endField(start);
+    }
+
+private:
+    void separate() noexcept
+    {
+        if (m_separate)
+        {
+            put(',');
+        }
+    }
+
+    void key(const char* name) noexcept
+    {
+        separate();
+        put('"');
+        put(name, strlen(name));
+        put("\":", 2);
+        m_separate = true;
+    }
+
+    void decimal(uint64_t value) noexcept
+    {
+        char digits[20];
+        size_t n = sizeof(digits);
+        do
+        {
+            digits[--n] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+        put(digits + n, sizeof(digits) - n);
+    }
+
+    /// the array of frames was started?
+    bool m_framesOpen = false;
+};
+
+/// Writes a report as a length-prefixed protobuf message.
+class ProtoEncoder : public ReportBuffer
+{
+public:
+    /// the reserve for the last fields (i.e. "truncated")
+    static constexpr size_t s_RESERVE = 2;
+
+    ProtoEncoder(char* buffer, size_t size) noexcept : ReportBuffer(buffer, size, s_RESERVE, 0) {}
+
+    void begin() noexcept { m_message = reserveLength(); }
+    void end() noexcept { fillLength(m_message); }
+
+    void beginFrames() noexcept {}
+    void endFrames() noexcept {}
+
+    void beginFrame() noexcept
+    {
+        tag(static_cast<uint32_t>(ReportField::FRAMES), s_WIRE_LENGTH);
+        m_frame = reserveLength();
+    }
+    void endFrame() noexcept { fillLength(m_frame); }
+
+    /// Adds a string, which is truncated if it doesn't fit (nullptr: omitted).
+    template <typename Field>
+    void text(Field field, const char*, const char* value) noexcept
+    {
+        if (value == nullptr)
+        {
+            return;
+        }
+        const Mark start = beginField();
+        tag(static_cast<uint32_t>(field), s_WIRE_LENGTH);
+        // a string that doesn't fit is truncated (its length needs at most 10 bytes)
+        const size_t length = strlen(value);
+        const size_t space = room() > 10 ? room() - 10 : 0;
+        const size_t kept = length < space ? length : space;
+        varint(kept);
+        put(value, kept);
+        endField(start);
+        m_overflowed = m_overflowed || kept < length;
+    }
+
+    template <typename Field>
+    void number(Field field, const char*, uint64_t value) noexcept
+    {
+        const Mark start = beginField();
+        tag(static_cast<uint32_t>(field), s_WIRE_VARINT);
+        varint(value);
+        endField(start);
+    }
+
+    template <typename Field>
+    void integer(Field field, const char*, int64_t value) noexcept
+    {
+        // int64: two's complement
+        number(field, nullptr, static_cast<uint64_t>(value));
+    }
+
+    template <typename Field>
+    void address(Field field, const char*, uint64_t value) noexcept
+    {
+        number(field, nullptr, value);
+    }
+
+    template <typename Field>
+    void flag(Field field, const char*) noexcept
+    {
+        number(field, nullptr, 1);
+    }
+
+private:
+    void varint(uint64_t value) noexcept
+    {
+        unsigned char bytes[10];
+        size_t n = 0;
+        while (value >= 0x80)
+        {
+            bytes[n++] = static_cast<unsigned char>(value | 0x80);
+            value >>= 7;
+        }
+        bytes[n++] = static_cast<unsigned char>(value);
+        put(bytes, n);
+    }
+
+    void tag(uint32_t field, uint32_t wireType) noexcept { varint(field << 3 | wireType); }
+
+    /// Reserves the length of a message.
+    /// @return the offset of its contents (0: didn't fit)
+    size_t reserveLength() noexcept
+    {
+        if (room() < s_MESSAGE_LENGTH_SIZE)
+        {
+            m_overflowed = true;
+            return 0;
+        }
+        const unsigned char placeholder[s_MESSAGE_LENGTH_SIZE] = {};
+        put(placeholder, sizeof(placeholder));
+        return size();
+    }
+
+    /// Stores the length of the message that starts at 'start' (as a 4 byte varint).
+    void fillLength(size_t start) noexcept
+    {
+        if (start > size() || start < s_MESSAGE_LENGTH_SIZE)
+        {
+            // the reserved length didn't fit (or was rolled back)
+            return;
+        }
+        auto length = static_cast<uint32_t>(size() - start);
+        auto* bytes = reinterpret_cast<unsigned char*>(m_begin + start - s_MESSAGE_LENGTH_SIZE);
+        for (size_t i = 0; i < s_MESSAGE_LENGTH_SIZE; ++i)
+        {
+            bytes[i] = static_cast<unsigned char>((length & 0x7F) |
+                                                  (i + 1 < s_MESSAGE_LENGTH_SIZE ? 0x80 : 0));
+            length >>= 7;
+        }
+    }
+
+    /// the contents of the report and the current frame
+    size_t m_message = 0;
+    size_t m_frame = 0;
+};
+
+} // namespace ooopsi
+
+#endif /* STRUCTUREDLOG_HPP_ */
@@ -0,0 +1,170 @@
+/**
+ * @file    symbolcache.cpp
+ * @brief   process-wide cache of resolved symbols
+ *
+ * The cache is a fixed-size, open-addressing hash table plus a string pool, both statically
+ * allocated. Entries are never removed: once the table or the pool is full, no more symbols are
+ * cached. All operations are lock-free and never allocate, which allows lookups from signal
+ * handlers.
+ *
+ * Entries are keyed by the address and the slot of its module in the module map, which is never
+ * reused: after a module was unloaded and another one was loaded at the same address, the old
+ * entries don't match anymore (as soon as the module map has noticed the change).
+ */
+
+#include "internal.hpp"
+
+#include <atomic>
+#include <cstring>
+
+namespace ooopsi
+{
+
+static_assert(ATOMIC_POINTER_LOCK_FREE == 2, "the symbol cache requires lock-free pointers");
+static_assert(ATOMIC_BOOL_LOCK_FREE == 2, "the symbol cache requires lock-free booleans");
+
+/// number of hash table slots (must be a power of 2)
+static constexpr size_t s_SYMBOL_CACHE_SLOTS = 4096;
+/// number of bytes available for all symbol names
+static constexpr size_t s_SYMBOL_CACHE_POOL_SIZE = 512 * 1024;
+/// number of slots to check before giving up (linear probing)
+static constexpr size_t s_SYMBOL_CACHE_MAX_PROBES = 8;
+
+static_assert((s_SYMBOL_CACHE_SLOTS & (s_SYMBOL_CACHE_SLOTS - 1)) == 0,
+              "the number of slots must be a power of 2");
+
+namespace
+{
+
+/// A single hash table entry.
+struct CacheSlot
+{
+    /// the cached address (nullptr: slot is free), written once
+    std::atomic<pointer_t> address;
+    /// set after all other members have been written
+    std::atomic<bool> ready;
+    /// the module map slot of the address + 1 (0: not in any known module)
+    size_t module;
+    /// start address of the symbol
+    pointer_t start;
+    /// offset of the mangled name in s_pool
+    uint32_t mangled;
+    /// offset of the demangled name in s_pool
+    uint32_t demangled;
+};
+
+} // namespace
+
+/// the hash table (zero-initialized, i.e. all slots are free)
+static CacheSlot s_slots[s_SYMBOL_CACHE_SLOTS];
+/// storage for all names
+static char s_pool[s_SYMBOL_CACHE_POOL_SIZE];
+/// number of used bytes in s_pool
+static std::atomic<size_t> s_poolUsed{ 0 };
+
+
+/// Returns the first slot to check for the given address (fibonacci hashing).
+static size_t slotIndex(pointer_t address) noexcept
+{
+    const uint64_t key = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(address));
+    return static_cast<size_t>(key * UINT64_C(0x9E3779B97F4A7C15) >> 32) &
+           (s_SYMBOL_CACHE_SLOTS - 1);
+}
+
+/// Returns the key of the address' module (see CacheSlot::module).
+static size_t moduleKey(pointer_t address) noexcept
+{
+    ModuleInfo module;
+    size_t index = 0;
+    return findModule(address, module, &index) ? index + 1 : 0;
+}
+
+/// Copies the string into the pool, returns its offset or false if the pool is exhausted.
+static bool storeString(const char* str, uint32_t& offset) noexcept
+{
+    const size_t len = strlen(str) + 1;
+    const size_t pos = s_poolUsed.fetch_add(len, std::memory_order_relaxed);
+    if (pos + len > sizeof(s_pool))
+    {
+        return false;
+    }
+    memcpy(s_pool + pos, str, len);
+    offset = static_cast<uint32_t>(pos);
+    return true;
+}
+
+
+bool lookupCachedSymbol(pointer_t address, CachedSymbol& result) noexcept
+{
+    const size_t module = moduleKey(address);
+    size_t index = slotIndex(address);
+    for (size_t probe = 0; probe < s_SYMBOL_CACHE_MAX_PROBES; ++probe)
+    {
+        const CacheSlot& slot = s_slots[index];
+        const pointer_t cur = slot.address.load(std::memory_order_acquire);
+        if (cur == address)
+        {
+            // another thread may still be filling in the data
+            if (!slot.ready.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            if (slot.module != module)
+            {
+                // the same address in a module that has been unloaded (or vice versa)
+                index = (index + 1) & (s_SYMBOL_CACHE_SLOTS - 1);
+                continue;
+            }
+            result.start = slot.start;
+            result.mangled = s_pool + slot.mangled;
+            result.demangled = s_pool + slot.demangled;
+            return true;
+        }
+        if (cur == nullptr)
+        {
+            return false;
+        }
+        index = (index + 1) & (s_SYMBOL_CACHE_SLOTS - 1);
+    }
+    return false;
+}
+
+void cacheSymbol(pointer_t address, pointer_t start, const char* mangled,
+                 const char* demangled) noexcept
+{
+    if (address == nullptr || mangled == nullptr || demangled == nullptr)
+    {
+        return;
+    }
+
+    const size_t module = moduleKey(address);
+    size_t index = slotIndex(address);
+    for (size_t probe = 0; probe < s_SYMBOL_CACHE_MAX_PROBES; ++probe)
+    {
+        CacheSlot& slot = s_slots[index];
+        pointer_t cur = slot.address.load(std::memory_order_acquire);
+        if (cur == nullptr &&
+            slot.address.compare_exchange_strong(cur, address, std::memory_order_acq_rel))
+        {
+            // we own this slot now
+            slot.module = module;
+            slot.start = start;
+            if (storeString(mangled, slot.mangled) && storeString(demangled, slot.demangled))
+            {
+                slot.ready.store(true, std::memory_order_release);
+            }
+            // else: the pool is exhausted, the slot stays unusable
+            return;
+        }
+        if (cur == address &&
+            (!slot.ready.load(std::memory_order_acquire) || slot.module == module))
+        {
+            // already cached (or being cached by another thread)
+            return;
+        }
+        index = (index + 1) & (s_SYMBOL_CACHE_SLOTS - 1);
+    }
+    // else: the table is too crowded around this address
+}
+
+} // namespace ooopsi
@@ -0,0 +1,256 @@
+/**
+ * @file    symbolindex.cpp
+ * @brief   building and searching symbol indexes (see symbolindex.hpp)
+ *
+ * The defined function symbols of .symtab and .dynsym are collected, sorted by address and
+ * reduced to one per address (aliases, and the copies of exported functions in both tables).
+ * Names are stored once per index.
+ */
+
+#include "symbolindex.hpp"
+#include "internal.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#ifdef OOOPSI_LINUX
+#include <elf.h>
+#endif
+
+namespace ooopsi
+{
+
+#ifdef OOOPSI_LINUX
+
+namespace
+{
+
+/// Collects the symbols and names of the symbol tables.
+class SymbolIndexBuilder
+{
+public:
+    SymbolIndexBuilder(const char* image, size_t size) noexcept : m_image(image), m_size(size) {}
+
+    /// Adds the function symbols of all symbol tables, returns false if there are none.
+    template <class Ehdr, class Shdr, class Sym>
+    bool parse()
+    {
+        Ehdr ehdr;
+        if (m_size < sizeof(ehdr))
+        {
+            return false;
+        }
+        memcpy(&ehdr, m_image, sizeof(ehdr));
+        if (ehdr.e_shentsize != sizeof(Shdr) || ehdr.e_shoff > m_size ||
+            ehdr.e_shnum > (m_size - ehdr.e_shoff) / sizeof(Shdr))
+        {
+            return false;
+        }
+
+        auto section = [&](size_t i) {
+            Shdr shdr;
+            memcpy(&shdr, m_image + ehdr.e_shoff + i * sizeof(Shdr), sizeof(shdr));
+            return shdr;
+        };
+        // the full table first: its names win for the same address
+        for (const uint32_t type : { static_cast<uint32_t>(SHT_SYMTAB),
+                                     static_cast<uint32_t>(SHT_DYNSYM) })
+        {
+            for (size_t i = 0; i < ehdr.e_shnum; ++i)
+            {
+                const Shdr symtab = section(i);
+                if (symtab.sh_type == type && symtab.sh_link < ehdr.e_shnum)
+                {
+                    addSymbols<Sym>(symtab, section(symtab.sh_link));
+                }
+            }
+        }
+        return !m_symbols.empty();
+    }
+
+    /// Sorts the symbols and writes the index.
+    void write(std::vector<char>& index)
+    {
+        // the first one per address wins, sized ones before unsized ones
+        std::stable_sort(m_symbols.begin(), m_symbols.end(),
+                         [](const SymbolIndexEntry& lhs, const SymbolIndexEntry& rhs) {
+                             return lhs.start < rhs.start ||
+                                    (lhs.start == rhs.start && lhs.size != 0 && rhs.size == 0);
+                         });
+        m_symbols.erase(std::unique(m_symbols.begin(), m_symbols.end(),
+                                    [](const SymbolIndexEntry& lhs, const SymbolIndexEntry& rhs) {
+                                        return lhs.start == rhs.start;
+                                    }),
+                        m_symbols.end());
+
+        SymbolIndexHeader header;
+        memcpy(header.magic, s_SYMBOL_INDEX_MAGIC, sizeof(header.magic));
+        header.numSymbols = m_symbols.size();
+        header.stringsSize = m_strings.size();
+
+        index.resize(sizeof(header) + m_symbols.size() * sizeof(SymbolIndexEntry) +
+                     m_strings.size());
+        char* pos = index.data();
+        memcpy(pos, &header, sizeof(header));
+        pos += sizeof(header);
+        memcpy(pos, m_symbols.data(), m_symbols.size() * sizeof(SymbolIndexEntry));
+        pos += m_symbols.size() * sizeof(SymbolIndexEntry);
+        memcpy(pos, m_strings.data(), m_strings.size());
+    }
+
+private:
+    template <class Sym, class Shdr>
+    void addSymbols(const Shdr& symtab, const Shdr& strtab)
+    {
+        if (symtab.sh_offset > m_size || symtab.sh_size > m_size - symtab.sh_offset ||
+            strtab.sh_type != SHT_STRTAB || strtab.sh_offset > m_size ||
+            strtab.sh_size > m_size - strtab.sh_offset)
+        {
+            return;
+        }
+        const char* strings = m_image + strtab.sh_offset;
+        const auto stringsSize = static_cast<size_t>(strtab.sh_size);
+        const auto numSymbols = static_cast<size_t>(symtab.sh_size / sizeof(Sym));
+        for (size_t i = 0; i < numSymbols; ++i)
+        {
+            Sym sym;
+            memcpy(&sym, m_image + symtab.sh_offset + i * sizeof(Sym), sizeof(sym));
+            const unsigned type = sym.st_info & 0xf;
+            if ((type != STT_FUNC && type != STT_GNU_IFUNC) || sym.st_value == 0 ||
+                sym.st_shndx == SHN_UNDEF || sym.st_name >= stringsSize)
+            {
+                continue;
+            }
+            const char* name = strings + sym.st_name;
+            const size_t length = strnlen(name, stringsSize - sym.st_name);
+            if (length == 0 || length == stringsSize - sym.st_name)
+            {
+                continue;
+            }
+            const uint64_t size = sym.st_size;
+            m_symbols.push_back(SymbolIndexEntry{ sym.st_value,
+                                                  static_cast<uint32_t>(
+                                                    std::min<uint64_t>(size, UINT32_MAX)),
+                                                  addString(std::string(name, length)) });
+        }
+    }
+
+    /// Returns the offset of a name (stored once).
+    uint32_t addString(const std::string& name)
+    {
+        const auto found = m_stringOffsets.find(name);
+        if (found != m_stringOffsets.end())
+        {
+            return found->second;
+        }
+        const auto offset = static_cast<uint32_t>(m_strings.size());
+        m_strings.append(name).push_back('\0');
+        m_stringOffsets.emplace(name, offset);
+        return offset;
+    }
+
+    const char* m_image;
+    size_t m_size;
+    std::vector<SymbolIndexEntry> m_symbols;
+    std::string m_strings;
+    std::unordered_map<std::string, uint32_t> m_stringOffsets;
+};
+
+} // namespace
+
+bool buildSymbolIndex(const char* image, size_t size, std::vector<char>& index)
+{
+    if (size < EI_NIDENT || memcmp(image, ELFMAG, SELFMAG) != 0 ||
+        image[EI_DATA] != ELFDATA2LSB)
+    {
+        return false;
+    }
+    SymbolIndexBuilder builder(image, size);
+    const bool found = image[EI_CLASS] == ELFCLASS64
+                         ? builder.parse<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym>()
+                         : builder.parse<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym>();
+    if (!found)
+    {
+        return false;
+    }
+    builder.write(index);
+    return true;
+}
+
+#else // !OOOPSI_LINUX
+
+bool buildSymbolIndex(const char* /*image*/, size_t /*size*/, std::vector<char>& /*index*/)
+{
+    // only ELF files are supported
+    return false;
+}
+
+#endif // OOOPSI_LINUX
+
+bool isValidSymbolIndex(const char* index, size_t size) noexcept
+{
+    SymbolIndexHeader header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, index, sizeof(header));
+    const uint64_t payload = size - sizeof(header);
+    return memcmp(header.magic, s_SYMBOL_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+           header.numSymbols <= payload / sizeof(SymbolIndexEntry) &&
+           header.stringsSize == payload - header.numSymbols * sizeof(SymbolIndexEntry) &&
+           (header.stringsSize == 0 || index[size - 1] == '\0');
+}
+
+uint64_t numIndexedSymbols(const char* index) noexcept
+{
+    SymbolIndexHeader header;
+    memcpy(&header, index, sizeof(header));
+    return header.numSymbols;
+}
+
+const char* lookupSymbol(const char* index, uint64_t address, uint64_t& start) noexcept
+{
+    SymbolIndexHeader header;
+    memcpy(&header, index, sizeof(header));
+    const char* symbols = index + sizeof(header);
+    const char* strings = symbols + header.numSymbols * sizeof(SymbolIndexEntry);
+
+    auto symbolAt = [&](uint64_t i) {
+        SymbolIndexEntry entry;
+        memcpy(&entry, symbols + i * sizeof(SymbolIndexEntry), sizeof(entry));
+        return entry;
+    };
+
+    // find the last symbol at or before the address
+    uint64_t low = 0;
+    uint64_t high = header.numSymbols;
+    while (low < high)
+    {
+        const uint64_t mid = low + (high - low) / 2;
+        if (symbolAt(mid).start <= address)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low == 0)
+    {
+        return nullptr;
+    }
+    const SymbolIndexEntry entry = symbolAt(low - 1);
+    if ((entry.size != 0 && address - entry.start >= entry.size) ||
+        entry.name >= header.stringsSize)
+    {
+        return nullptr;
+    }
+    start = entry.start;
+    return strings + entry.name;
+}
+
+} // namespace ooopsi
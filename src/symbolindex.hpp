@@ -0,0 +1,80 @@
+/**
+ * @file    symbolindex.hpp
+ * @brief   compact address-to-symbol index of a module, built from the ELF symbol tables
+ *
+ * The index has the function symbols of .symtab (if the module isn't stripped) and .dynsym,
+ * sorted by address, so a lookup is a binary search over a contiguous array instead of the
+ * per-call search through the symbol tables and DWARF data of unw_get_proc_name(). Same as the
+ * line index (see lineindex.hpp), it's a single position-independent block of memory that is
+ * read-only once built.
+ *
+ * Layout (all integers in the byte order of the host, no padding between the parts):
+ *  - SymbolIndexHeader
+ *  - symbols (SymbolIndexHeader::numSymbols x SymbolIndexEntry, sorted by address)
+ *  - names (SymbolIndexHeader::stringsSize bytes of NUL-terminated, mangled names)
+ */
+
+#ifndef SYMBOLINDEX_HPP_
+#define SYMBOLINDEX_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ooopsi
+{
+
+/// identifies a symbol index (and its version)
+static constexpr char s_SYMBOL_INDEX_MAGIC[8] = { 'O', 'O', 'O', 'P', 'S', 'I', 'Y', '1' };
+
+/// The fixed-size start of a symbol index.
+struct SymbolIndexHeader
+{
+    /// s_SYMBOL_INDEX_MAGIC
+    char magic[8];
+    /// number of symbols
+    uint64_t numSymbols;
+    /// size of the names in bytes
+    uint64_t stringsSize;
+};
+
+/// A function symbol.
+struct SymbolIndexEntry
+{
+    /// the module-relative (i.e. link-time) start address
+    uint64_t start;
+    /// the size in bytes (0: unknown, up to the next symbol)
+    uint32_t size;
+    /// offset of the name
+    uint32_t name;
+};
+
+static_assert(sizeof(SymbolIndexEntry) == 16, "unexpected padding");
+
+/// Builds the symbol index of an ELF file.
+///
+/// @param[in]  image   the contents of the ELF file
+/// @param[in]  size    size of 'image' in bytes
+/// @param[out] index   receives the index
+/// @return false if the file has no function symbols
+bool buildSymbolIndex(const char* image, size_t size, std::vector<char>& index);
+
+/// Checks the header and the size of a symbol index.
+bool isValidSymbolIndex(const char* index, size_t size) noexcept;
+
+/// Returns the number of symbols in a (valid) index.
+uint64_t numIndexedSymbols(const char* index) noexcept;
+
+/// Looks up the function that contains an address in a (valid) index.
+/// This function doesn't allocate and is safe to use in signal handlers.
+///
+/// @param[in]  index       the index
+/// @param[in]  address     the module-relative address
+/// @param[out] start       the module-relative start address of the function
+/// @return the (mangled) name, which points into the index, or nullptr if not found
+const char* lookupSymbol(const char* index, uint64_t address, uint64_t& start) noexcept;
+
+} // namespace ooopsi
+
+
+#endif /* SYMBOLINDEX_HPP_ */
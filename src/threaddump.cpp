@@ -0,0 +1,391 @@
+/**
+ * @file    threaddump.cpp
+ * @brief   crash coordination between threads and an all-threads stack dump
+ *
+ * The crash gate lets exactly one thread report, the others are parked until the process exits.
+ * The reporting thread may collect the stacks of all other threads: On Linux, it assigns a
+ * preallocated slot to every thread and interrupts the threads with a signal, whose handler
+ * writes the thread's return addresses into its slot. After all threads answered (or the timeout
+ * expired), the slots are printed. On Windows, the threads are suspended and walked one by one.
+ */
+
+#include "internal.hpp"
+
+#include <atomic>
+
+#ifdef OOOPSI_LINUX
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#ifdef OOOPSI_MAC
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#ifdef OOOPSI_WINDOWS
+#include <tlhelp32.h>
+#endif
+
+namespace ooopsi
+{
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the crash gate requires lock-free 64 bit integers");
+
+/// the thread that reports the termination (0: none)
+static std::atomic<uint64_t> s_reportingThread{ 0 };
+
+/// the settings (disabled by default, constant-initialized to allow changes by HandlerSetup)
+static bool s_threadDumpEnabled = false;
+static unsigned s_threadDumpTimeoutMs = 500;
+
+uint64_t currentThreadId() noexcept
+{
+#if defined(OOOPSI_LINUX)
+    return static_cast<uint64_t>(syscall(SYS_gettid));
+#elif defined(OOOPSI_MAC)
+    uint64_t id = 0;
+    pthread_threadid_np(nullptr, &id);
+    return id;
+#elif defined(OOOPSI_WINDOWS)
+    return GetCurrentThreadId();
+#endif
+}
+
+/// Parks the current thread forever.
+[[noreturn]] static void parkThread() noexcept
+{
+    for (;;)
+    {
+#ifdef OOOPSI_WINDOWS
+        Sleep(INFINITE);
+#else
+        // note: signal handlers (e.g. for the thread dump) still run
+        pause();
+#endif
+    }
+}
+
+bool enterCrashGate() noexcept
+{
+    const uint64_t self = currentThreadId();
+    uint64_t expected = 0;
+    if (s_reportingThread.compare_exchange_strong(expected, self, std::memory_order_acq_rel))
+    {
+        return true;
+    }
+    if (expected == self)
+    {
+        // crashed again while reporting
+        return false;
+    }
+    // another thread is reporting already and will end the process
+    parkThread();
+}
+
+void adoptCrashGate() noexcept
+{
+    // the forked thread has another ID
+    s_reportingThread.store(currentThreadId(), std::memory_order_release);
+}
+
+bool isReportingThread() noexcept
+{
+    return s_reportingThread.load(std::memory_order_acquire) == currentThreadId();
+}
+
+
+#ifdef OOOPSI_LINUX
+
+/// maximum number of threads in a dump
+static constexpr size_t s_MAX_DUMPED_THREADS = 256;
+/// maximum number of frames per thread
+static constexpr size_t s_MAX_DUMPED_FRAMES = 64;
+
+/// states of a dump slot
+enum DumpState : int
+{
+    /// waiting for the thread's answer
+    s_DUMP_REQUESTED,
+    /// the thread is writing its stack
+    s_DUMP_WRITING,
+    /// the stack has been written
+    s_DUMP_DONE,
+    /// the thread didn't answer (in time)
+    s_DUMP_TIMED_OUT,
+};
+
+namespace
+{
+
+/// The stack of a thread in the dump.
+struct DumpSlot
+{
+    std::atomic<int> state;
+    pid_t tid;
+    /// the thread's name (from /proc/self/task/<tid>/comm)
+    char name[32];
+    size_t numFrames;
+    pointer_t frames[s_MAX_DUMPED_FRAMES];
+};
+
+} // namespace
+
+static DumpSlot s_dumpSlots[s_MAX_DUMPED_THREADS];
+/// number of slots used by the current dump
+static std::atomic<size_t> s_numDumpSlots{ 0 };
+
+/// the signal interrupting the threads
+static int threadDumpSignal() noexcept
+{
+    return SIGRTMIN + 4;
+}
+
+/// Handler of the thread dump signal: writes the stack into the thread's slot.
+static void onThreadDumpSignal(int /*sig*/, siginfo_t* info, void* ctx)
+{
+    // only accept requests from our process
+    if (info->si_code != SI_TKILL || info->si_pid != getpid())
+    {
+        return;
+    }
+
+    const int savedErrno = errno;
+    const auto tid = static_cast<pid_t>(syscall(SYS_gettid));
+    const size_t numSlots = s_numDumpSlots.load(std::memory_order_acquire);
+    for (size_t i = 0; i < numSlots; ++i)
+    {
+        DumpSlot& slot = s_dumpSlots[i];
+        int expected = s_DUMP_REQUESTED;
+        if (slot.tid == tid && slot.state.compare_exchange_strong(expected, s_DUMP_WRITING,
+                                                                  std::memory_order_acquire))
+        {
+            slot.numFrames = captureSignalStack(ctx, slot.frames, s_MAX_DUMPED_FRAMES,
+                                                Unwinder::DEFAULT);
+            slot.state.store(s_DUMP_DONE, std::memory_order_release);
+            break;
+        }
+    }
+    errno = savedErrno;
+}
+
+/// Reads the name of a thread (signal-safe).
+static void readThreadName(pid_t tid, char* name, size_t size) noexcept
+{
+    name[0] = '\0';
+    char path[64];
+    LineFormatter pathFormatter(path);
+    pathFormatter.append("/proc/self/task/").appendDecimal(static_cast<uint64_t>(tid));
+    pathFormatter.append("/comm");
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    const ssize_t n = read(fd, name, size - 1);
+    close(fd);
+    size_t len = n > 0 ? static_cast<size_t>(n) : 0;
+    // strip the trailing newline
+    while (len > 0 && name[len - 1] == '\n')
+    {
+        --len;
+    }
+    name[len] = '\0';
+}
+
+/// Assigns a slot to every other thread of the process, returns the number of slots (signal-safe).
+static size_t assignDumpSlots(pid_t self) noexcept
+{
+    const int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    size_t numSlots = 0;
+    char buffer[4096];
+    long n = 0;
+    while (numSlots < s_MAX_DUMPED_THREADS &&
+           (n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0)
+    {
+        // struct linux_dirent64: ino (8 bytes), offset (8 bytes), reclen (2 bytes), type, name
+        for (long pos = 0; pos < n && numSlots < s_MAX_DUMPED_THREADS;)
+        {
+            const char* entry = buffer + pos;
+            unsigned short reclen = 0;
+            memcpy(&reclen, entry + 16, sizeof(reclen));
+            const char* name = entry + 19;
+            pos += reclen;
+
+            pid_t tid = 0;
+            for (; *name >= '0' && *name <= '9'; ++name)
+            {
+                tid = tid * 10 + (*name - '0');
+            }
+            if (*name != '\0' || tid <= 0 || tid == self)
+            {
+                // ".", ".." or the current thread
+                continue;
+            }
+
+            DumpSlot& slot = s_dumpSlots[numSlots++];
+            slot.state.store(s_DUMP_REQUESTED, std::memory_order_relaxed);
+            slot.tid = tid;
+            slot.numFrames = 0;
+            readThreadName(tid, slot.name, sizeof(slot.name));
+        }
+    }
+    close(fd);
+    return numSlots;
+}
+
+/// Returns the current monotonic time in milliseconds (signal-safe).
+static uint64_t monotonicMs() noexcept
+{
+    struct timespec now; // NOLINT (initialized below)
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000u +
+           static_cast<uint64_t>(now.tv_nsec) / 1000000u;
+}
+
+#endif // OOOPSI_LINUX
+
+
+void setThreadDumpSettings(const ThreadDumpSettings& settings) noexcept
+{
+    s_threadDumpEnabled = settings.enabled;
+    s_threadDumpTimeoutMs = settings.timeoutMs;
+
+#ifdef OOOPSI_LINUX
+    if (settings.enabled)
+    {
+        // install the handler now, it's only triggered by dumpOtherThreads()
+        struct sigaction act; // NOLINT (initialization below)
+        memset(&act, 0, sizeof(act));
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_ONSTACK | SA_SIGINFO | SA_RESTART; // NOLINT (sorry, that's C ...)
+        act.sa_sigaction = onThreadDumpSignal;
+        sigaction(threadDumpSignal(), &act, nullptr);
+    }
+#endif
+}
+
+ThreadDumpSettings getThreadDumpSettings() noexcept
+{
+    ThreadDumpSettings settings;
+    settings.enabled = s_threadDumpEnabled;
+    settings.timeoutMs = s_threadDumpTimeoutMs;
+    return settings;
+}
+
+void dumpOtherThreads(LogWriter& writer, const LogSettings& settings) noexcept
+{
+    if (!s_threadDumpEnabled)
+    {
+        return;
+    }
+
+    char title[128];
+
+#if defined(OOOPSI_LINUX)
+    const pid_t pid = getpid();
+    const auto self = static_cast<pid_t>(syscall(SYS_gettid));
+    const size_t numSlots = assignDumpSlots(self);
+    s_numDumpSlots.store(numSlots, std::memory_order_release);
+
+    for (size_t i = 0; i < numSlots; ++i)
+    {
+        if (syscall(SYS_tgkill, pid, s_dumpSlots[i].tid, threadDumpSignal()) != 0)
+        {
+            // the thread is gone already
+            s_dumpSlots[i].state.store(s_DUMP_TIMED_OUT, std::memory_order_relaxed);
+        }
+    }
+
+    // wait for all answers (or the timeout)
+    const uint64_t deadline = monotonicMs() + s_threadDumpTimeoutMs;
+    for (;;)
+    {
+        size_t numPending = 0;
+        for (size_t i = 0; i < numSlots; ++i)
+        {
+            const int state = s_dumpSlots[i].state.load(std::memory_order_acquire);
+            numPending += state == s_DUMP_REQUESTED || state == s_DUMP_WRITING ? 1 : 0;
+        }
+        if (numPending == 0 || monotonicMs() >= deadline)
+        {
+            break;
+        }
+        const struct timespec interval = { 0, 1000000 };
+        nanosleep(&interval, nullptr);
+    }
+
+    for (size_t i = 0; i < numSlots; ++i)
+    {
+        DumpSlot& slot = s_dumpSlots[i];
+        // late answers are ignored
+        int state = s_DUMP_REQUESTED;
+        slot.state.compare_exchange_strong(state, s_DUMP_TIMED_OUT, std::memory_order_acquire);
+
+        const bool done = state == s_DUMP_DONE;
+        LineFormatter line(title);
+        line.append("---------- THREAD ").appendDecimal(static_cast<uint64_t>(slot.tid));
+        line.append(" (").append(slot.name).append(')');
+        line.append(done ? "" : " NOT RESPONDING").append(" ----------");
+        printAddresses(writer, settings, line.c_str(), slot.frames, done ? slot.numFrames : 0,
+                       nullptr, false);
+    }
+    s_numDumpSlots.store(0, std::memory_order_release);
+
+#elif defined(OOOPSI_WINDOWS) && (defined(_M_X64) || defined(__x86_64__))
+    const DWORD pid = GetCurrentProcessId();
+    const DWORD self = GetCurrentThreadId();
+    const ULONGLONG deadline = GetTickCount64() + s_threadDumpTimeoutMs;
+
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+    THREADENTRY32 entry;
+    entry.dwSize = sizeof(entry);
+    for (BOOL ok = Thread32First(snapshot, &entry); ok; ok = Thread32Next(snapshot, &entry))
+    {
+        if (entry.th32OwnerProcessID != pid || entry.th32ThreadID == self)
+        {
+            continue;
+        }
+
+        pointer_t frames[s_MAX_STACK_FRAMES];
+        size_t numFrames = 0;
+        const bool inTime = GetTickCount64() < deadline;
+        if (inTime)
+        {
+            HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT, FALSE,
+                                       entry.th32ThreadID);
+            if (thread != nullptr)
+            {
+                numFrames = captureThreadStack(thread, frames, s_MAX_STACK_FRAMES);
+                CloseHandle(thread);
+            }
+        }
+        const unsigned long tid = entry.th32ThreadID;
+        LineFormatter line(title);
+        line.append("---------- THREAD ").appendDecimal(tid);
+        line.append(inTime ? "" : " (timed out)").append(" ----------");
+        printAddresses(writer, settings, line.c_str(), frames, numFrames, nullptr, false);
+    }
+    CloseHandle(snapshot);
+
+#else
+    // not supported
+    std::ignore = writer;
+    std::ignore = settings;
+    std::ignore = title;
+#endif
+}
+
+} // namespace ooopsi
@@ -0,0 +1,125 @@
+/**
+ * @file    throwtrace.cpp
+ * @brief   capturing the throw sites of exceptions
+ *
+ * Every thread owns a preallocated slot that receives the raw frame addresses of the last sampled
+ * exception it has thrown. An unsampled throw only invalidates the slot, so the slot always
+ * describes the most recent exception (or nothing). The slot is read by onTerminate() on the same
+ * thread, so no synchronization is needed.
+ */
+
+#include "internal.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+namespace ooopsi
+{
+
+/// the maximum number of frames per trace
+static constexpr size_t s_MAX_THROW_FRAMES = 64;
+/// additional frames captured for the hook itself (skipped later)
+static constexpr size_t s_THROW_HOOK_FRAMES = 8;
+
+namespace
+{
+
+/// The stack of the last exception thrown on a thread.
+struct ThrowTrace
+{
+    pointer_t frames[s_MAX_THROW_FRAMES + s_THROW_HOOK_FRAMES];
+    /// number of valid elements in 'frames' (0: the last exception wasn't captured)
+    size_t numFrames;
+    /// the exception's type (nullptr: unknown)
+    const std::type_info* type;
+    /// remaining throws until the next one is sampled
+    unsigned countdown;
+};
+
+} // namespace
+
+/// the settings (relaxed atomics: a concurrent change may affect a single throw only)
+static std::atomic<unsigned> s_throwSampleInterval{ 0 };
+static std::atomic<size_t> s_throwMaxFrames{ ThrowTraceSettings::s_DEFAULT_MAX_FRAMES };
+static std::atomic<Unwinder> s_throwUnwinder{ Unwinder::DEFAULT };
+
+/// the current thread's slot
+static thread_local ThrowTrace t_throwTrace;
+
+
+void setThrowTraceSettings(const ThrowTraceSettings& settings) noexcept
+{
+    s_throwMaxFrames.store(std::min(settings.maxFrames, s_MAX_THROW_FRAMES),
+                           std::memory_order_relaxed);
+    s_throwUnwinder.store(settings.unwinder, std::memory_order_relaxed);
+    s_throwSampleInterval.store(settings.sampleInterval, std::memory_order_relaxed);
+}
+
+ThrowTraceSettings getThrowTraceSettings() noexcept
+{
+    ThrowTraceSettings settings;
+    settings.sampleInterval = s_throwSampleInterval.load(std::memory_order_relaxed);
+    settings.maxFrames = s_throwMaxFrames.load(std::memory_order_relaxed);
+    settings.unwinder = s_throwUnwinder.load(std::memory_order_relaxed);
+    return settings;
+}
+
+void recordThrowSite(const std::type_info* type, pointer_t caller) noexcept
+{
+    const unsigned interval = s_throwSampleInterval.load(std::memory_order_relaxed);
+    if (interval == 0)
+    {
+        return;
+    }
+
+    ThrowTrace& trace = t_throwTrace;
+    trace.numFrames = 0;
+    if (trace.countdown > 1 && trace.countdown <= interval)
+    {
+        --trace.countdown;
+        return;
+    }
+    trace.countdown = interval;
+
+    const size_t maxFrames = s_throwMaxFrames.load(std::memory_order_relaxed);
+    size_t n = captureStackAddresses(trace.frames, maxFrames + s_THROW_HOOK_FRAMES,
+                                     s_throwUnwinder.load(std::memory_order_relaxed));
+
+    // skip the frames of the hook, i.e. everything up to (and excluding) the caller
+    size_t first = 0;
+    if (caller != nullptr)
+    {
+        while (first < n && first < s_THROW_HOOK_FRAMES && trace.frames[first] != caller)
+        {
+            ++first;
+        }
+        if (first == n || first == s_THROW_HOOK_FRAMES)
+        {
+            // not found: keep all frames
+            first = 0;
+        }
+    }
+    n = std::min(n - first, maxFrames);
+    std::copy(trace.frames + first, trace.frames + first + n, trace.frames);
+
+    trace.type = type;
+    trace.numFrames = n;
+}
+
+bool getThrowSite(const std::type_info* type, ThrowSite& site) noexcept
+{
+    const ThrowTrace& trace = t_throwTrace;
+    if (trace.numFrames == 0)
+    {
+        return false;
+    }
+    if (type != nullptr && trace.type != nullptr && *type != *trace.type)
+    {
+        return false;
+    }
+    site.frames = trace.frames;
+    site.numFrames = trace.numFrames;
+    return true;
+}
+
+} // namespace ooopsi
@@ -0,0 +1,263 @@
+/**
+ * @file    tracetable.cpp
+ * @brief   process-wide table of unique stack traces and their number of occurrences
+ *
+ * Same as the symbol cache, the table is a fixed-size, open-addressing hash table plus a pool for
+ * the frame addresses, both statically allocated. Traces are identified by the hash of their
+ * addresses only (a collision of 64 bit hashes is very unlikely). Recording a trace is lock-free
+ * and never allocates: after the first sight, it's just a counter increment.
+ * The symbolized frames are created on demand and kept in a map, guarded by a mutex.
+ */
+
+#include "internal.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <vector>
+
+namespace ooopsi
+{
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the trace table requires lock-free 64 bit integers");
+static_assert(ATOMIC_BOOL_LOCK_FREE == 2, "the trace table requires lock-free booleans");
+
+/// number of hash table slots (must be a power of 2)
+static constexpr size_t s_TRACE_TABLE_SLOTS = 4096;
+/// number of frame addresses available for all traces
+static constexpr size_t s_TRACE_TABLE_POOL_SIZE = 64 * 1024;
+/// number of slots to check before giving up (linear probing)
+static constexpr size_t s_TRACE_TABLE_MAX_PROBES = 16;
+
+static_assert((s_TRACE_TABLE_SLOTS & (s_TRACE_TABLE_SLOTS - 1)) == 0,
+              "the number of slots must be a power of 2");
+
+#ifdef OOOPSI_WINDOWS
+using TraceTableMutex = DbgHelpMutex;
+#else
+using TraceTableMutex = std::mutex;
+#endif
+
+namespace
+{
+
+/// A single hash table entry.
+struct TraceSlot
+{
+    /// the trace's ID (0: slot is free), written once
+    std::atomic<uint64_t> id;
+    /// number of occurrences
+    std::atomic<uint64_t> count;
+    /// set after the frames have been written
+    std::atomic<bool> ready;
+    /// offset of the frames in s_framePool
+    size_t frames;
+    /// number of frames
+    size_t numFrames;
+};
+
+} // namespace
+
+/// the hash table (zero-initialized, i.e. all slots are free)
+static TraceSlot s_traceSlots[s_TRACE_TABLE_SLOTS];
+/// storage for all frame addresses
+static pointer_t s_framePool[s_TRACE_TABLE_POOL_SIZE];
+/// number of used elements in s_framePool
+static std::atomic<size_t> s_framePoolUsed{ 0 };
+
+/// guards s_symbolizedTraces
+static TraceTableMutex s_traceTableMutex;
+/// the symbolized frames of all traces that have been requested so far
+static std::map<StackTraceId, std::vector<StackFrame>> s_symbolizedTraces;
+
+
+/// Returns the first slot to check for the given ID (which is well mixed already).
+static size_t slotIndex(StackTraceId id) noexcept
+{
+    return static_cast<size_t>(id >> 32) & (s_TRACE_TABLE_SLOTS - 1);
+}
+
+/// Returns the slot of the given ID or nullptr if not found.
+static const TraceSlot* findSlot(StackTraceId id) noexcept
+{
+    size_t index = slotIndex(id);
+    for (size_t probe = 0; probe < s_TRACE_TABLE_MAX_PROBES; ++probe)
+    {
+        const TraceSlot& slot = s_traceSlots[index];
+        const uint64_t cur = slot.id.load(std::memory_order_acquire);
+        if (cur == id)
+        {
+            return &slot;
+        }
+        if (cur == 0)
+        {
+            return nullptr;
+        }
+        index = (index + 1) & (s_TRACE_TABLE_SLOTS - 1);
+    }
+    return nullptr;
+}
+
+
+StackTraceId hashStackTrace(const pointer_t* addresses, size_t numAddresses) noexcept
+{
+    // FNV-1a over the addresses, followed by the MurmurHash3 finalizer to mix the upper bits
+    uint64_t hash = UINT64_C(0xCBF29CE484222325) ^ static_cast<uint64_t>(numAddresses);
+    for (size_t i = 0; i < numAddresses; ++i)
+    {
+        hash ^= static_cast<uint64_t>(reinterpret_cast<uintptr_t>(addresses[i]));
+        hash *= UINT64_C(0x100000001B3);
+    }
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xFF51AFD7ED558CCD);
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xC4CEB9FE1A85EC53);
+    hash ^= hash >> 33;
+    return hash != 0 ? hash : 1;
+}
+
+StackTraceId recordStackTrace(const pointer_t* addresses, size_t numAddresses,
+                              uint64_t* count) noexcept
+{
+    const StackTraceId id = hashStackTrace(addresses, numAddresses);
+    uint64_t newCount = 0;
+
+    size_t index = slotIndex(id);
+    for (size_t probe = 0; probe < s_TRACE_TABLE_MAX_PROBES; ++probe)
+    {
+        TraceSlot& slot = s_traceSlots[index];
+        uint64_t cur = slot.id.load(std::memory_order_acquire);
+        if (cur == 0 && slot.id.compare_exchange_strong(cur, id, std::memory_order_acq_rel))
+        {
+            // we own this slot now
+            const size_t pos = s_framePoolUsed.fetch_add(numAddresses, std::memory_order_relaxed);
+            if (pos + numAddresses <= s_TRACE_TABLE_POOL_SIZE)
+            {
+                std::copy(addresses, addresses + numAddresses, s_framePool + pos);
+                slot.frames = pos;
+                slot.numFrames = numAddresses;
+                slot.ready.store(true, std::memory_order_release);
+            }
+            // else: the pool is exhausted, the trace is counted, but can't be symbolized
+            cur = id;
+        }
+        if (cur == id)
+        {
+            newCount = slot.count.fetch_add(1, std::memory_order_relaxed) + 1;
+            break;
+        }
+        index = (index + 1) & (s_TRACE_TABLE_SLOTS - 1);
+    }
+    // else: the table is too crowded around this ID
+
+    if (count)
+    {
+        *count = newCount;
+    }
+    return id;
+}
+
+StackTraceId recordStackTrace(Unwinder unwinder, uint64_t* count) noexcept
+{
+    pointer_t addresses[s_MAX_STACK_FRAMES];
+    const size_t n = captureStackAddresses(addresses, s_MAX_STACK_FRAMES, unwinder);
+    return recordStackTrace(addresses, n, count);
+}
+
+uint64_t getStackTraceCount(StackTraceId id) noexcept
+{
+    const TraceSlot* slot = findSlot(id);
+    return slot ? slot->count.load(std::memory_order_relaxed) : 0;
+}
+
+/// Fills in the symbolized frames of a (ready) slot, the caller must hold s_traceTableMutex.
+static void getFrames(const TraceSlot& slot, StackTraceId id, std::vector<StackFrame>& frames)
+{
+    auto it = s_symbolizedTraces.find(id);
+    if (it == s_symbolizedTraces.end())
+    {
+        std::vector<StackFrame> symbolized(slot.numFrames);
+        symbolize(s_framePool + slot.frames, slot.numFrames, symbolized.data());
+        it = s_symbolizedTraces.emplace(id, std::move(symbolized)).first;
+    }
+    frames = it->second;
+}
+
+bool getStackTrace(StackTraceId id, StackTraceCount& result)
+{
+    const TraceSlot* slot = findSlot(id);
+    if (slot == nullptr || !slot->ready.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+
+    result.id = id;
+    result.count = slot->count.load(std::memory_order_relaxed);
+    const std::lock_guard<TraceTableMutex> lock(s_traceTableMutex);
+    getFrames(*slot, id, result.frames);
+    return true;
+}
+
+std::vector<StackTraceCount> getTopStackTraces(size_t maxTraces)
+{
+    // take a snapshot of the counters (they may change while sorting)
+    std::vector<std::pair<uint64_t, const TraceSlot*>> candidates;
+    for (const TraceSlot& slot : s_traceSlots)
+    {
+        if (slot.ready.load(std::memory_order_acquire))
+        {
+            candidates.emplace_back(slot.count.load(std::memory_order_relaxed), &slot);
+        }
+    }
+
+    const size_t n = std::min(maxTraces, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + static_cast<ptrdiff_t>(n),
+                      candidates.end(),
+                      [](const std::pair<uint64_t, const TraceSlot*>& a,
+                         const std::pair<uint64_t, const TraceSlot*>& b) {
+                          return a.first > b.first;
+                      });
+
+    std::vector<StackTraceCount> result(n);
+    const std::lock_guard<TraceTableMutex> lock(s_traceTableMutex);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const TraceSlot& slot = *candidates[i].second;
+        result[i].id = slot.id.load(std::memory_order_relaxed);
+        result[i].count = candidates[i].first;
+        getFrames(slot, result[i].id, result[i].frames);
+    }
+    return result;
+}
+
+void printTopStackTraces(size_t maxTraces, LogSettings settings)
+{
+    refreshModuleMap();
+    const std::vector<StackTraceCount> traces = getTopStackTraces(maxTraces);
+
+    LogWriter writer(settings);
+    writer.line("---------- TOP STACK TRACES ----------");
+
+    char messageBuffer[128];
+    for (size_t i = 0; i < traces.size(); ++i)
+    {
+        const uint64_t num = i;
+        snprintf(messageBuffer, sizeof(messageBuffer),
+                 "[%" PRIu64 "] %" PRIu64 " times (ID %016" PRIx64 ")", num, traces[i].count,
+                 traces[i].id);
+        writer.line(messageBuffer);
+
+        const std::vector<StackFrame>& frames = traces[i].frames;
+        for (size_t f = 0; f < frames.size(); ++f)
+        {
+            const char* symbol = frames[f].function.empty() ? nullptr : frames[f].function.c_str();
+            logFrame(writer, f, frames[f].address, symbol, frames[f].offset, nullptr,
+                     settings.printModules, settings.printSourceLines);
+        }
+    }
+
+    writer.line("--------------------------------------");
+    writer.finish();
+}
+
+} // namespace ooopsi
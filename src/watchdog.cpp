@@ -0,0 +1,512 @@
+/**
+ * @file    watchdog.cpp
+ * @brief   detects threads that stopped making progress (hangs, deadlocks) and prints their stacks
+ *
+ * Every watched thread owns a slot of a preallocated table, which it claims once (like the
+ * breadcrumb rings). Kicking the watchdog is a single relaxed store of a flag into the thread's own
+ * slot. The watchdog wakes up periodically, takes the flags and remembers when it saw each one
+ * last: A thread that didn't kick it within its timeout is reported once per stall. On Linux, the
+ * thread is interrupted by a signal, whose handler writes its return addresses into a preallocated
+ * buffer, on Windows it's suspended and walked. The stack is symbolized and logged by the
+ * watchdog (with the current log function), which calls abort() afterwards if configured.
+ */
+
+#include "ooopsi.hpp"
+#include "internal.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+#ifdef OOOPSI_LINUX
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <ctime>
+#include <mutex>
+#include <thread>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
+#include <pthread.h>
+#endif
+
+namespace ooopsi
+{
+
+/// maximum number of watched threads at the same time
+static constexpr size_t s_MAX_WATCHED_THREADS = 4096;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the watchdog requires lock-free 64 bit integers");
+
+#ifdef OOOPSI_WINDOWS
+/// the owner of a slot that is being released (it can't be claimed until its handle is closed)
+static constexpr uint64_t s_RELEASING_OWNER = ~uint64_t(0);
+#endif
+
+namespace
+{
+
+/// A watched thread (one cache line).
+struct alignas(64) WatchSlot
+{
+    /// the owning thread (0: free)
+    std::atomic<uint64_t> owner;
+    /// set by kickWatchdog(), taken by the watchdog
+    std::atomic<uint32_t> kicked;
+    /// the thread's timeout in milliseconds
+    std::atomic<uint32_t> timeoutMs;
+    /// the owner that lastSeenMs refers to (only used by the watchdog)
+    uint64_t seenOwner;
+    /// when the watchdog saw the last kick (only used by the watchdog)
+    uint64_t lastSeenMs;
+    /// the current stall has been reported (only used by the watchdog)
+    bool reported;
+    /// the thread's name (if known when the slot was claimed; at most 16 bytes on Linux)
+    char name[24];
+#ifdef OOOPSI_WINDOWS
+    /// the thread, opened for suspending it
+    HANDLE thread;
+    /// the watchdog is using 'thread' (releasing the slot waits for it)
+    std::atomic<bool> capturing;
+#endif
+};
+
+/// Releases the slot of the current thread when it exits.
+class WatchOwner
+{
+public:
+    WatchOwner() noexcept = default;
+    ~WatchOwner();
+
+    WatchOwner(const WatchOwner&) = delete;
+    WatchOwner& operator=(const WatchOwner&) = delete;
+
+    WatchSlot* slot = nullptr;
+};
+
+} // namespace
+
+/// the slots of all watched threads
+static WatchSlot s_watchSlots[s_MAX_WATCHED_THREADS];
+/// the number of slots that were ever used (the watchdog only looks at these)
+static std::atomic<size_t> s_numWatchSlots{ 0 };
+
+/// the current thread's slot (trivial, so accessing it doesn't need an initialization check)
+static thread_local WatchSlot* t_watchSlot = nullptr;
+/// releases it when the thread exits (only touched when the slot is claimed)
+static thread_local WatchOwner t_watchOwner;
+
+/// the settings of the running watchdog
+static WatchdogSettings s_watchdogSettings;
+
+
+/// Frees a slot.
+static void releaseWatchSlot(WatchSlot& slot) noexcept
+{
+#ifdef OOOPSI_WINDOWS
+    if (slot.thread != nullptr)
+    {
+        // the watchdog may be suspending or walking the thread: wait until it's done with it
+        slot.owner.store(s_RELEASING_OWNER, std::memory_order_seq_cst);
+        while (slot.capturing.load(std::memory_order_seq_cst))
+        {
+            SwitchToThread();
+        }
+        CloseHandle(slot.thread);
+        slot.thread = nullptr;
+    }
+#endif
+    slot.owner.store(0, std::memory_order_release);
+}
+
+WatchOwner::~WatchOwner()
+{
+    if (slot != nullptr)
+    {
+        releaseWatchSlot(*slot);
+    }
+}
+
+bool watchThread(unsigned timeoutMs) noexcept
+{
+    if (timeoutMs == 0)
+    {
+        return false;
+    }
+    WatchSlot* slot = t_watchSlot;
+    if (slot == nullptr)
+    {
+        const uint64_t self = currentThreadId();
+        for (size_t i = 0; i < s_MAX_WATCHED_THREADS && slot == nullptr; ++i)
+        {
+            uint64_t expected = 0;
+            if (s_watchSlots[i].owner.compare_exchange_strong(expected, self,
+                                                              std::memory_order_acq_rel))
+            {
+                slot = &s_watchSlots[i];
+                // let the watchdog look at the slot
+                size_t used = s_numWatchSlots.load(std::memory_order_relaxed);
+                while (used <= i && !s_numWatchSlots.compare_exchange_weak(
+                                      used, i + 1, std::memory_order_release))
+                {
+                }
+            }
+        }
+        if (slot == nullptr)
+        {
+            // too many threads
+            return false;
+        }
+        slot->name[0] = '\0';
+#if defined(OOOPSI_LINUX) || defined(OOOPSI_MAC)
+        pthread_getname_np(pthread_self(), slot->name, sizeof(slot->name));
+#elif defined(OOOPSI_WINDOWS)
+        slot->thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT, FALSE,
+                                  GetCurrentThreadId());
+#endif
+        t_watchSlot = slot;
+        t_watchOwner.slot = slot;
+    }
+    slot->timeoutMs.store(static_cast<uint32_t>(timeoutMs), std::memory_order_relaxed);
+    // counts as a kick: the watchdog starts measuring now
+    slot->kicked.store(1, std::memory_order_release);
+    return true;
+}
+
+void unwatchThread() noexcept
+{
+    WatchSlot* slot = t_watchSlot;
+    if (slot != nullptr)
+    {
+        t_watchSlot = nullptr;
+        t_watchOwner.slot = nullptr;
+        releaseWatchSlot(*slot);
+    }
+}
+
+void kickWatchdog() noexcept
+{
+    WatchSlot* slot = t_watchSlot;
+    if (slot != nullptr)
+    {
+        slot->kicked.store(1, std::memory_order_relaxed);
+    }
+}
+
+#if defined(OOOPSI_LINUX) || (defined(OOOPSI_WINDOWS) && (defined(_M_X64) || defined(__x86_64__)))
+#define OOOPSI_WATCHDOG
+
+/// Returns the time of a steady clock in milliseconds.
+static uint64_t watchdogMilliseconds() noexcept
+{
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+/// time to wait for a stuck thread's stack
+static constexpr uint64_t s_HANG_CAPTURE_TIMEOUT_MS = 100;
+
+/// Captures the stack of a watched thread, returns the number of frames (0: not responding).
+static size_t captureStuckThread(WatchSlot& slot, uint64_t tid, pointer_t* frames) noexcept;
+
+/// Reports a thread that didn't kick the watchdog in time.
+static void reportHang(WatchSlot& slot, uint64_t tid, uint64_t stalledMs) noexcept
+{
+    pointer_t frames[s_MAX_STACK_FRAMES];
+    const size_t numFrames = captureStuckThread(slot, tid, frames);
+
+    char buffer[160];
+    LineFormatter what(buffer);
+    what.append("thread ").appendDecimal(tid);
+    if (slot.name[0] != '\0')
+    {
+        what.append(" (").append(slot.name).append(')');
+    }
+    what.append(" didn't kick the watchdog for ").appendDecimal(stalledMs).append(" ms");
+
+    const LogSettings settings;
+    LogWriter writer(settings);
+    char title[224];
+    writer.line(LineFormatter(title).append("!!! HANG: ").append(what.c_str()).c_str());
+    printAddresses(writer, settings,
+                   numFrames > 0 ? "---------- BACKTRACE ----------"
+                                 : "---------- BACKTRACE (NOT RESPONDING) ----------",
+                   frames, numFrames, nullptr, numFrames == s_MAX_STACK_FRAMES);
+    writer.finish();
+
+    if (s_watchdogSettings.abortOnHang)
+    {
+        char reason[256];
+        formatReason(reason, "A HANG", what.c_str());
+        // the watchdog's own stack isn't of interest
+        AbortSettings abortSettings;
+        abortSettings.printStackTrace = false;
+        abort(reason, abortSettings);
+    }
+}
+
+/// Checks the deadlines of all watched threads.
+static void checkWatchedThreads() noexcept
+{
+    const uint64_t now = watchdogMilliseconds();
+    const size_t numSlots = s_numWatchSlots.load(std::memory_order_acquire);
+    for (size_t i = 0; i < numSlots; ++i)
+    {
+        WatchSlot& slot = s_watchSlots[i];
+        const uint64_t owner = slot.owner.load(std::memory_order_acquire);
+#ifdef OOOPSI_WINDOWS
+        if (owner == 0 || owner == s_RELEASING_OWNER)
+#else
+        if (owner == 0)
+#endif
+        {
+            slot.seenOwner = 0;
+            continue;
+        }
+        // a new owner may not have set its timeout and first kick yet: start measuring now
+        if (slot.kicked.exchange(0, std::memory_order_acquire) != 0 || owner != slot.seenOwner)
+        {
+            slot.seenOwner = owner;
+            slot.lastSeenMs = now;
+            slot.reported = false;
+            continue;
+        }
+        const uint64_t stalledMs = now - slot.lastSeenMs;
+        if (!slot.reported && stalledMs >= slot.timeoutMs.load(std::memory_order_relaxed))
+        {
+            slot.reported = true;
+            reportHang(slot, owner, stalledMs);
+        }
+    }
+}
+
+#endif // OOOPSI_WATCHDOG
+
+#ifdef OOOPSI_LINUX
+
+/// states of the hang capture
+enum HangCaptureState : int
+{
+    s_HANG_IDLE,
+    /// waiting for the thread's answer
+    s_HANG_REQUESTED,
+    /// the thread is writing its stack
+    s_HANG_WRITING,
+    /// the stack has been written
+    s_HANG_DONE,
+};
+
+/// The buffer for the stack of a stuck thread (one at a time).
+static struct
+{
+    std::atomic<int> state{ s_HANG_IDLE };
+    std::atomic<pid_t> tid{ 0 };
+    size_t numFrames = 0;
+    pointer_t frames[s_MAX_STACK_FRAMES];
+} s_hangCapture;
+
+/// the background thread
+static std::thread s_watchdogThread;
+/// wakes up the background thread when stopping
+static std::condition_variable s_watchdogWakeup;
+static std::mutex s_watchdogMutex;
+static bool s_watchdogRunning = false;
+/// the signal handler is installed once and stays
+static bool s_watchdogHandlerInstalled = false;
+
+/// the signal interrupting a stuck thread
+static int watchdogSignal() noexcept
+{
+    return SIGRTMIN + 5;
+}
+
+/// Handler of the watchdog signal: writes the stack into the capture buffer.
+static void onWatchdogSignal(int /*sig*/, siginfo_t* info, void* ctx)
+{
+    // only accept requests from our process
+    if (info->si_code != SI_TKILL || info->si_pid != getpid())
+    {
+        return;
+    }
+    const int savedErrno = errno;
+    int expected = s_HANG_REQUESTED;
+    if (s_hangCapture.tid.load(std::memory_order_relaxed) == syscall(SYS_gettid) &&
+        s_hangCapture.state.compare_exchange_strong(expected, s_HANG_WRITING,
+                                                    std::memory_order_acquire))
+    {
+        s_hangCapture.numFrames =
+          captureSignalStack(ctx, s_hangCapture.frames, s_MAX_STACK_FRAMES, Unwinder::DEFAULT);
+        s_hangCapture.state.store(s_HANG_DONE, std::memory_order_release);
+    }
+    errno = savedErrno;
+}
+
+static size_t captureStuckThread(WatchSlot& /*slot*/, uint64_t tid, pointer_t* frames) noexcept
+{
+    s_hangCapture.tid.store(static_cast<pid_t>(tid), std::memory_order_relaxed);
+    s_hangCapture.state.store(s_HANG_REQUESTED, std::memory_order_release);
+    if (syscall(SYS_tgkill, getpid(), static_cast<pid_t>(tid), watchdogSignal()) != 0)
+    {
+        s_hangCapture.state.store(s_HANG_IDLE, std::memory_order_relaxed);
+        return 0;
+    }
+
+    const uint64_t deadline = watchdogMilliseconds() + s_HANG_CAPTURE_TIMEOUT_MS;
+    while (s_hangCapture.state.load(std::memory_order_acquire) == s_HANG_REQUESTED &&
+           watchdogMilliseconds() < deadline)
+    {
+        const struct timespec interval = { 0, 1000000 };
+        nanosleep(&interval, nullptr);
+    }
+    // a late answer is ignored, one that is being written is waited for
+    int state = s_HANG_REQUESTED;
+    if (s_hangCapture.state.compare_exchange_strong(state, s_HANG_IDLE, std::memory_order_acquire))
+    {
+        return 0;
+    }
+    while (s_hangCapture.state.load(std::memory_order_acquire) == s_HANG_WRITING)
+    {
+        std::this_thread::yield();
+    }
+    const size_t numFrames = s_hangCapture.numFrames;
+    memcpy(frames, s_hangCapture.frames, numFrames * sizeof(pointer_t));
+    s_hangCapture.state.store(s_HANG_IDLE, std::memory_order_relaxed);
+    return numFrames;
+}
+
+/// The background thread: checks the deadlines periodically.
+static void watchdogThread()
+{
+    std::unique_lock<std::mutex> lock(s_watchdogMutex);
+    while (s_watchdogRunning)
+    {
+        lock.unlock();
+        checkWatchedThreads();
+        // keep the module map up to date for the crash reports, too
+        refreshModuleMap();
+        lock.lock();
+        s_watchdogWakeup.wait_for(lock,
+                                  std::chrono::milliseconds(s_watchdogSettings.intervalMs));
+    }
+}
+
+bool startWatchdog(const WatchdogSettings& settings) noexcept
+{
+    const std::lock_guard<std::mutex> lock(s_watchdogMutex);
+    if (s_watchdogRunning || s_watchdogThread.joinable() || settings.intervalMs == 0)
+    {
+        return false;
+    }
+    if (!s_watchdogHandlerInstalled)
+    {
+        struct sigaction act; // NOLINT (initialization below)
+        memset(&act, 0, sizeof(act));
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_ONSTACK | SA_SIGINFO | SA_RESTART; // NOLINT (sorry, that's C ...)
+        act.sa_sigaction = onWatchdogSignal;
+        if (sigaction(watchdogSignal(), &act, nullptr) != 0)
+        {
+            return false;
+        }
+        s_watchdogHandlerInstalled = true;
+    }
+
+    s_watchdogSettings = settings;
+    s_watchdogRunning = true;
+    try
+    {
+        s_watchdogThread = std::thread(watchdogThread);
+    }
+    catch (...)
+    {
+        s_watchdogRunning = false;
+        return false;
+    }
+    return true;
+}
+
+void stopWatchdog() noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(s_watchdogMutex);
+        if (!s_watchdogRunning)
+        {
+            return;
+        }
+        s_watchdogRunning = false;
+    }
+    s_watchdogWakeup.notify_all();
+    if (s_watchdogThread.joinable())
+    {
+        s_watchdogThread.join();
+    }
+}
+
+#elif defined(OOOPSI_WATCHDOG) // Windows x64
+
+/// the timer calling checkWatchedThreads() (nullptr: not running)
+static HANDLE s_watchdogTimer = nullptr;
+
+static size_t captureStuckThread(WatchSlot& slot, uint64_t tid, pointer_t* frames) noexcept
+{
+    // keeps the handle open: the owner announces the release before it checks the flag, so either
+    // the release is seen here or the owner waits
+    slot.capturing.store(true, std::memory_order_seq_cst);
+    size_t numFrames = 0;
+    if (slot.owner.load(std::memory_order_seq_cst) == tid && slot.thread != nullptr)
+    {
+        numFrames = captureThreadStack(slot.thread, frames, s_MAX_STACK_FRAMES);
+    }
+    slot.capturing.store(false, std::memory_order_release);
+    return numFrames;
+}
+
+/// Called by the timer queue's thread.
+static VOID CALLBACK onWatchdogTimer(PVOID /*param*/, BOOLEAN /*fired*/)
+{
+    checkWatchedThreads();
+}
+
+bool startWatchdog(const WatchdogSettings& settings) noexcept
+{
+    if (s_watchdogTimer != nullptr || settings.intervalMs == 0)
+    {
+        return false;
+    }
+    s_watchdogSettings = settings;
+    // WT_EXECUTEINTIMERTHREAD: a check never runs in parallel to another one
+    if (!CreateTimerQueueTimer(&s_watchdogTimer, nullptr, onWatchdogTimer, nullptr,
+                               settings.intervalMs, settings.intervalMs, WT_EXECUTEINTIMERTHREAD))
+    {
+        s_watchdogTimer = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void stopWatchdog() noexcept
+{
+    if (s_watchdogTimer != nullptr)
+    {
+        // waits for a running callback
+        DeleteTimerQueueTimer(nullptr, s_watchdogTimer, INVALID_HANDLE_VALUE);
+        s_watchdogTimer = nullptr;
+    }
+}
+
+#else // unsupported platform
+
+bool startWatchdog(const WatchdogSettings& /*settings*/) noexcept
+{
+    return false;
+}
+
+void stopWatchdog() noexcept {}
+
+#endif // OOOPSI_LINUX/WATCHDOG
+
+} // namespace ooopsi
@@ -4,11 +4,21 @@
  * Unit tests for the abort() function and the related hooks.
  */
 
+#include "crashdump.hpp"
+#include "crashrecord.hpp"
 #include "ooopsi.hpp"
 #include "test_helper.hpp"
 
 #include <gtest/gtest.h>
 
+#include <thread>
+#include <vector>
+
+#ifdef OOOPSI_LINUX
+#include <fcntl.h>
+#include <pthread.h>
+#endif
+
 // detect compilation with AddressSanitizer: we need to exclude some bad stuff here...
 #ifdef __SANITIZE_ADDRESS__
 #define OOOPSI_ASAN
@@ -52,7 +62,7 @@ bool isWine() noexcept
 //#define BACKTRACE_REGEX_REAL ".*BACKTRACE.*RtlUserThreadStart.*"
 #define BACKTRACE_REGEX_REAL BACKTRACE_REGEX_WINE
 #define BACKTRACE_REGEX_TERM BACKTRACE_REGEX_WINE
-#define BACKTRACE_TRUNCATED_REGEX BACKTRACE_REGEX_WINE
+#define BACKTRACE_RECURSION_REGEX BACKTRACE_REGEX_WINE
 // not supported
 #define SEGV_DETAILS ""
 
@@ -93,7 +103,8 @@ static std::string makeBtRegexTerm(const char* prefix, const char* reason)
 #else
 #define BACKTRACE_REGEX_TERMINATE BACKTRACE_REGEX
 #endif
-#define BACKTRACE_TRUNCATED_REGEX ".*BACKTRACE.*(truncating)"
+// the recursion is collapsed, and the bottom of the stack is kept
+#define BACKTRACE_RECURSION_REGEX ".*BACKTRACE.*\\[cycle of 1 frame x [0-9]+\\].*main"
 #define SEGV_DETAILS "\\(address not mapped to object\\) "
 
 static std::string makeBtRegex(const char* prefix)
@@ -126,6 +137,24 @@ TEST(Abort, AbortDeath)
     ASSERT_DEATH(ooopsi::abort("ooops", settings), "^ooops\n$");
 }
 
+TEST(Abort, AbortToFdDeath)
+{
+    // write the output to STDERR in a single block
+    ooopsi::AbortSettings settings;
+    settings.logFd = 2;
+    ASSERT_DEATH(ooopsi::abort("ooops", settings), makeBtRegex("^ooops"));
+    settings.printStackTrace = false;
+    ASSERT_DEATH(ooopsi::abort("ooops", settings), "^ooops\n$");
+
+    // the same for the global setting (e.g. for crashes)
+    ASSERT_DEATH(
+      {
+          ooopsi::setAbortLogFd(2);
+          failSegmentationFault();
+      },
+      "!!! TERMINATING DUE TO SEGMENTATION FAULT.*BACKTRACE.*");
+}
+
 TEST(Abort, StdAbortDeath)
 {
     ASSERT_DEATH(std::abort(), "!!! TERMINATING DUE TO std::abort\\(\\)");
@@ -149,6 +178,69 @@ TEST(Abort, TerminateDeath)
                                                  "unknown exception"));
 }
 
+TEST(Abort, TerminateLongMessageDeath)
+{
+    // the message is formatted in the crash arena, so it isn't truncated
+    const std::string message(1000, 'x');
+    ASSERT_DEATH(
+      {
+          try
+          {
+              throw std::runtime_error(message + "<end>");
+          }
+          catch (...)
+          {
+              std::terminate();
+          }
+      },
+      "std::runtime_error: \"x{1000}<end>\"\\)");
+
+    // without an arena, the fixed-size buffers are used
+    ASSERT_DEATH(
+      {
+          ooopsi::setCrashArenaSize(0);
+          try
+          {
+              throw std::runtime_error(message + "<end>");
+          }
+          catch (...)
+          {
+              std::terminate();
+          }
+      },
+      "std::runtime_error: \"x+\n");
+}
+
+#ifdef OOOPSI_LINUX
+TEST(Abort, TerminateThrowSiteDeath)
+{
+    // the throw site is printed before the trace at termination
+    ASSERT_DEATH(
+      {
+          ooopsi::ThrowTraceSettings settings;
+          ooopsi::setThrowTraceSettings(settings);
+          failThrowStd();
+      },
+      "whoopsi!\"\\)\n---------- THROWN AT ----------\n.*failThrowStd.*\n---------- BACKTRACE");
+
+    // not if the throw wasn't sampled (the caught exception was)
+    ASSERT_DEATH(
+      {
+          ooopsi::ThrowTraceSettings settings;
+          settings.sampleInterval = 2;
+          ooopsi::setThrowTraceSettings(settings);
+          try
+          {
+              throw std::logic_error("caught");
+          }
+          catch (const std::exception&)
+          {
+          }
+          failThrowStd();
+      },
+      "whoopsi!\"\\)\n---------- BACKTRACE");
+}
+#endif // OOOPSI_LINUX
 
 TEST(Abort, CrashVirtualDeath)
 {
@@ -186,11 +278,12 @@ TEST(Abort, SegmentationFaultDeath)
     {
 #ifdef OOOPSI_WINDOWS
         ASSERT_DEATH(failStackOverflow(),
-                     "!!! TERMINATING DUE TO SEGMENTATION FAULT \\(stack overflow\\)");
+                     "!!! TERMINATING DUE TO SEGMENTATION FAULT \\(stack overflow\\)"
+                     BACKTRACE_RECURSION_REGEX);
 #else
         ASSERT_DEATH(failStackOverflow(),
                      "!!! TERMINATING DUE TO SEGMENTATION FAULT \\(stack overflow\\)"
-                     " @ 0x[0-9a-f]+" BACKTRACE_TRUNCATED_REGEX);
+                     " @ 0x[0-9a-f]+" BACKTRACE_RECURSION_REGEX);
 #endif
     }
 
@@ -200,6 +293,393 @@ TEST(Abort, SegmentationFaultDeath)
 #endif // _WIN32
 }
 
+#ifndef OOOPSI_WINDOWS
+TEST(Abort, SignalHandlerDemanglesDeath)
+{
+#ifdef OOOPSI_ASAN
+    GTEST_SKIP();
+#endif
+
+    // names are demangled in the signal handler, too (e.g. the GoogleTest stack frames)
+    ASSERT_DEATH(failSegmentationFault(),
+                 "!!! TERMINATING DUE TO SEGMENTATION FAULT.*BACKTRACE.* in testing::");
+}
+#endif // OOOPSI_WINDOWS
+
+#ifdef OOOPSI_LINUX
+TEST(Abort, SignalTraceStartsAtFaultDeath)
+{
+#ifdef OOOPSI_ASAN
+    GTEST_SKIP();
+#endif
+
+    // the trace starts with the faulting frame, not with the signal handler's frames
+    ASSERT_DEATH(failSegmentationFault(), "---------- BACKTRACE ----------\n"
+                                          "=>#0 +0x[0-9a-f]+ in (failSegmentationFault|Abort_)");
+}
+
+/// Mutual recursion (a cycle of 2 frames) that crashes at the bottom.
+static void recurseEven(volatile int depth);
+static void recurseOdd(volatile int depth)
+{
+    recurseEven(depth - 1);
+}
+static void recurseEven(volatile int depth)
+{
+    if (depth <= 0)
+    {
+        failSegmentationFault();
+    }
+    recurseOdd(depth - 1);
+}
+
+TEST(Abort, RecursionCollapsedDeath)
+{
+#ifdef OOOPSI_ASAN
+    GTEST_SKIP();
+#endif
+
+    // the recursion is printed once, the frames below it are kept
+    ASSERT_DEATH(recurseEven(5000), "BACKTRACE.*\\[cycle of 2 frames x [0-9]+\\].* in Abort_");
+}
+
+TEST(Abort, StructuredReportDeath)
+{
+#ifdef OOOPSI_ASAN
+    GTEST_SKIP();
+#endif
+
+    // a single line with the fields of the report
+    ASSERT_DEATH(
+      {
+          ooopsi::setCrashReportFormat(ooopsi::LogFormat::JSON);
+          failSegmentationFault();
+      },
+      "^\\{\"reason\":\"!!! TERMINATING DUE TO SEGMENTATION FAULT \\(.*\\) @ 0x12345678\","
+      "\"signal\":11,\"code\":1,\"address\":\"0x12345678\",\"fault\":\"0x[0-9a-f]+\","
+      "\"thread\":[0-9]+,\"frames\":\\[\\{\"num\":0,.*\"symbol\":\"failSegmentationFault"
+      ".*\\}\\]\\}\n$");
+}
+
+TEST(Abort, PrintStatsDeath)
+{
+    ooopsi::AbortSettings settings;
+    settings.printStats = true;
+    ASSERT_DEATH(ooopsi::abort("ooops", settings),
+                 "^ooops\n---------- BACKTRACE.*\n\\(ooopsi: unwind [0-9.]+[mun]?s, symbolize "
+                 "[0-9.]+[mun]?s, demangle [0-9.]+[mun]?s, log [0-9.]+[mun]?s; [0-9]+ frames, "
+                 "[0-9]+ cache hits, [0-9]+ misses\\)\n$");
+}
+
+TEST(Abort, CrashRecordDeath)
+{
+#ifdef OOOPSI_ASAN
+    GTEST_SKIP();
+#endif
+
+    char path[] = "/tmp/ooopsi_record_XXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+
+    // a record replaces the stack trace
+    ASSERT_DEATH(
+      {
+          ooopsi::setCrashRecordFd(fd);
+          failSegmentationFault();
+      },
+      "!!! TERMINATING DUE TO SEGMENTATION FAULT.*\n\\(crash record written\\)\n$");
+
+    ooopsi::CrashRecordHeader header;
+    ASSERT_EQ(pread(fd, &header, sizeof(header), 0), static_cast<ssize_t>(sizeof(header)));
+    EXPECT_EQ(memcmp(header.magic, ooopsi::s_CRASH_RECORD_MAGIC, sizeof(header.magic)), 0);
+    EXPECT_EQ(header.size, lseek(fd, 0, SEEK_END));
+    EXPECT_EQ(header.signal, SIGSEGV);
+    EXPECT_EQ(header.signalAddress, 0x12345678U);
+    EXPECT_NE(header.faultAddress, 0U);
+    EXPECT_GT(header.numRegisters, 0U);
+    EXPECT_GT(header.numFrames, 2U);
+    EXPECT_GT(header.numModules, 2U);
+
+    close(fd);
+    unlink(path);
+}
+
+TEST(Abort, ForkedReportDeath)
+{
+#ifdef OOOPSI_ASAN
+    GTEST_SKIP();
+#endif
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+
+    // the process ends right away (without any output of its own), a forked child reports
+    ASSERT_DEATH(
+      {
+          ooopsi::setAbortLogFd(fds[1]);
+          ooopsi::setForkedCrashReports(true);
+          failSegmentationFault();
+      },
+      "^$");
+
+    // the child holds the last writing end
+    close(fds[1]);
+    std::string report;
+    char buffer[4096];
+    ssize_t n = 0;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        report.append(buffer, static_cast<size_t>(n));
+    }
+    close(fds[0]);
+
+    EXPECT_NE(report.find("!!! TERMINATING DUE TO SEGMENTATION FAULT"), std::string::npos);
+    EXPECT_NE(report.find("---------- BACKTRACE ----------\n=>#0"), std::string::npos);
+}
+
+TEST(Abort, CrashJournalDeath)
+{
+#ifdef OOOPSI_ASAN
+    GTEST_SKIP();
+#endif
+
+    char path[] = "/tmp/ooopsi_journal_XXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    // the same crash twice, in different processes
+    ooopsi::CrashJournalSettings settings;
+    settings.path = path;
+    settings.numEntries = 4;
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_DEATH(
+          {
+              ooopsi::setCrashJournalSettings(settings);
+              failSegmentationFault();
+          },
+          "!!! TERMINATING DUE TO SEGMENTATION FAULT");
+    }
+
+    const auto crashes = ooopsi::readCrashJournal(path);
+    ASSERT_EQ(crashes.size(), 1U);
+    EXPECT_EQ(crashes[0].count, 2U);
+    EXPECT_NE(crashes[0].traceId, 0U);
+    EXPECT_LE(crashes[0].firstTime, crashes[0].lastTime);
+    EXPECT_EQ(crashes[0].reason.find("!!! TERMINATING DUE TO SEGMENTATION FAULT"), 0U);
+    ASSERT_GT(crashes[0].frames.size(), 2U);
+    EXPECT_NE(crashes[0].frames[0].find("+0x"), std::string::npos);
+
+    unlink(path);
+}
+
+/// a region for the crash dump
+static char s_dumpMarker[] = "some application state";
+
+TEST(Abort, CrashDumpDeath)
+{
+#ifdef OOOPSI_ASAN
+    GTEST_SKIP();
+#endif
+
+    char path[] = "/tmp/ooopsi_dump_XXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+
+    // the dump is written in addition to the stack trace
+    ASSERT_DEATH(
+      {
+          ooopsi::CrashDumpSettings settings;
+          settings.path = path;
+          settings.maxSize = 1024 * 1024;
+          ooopsi::setCrashDumpSettings(settings);
+          ooopsi::addCrashDumpRegion(s_dumpMarker, sizeof(s_dumpMarker));
+          failSegmentationFault();
+      },
+      "!!! TERMINATING DUE TO SEGMENTATION FAULT.*\n\\(crash dump written to /tmp/ooopsi_dump_"
+      ".*BACKTRACE");
+
+    const auto size = lseek(fd, 0, SEEK_END);
+    ASSERT_GT(size, 0);
+    std::vector<char> dump(static_cast<size_t>(size));
+    ASSERT_EQ(pread(fd, dump.data(), dump.size(), 0), size);
+    close(fd);
+    unlink(path);
+
+    ooopsi::CrashDumpHeader header;
+    memcpy(&header, dump.data(), sizeof(header));
+    EXPECT_EQ(memcmp(header.magic, ooopsi::s_CRASH_DUMP_MAGIC, sizeof(header.magic)), 0);
+    EXPECT_EQ(header.size, dump.size());
+    EXPECT_EQ(header.flags, 0U);
+
+    // a record, the stack and the region (at least)
+    bool haveRecord = false;
+    bool haveStack = false;
+    bool haveRegion = false;
+    size_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.numStreams; ++i)
+    {
+        ooopsi::CrashDumpStream stream;
+        ASSERT_LE(offset + sizeof(stream), dump.size());
+        memcpy(&stream, dump.data() + offset, sizeof(stream));
+        offset += sizeof(stream);
+        ASSERT_LE(offset + stream.size, dump.size());
+        if (stream.type == ooopsi::s_DUMP_STREAM_RECORD)
+        {
+            haveRecord = memcmp(dump.data() + offset, ooopsi::s_CRASH_RECORD_MAGIC,
+                                sizeof(ooopsi::s_CRASH_RECORD_MAGIC)) == 0;
+        }
+        else if (stream.type == ooopsi::s_DUMP_STREAM_MEMORY)
+        {
+            ooopsi::CrashDumpMemory memory;
+            memcpy(&memory, dump.data() + offset, sizeof(memory));
+            const char* contents = dump.data() + offset + sizeof(memory);
+            haveStack |= memory.kind == ooopsi::s_DUMP_MEMORY_STACK;
+            haveRegion |= memory.kind == ooopsi::s_DUMP_MEMORY_REGION &&
+                          memory.address == reinterpret_cast<uintptr_t>(s_dumpMarker) &&
+                          strcmp(contents, s_dumpMarker) == 0;
+        }
+        offset += stream.size;
+    }
+    EXPECT_EQ(offset, dump.size());
+    EXPECT_TRUE(haveRecord);
+    EXPECT_TRUE(haveStack);
+    EXPECT_TRUE(haveRegion);
+}
+
+/// a thread that doesn't do anything (but should show up in a dump)
+static void sleepingThread()
+{
+    pthread_setname_np(pthread_self(), "sleeper");
+    for (;;)
+    {
+        pause();
+    }
+}
+
+TEST(Abort, ThreadDumpDeath)
+{
+    // the other threads follow the trace of the terminating one
+    ASSERT_DEATH(
+      {
+          ooopsi::setThreadDumpSettings(ooopsi::ThreadDumpSettings());
+          std::thread sleeper(sleepingThread);
+          sleeper.detach();
+          sleep(1);
+          ooopsi::abort("ooops");
+      },
+      "^ooops\n---------- BACKTRACE.*\n---------- THREAD " LINENUM_REGEX
+      " \\(sleeper\\) ----------\n.*sleepingThread.*\n-------------------------------\n$");
+}
+
+TEST(Abort, BreadcrumbsDeath)
+{
+    // the latest breadcrumbs of every thread follow the trace
+    ASSERT_DEATH(
+      {
+          std::thread other([] {
+              pthread_setname_np(pthread_self(), "worker");
+              ooopsi::breadcrumb("request received", 42);
+          });
+          other.join();
+          for (uint64_t i = 0; i < 100; ++i)
+          {
+              ooopsi::breadcrumb("state changed", i);
+          }
+          ooopsi::abort("ooops");
+      },
+      "^ooops\n---------- BACKTRACE.*\n---------- BREADCRUMBS ----------\n"
+      "exited thread \\(worker\\):\n  #1 +request received 42\n"
+      "thread [0-9]+.*:\n  #69 +state changed 68\n(  #[0-9]+ +state changed [0-9]+\n){30}"
+      "  #100 +state changed 99\n"
+      "-------------------------------\n$");
+}
+
+/// Doesn't kick the watchdog for a while.
+static void stallWatchedThread()
+{
+    for (int i = 0; i < 200; ++i)
+    {
+        // sleep() might be interrupted by the watchdog's signal
+        usleep(10 * 1000);
+    }
+}
+
+TEST(Abort, WatchdogHangDeath)
+{
+    // the stuck thread's stack is printed, not the watchdog's
+    ASSERT_DEATH(
+      {
+          ooopsi::WatchdogSettings settings;
+          settings.intervalMs = 10;
+          settings.abortOnHang = true;
+          ooopsi::startWatchdog(settings);
+          ooopsi::watchThread(50);
+          for (int i = 0; i < 20; ++i)
+          {
+              ooopsi::kickWatchdog();
+              usleep(10 * 1000);
+          }
+          stallWatchedThread();
+      },
+      "^!!! HANG: thread [0-9]+ .*didn't kick the watchdog for [0-9]+ ms\n"
+      "---------- BACKTRACE ----------\n.*stallWatchedThread.*\n-{31}\n"
+      "!!! TERMINATING DUE TO A HANG \\(thread [0-9]+ .*");
+}
+
+// every thread gets its own alternate signal stack
+TEST(Abort, ThreadAltStack)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        stack_t altStack;
+        memset(&altStack, 0, sizeof(altStack));
+        void* reused = nullptr;
+        std::thread worker([&]() { sigaltstack(nullptr, &altStack); });
+        worker.join();
+        ASSERT_EQ(altStack.ss_flags & SS_DISABLE, 0);
+        ASSERT_GE(altStack.ss_size, ooopsi::getAltStackSize());
+
+        // the next thread reuses the stack
+        std::thread next([&]() {
+            stack_t other;
+            sigaltstack(nullptr, &other);
+            reused = other.ss_sp;
+        });
+        next.join();
+        ASSERT_EQ(reused, altStack.ss_sp);
+    }
+}
+
+TEST(Abort, ThreadStackOverflowDeath)
+{
+#ifdef OOOPSI_ASAN
+    GTEST_SKIP();
+#endif
+
+    ASSERT_DEATH(
+      {
+          std::thread worker(failStackOverflow);
+          worker.join();
+      },
+      "!!! TERMINATING DUE TO SEGMENTATION FAULT \\(stack overflow\\)");
+}
+
+TEST(Abort, ConcurrentCrashDeath)
+{
+    // only one thread reports, the other one is parked
+    ASSERT_DEATH(
+      {
+          std::thread first(failSegmentationFault);
+          std::thread second(failSegmentationFault);
+          first.join();
+          second.join();
+      },
+      "^!!! TERMINATING DUE TO SEGMENTATION FAULT[^!]*$");
+}
+#endif // OOOPSI_LINUX
+
 TEST(Abort, FloatingPointDeath)
 {
 #ifdef OOOPSI_ASAN
@@ -8,6 +8,8 @@
 
 #include <gtest/gtest.h>
 
+#include <cstring>
+
 TEST(Demangle, Nullptr)
 {
     std::string result = ooopsi::demangle(nullptr);
@@ -40,3 +42,72 @@ TEST(Demangle, CppNames)
     ASSERT_EQ(result, "ooopsi::printStackTrace(ooopsi::LogSettings, void const* const*)");
 #endif
 }
+
+TEST(Demangle, BufferNullptr)
+{
+    char buffer[16] = "garbage";
+    ASSERT_EQ(ooopsi::demangle(nullptr, buffer, sizeof(buffer)), 0u);
+    ASSERT_STREQ(buffer, "");
+    ASSERT_EQ(ooopsi::demangle("foo", nullptr, 0), 0u);
+}
+
+TEST(Demangle, BufferCNames)
+{
+    char buffer[64];
+    for (auto name : { "foo", "bar", "main", "this_is_not_cpp", "strlen", "_Z", "_Zfoo" })
+    {
+        ASSERT_EQ(ooopsi::demangle(name, buffer, sizeof(buffer)), strlen(name));
+        ASSERT_STREQ(buffer, name);
+    }
+}
+
+TEST(Demangle, BufferTruncated)
+{
+    char buffer[8];
+    ASSERT_EQ(ooopsi::demangle("this_is_not_cpp", buffer, sizeof(buffer)), 7u);
+    ASSERT_STREQ(buffer, "this_is");
+#ifndef _MSC_VER
+    ASSERT_EQ(ooopsi::demangle("_ZNKSt16initializer_listIiE3endEv", buffer, sizeof(buffer)), 7u);
+    ASSERT_STREQ(buffer, "std::in");
+#endif
+}
+
+#ifndef _MSC_VER
+TEST(Demangle, BufferCppNames)
+{
+    // the output must be the same as the one of the allocating version
+    for (auto name : {
+           "_ZNKSt16initializer_listIiE3endEv",
+           "_ZN6ooopsi15printStackTraceENS_11LogSettingsEPKPKv",
+           "_ZN6ooopsi5abortEPKcNS_13AbortSettingsE",
+           "_ZNSt6vectorIiSaIiEE9push_backERKi",
+           "_ZNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEEC1EPKcRKS3_",
+           "_ZNSsC1Ev",
+           "_ZN9__gnu_cxx13new_allocatorIPFvvEE8allocateEmPKv",
+           "_ZNK3FooclIJiEEEDaDpOT_",
+           "_ZZ4mainENKUlvE_clEv",
+           "_ZZN1A1fEvE1x",
+           "_ZN1AIiE1fIcEEPFvvEv",
+           "_ZNKR1A1fEv",
+           "_ZN1AD0Ev",
+           "_ZN1AcvPKcEv",
+           "_ZplRK1AS1_",
+           "_Z1fIJEEvv",
+           "_Z1fIiLi5ELb1ELj3ELc65EEvv",
+           "_Z1fRA5_KiPA2_A3_i",
+           "_Z1fM1AKFviE",
+           "_Z1fDv4_fDn",
+           "_ZTV1A",
+           "_ZThn16_N1A1fEv",
+           "_ZGVZ1fvE1x",
+           "_ZN12_GLOBAL__N_13fooEv",
+           "_Z3fooB5cxx11v",
+           "_Z3foov.cold",
+         })
+    {
+        char buffer[512];
+        const size_t len = ooopsi::demangle(name, buffer, sizeof(buffer));
+        ASSERT_EQ(std::string(buffer, len), ooopsi::demangle(name)) << name;
+    }
+}
+#endif
@@ -0,0 +1,62 @@
+/**
+ * @file    test_profiler.cpp
+ *
+ * Tests the sampling profiler.
+ */
+
+#include "internal.hpp"
+#include "ooopsi.hpp"
+
+#include <gmock/gmock-matchers.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cmath>
+#include <string>
+
+// burn some CPU time that shows up in the profile (not static to keep the symbol)
+double burnCpu(std::chrono::milliseconds duration)
+{
+    volatile double result = 0.0;
+    const auto end = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < end)
+    {
+        for (int i = 0; i < 1000; ++i)
+        {
+            result = result + std::sqrt(static_cast<double>(i));
+        }
+    }
+    return result;
+}
+
+TEST(Profiler, FoldedAndPprof)
+{
+#ifdef OOOPSI_MAC
+    GTEST_SKIP();
+#endif
+
+    ooopsi::ProfilerSettings settings;
+    settings.frequency = 1000;
+    ASSERT_TRUE(ooopsi::startProfiler(settings));
+    // only one at a time
+    ASSERT_FALSE(ooopsi::startProfiler(settings));
+    burnCpu(std::chrono::milliseconds(300));
+    ooopsi::stopProfiler();
+
+    // "root;...;leaf count" - the test function must be on most stacks
+    const std::string folded = ooopsi::getProfile(ooopsi::ProfileFormat::FOLDED);
+    ASSERT_THAT(folded, testing::HasSubstr("burnCpu"));
+    ASSERT_THAT(folded, testing::MatchesRegex("([^\n]+ [0-9]+\n)+"));
+
+    // a protocol buffer, starting with the sample types (field 1)
+    const std::string pprof = ooopsi::getProfile(ooopsi::ProfileFormat::PPROF);
+    ASSERT_GT(pprof.size(), 100u);
+    ASSERT_EQ(pprof[0], '\x0a');
+    ASSERT_THAT(pprof, testing::HasSubstr("burnCpu"));
+
+    // the profile is kept after stopping, but reset on start
+    ASSERT_EQ(folded, ooopsi::getProfile());
+    ASSERT_TRUE(ooopsi::startProfiler(settings));
+    ooopsi::stopProfiler();
+    ASSERT_THAT(ooopsi::getProfile(), testing::Not(testing::HasSubstr("burnCpu")));
+}
@@ -6,6 +6,7 @@
 
 #include "internal.hpp"
 #include "ooopsi.hpp"
+#include "structuredlog.hpp"
 
 #ifdef OOOPSI_MSVC
 // gmock triggers a warning because an ignored warning doesn't exist ... :(
@@ -15,10 +16,22 @@
 #include <gmock/gmock-matchers.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <csignal>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
+#ifndef OOOPSI_WINDOWS
+#include <unistd.h>
+#endif
+
+#ifdef OOOPSI_LINUX
+#include <dlfcn.h>
+#include <ucontext.h>
+#endif
+
 #ifdef OOOPSI_MINGW
 
 // minimalistic std::thread replacement
@@ -218,3 +231,608 @@ TEST(StackTrace, CollectMultiThreaded)
         });
     }
 }
+
+// capture addresses only, resolve them later
+TEST(StackTrace, CaptureAndSymbolize)
+{
+    constexpr size_t maxFrames = 128;
+    ooopsi::pointer_t addresses[maxFrames];
+    size_t numFrames = ooopsi::captureStackAddresses(addresses, maxFrames);
+    ASSERT_LE(numFrames, maxFrames);
+    ASSERT_GE(numFrames, 2);
+
+    // the same stack, collected the "old" way (this function is the only difference)
+    ooopsi::StackFrame collected[maxFrames];
+    size_t numCollected = ooopsi::collectStackTrace(collected, maxFrames);
+    ASSERT_EQ(numCollected, numFrames);
+
+    ooopsi::StackFrame frames[maxFrames];
+    size_t numResolved = ooopsi::symbolize(addresses, numFrames, frames);
+    ASSERT_LE(numResolved, numFrames);
+    ASSERT_GE(numResolved, 1);
+
+    for (size_t i = 0; i < numFrames; ++i)
+    {
+        ASSERT_EQ(frames[i].address, addresses[i]);
+    }
+    // the outermost frames are identical
+    ASSERT_EQ(frames[numFrames - 1].function, collected[numCollected - 1].function);
+    ASSERT_EQ(frames[numFrames - 1].offset, collected[numCollected - 1].offset);
+
+    // a limited buffer is respected
+    ooopsi::pointer_t small[2];
+    ASSERT_EQ(ooopsi::captureStackAddresses(small, 2), 2u);
+}
+
+#if defined(OOOPSI_LINUX) && defined(__x86_64__)
+// walks the stack of a context that isn't the caller's
+static size_t captureFromContext(const ucontext_t& context, ooopsi::pointer_t* buffer,
+                                 size_t bufferSize,
+                                 ooopsi::Unwinder unwinder = ooopsi::Unwinder::DEFAULT)
+{
+    return ooopsi::captureSignalStack(&context, buffer, bufferSize, unwinder);
+}
+#endif
+
+// signal stacks are unwound from the given context, not by skipping up to it from the handler
+TEST(StackTrace, CaptureSignalStack)
+{
+#if defined(OOOPSI_LINUX) && defined(__x86_64__)
+    // The context's instruction is after getcontext(), which isn't on the current call chain
+    // anymore: only the unwinder that starts at the context (unw_init_local2()) finds its callers.
+    ucontext_t context;
+    ASSERT_EQ(getcontext(&context), 0);
+    constexpr size_t maxFrames = 128;
+    ooopsi::pointer_t addresses[maxFrames];
+    const size_t numFrames = captureFromContext(context, addresses, maxFrames);
+    ASSERT_GE(numFrames, 3u);
+    ASSERT_EQ(addresses[0],
+              reinterpret_cast<ooopsi::pointer_t>(context.uc_mcontext.gregs[REG_RIP]));
+
+    ooopsi::StackFrame last;
+    ooopsi::symbolize(&addresses[numFrames - 1], 1, &last);
+    ASSERT_EQ(last.function, "_start");
+#endif
+}
+
+// walking from the handler keeps the frames if the interrupted one isn't found on the way
+TEST(StackTrace, CaptureSignalStackFromHandler)
+{
+#if defined(OOOPSI_LINUX) && defined(__x86_64__)
+    // the context's instruction (after getcontext()) isn't on the walked call chain
+    ucontext_t context;
+    ASSERT_EQ(getcontext(&context), 0);
+    constexpr size_t maxFrames = 128;
+    ooopsi::pointer_t addresses[maxFrames];
+    const size_t numFrames =
+      captureFromContext(context, addresses, maxFrames, ooopsi::Unwinder::FROM_HANDLER);
+    ASSERT_GE(numFrames, 3u);
+    ASSERT_EQ(addresses[0],
+              reinterpret_cast<ooopsi::pointer_t>(context.uc_mcontext.gregs[REG_RIP]));
+
+    ooopsi::StackFrame last;
+    ooopsi::symbolize(&addresses[numFrames - 1], 1, &last);
+    ASSERT_EQ(last.function, "_start");
+#endif
+}
+
+// resolving the same addresses twice (the second time from the cache) gives the same result
+TEST(StackTrace, SymbolizeCached)
+{
+    constexpr size_t maxFrames = 128;
+    ooopsi::pointer_t addresses[maxFrames];
+    size_t numFrames = ooopsi::captureStackAddresses(addresses, maxFrames);
+    ASSERT_GE(numFrames, 2);
+
+    ooopsi::StackFrame first[maxFrames];
+    ooopsi::StackFrame second[maxFrames];
+    size_t numFirst = ooopsi::symbolize(addresses, numFrames, first);
+    size_t numSecond = ooopsi::symbolize(addresses, numFrames, second);
+    ASSERT_EQ(numFirst, numSecond);
+
+    for (size_t i = 0; i < numFrames; ++i)
+    {
+        ASSERT_EQ(first[i].address, second[i].address);
+        ASSERT_EQ(first[i].function, second[i].function);
+        ASSERT_EQ(first[i].offset, second[i].offset);
+    }
+
+    // and the cache is used by printStackTrace as well
+    ooopsi::LogSettings settings;
+    settings.logFunc = writeStackTrace;
+    ooopsi::printStackTrace(settings);
+    ASSERT_TRUE(s_stackTraceEndsWithNULL);
+}
+
+// a batch with duplicates in any order gives the same frames as resolving one after another
+TEST(StackTrace, SymbolizeBatch)
+{
+    constexpr size_t maxFrames = 128;
+    ooopsi::pointer_t addresses[maxFrames];
+    const size_t numFrames = ooopsi::captureStackAddresses(addresses, maxFrames);
+    ASSERT_GE(numFrames, 2);
+
+    // (addresses inside the frames' functions that haven't been resolved yet)
+    std::vector<ooopsi::pointer_t> batch;
+    for (size_t copy = 0; copy < 3; ++copy)
+    {
+        for (size_t i = numFrames; i > 0; --i)
+        {
+            const auto address = reinterpret_cast<uintptr_t>(addresses[i - 1]);
+            batch.push_back(reinterpret_cast<ooopsi::pointer_t>(address - copy));
+        }
+    }
+    std::vector<ooopsi::StackFrame> frames(batch.size());
+    const size_t numResolved = ooopsi::symbolizeBatch(batch.data(), batch.size(), frames.data(), 4);
+    ASSERT_GE(numResolved, batch.size() / 2);
+
+    std::vector<ooopsi::StackFrame> expected(batch.size());
+    ASSERT_EQ(ooopsi::symbolize(batch.data(), batch.size(), expected.data()), numResolved);
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        ASSERT_EQ(frames[i].address, batch[i]);
+        ASSERT_EQ(frames[i].function, expected[i].function);
+        ASSERT_EQ(frames[i].offset, expected[i].offset);
+    }
+
+    // nothing to do
+    ASSERT_EQ(ooopsi::symbolizeBatch(nullptr, 0, nullptr), 0u);
+}
+
+// the cached names of a module are gone once it's unloaded, and found again after reloading it
+TEST(StackTrace, SymbolizeUnloadedModule)
+{
+#ifdef OOOPSI_LINUX
+    // (any library that the tests don't load anyway)
+    void* handle = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+    {
+        GTEST_SKIP() << "libz not found";
+    }
+    // (symbolize() expects return addresses, i.e. looks up the byte before)
+    const auto address = static_cast<const char*>(dlsym(handle, "zlibVersion")) + 1;
+    ASSERT_NE(address, reinterpret_cast<const char*>(1));
+    ooopsi::StackFrame loaded;
+    const ooopsi::pointer_t addresses[] = { address };
+    ASSERT_EQ(ooopsi::symbolize(addresses, 1, &loaded), 1u);
+    ASSERT_EQ(loaded.function, "zlibVersion");
+
+    ASSERT_EQ(dlclose(handle), 0);
+    Dl_info info;
+    if (dladdr(address, &info) != 0)
+    {
+        GTEST_SKIP() << "libz wasn't unloaded";
+    }
+    ooopsi::StackFrame unloaded;
+    ooopsi::symbolize(addresses, 1, &unloaded);
+    ASSERT_EQ(unloaded.function, "");
+
+    handle = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+    ASSERT_NE(handle, nullptr);
+    const ooopsi::pointer_t reloaded = static_cast<const char*>(dlsym(handle, "zlibVersion")) + 1;
+    ooopsi::StackFrame frame;
+    ASSERT_EQ(ooopsi::symbolize(&reloaded, 1, &frame), 1u);
+    ASSERT_EQ(frame.function, "zlibVersion");
+    dlclose(handle);
+#else
+    GTEST_SKIP();
+#endif
+}
+
+// walk the frame pointers instead of using the default unwinder
+TEST(StackTrace, CaptureFramePointers)
+{
+    constexpr size_t maxFrames = 128;
+    ooopsi::pointer_t addresses[2][maxFrames];
+    size_t numFrames[2];
+    // (same call site for both unwinders)
+    for (size_t i = 0; i < 2; ++i)
+    {
+        const auto unwinder = i == 0 ? ooopsi::Unwinder::DEFAULT : ooopsi::Unwinder::FRAME_POINTER;
+        numFrames[i] = ooopsi::captureStackAddresses(addresses[i], maxFrames, unwinder);
+    }
+    ASSERT_GE(numFrames[0], 2);
+    ASSERT_LE(numFrames[1], maxFrames);
+    ASSERT_GE(numFrames[1], 1);
+    // at least this function's frame is found (the whole chain depends on the compiler flags)
+    ASSERT_EQ(addresses[0][0], addresses[1][0]);
+
+    // a limited buffer is respected
+    ooopsi::pointer_t small[1];
+    ASSERT_EQ(ooopsi::captureStackAddresses(small, 1, ooopsi::Unwinder::FRAME_POINTER), 1u);
+
+    // and it can be used for printing as well
+    s_stackTraceNumLines = 0;
+    ooopsi::LogSettings settings;
+    settings.logFunc = writeStackTrace;
+    settings.unwinder = ooopsi::Unwinder::FRAME_POINTER;
+    ooopsi::printStackTrace(settings);
+    ASSERT_GE(s_stackTraceNumLines, 3u);
+    ASSERT_TRUE(s_stackTraceEndsWithNULL);
+}
+
+static std::string s_stackTraceBlocks;
+static size_t s_stackTraceNumBlocks = 0;
+
+/// Appends the given block to s_stackTraceBlocks (not thread safe).
+static void writeStackTraceBlock(const char* text, size_t length)
+{
+    s_stackTraceEndsWithNULL = (text == nullptr);
+    if (text)
+    {
+        s_stackTraceBlocks.append(text, length);
+        ++s_stackTraceNumBlocks;
+    }
+}
+
+// print the trace as a single block of text
+TEST(StackTrace, GenerateBlock)
+{
+    s_stackTraceBlocks.clear();
+    s_stackTraceNumBlocks = 0;
+    s_stackTraceEndsWithNULL = false;
+
+    ooopsi::LogSettings settings;
+    settings.logBlockFunc = writeStackTraceBlock;
+    // (takes precedence)
+    settings.logFunc = writeStackTrace;
+    ooopsi::printStackTrace(settings);
+
+    ASSERT_EQ(s_stackTraceNumBlocks, 1u);
+    ASSERT_TRUE(s_stackTraceEndsWithNULL);
+    ASSERT_EQ(s_stackTraceBlocks.find("---------- BACKTRACE ----------\n"), 0u);
+    ASSERT_GE(std::count(s_stackTraceBlocks.begin(), s_stackTraceBlocks.end(), '\n'), 3);
+    ASSERT_EQ(s_stackTraceBlocks.back(), '\n');
+}
+
+#ifndef OOOPSI_WINDOWS
+// print the trace to a file descriptor
+TEST(StackTrace, GenerateFd)
+{
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+
+    ooopsi::LogSettings settings;
+    settings.logFd = fds[1];
+    ooopsi::printStackTrace(settings);
+    close(fds[1]);
+
+    std::string output;
+    char buffer[4096];
+    ssize_t n = 0;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        output.append(buffer, static_cast<size_t>(n));
+    }
+    close(fds[0]);
+
+    ASSERT_EQ(output.find("---------- BACKTRACE ----------\n"), 0u);
+    ASSERT_NE(output.find("\n-------------------------------\n"), std::string::npos);
+}
+#endif // OOOPSI_WINDOWS
+
+// frames are annotated with the module and the module-relative address
+TEST(StackTrace, PrintModules)
+{
+    s_stackTraceBlocks.clear();
+    s_stackTraceNumBlocks = 0;
+
+    ooopsi::LogSettings settings;
+    settings.logBlockFunc = writeStackTraceBlock;
+    ooopsi::printStackTrace(settings);
+#ifdef OOOPSI_WINDOWS
+    ASSERT_THAT(s_stackTraceBlocks, testing::HasSubstr("ooopsi.dll+0x"));
+#else
+    ASSERT_THAT(s_stackTraceBlocks, testing::HasSubstr(" (libooopsi.so+0x"));
+#endif
+
+    s_stackTraceBlocks.clear();
+    settings.printModules = false;
+    ooopsi::printStackTrace(settings);
+    ASSERT_THAT(s_stackTraceBlocks, testing::Not(testing::HasSubstr("ooopsi.so+0x")));
+    ASSERT_THAT(s_stackTraceBlocks, testing::Not(testing::HasSubstr("ooopsi.dll+0x")));
+}
+
+// the trace as a single JSON object
+TEST(StackTrace, StructuredJson)
+{
+    s_stackTraceBlocks.clear();
+    s_stackTraceNumBlocks = 0;
+
+    ooopsi::LogSettings settings;
+    settings.logBlockFunc = writeStackTraceBlock;
+    settings.format = ooopsi::LogFormat::JSON;
+    ooopsi::printStackTrace(settings);
+
+    ASSERT_EQ(s_stackTraceNumBlocks, 1u);
+    ASSERT_THAT(s_stackTraceBlocks,
+                testing::MatchesRegex("\\{\"thread\":[0-9]+,\"frames\":\\["
+                                      "\\{\"num\":0,\"address\":\"0x[0-9a-f]+\",.*\\}\\]\\}\n"));
+    ASSERT_THAT(s_stackTraceBlocks, testing::HasSubstr("\"symbol\":\"StackTrace_StructuredJson"));
+    ASSERT_EQ(std::count(s_stackTraceBlocks.begin(), s_stackTraceBlocks.end(), '\n'), 1);
+}
+
+/// Reads a varint of a protobuf message.
+static uint64_t readVarint(const std::string& data, size_t& pos)
+{
+    uint64_t value = 0;
+    for (int shift = 0; pos < data.size() && shift < 64; shift += 7)
+    {
+        const auto byte = static_cast<unsigned char>(data[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            break;
+        }
+    }
+    return value;
+}
+
+// the trace as a length-prefixed protobuf message
+TEST(StackTrace, StructuredBinary)
+{
+    s_stackTraceBlocks.clear();
+    s_stackTraceNumBlocks = 0;
+
+    ooopsi::LogSettings settings;
+    settings.logBlockFunc = writeStackTraceBlock;
+    settings.format = ooopsi::LogFormat::BINARY;
+    ooopsi::printStackTrace(settings);
+    ASSERT_EQ(s_stackTraceNumBlocks, 1u);
+
+    const std::string& message = s_stackTraceBlocks;
+    size_t pos = 0;
+    ASSERT_EQ(readVarint(message, pos), message.size() - ooopsi::s_MESSAGE_LENGTH_SIZE);
+    size_t numFrames = 0;
+    bool foundTest = false;
+    while (pos < message.size())
+    {
+        const uint64_t tag = readVarint(message, pos);
+        if (tag >> 3 != static_cast<uint32_t>(ooopsi::ReportField::FRAMES))
+        {
+            ASSERT_EQ(tag & 7, ooopsi::s_WIRE_VARINT);
+            readVarint(message, pos);
+            continue;
+        }
+        ASSERT_EQ(tag & 7, ooopsi::s_WIRE_LENGTH);
+        const uint64_t length = readVarint(message, pos);
+        ASSERT_LE(pos + length, message.size());
+        const std::string frame = message.substr(pos, length);
+        foundTest = foundTest || frame.find("StackTrace_StructuredBinary") != std::string::npos;
+        ++numFrames;
+        pos += length;
+    }
+    ASSERT_EQ(pos, message.size());
+    ASSERT_GE(numFrames, 3u);
+    ASSERT_TRUE(foundTest);
+}
+
+// the work of the symbolized traces is counted
+TEST(StackTrace, Stats)
+{
+    ooopsi::resetStats();
+    ooopsi::StackFrame frames[64];
+    const size_t n = ooopsi::collectStackTrace(frames, 64);
+    ASSERT_GT(n, 2u);
+
+    const ooopsi::Stats stats = ooopsi::getStats();
+    EXPECT_EQ(stats.traces, 1u);
+    EXPECT_EQ(stats.frames, n);
+    EXPECT_EQ(stats.cacheHits + stats.cacheMisses, n);
+    EXPECT_GT(stats.unwindNanoseconds, 0u);
+    EXPECT_EQ(stats.logNanoseconds, 0u);
+
+    // the same frames are cached now
+    ooopsi::resetStats();
+    ooopsi::symbolize(&frames[0].address, 1, frames);
+    EXPECT_EQ(ooopsi::getStats().cacheHits, 1u);
+    EXPECT_EQ(ooopsi::getStats().traces, 0u);
+}
+
+// repeated traces are counted in the table of unique traces
+TEST(StackTrace, RecordAndCount)
+{
+    constexpr size_t maxFrames = 128;
+    ooopsi::pointer_t addresses[maxFrames];
+    size_t numFrames = ooopsi::captureStackAddresses(addresses, maxFrames);
+    ASSERT_GE(numFrames, 2);
+
+    // the ID only depends on the addresses
+    const ooopsi::StackTraceId id = ooopsi::hashStackTrace(addresses, numFrames);
+    ASSERT_NE(id, 0u);
+    ASSERT_EQ(ooopsi::hashStackTrace(addresses, numFrames), id);
+    ASSERT_NE(ooopsi::hashStackTrace(addresses, numFrames - 1), id);
+
+    uint64_t count = 0;
+    for (uint64_t i = 1; i <= 10; ++i)
+    {
+        ASSERT_EQ(ooopsi::recordStackTrace(addresses, numFrames, &count), id);
+        ASSERT_EQ(count, i);
+    }
+    // a different (shorter) trace
+    const ooopsi::StackTraceId other = ooopsi::recordStackTrace(addresses + 1, numFrames - 1);
+    ASSERT_NE(other, id);
+    ASSERT_EQ(ooopsi::getStackTraceCount(id), 10u);
+    ASSERT_EQ(ooopsi::getStackTraceCount(other), 1u);
+    ASSERT_EQ(ooopsi::getStackTraceCount(id ^ 1), 0u);
+
+    ooopsi::StackTraceCount trace;
+    ASSERT_TRUE(ooopsi::getStackTrace(id, trace));
+    ASSERT_EQ(trace.id, id);
+    ASSERT_EQ(trace.count, 10u);
+    ASSERT_EQ(trace.frames.size(), numFrames);
+    ooopsi::StackFrame frames[maxFrames];
+    ooopsi::symbolize(addresses, numFrames, frames);
+    for (size_t i = 0; i < numFrames; ++i)
+    {
+        ASSERT_EQ(trace.frames[i].address, addresses[i]);
+        ASSERT_EQ(trace.frames[i].function, frames[i].function);
+    }
+
+    const std::vector<ooopsi::StackTraceCount> top = ooopsi::getTopStackTraces(2);
+    ASSERT_EQ(top.size(), 2u);
+    ASSERT_EQ(top[0].id, id);
+    ASSERT_EQ(top[1].count, 1u);
+
+    s_stackTraceBlocks.clear();
+    ooopsi::LogSettings settings;
+    settings.logBlockFunc = writeStackTraceBlock;
+    ooopsi::printTopStackTraces(1, settings);
+    ASSERT_EQ(s_stackTraceBlocks.find("---------- TOP STACK TRACES ----------\n[0] 10 times (ID "),
+              0u);
+}
+
+// the fixed-capacity trace doesn't allocate and resolves its names on demand
+TEST(StackTrace, FixedCapacity)
+{
+    using Trace = ooopsi::StackTrace<64>;
+    static_assert(std::is_trivially_copyable<Trace>::value, "must be trivially copyable");
+
+    Trace trace;
+    ASSERT_TRUE(trace.empty());
+    ASSERT_EQ(trace.begin(), trace.end());
+    ASSERT_GE(trace.capture(), 2u);
+    ASSERT_LE(trace.size(), Trace::capacity());
+
+    // copies compare (and hash) equal, independent of the resolved names
+    const Trace copy = trace;
+    ASSERT_TRUE(copy == trace);
+    ASSERT_EQ(std::hash<Trace>()(copy), std::hash<Trace>()(trace));
+    ASSERT_EQ(copy.id(), ooopsi::hashStackTrace(trace.addresses(), trace.size()));
+
+    ooopsi::StackFrame frames[64];
+    ooopsi::symbolize(copy.addresses(), copy.size(), frames);
+    size_t i = 0;
+    for (const Trace::Frame frame : copy)
+    {
+        ASSERT_EQ(frame.address(), frames[i].address);
+        ASSERT_EQ(std::string(frame.name() ? frame.name() : ""), frames[i].function);
+        ASSERT_EQ(frame.offset(), frames[i].offset);
+        ++i;
+    }
+    ASSERT_EQ(i, copy.size());
+    const bool found = std::any_of(copy.begin(), copy.end(), [](const Trace::Frame& frame) {
+        return frame.name() != nullptr && strstr(frame.name(), "FixedCapacity") != nullptr;
+    });
+    ASSERT_TRUE(found);
+
+    // a shorter trace differs
+    Trace shorter;
+    shorter.assign(trace.addresses() + 1, trace.size() - 1);
+    ASSERT_TRUE(shorter != trace);
+    ASSERT_EQ(shorter[0].address(), trace[1].address());
+
+    // a tiny pool truncates the names
+    ooopsi::StackTrace<4, 8> tiny;
+    tiny.capture();
+    tiny.resolve();
+    ASSERT_LE(strlen(tiny[0].name()), 7u);
+}
+
+// captured traces are formatted into buffers and output iterators
+TEST(StackTrace, Format)
+{
+    ooopsi::StackTrace<64> trace;
+    ASSERT_GE(trace.capture(), 2u);
+
+    char buffer[16 * 1024];
+    const size_t length = ooopsi::formatStackTrace(trace, buffer, sizeof(buffer));
+    ASSERT_EQ(length, strlen(buffer));
+    const std::string text(buffer, length);
+    ASSERT_EQ(std::count(text.begin(), text.end(), '\n'), static_cast<long>(trace.size()));
+    ASSERT_EQ(text.compare(0, 6, "  #0  "), 0);
+#ifdef OOOPSI_LINUX
+    ASSERT_THAT(text, testing::HasSubstr(" in _start+0x"));
+#endif
+
+    // the same text through an iterator, and line by line
+    std::string appended;
+    ooopsi::formatStackTrace(trace, std::back_inserter(appended));
+    ASSERT_EQ(appended, text);
+    char line[1024];
+    const size_t lineLength = ooopsi::formatStackFrame(0, trace[0].address(), line, sizeof(line));
+    ASSERT_EQ(text.substr(0, text.find('\n')), std::string(line, lineLength));
+
+    // only whole lines are written
+    char small[100];
+    const size_t smallLength = ooopsi::formatStackTrace(trace, small, sizeof(small));
+    ASSERT_LT(smallLength, sizeof(small));
+    ASSERT_EQ(std::string(small, smallLength), text.substr(0, smallLength));
+    ASSERT_TRUE(smallLength == 0 || small[smallLength - 1] == '\n');
+
+    // only the innermost frame is symbolized, the fault is highlighted
+    ooopsi::FormatSettings settings;
+    settings.maxSymbolizedFrames = 1;
+    settings.faultAddress = trace[0].address();
+    std::string summary;
+    ooopsi::formatStackTrace(trace.addresses(), trace.size(), std::back_inserter(summary),
+                             settings);
+    ASSERT_EQ(summary.compare(0, 6, "=>#0  "), 0);
+    ASSERT_EQ(summary.substr(2, summary.find('\n') - 2), text.substr(2, text.find('\n') - 2));
+#ifdef OOOPSI_LINUX
+    ASSERT_THAT(summary, testing::Not(testing::HasSubstr("_start")));
+#endif
+}
+
+// frames are followed by their source location (if the modules have debug information)
+TEST(StackTrace, SourceLines)
+{
+    s_stackTraceBlocks.clear();
+    ooopsi::LogSettings settings;
+    settings.logBlockFunc = writeStackTraceBlock;
+    settings.printSourceLines = true;
+    ooopsi::printStackTrace(settings);
+    ASSERT_THAT(s_stackTraceBlocks, testing::HasSubstr("BACKTRACE"));
+
+    for (size_t pos = s_stackTraceBlocks.find(" at "); pos != std::string::npos;
+         pos = s_stackTraceBlocks.find(" at ", pos + 1))
+    {
+        const size_t end = s_stackTraceBlocks.find('\n', pos);
+        const std::string line = s_stackTraceBlocks.substr(pos, end - pos);
+        ASSERT_THAT(line, testing::MatchesRegex(" at .+:[0-9]+"));
+    }
+#ifdef OOOPSI_LINUX
+    // this function's location is known if the test was compiled with debug information
+    if (s_stackTraceBlocks.find("test_trace.cpp:") != std::string::npos)
+    {
+        // and then the index is used by later traces (e.g. in abort()) as well
+        s_stackTraceBlocks.clear();
+        settings.printSourceLines = false;
+        ooopsi::printStackTrace(settings);
+        ASSERT_THAT(s_stackTraceBlocks, testing::HasSubstr("test_trace.cpp:"));
+        ASSERT_GE(ooopsi::prepareSourceLines(), 1u);
+    }
+#endif
+}
+
+// collects the stack in a function that hasn't been symbolized yet
+static size_t collectIndexedTrace(ooopsi::StackFrame* frames, size_t maxFrames)
+{
+    return ooopsi::collectStackTrace(frames, maxFrames);
+}
+
+// frames are symbolized by the symbol index once it's built
+TEST(StackTrace, SymbolIndex)
+{
+#ifdef OOOPSI_LINUX
+    ASSERT_GE(ooopsi::prepareSymbolIndexes(), 1u);
+    // the second call has nothing left to build
+    ASSERT_EQ(ooopsi::prepareSymbolIndexes(), ooopsi::prepareSymbolIndexes());
+#else
+    ASSERT_EQ(ooopsi::prepareSymbolIndexes(), 0u);
+#endif
+
+    constexpr size_t maxFrames = 128;
+    ooopsi::StackFrame frames[maxFrames];
+    const size_t numFrames = collectIndexedTrace(frames, maxFrames);
+    ASSERT_GE(numFrames, 2u);
+    bool found = false;
+    for (size_t i = 0; i < numFrames; ++i)
+    {
+        found = found || frames[i].function.find("collectIndexedTrace") != std::string::npos;
+    }
+    ASSERT_TRUE(found);
+#if defined(OOOPSI_LINUX)
+    ASSERT_EQ(frames[numFrames - 1].function, "_start");
+#endif
+}
@@ -0,0 +1,96 @@
+/**
+ * @file    journal.cpp
+ * @brief   ooopsi-journal: shows how often the crashes in a crash journal happened
+ *
+ * Usage: ooopsi-journal [-f <max frames>] <journal file>
+ *
+ * The crashes with the same stack (see setCrashJournalSettings()) are listed once, the most
+ * frequent ones first, with the reason and the frames of the latest one. The module-relative
+ * addresses can be symbolized with addr2line (or with ooopsi-symbolize, from a crash record).
+ */
+
+#include "ooopsi.hpp"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace
+{
+
+/// Formats a time of the journal (UTC).
+void formatTime(uint64_t microseconds, char (&buffer)[32])
+{
+    const auto seconds = static_cast<time_t>(microseconds / 1000000U);
+    struct tm utc;
+    if (gmtime_r(&seconds, &utc) == nullptr ||
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &utc) == 0)
+    {
+        snprintf(buffer, sizeof(buffer), "%" PRIu64, microseconds);
+    }
+}
+
+void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-f <max frames>] <journal file>\n", argv0);
+    fprintf(stderr, "  -f <n>     print at most n frames per crash (default: all)\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    size_t maxFrames = SIZE_MAX;
+    const char* inputPath = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            maxFrames = static_cast<size_t>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (argv[i][0] != '-' && inputPath == nullptr)
+        {
+            inputPath = argv[i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (inputPath == nullptr)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const std::vector<ooopsi::CrashSummary> crashes = ooopsi::readCrashJournal(inputPath);
+    if (crashes.empty())
+    {
+        fprintf(stderr, "no crashes found in %s\n", inputPath);
+        return 1;
+    }
+
+    for (size_t i = 0; i < crashes.size(); ++i)
+    {
+        const ooopsi::CrashSummary& crash = crashes[i];
+        char first[32];
+        char last[32];
+        formatTime(crash.firstTime, first);
+        formatTime(crash.lastTime, last);
+        if (i > 0)
+        {
+            printf("\n");
+        }
+        printf("%" PRIu64 " x %016" PRIx64 " (first: %s, last: %s UTC)\n", crash.count,
+               crash.traceId, first, last);
+        printf("%s\n", crash.reason.c_str());
+        for (size_t f = 0; f < crash.frames.size() && f < maxFrames; ++f)
+        {
+            printf("  #%-4zu %s\n", f, crash.frames[f].c_str());
+        }
+    }
+    return 0;
+}
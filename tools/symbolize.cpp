@@ -0,0 +1,510 @@
+/**
+ * @file    symbolize.cpp
+ * @brief   ooopsi-symbolize: turns binary crash records into readable stack traces
+ *
+ * Usage: ooopsi-symbolize [-d <debug dir>]... [-r] [<record file>]
+ *
+ * The symbols are read from the modules listed in the record, or from separate debug files with a
+ * matching build-id, looked up in the given directories (like GDB does):
+ *  - <debug dir>/.build-id/xx/yyyy.debug
+ *  - <debug dir>/<module file name>(.debug)
+ * Frames are followed by their source file and line if the file contains DWARF line tables.
+ */
+
+#include "crashrecord.hpp"
+#include "internal.hpp"
+#include "lineindex.hpp"
+#include "ooopsi.hpp"
+
+#include <elf.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+/// A symbol of an ELF file.
+struct Symbol
+{
+    uint64_t address;
+    uint64_t size;
+    std::string name;
+
+    bool operator<(const Symbol& rhs) const { return address < rhs.address; }
+};
+
+/// The function symbols, source lines and the build-id of an ELF file.
+class ElfSymbols
+{
+public:
+    /// Loads the symbols from the given file, returns false if it isn't an ELF file.
+    bool load(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+        m_data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (m_data.size() < EI_NIDENT || memcmp(m_data.data(), ELFMAG, SELFMAG) != 0)
+        {
+            return false;
+        }
+        bool ok = false;
+        if (m_data[EI_CLASS] == ELFCLASS64)
+        {
+            ok = parse<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym, Elf64_Nhdr>();
+        }
+        else if (m_data[EI_CLASS] == ELFCLASS32)
+        {
+            ok = parse<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym, Elf32_Nhdr>();
+        }
+        std::sort(m_symbols.begin(), m_symbols.end());
+        if (ok && !ooopsi::buildLineIndex(m_data.data(), m_data.size(), m_lines))
+        {
+            m_lines.clear();
+        }
+        // the file contents aren't needed anymore
+        m_data.clear();
+        m_data.shrink_to_fit();
+        return ok;
+    }
+
+    const std::string& buildId() const { return m_buildId; }
+
+    bool hasSymbols() const { return !m_symbols.empty(); }
+
+    /// Looks up the source line of the given (virtual) address.
+    bool lookupLine(uint64_t address, ooopsi::SourceLocation& location) const
+    {
+        return !m_lines.empty() && ooopsi::lookupLine(m_lines.data(), address, location);
+    }
+
+    /// Looks up the symbol containing the given (virtual) address.
+    const Symbol* lookup(uint64_t address) const
+    {
+        auto it = std::upper_bound(m_symbols.begin(), m_symbols.end(), Symbol{ address, 0, "" });
+        if (it == m_symbols.begin())
+        {
+            return nullptr;
+        }
+        --it;
+        if (it->size != 0 && address >= it->address + it->size)
+        {
+            return nullptr;
+        }
+        return &*it;
+    }
+
+private:
+    template <class T>
+    const T* at(uint64_t offset, uint64_t count = 1) const
+    {
+        if (offset > m_data.size() || count > (m_data.size() - offset) / sizeof(T))
+        {
+            return nullptr;
+        }
+        return reinterpret_cast<const T*>(m_data.data() + offset);
+    }
+
+    template <class Ehdr, class Shdr, class Sym, class Nhdr>
+    bool parse()
+    {
+        const auto* ehdr = at<Ehdr>(0);
+        if (ehdr == nullptr || ehdr->e_shentsize != sizeof(Shdr))
+        {
+            return false;
+        }
+        const auto* sections = at<Shdr>(ehdr->e_shoff, ehdr->e_shnum);
+        if (sections == nullptr)
+        {
+            return false;
+        }
+
+        // prefer the full symbol table over the dynamic one
+        const Shdr* symtab = nullptr;
+        for (unsigned i = 0; i < ehdr->e_shnum; ++i)
+        {
+            const Shdr& section = sections[i];
+            if (section.sh_type == SHT_SYMTAB ||
+                (section.sh_type == SHT_DYNSYM && symtab == nullptr))
+            {
+                symtab = &section;
+            }
+            else if (section.sh_type == SHT_NOTE)
+            {
+                parseBuildId<Nhdr>(section.sh_offset, section.sh_size);
+            }
+        }
+        if (symtab == nullptr || symtab->sh_link >= ehdr->e_shnum)
+        {
+            return true;
+        }
+
+        const Shdr& strtab = sections[symtab->sh_link];
+        const auto* symbols = at<Sym>(symtab->sh_offset, symtab->sh_size / sizeof(Sym));
+        const char* strings = at<char>(strtab.sh_offset, strtab.sh_size);
+        if (symbols == nullptr || strings == nullptr)
+        {
+            return true;
+        }
+        for (size_t i = 0; i < symtab->sh_size / sizeof(Sym); ++i)
+        {
+            const Sym& sym = symbols[i];
+            const unsigned type = sym.st_info & 0xf;
+            if ((type != STT_FUNC && type != STT_GNU_IFUNC) || sym.st_value == 0 ||
+                sym.st_shndx == SHN_UNDEF || sym.st_name >= strtab.sh_size)
+            {
+                continue;
+            }
+            const char* name = strings + sym.st_name;
+            m_symbols.push_back(Symbol{ sym.st_value, sym.st_size,
+                                        std::string(name, strnlen(name, strtab.sh_size - sym.st_name)) });
+        }
+        return true;
+    }
+
+    template <class Nhdr>
+    void parseBuildId(uint64_t offset, uint64_t size)
+    {
+        const char* notes = at<char>(offset, size);
+        uint64_t pos = 0;
+        while (notes != nullptr && pos + sizeof(Nhdr) <= size)
+        {
+            Nhdr note;
+            memcpy(&note, notes + pos, sizeof(note));
+            const uint64_t name = pos + sizeof(Nhdr);
+            const uint64_t desc = name + ((note.n_namesz + 3U) & ~3U);
+            const uint64_t next = desc + ((note.n_descsz + 3U) & ~3U);
+            if (next > size)
+            {
+                return;
+            }
+            if (note.n_type == NT_GNU_BUILD_ID && note.n_namesz == 4 &&
+                memcmp(notes + name, "GNU", 4) == 0)
+            {
+                m_buildId.assign(notes + desc, note.n_descsz);
+                return;
+            }
+            pos = next;
+        }
+    }
+
+    std::vector<char> m_data;
+    std::vector<Symbol> m_symbols;
+    /// the line index (empty: no line information)
+    std::vector<char> m_lines;
+    std::string m_buildId;
+};
+
+/// A module of the crashed process.
+struct Module
+{
+    ooopsi::CrashRecordModule info;
+    std::string buildId;
+    std::string path;
+    /// the symbols (nullptr: none found)
+    const ElfSymbols* symbols = nullptr;
+};
+
+/// A parsed crash record.
+struct Record
+{
+    ooopsi::CrashRecordHeader header;
+    std::string reason;
+    std::vector<uint64_t> registers;
+    std::vector<uint64_t> frames;
+    std::vector<Module> modules;
+};
+
+/// Reads the next record from the input, returns false at the end or for invalid input.
+bool readRecord(FILE* input, Record& record)
+{
+    auto& header = record.header;
+    if (fread(&header, sizeof(header), 1, input) != 1)
+    {
+        return false;
+    }
+    if (memcmp(header.magic, ooopsi::s_CRASH_RECORD_MAGIC, sizeof(header.magic)) != 0 ||
+        header.size < sizeof(header))
+    {
+        fprintf(stderr, "invalid crash record\n");
+        return false;
+    }
+
+    std::vector<char> data(header.size - sizeof(header));
+    if (!data.empty() && fread(data.data(), data.size(), 1, input) != 1)
+    {
+        fprintf(stderr, "truncated crash record\n");
+        return false;
+    }
+
+    size_t pos = 0;
+    auto read = [&](void* out, size_t length) {
+        if (length > data.size() - pos)
+        {
+            return false;
+        }
+        memcpy(out, data.data() + pos, length);
+        pos += length;
+        return true;
+    };
+    auto readString = [&](std::string& out, size_t length) {
+        out.resize(length);
+        return length == 0 || read(&out[0], length);
+    };
+
+    record.registers.resize(header.numRegisters);
+    record.frames.resize(header.numFrames);
+    bool ok = readString(record.reason, header.reasonLength) &&
+              read(record.registers.data(), record.registers.size() * sizeof(uint64_t)) &&
+              read(record.frames.data(), record.frames.size() * sizeof(uint64_t));
+    record.modules.resize(header.numModules);
+    for (auto& module : record.modules)
+    {
+        ok = ok && read(&module.info, sizeof(module.info)) &&
+             readString(module.buildId, module.info.buildIdLength) &&
+             readString(module.path, module.info.pathLength);
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "corrupt crash record\n");
+    }
+    return ok;
+}
+
+std::string toHex(const std::string& data)
+{
+    std::string hex;
+    char buf[3];
+    for (char c : data)
+    {
+        snprintf(buf, sizeof(buf), "%02x", static_cast<unsigned char>(c));
+        hex += buf;
+    }
+    return hex;
+}
+
+std::string baseName(const std::string& path)
+{
+    const size_t pos = path.rfind('/');
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+/// Loads and caches the symbols of the modules.
+class SymbolStore
+{
+public:
+    explicit SymbolStore(std::vector<std::string> debugDirs) : m_debugDirs(std::move(debugDirs)) {}
+
+    const ElfSymbols* find(const Module& module)
+    {
+        // candidates, best match first
+        std::vector<std::string> paths;
+        const std::string buildId = toHex(module.buildId);
+        const std::string name = baseName(module.path);
+        for (const auto& dir : m_debugDirs)
+        {
+            if (buildId.size() > 2)
+            {
+                paths.push_back(dir + "/.build-id/" + buildId.substr(0, 2) + "/" +
+                                buildId.substr(2) + ".debug");
+            }
+            paths.push_back(dir + "/" + name + ".debug");
+            paths.push_back(dir + "/" + name);
+        }
+        paths.push_back(module.path);
+
+        for (const auto& path : paths)
+        {
+            const ElfSymbols* symbols = load(path);
+            if (symbols == nullptr || !symbols->hasSymbols())
+            {
+                continue;
+            }
+            if (!module.buildId.empty() && !symbols->buildId().empty() &&
+                symbols->buildId() != module.buildId)
+            {
+                fprintf(stderr, "ignoring %s: build-id mismatch\n", path.c_str());
+                continue;
+            }
+            return symbols;
+        }
+        return nullptr;
+    }
+
+private:
+    const ElfSymbols* load(const std::string& path)
+    {
+        auto it = m_files.find(path);
+        if (it == m_files.end())
+        {
+            ElfSymbols symbols;
+            const bool ok = symbols.load(path);
+            it = m_files.emplace(path, std::move(symbols)).first;
+            if (!ok)
+            {
+                it->second = ElfSymbols();
+            }
+        }
+        return &it->second;
+    }
+
+    std::vector<std::string> m_debugDirs;
+    std::map<std::string, ElfSymbols> m_files;
+};
+
+void printRegisters(const Record& record)
+{
+    static const char* const s_x86_64[] = { "r8",  "r9",  "r10",    "r11", "r12",    "r13",
+                                            "r14", "r15", "rdi",    "rsi", "rbp",    "rbx",
+                                            "rdx", "rax", "rcx",    "rsp", "rip",    "eflags",
+                                            "csgsfs", "err", "trapno", "oldmask", "cr2" };
+    printf("---------- REGISTERS ----------\n");
+    for (size_t i = 0; i < record.registers.size(); ++i)
+    {
+        char name[32];
+        if (record.header.machine == EM_X86_64 && i < sizeof(s_x86_64) / sizeof(s_x86_64[0]))
+        {
+            snprintf(name, sizeof(name), "%s", s_x86_64[i]);
+        }
+        else if (record.header.machine == EM_AARCH64 && i >= 31)
+        {
+            snprintf(name, sizeof(name), "%s", i == 31 ? "sp" : (i == 32 ? "pc" : "pstate"));
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%s%zu", record.header.machine == EM_AARCH64 ? "x" : "r", i);
+        }
+        printf("  %-8s 0x%016" PRIx64 "\n", name, record.registers[i]);
+    }
+    printf("-------------------------------\n");
+}
+
+void printRecord(Record& record, SymbolStore& store, bool withRegisters)
+{
+    for (auto& module : record.modules)
+    {
+        module.symbols = store.find(module);
+    }
+
+    if (!record.reason.empty())
+    {
+        printf("%s\n", record.reason.c_str());
+    }
+    printf("---------- BACKTRACE ----------\n");
+    for (size_t i = 0; i < record.frames.size(); ++i)
+    {
+        const uint64_t address = record.frames[i];
+        const char* prefix = address == record.header.faultAddress ? "=>" : "  ";
+        printf("%s#%-2zu  0x%" PRIx64, prefix, i, address);
+
+        const auto module = std::find_if(record.modules.begin(), record.modules.end(),
+                                         [&](const Module& m) {
+                                             return address >= m.info.start && address < m.info.end;
+                                         });
+        if (module != record.modules.end())
+        {
+            // look up the previous instruction for return addresses
+            const uint64_t vaddr = address - module->info.base;
+            const uint64_t lookupAddress = prefix[0] == '=' ? vaddr : vaddr - 1;
+            const Symbol* sym =
+              module->symbols != nullptr ? module->symbols->lookup(lookupAddress) : nullptr;
+            if (sym != nullptr)
+            {
+                printf(" in %s+0x%" PRIx64 " (%s+0x%" PRIx64 ")",
+                       ooopsi::demangle(sym->name).c_str(), vaddr - sym->address,
+                       baseName(module->path).c_str(), vaddr);
+            }
+            else
+            {
+                printf(" in %s+0x%" PRIx64, baseName(module->path).c_str(), vaddr);
+            }
+            ooopsi::SourceLocation location;
+            if (module->symbols != nullptr && module->symbols->lookupLine(lookupAddress, location))
+            {
+                printf(" at %s:%u", location.file, location.line);
+            }
+        }
+        printf("\n");
+    }
+    if (record.frames.size() == ooopsi::s_MAX_STACK_FRAMES)
+    {
+        printf("  #%-2zu ... (truncating)\n", record.frames.size());
+    }
+    printf("-------------------------------\n");
+
+    if (withRegisters && !record.registers.empty())
+    {
+        printRegisters(record);
+    }
+}
+
+void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [-d <debug dir>]... [-r] [<record file>]\n", argv0);
+    fprintf(stderr, "  -d <dir>   look for debug files in this directory\n");
+    fprintf(stderr, "  -r         print the registers\n");
+    fprintf(stderr, "Reads from STDIN if no file is given.\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> debugDirs;
+    bool withRegisters = false;
+    const char* inputPath = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            debugDirs.push_back(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            withRegisters = true;
+        }
+        else if (argv[i][0] != '-' && inputPath == nullptr)
+        {
+            inputPath = argv[i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    FILE* input = inputPath != nullptr ? fopen(inputPath, "rb") : stdin;
+    if (input == nullptr)
+    {
+        fprintf(stderr, "failed to open %s\n", inputPath);
+        return 1;
+    }
+
+    SymbolStore store(std::move(debugDirs));
+    size_t numRecords = 0;
+    Record record;
+    while (readRecord(input, record))
+    {
+        if (numRecords++ > 0)
+        {
+            printf("\n");
+        }
+        printRecord(record, store, withRegisters);
+    }
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+    return numRecords > 0 ? 0 : 1;
+}